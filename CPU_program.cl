@@ -27,7 +27,18 @@ typedef struct {
 	
 	int BufferSize[3];
 	int BoundaryConds[3];
+	int TangentialVelBC[3];
+	int FuseVelocityBC;
+	int LeesEdwards;
+	int EnsembleSize;
+	int NumPeriodicNodes; // Per ensemble member
+	int FPartPlanes; // Planes (component x member) of f in the first allocation, see field_plane
+	int GpfPartPlanes; // Same for gpf, a multiple of 3
+	int OutOfCorePlanes; // Interior z planes per slab when f is held on the host, 0 if on the device
+	int SlabOrigin; // Whole-lattice z of plane 0 of an out-of-core slab, else 0
+	int WholeLatticeZ; // LatticeSize[2] of the whole lattice, which a slab's is not
 	int NumZones[3];
+	int ZoneNeighStride;
 
 	int MaintainShear;
 	int ViscosityModel;
@@ -38,10 +49,9 @@ typedef struct {
 	int MaxSurfPointsPerNode;
 	int InterpOrderIBM;
 
-	int PointsPerParticle;
 	int PointsPerWorkGroup;
 	int TotalSurfPoints;
-	int WorkGroupsPerParticle;
+	int TotalWorkGroups;
 
 } int_param_struct;
 
@@ -53,6 +63,7 @@ typedef struct {
 	float EqWeights[19];
 	float VelUpper[3];
 	float VelLower[3];
+	float LEVelocity;
 	// Viscosity
 	float NewtonianTau;
 	float ViscosityParams[4];
@@ -61,9 +72,6 @@ typedef struct {
 
 	// Particle
 	float ParticleDiam;
-	float ParticleMass;
-	float PointArea;
-	float ParticleMomInertia;
 	float ParForceParams[2];
 	float ParticleZBuffer;
 
@@ -71,7 +79,11 @@ typedef struct {
 
 } flp_param_struct; 
 
-float compute_squeeze_force(int viscosityModel, float vRel, float minSep, float rp, float NewtonianTau, __global float* nonNewtonianParams);
+float compute_squeeze_force(int viscosityModel, float vRel, float minSep, float rStar, float NewtonianTau, __global float* nonNewtonianParams);
+int particle_member(__global int_param_struct* intDat);
+void sum_fluid_force_torque(int p, int nfa, int wg, __global float4* parFluidForce, __global int* parSurfOffset,
+	float4* force, float4* torque);
+void lees_edwards_wrap(float4* r, float4* v, float4 w, float leOffset, float leVelocity);
 
 __kernel void particle_particle_forces(
 	__global int_param_struct* intDat,
@@ -83,11 +95,22 @@ __kernel void particle_particle_forces(
 	__global int* threadMembers,
 	__global int* numParInThread,
 	__global int* zoneMembers,
-	__global int* numParInZone)
+	__global int* numParInZone,
+	__global float4* parProps,
+	float leOffset)
 {
 	int threadID = get_global_id(0);
 	int np = intDat->NumParticles;
-	float rp = flpDat->ParticleDiam/2.0f;
+	int stride = intDat->ZoneNeighStride;
+
+	int member = particle_member(intDat);
+	int numZones = intDat->NumZones[0]*intDat->NumZones[1]*intDat->NumZones[2];
+	flpDat += member;
+	parKin += 4*member*np;
+	parForce += 2*member*np;
+	parsZone += member*np;
+	zoneMembers += member*numZones*np;
+	numParInZone += member*numZones;
 	
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
@@ -98,15 +121,16 @@ __kernel void particle_particle_forces(
 	{
 		// Detect collisions
 		int pi = threadMembers[threadID*intDat->NumParticles + i];
+		float ri = parProps[pi].x/2.0f;
 		//printf("pi = %d\n", pi);
 
 		int pZone = parsZone[pi];
-		//printf("zoneNeighDat[pZone*28] = %d\n", zoneNeighDat[pZone*28]);
+		//printf("zoneNeighDat[pZone*stride] = %d\n", zoneNeighDat[pZone*stride]);
 
 		// Loop over neighbour zones (which should include this particles zone as well)
-		for (int i_nz = 1; i_nz <= zoneNeighDat[pZone*28]; i_nz++) {
+		for (int i_nz = 1; i_nz <= zoneNeighDat[pZone*stride]; i_nz++) {
 
-			int zoneID = zoneNeighDat[pZone*28 + i_nz];
+			int zoneID = zoneNeighDat[pZone*stride + i_nz];
 			//printf("zoneID = %d\n", zoneID);
 			//printf("numParInZone[zoneID] = %d\n", numParInZone[zoneID]);
 
@@ -120,6 +144,16 @@ __kernel void particle_particle_forces(
 					
 					// Distance
 					float4 rij = parKin[pj] - parKin[pi];
+					float dvLE = 0.0f;
+
+					// Lees-Edwards: nearest image across z is in the sliding image, offset in x
+					if (intDat->LeesEdwards && fabs(rij.z) >= w.z/2.0f) {
+						float imageZ = rij.z > 0.0f ? -1.0f : 1.0f;
+						rij.z += imageZ*w.z;
+						rij.x += imageZ*leOffset;
+						rij.x -= w.x*floor(rij.x/w.x + 0.5f);
+						dvLE = imageZ*flpDat->LEVelocity;
+					}
 					// Correct each component for pbc 
 					int signX = (rij.x < 0.0f) ? -1 : (rij.x > 0.0f);
 					int signY = (rij.y < 0.0f) ? -1 : (rij.y > 0.0f);
@@ -134,8 +168,12 @@ __kernel void particle_particle_forces(
 					
 					// Relative velocity
 					float4 vij = parKin[pj + np] - parKin[pi + np];
+					vij.x += dvLE;
 					
-					float minSep = rSep - 2*rp;	// Closest approach between spheres
+					float rj = parProps[pj].x/2.0f;
+					float rStar = ri*rj/(ri + rj); // Reduced radius, rp/2 for equal spheres
+
+					float minSep = rSep - ri - rj;	// Closest approach between spheres
 					float4 eij = rij/rSep;
 					float vRel = -(eij.x*vij.x + eij.y*vij.y + eij.z*vij.z); // Positive if spheres approaching
 					//printf("vRel = (%f,%f,%f) %f\n", vij.x, vij.y, vij.z, vRel);
@@ -156,9 +194,9 @@ __kernel void particle_particle_forces(
 					
 					
 					// Squeeze force
-					if (minSep > 0 && minSep < SQUEEZE_RANGE*rp) { // Harmonic f = k.x
+					if (minSep > 0 && minSep < SQUEEZE_RANGE*2.0f*rStar) { // Harmonic f = k.x
 						
-						float sqForce = compute_squeeze_force(intDat->ViscosityModel, vRel, minSep, rp, 
+						float sqForce = compute_squeeze_force(intDat->ViscosityModel, vRel, minSep, rStar, 
 							flpDat->NewtonianTau, &(flpDat->ViscosityParams[0]));
 							
 						//printf("Squeeze force = %f\n", sqForce);
@@ -171,14 +209,16 @@ __kernel void particle_particle_forces(
 			}
 		}
 		
-		// Particle-wall collisions (z-wall only)
-		float lowerOverlap = flpDat->ParticleZBuffer - parKin[pi].z;
-		if (lowerOverlap > 0) {
-			parForce[pi].z += flpDat->ParForceParams[0]*lowerOverlap;
-		}
-		float upperOverlap = parKin[pi].z - ((float)intDat->SystemSize[2]-flpDat->ParticleZBuffer);
-		if (upperOverlap > 0) {
-			parForce[pi].z -= flpDat->ParForceParams[0]*upperOverlap;
+		// Particle-wall collisions (z-wall only, none with Lees-Edwards)
+		if (!intDat->LeesEdwards) {
+			float lowerOverlap = flpDat->ParticleZBuffer - parKin[pi].z;
+			if (lowerOverlap > 0) {
+				parForce[pi].z += flpDat->ParForceParams[0]*lowerOverlap;
+			}
+			float upperOverlap = parKin[pi].z - ((float)intDat->SystemSize[2]-flpDat->ParticleZBuffer);
+			if (upperOverlap > 0) {
+				parForce[pi].z -= flpDat->ParForceParams[0]*upperOverlap;
+			}
 		}
 	}
 }
@@ -191,11 +231,21 @@ __kernel void particle_dynamics(
 	__global float4* parForce,
 	__global float4* parFluidForce,
 	__global int* threadMembers,
-	__global int* numParInThread)
+	__global int* numParInThread,
+	__global float4* parProps,
+	__global int* parSurfOffset,
+	float leOffset)
 {
 	int threadID = get_global_id(0);
 	int np = intDat->NumParticles;
-	int nfa = intDat->WorkGroupsPerParticle;
+	int nfa = intDat->TotalWorkGroups;
+	int wg = intDat->PointsPerWorkGroup;
+
+	int member = particle_member(intDat);
+	flpDat += member;
+	parKin += 4*member*np;
+	parForce += 2*member*np;
+	parFluidForce += 2*member*nfa;
 	
 	//printf("ThreadID = %d\n", threadID);
 	//printf("numParInThread[threadID] = %d\n", numParInThread[threadID]);
@@ -214,13 +264,10 @@ __kernel void particle_dynamics(
 		float4 accel = (float4){0.0f, 0.0f, 0.0f, 0.0f};
 		float4 angAccel = (float4){0.0f, 0.0f, 0.0f, 0.0f};
 
-		// Sum fluid-particle forces
-		for (int fa = 0; fa < nfa; fa++) {
-			accel += parFluidForce[p*nfa + fa]; // Force
-			//printf("Fluid-particle force    =  %f %f %f\n", accel.x, accel.y, accel.z);
-			angAccel += parFluidForce[(p+np)*nfa + fa]; // Torque
-			//printf("Fluid-particle torque   = %f %f %f\n", angAccel.x, angAccel.y, angAccel.z);
-		}
+		// Sum fluid-particle forces over this particle's work groups
+		sum_fluid_force_torque(p, nfa, wg, parFluidForce, parSurfOffset, &accel, &angAccel);
+		//printf("Fluid-particle force    =  %f %f %f\n", accel.x, accel.y, accel.z);
+		//printf("Fluid-particle torque   = %f %f %f\n", angAccel.x, angAccel.y, angAccel.z);
 
 		// Add particle-particle force
 		//printf("Particle-particle force = %f %f %f\n", parForce[p].x, parForce[p].y, parForce[p].z);
@@ -229,8 +276,8 @@ __kernel void particle_dynamics(
 		//printf("Particle-particle force = %f %f %f\n", parForce[p].x, parForce[p].y, parForce[p].z);
 		//printf("+ particle-particle torque   = %f %f %f\n", angAccel.x, angAccel.y, angAccel.z);
 
-		accel /= flpDat->ParticleMass;
-		angAccel /= flpDat->ParticleMomInertia; // Spheres
+		accel /= parProps[p].y; // Mass
+		angAccel /= parProps[p].z; // Moment of inertia (spheres)
 		//printf("ang accel   = %f %f %f\n", angAccel.x, angAccel.y, angAccel.z);
 
 		// Add constant acceleration
@@ -244,6 +291,11 @@ __kernel void particle_dynamics(
 		// x_t+1  =  x_t      +  v_t*dt        + 0.5*acc*dt^2
 		//printf("Old position: %f %f %f\n", parKin[p].x, parKin[p].y, parKin[p].z);
 		float4 rTemp = parKin[p] + parKin[p + np] + 0.5f*accel;
+		float4 vTemp = parKin[p + np];
+		if (intDat->LeesEdwards) {
+			lees_edwards_wrap(&rTemp, &vTemp, w, leOffset, flpDat->LEVelocity);
+			parKin[p + np] = vTemp;
+		}
 		parKin[p] = fmod((rTemp+w),w);
 		//printf("New position: %f %f %f\n", parKin[p].x, parKin[p].y, parKin[p].z);
 
@@ -277,6 +329,114 @@ __kernel void particle_dynamics(
 }
 
 
+// Velocity-Verlet sub-stepping of contact and lubrication forces, with the fluid force held at its value
+// from the last LB step. Per sub-step: particle_substep_kick_drift, particle_particle_forces, particle_substep_kick
+__kernel void particle_substep_kick_drift(
+	__global int_param_struct* intDat,
+	__global flp_param_struct* flpDat,
+	__global float4* parKin,
+	__global float4* parForce,
+	__global float4* parFluidForce,
+	__global int* threadMembers,
+	__global int* numParInThread,
+	__global float4* parProps,
+	__global int* parSurfOffset,
+	float dt,
+	float leOffset)
+{
+	int threadID = get_global_id(0);
+	int np = intDat->NumParticles;
+	int nfa = intDat->TotalWorkGroups;
+	int wg = intDat->PointsPerWorkGroup;
+
+	int member = particle_member(intDat);
+	flpDat += member;
+	parKin += 4*member*np;
+	parForce += 2*member*np;
+	parFluidForce += 2*member*nfa;
+
+	float4 w = (float4){intDat->SystemSize[0], intDat->SystemSize[1], intDat->SystemSize[2], 1.0f};
+	float4 g = (float4){flpDat->ConstBodyForce[0], flpDat->ConstBodyForce[1], flpDat->ConstBodyForce[2], 0.0f};
+
+	for(int i = 0; i < numParInThread[threadID]; ++i)
+	{
+		int p = threadMembers[threadID*intDat->NumParticles + i];
+
+		float4 force = parForce[p];
+		float4 torque = parForce[p + np];
+		sum_fluid_force_torque(p, nfa, wg, parFluidForce, parSurfOffset, &force, &torque);
+
+		// Half kick, v(t+dt/2) = v(t) + a(t)*dt/2
+		float4 vHalf = parKin[p + np] + 0.5f*dt*(force/parProps[p].y + g);
+		float4 avHalf = parKin[p + 3*np] + 0.5f*dt*torque/parProps[p].z;
+
+		// Drift
+		float4 rTemp = parKin[p] + dt*vHalf;
+		if (intDat->LeesEdwards) {
+			lees_edwards_wrap(&rTemp, &vHalf, w, leOffset, flpDat->LEVelocity);
+		}
+		parKin[p] = fmod((rTemp+w),w);
+
+		// Rotation quaternion, dq/dt = (1/2)*[angVel, 0]*q
+		float4 q = parKin[p + 2*np];
+		float dq_w = -dot(avHalf,q);
+		float4 dq_xyz = q.w*avHalf + cross(avHalf,q);
+		q += 0.5f*dt*dq_xyz;
+		q.w += 0.5f*dt*dq_w;
+		parKin[p + 2*np] = normalize(q);
+
+		parKin[p + np] = vHalf;
+		parKin[p + 3*np] = avHalf;
+
+		// Reset for particle_particle_forces at the new positions
+		parForce[p] = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+		parForce[p + np] = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+	}
+}
+
+
+__kernel void particle_substep_kick(
+	__global int_param_struct* intDat,
+	__global flp_param_struct* flpDat,
+	__global float4* parKin,
+	__global float4* parForce,
+	__global float4* parFluidForce,
+	__global int* threadMembers,
+	__global int* numParInThread,
+	__global float4* parProps,
+	__global int* parSurfOffset,
+	float dt,
+	float leOffset)
+{
+	int threadID = get_global_id(0);
+	int np = intDat->NumParticles;
+	int nfa = intDat->TotalWorkGroups;
+	int wg = intDat->PointsPerWorkGroup;
+
+	int member = particle_member(intDat);
+	flpDat += member;
+	parKin += 4*member*np;
+	parForce += 2*member*np;
+	parFluidForce += 2*member*nfa;
+
+	float4 g = (float4){flpDat->ConstBodyForce[0], flpDat->ConstBodyForce[1], flpDat->ConstBodyForce[2], 0.0f};
+
+	for(int i = 0; i < numParInThread[threadID]; ++i)
+	{
+		int p = threadMembers[threadID*intDat->NumParticles + i];
+
+		float4 force = parForce[p];
+		float4 torque = parForce[p + np];
+		sum_fluid_force_torque(p, nfa, wg, parFluidForce, parSurfOffset, &force, &torque);
+
+		// Second half kick, v(t+dt) = v(t+dt/2) + a(t+dt)*dt/2
+		// parForce is kept, it is the first half kick of the next sub-step
+		parKin[p + np] += 0.5f*dt*(force/parProps[p].y + g);
+		parKin[p + 3*np] += 0.5f*dt*torque/parProps[p].z;
+	}
+}
+
+
 __kernel void update_particle_zones(
 	__global int_param_struct* intDat,
 	__global flp_param_struct* flpDat,
@@ -288,6 +448,15 @@ __kernel void update_particle_zones(
 	__global int* numParInZone)
 {
 	int threadID = get_global_id(0);
+	int np = intDat->NumParticles;
+
+	int member = particle_member(intDat);
+	int numZones = intDat->NumZones[0]*intDat->NumZones[1]*intDat->NumZones[2];
+	flpDat += member;
+	parKin += 4*member*np;
+	parsZone += member*np;
+	zoneMembers += member*numZones*np;
+	numParInZone += member*numZones;
 
 	//printf("update_particle_zones: Thread ID %d,", threadID);
 	//printf(" num par in thread = %d\n", numParInThread[threadID]);
@@ -316,9 +485,35 @@ __kernel void update_particle_zones(
 
 
 
-float compute_squeeze_force(int viscosityModel, float vRel, float minSep, float rp, float NewtonianTau, __global float* nonNewtonianParams)
+// Ensemble members each take an equal share of the particle work items, so threadMembers and numParInThread
+// (indexed by the global id) hold every member's threads. Other particle arrays have a block per member,
+// which kernels offset to, with particle indices local to the member
+int particle_member(__global int_param_struct* intDat)
+{
+	return get_global_id(0)/(get_global_size(0)/intDat->EnsembleSize);
+}
+
+// Add the force and torque from each of a particle's work groups in particle_fluid_forces_linear_stencil
+void sum_fluid_force_torque(int p, int nfa, int wg, __global float4* parFluidForce, __global int* parSurfOffset,
+	float4* force, float4* torque)
+{
+	for (int fa = parSurfOffset[p]/wg; fa < parSurfOffset[p+1]/wg; fa++) {
+		*force += parFluidForce[fa];
+		*torque += parFluidForce[fa + nfa];
+	}
+}
+
+// Lees-Edwards: a particle leaving through a z face enters through the other, shifted by the image offset
+// in x and with the image velocity difference
+void lees_edwards_wrap(float4* r, float4* v, float4 w, float leOffset, float leVelocity)
+{
+	float crossZ = floor((*r).z/w.z); // +1 through the top, -1 through the bottom
+	(*r).x = fmod((*r).x - crossZ*leOffset + 2.0f*w.x, w.x);
+	(*v).x -= crossZ*leVelocity;
+}
+
+float compute_squeeze_force(int viscosityModel, float vRel, float minSep, float rStar, float NewtonianTau, __global float* nonNewtonianParams)
 {
-	float rStar = rp/2.0f;
 	minSep = minSep < MIN_SEP ? MIN_SEP : minSep;
 	float force = 0.0;
 	
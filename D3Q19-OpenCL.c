@@ -1,5 +1,6 @@
 #include "D3Q19-OpenCL_header.h"
 
+#include "field_snapshot.c"
 #include "sim_main.c"
 
 // Function to set up data arrays and read input file
@@ -27,6 +28,10 @@ int initialize_data(int_param_struct* intDat, flp_param_struct* flpDat, host_par
 	// Variable/input data
 	FILE *ifp;
 	ifp = fopen("input_file.txt", "r");
+	if (ifp == NULL) {
+		perror("input_file.txt");
+		return 1;
+	}
 
 	input_data_struct inputDefaults[] = {
 		{"iterations", TYPE_INT, &(intDat->MaxIterations), "1000"},
@@ -41,25 +46,62 @@ int initialize_data(int_param_struct* intDat, flp_param_struct* flpDat, host_par
 		{"initial_f", TYPE_STRING, &(hostDat->InitialDist), "zero"},
 		{"initial_vel", TYPE_FLOAT_3VEC, &(hostDat->InitialVel), "0.0 0.0 0.0"},
 		{"boundary_conditions_xyz", TYPE_INT_3VEC, &(intDat->BoundaryConds), "0 0 0"},
-		{"tangential_vel_bcs", TYPE_INT_3VEC, &(hostDat->TangentialVelBC), "0 0 0"},
-		{"maintain_shear_rate", TYPE_INT_3VEC, &(intDat->MaintainShear), "0"},
+		{"tangential_vel_bcs", TYPE_INT_3VEC, &(intDat->TangentialVelBC), "0 0 0"},
+		{"fuse_velocity_bc", TYPE_INT, &(intDat->FuseVelocityBC), "1"},
+		{"maintain_shear_rate", TYPE_INT, &(intDat->MaintainShear), "0"},
+		{"target_shear_rate", TYPE_FLOAT, &(hostDat->TargetShearRate), "0.0"},
+		{"shear_control_gain", TYPE_FLOAT, &(hostDat->ShearControlGain), "0.5"},
 		{"velocity_bc_upper", TYPE_FLOAT_3VEC, &(flpDat->VelUpper), "0.0 0.0 0.0"},
 		{"velocity_bc_lower", TYPE_FLOAT_3VEC, &(flpDat->VelLower), "0.0 0.0 0.0"},
+		{"lees_edwards_velocity", TYPE_FLOAT, &(flpDat->LEVelocity), "0.0"},
+		{"ensemble_size", TYPE_INT, &(intDat->EnsembleSize), "1"},
+		{"ensemble_file", TYPE_STRING, &(hostDat->EnsembleFile), "none"},
+		{"cpu_plane_fraction", TYPE_FLOAT, &(hostDat->CpuPlaneFraction), "0.0"},
+		{"split_balance_freq", TYPE_INT, &(hostDat->SplitBalanceFreq), "50"},
+		{"cpu_collide_vector", TYPE_INT, &(hostDat->CpuCollideVector), "1"},
+		{"huge_pages", TYPE_INT, &(hostDat->HugePages), "0"},
+		{"temporal_block_steps", TYPE_INT, &(hostDat->TemporalBlockSteps), "1"},
+		{"temporal_block_planes", TYPE_INT, &(hostDat->TemporalBlockPlanes), "0"},
+		{"out_of_core_planes", TYPE_INT, &(intDat->OutOfCorePlanes), "0"},
+		{"out_of_core_file", TYPE_STRING, &(hostDat->OutOfCoreFile), "none"},
 		{"num_particles", TYPE_INT, &(intDat->NumParticles), "0"},
 		{"initial_particle_distribution", TYPE_INT, &(hostDat->InitialParticleDistribution), "1"},
 		{"random_particle_shift", TYPE_FLOAT, &(hostDat->RandParticleShift), "0.0"},
 		{"initial_particle_buffer", TYPE_FLOAT, &(hostDat->ParticleBuffer), "4.0"},
 		{"z_wall_particle_buffer", TYPE_FLOAT, &(flpDat->ParticleZBuffer), "10.0"},
 		{"particle_diameter", TYPE_FLOAT, &(flpDat->ParticleDiam), "8.0"},
+		{"bidisperse_diameter", TYPE_FLOAT, &(hostDat->BidisperseDiam), "0.0"},
+		{"bidisperse_fraction", TYPE_FLOAT, &(hostDat->BidisperseFraction), "0.5"},
+		{"surface_point_generator", TYPE_INT, &(hostDat->SurfPointGenerator), "0"},
+		{"surface_point_density", TYPE_FLOAT, &(hostDat->SurfPointDensity), "1.0"},
 		{"particle_density", TYPE_FLOAT, &(hostDat->ParticleDensity), "1.0"},
 		{"particle_collision_model", TYPE_INT, &(intDat->ParForceModel), "1"},
 		{"particle_collision_params", TYPE_FLOAT, &(flpDat->ParForceParams), "1.0, 0.0"},
 		{"surf_point_write_atomic", TYPE_INT, &(intDat->MaxSurfPointsPerNode), "8"},
 		{"ibm_interpolation_mode", TYPE_INT, &(hostDat->InterpOrderIBM), "1"},
 		{"direct_forcing_coeff", TYPE_FLOAT, &(flpDat->DirectForcingCoeff), "1.0"},
+		{"packing_volume_fraction", TYPE_FLOAT, &(hostDat->PackingVolFraction), "0.0"},
+		{"packing_compression_sweeps", TYPE_INT, &(hostDat->PackingCompression), "0"},
+		{"packing_max_attempts", TYPE_INT, &(hostDat->PackingMaxAttempts), "10000"},
 		{"rebuild_neigh_list_freq", TYPE_INT, &(hostDat->RebuildFreq), "10"},
+		{"particle_substeps", TYPE_INT, &(hostDat->ParticleSubsteps), "1"},
 		{"video_freq", TYPE_INT, &(hostDat->VideoFreq), "1000"},
+		{"video_format", TYPE_INT, &(hostDat->VideoFormat), "1"},
+		{"output_vorticity", TYPE_INT, &(hostDat->OutputVorticity), "0"},
 		{"shear_stress_freq", TYPE_INT, &(hostDat->ShearStressFreq), "1000"},
+		{"shear_profile_history", TYPE_INT, &(hostDat->ShearProfileHistory), "1"},
+		{"convergence_window", TYPE_INT, &(hostDat->ConvergeWindow), "0"},
+		{"convergence_tolerance", TYPE_FLOAT, &(hostDat->ConvergeTolerance), "0.01"},
+		{"field_average_start", TYPE_INT, &(hostDat->FieldAverageStart), "0"},
+		{"field_average_freq", TYPE_INT, &(hostDat->FieldAverageFreq), "0"},
+		{"snapshot_codec", TYPE_INT, &(hostDat->SnapshotCodec), "1"},
+		{"snapshot_mantissa_bits", TYPE_INT, &(hostDat->SnapshotMantissaBits), "23"},
+		{"snapshot_slab_planes", TYPE_INT, &(hostDat->SnapshotSlabPlanes), "8"},
+		{"snapshot_threads", TYPE_INT, &(hostDat->SnapshotThreads), "4"},
+		{"checkpoint_freq", TYPE_INT, &(hostDat->CheckpointFreq), "0"},
+		{"checkpoint_keep", TYPE_INT, &(hostDat->CheckpointKeep), "2"},
+		{"restart_file", TYPE_STRING, &(hostDat->RestartFile), "none"},
+		{"restart_reset_time", TYPE_INT, &(hostDat->RestartResetTime), "0"},
 		{"fluid_ouput_spacing", TYPE_INT, &(hostDat->FluidOutputSpacing), "1"}
 	};
 
@@ -93,28 +135,192 @@ int initialize_data(int_param_struct* intDat, flp_param_struct* flpDat, host_par
 // Print out some important input information
 int parameter_checking(int_param_struct* intDat, flp_param_struct* flpDat, host_param_struct* hostDat)
 {
-	int NumNodes = intDat->LatticeSize[0]*intDat->LatticeSize[1]*intDat->LatticeSize[2];
-	printf("Total number of nodes: %d\n", NumNodes);
+	size_t NumNodes = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1]*intDat->LatticeSize[2];
+	printf("Total number of nodes: %llu\n", (unsigned long long)NumNodes);
 
 	printf("Particle domain decomposition: %dx%dx%d\n", hostDat->DomainDecomp[0], hostDat->DomainDecomp[1], hostDat->DomainDecomp[2]);
 
 	printf("Viscosity model %d\n", intDat->ViscosityModel);
 
+	// The whole lattice, as the slabs of an out-of-core fluid see it
+	intDat->WholeLatticeZ = intDat->LatticeSize[2];
+	intDat->SlabOrigin = 0;
+
+	// Rejected here rather than when the fields are initialized, so a server can go on to its next job
+	if (strstr(hostDat->InitialDist, "poiseuille") != NULL) {
+		printf("Error: poiseuille starting profile not supported yet.\n");
+		return 1;
+	}
+
 	if ((intDat->BoundaryConds[0]+intDat->BoundaryConds[1]+intDat->BoundaryConds[2]) > 1) {
 		printf("Error: More than 1 pair of faces with velocity boundaries not yet supported.\n");
 		return 1;
 	}
 
+	// Lees-Edwards images along z slide in x, so both must be periodic
+	intDat->LeesEdwards = flpDat->LEVelocity != 0.0f;
+	if (intDat->LeesEdwards) {
+		if (intDat->BoundaryConds[0] != BC_PERIODIC || intDat->BoundaryConds[2] != BC_PERIODIC) {
+			printf("Error: Lees-Edwards boundaries need periodic x and z axes.\n");
+			return 1;
+		}
+		printf("Lees-Edwards boundaries on z, relative image velocity %f along x\n", flpDat->LEVelocity);
+	}
+
+	if (hostDat->ParticleSubsteps < 1) {
+		printf("Error: particle_substeps must be at least 1.\n");
+		return 1;
+	}
+	else if (hostDat->ParticleSubsteps > 1) {
+		printf("Particle contact forces integrated with %d sub-steps per LB step\n", hostDat->ParticleSubsteps);
+	}
+
+	if (hostDat->ShearProfileHistory < 1) {
+		printf("Error: shear_profile_history must be at least 1.\n");
+		return 1;
+	}
+
+	if (intDat->EnsembleSize < 1) {
+		printf("Error: ensemble_size must be at least 1.\n");
+		return 1;
+	}
+	else if (intDat->EnsembleSize > 1) {
+		// Members share the lattice size, each with its own fluid and particles; per-member output is the shear rates and final field
+		if (intDat->MaintainShear || hostDat->FieldAverageFreq > 0 || hostDat->CheckpointFreq > 0
+		||	strcmp(hostDat->RestartFile, "none") != 0) {
+			printf("Error: ensemble runs do not support maintain_shear_rate, field statistics or checkpoints.\n");
+			return 1;
+		}
+		printf("Ensemble of %d simulations advanced together, no video output\n", intDat->EnsembleSize);
+	}
+
+	if (hostDat->CpuPlaneFraction > 0.0f) {
+		// The CPU device takes the upper z planes, each device applies the velocity boundary on its own wall.
+		// A fraction of 1 leaves the whole fluid lattice to the CPU device
+		if (hostDat->CpuPlaneFraction > 1.0f || intDat->LatticeSize[2] < 4) {
+			printf("Error: cpu_plane_fraction must be at most 1, with at least 2 z planes.\n");
+			return 1;
+		}
+		if (intDat->BoundaryConds[0] != BC_PERIODIC || intDat->BoundaryConds[1] != BC_PERIODIC
+		||	intDat->BoundaryConds[2] != BC_VELOCITY
+		||	intDat->TangentialVelBC[0] || intDat->TangentialVelBC[1] || intDat->TangentialVelBC[2]) {
+			printf("Error: cpu_plane_fraction needs periodic x and y, and velocity walls on z.\n");
+			return 1;
+		}
+		// Particles stay with the GPU's coupling kernels, which read and write the CPU's planes through copies
+		if (intDat->EnsembleSize > 1
+		||	hostDat->FieldAverageFreq > 0 || hostDat->CheckpointFreq > 0 || strcmp(hostDat->RestartFile, "none") != 0) {
+			printf("Error: cpu_plane_fraction does not support ensembles, field statistics or checkpoints yet.\n");
+			return 1;
+		}
+		printf("Fluid lattice split in z between GPU and CPU, CPU fraction %f, rebalanced every %d steps\n",
+			hostDat->CpuPlaneFraction, hostDat->SplitBalanceFreq);
+	}
+
+	if (hostDat->TemporalBlockSteps < 1 || hostDat->TemporalBlockPlanes < 0) {
+		printf("Error: temporal_block_steps must be at least 1, temporal_block_planes 0 (auto) or positive.\n");
+		return 1;
+	}
+	else if (hostDat->TemporalBlockSteps > 1) {
+		// The host only sees the fluid at the end of each block, where the outputs and the IBM forcing
+		// refresh fall. A wavefront needs the whole lattice on one device
+		if (hostDat->CpuPlaneFraction < 1.0f) {
+			printf("Error: temporal_block_steps needs the whole fluid lattice on the CPU device (cpu_plane_fraction 1).\n");
+			return 1;
+		}
+		if (hostDat->VideoFreq%hostDat->TemporalBlockSteps != 0 || hostDat->ShearStressFreq%hostDat->TemporalBlockSteps != 0) {
+			printf("Error: video_freq and shear_stress_freq must be multiples of temporal_block_steps.\n");
+			return 1;
+		}
+		printf("Fluid advanced %d steps per sweep of z slabs on the CPU device\n", hostDat->TemporalBlockSteps);
+	}
+
+	if (intDat->OutOfCorePlanes < 0) {
+		printf("Error: out_of_core_planes must be 0 (lattice on the device) or positive.\n");
+		return 1;
+	}
+	else if (intDat->OutOfCorePlanes > 0) {
+		// Populations stay on the host, the GPU sees a slab at a time. Velocity boundaries are applied
+		// by collide_stream on the slabs' own planes
+		if (hostDat->CpuPlaneFraction > 0.0f || intDat->EnsembleSize > 1 || intDat->LeesEdwards) {
+			printf("Error: out_of_core_planes does not combine with cpu_plane_fraction, ensembles or Lees-Edwards.\n");
+			return 1;
+		}
+		if ((intDat->BoundaryConds[0] || intDat->BoundaryConds[1] || intDat->BoundaryConds[2]) && !intDat->FuseVelocityBC) {
+			printf("Error: out_of_core_planes needs fuse_velocity_bc 1 with velocity boundaries.\n");
+			return 1;
+		}
+		if (hostDat->FieldAverageFreq > 0 || hostDat->CheckpointFreq > 0 || strcmp(hostDat->RestartFile, "none") != 0) {
+			printf("Error: out_of_core_planes does not support field statistics or checkpoints yet.\n");
+			return 1;
+		}
+		printf("Fluid populations held in %s, streamed through the GPU in %d-plane z slabs\n",
+			strcmp(hostDat->OutOfCoreFile, "none") == 0 ? "host memory" : hostDat->OutOfCoreFile, intDat->OutOfCorePlanes);
+	}
+
+	if (LATTICE_BRICK > 1) {
+		// Split lattice, temporal blocking and out-of-core copy runs of whole z planes, which bricks interleave
+		if (hostDat->CpuPlaneFraction > 0.0f || hostDat->TemporalBlockSteps > 1 || intDat->OutOfCorePlanes > 0) {
+			printf("Error: lattice stored in bricks (LATTICE_BRICK %d) does not support cpu_plane_fraction, "
+				"temporal_block_steps or out_of_core_planes.\n", LATTICE_BRICK);
+			return 1;
+		}
+		printf("Lattice nodes stored in %d^3 bricks, %llu nodes with padding\n", LATTICE_BRICK,
+			(unsigned long long)lattice_nodes(intDat->LatticeSize));
+	}
+
+	if (intDat->MaintainShear) {
+		int wallMoving = 0;
+		for (int d = 0; d < 3; d++) {
+			wallMoving |= flpDat->VelUpper[d] != 0.0f || flpDat->VelLower[d] != 0.0f;
+		}
+		if (intDat->BoundaryConds[2] != BC_VELOCITY || !wallMoving || hostDat->TargetShearRate == 0.0f) {
+			printf("Error: maintain_shear_rate needs moving z walls and a non-zero target_shear_rate.\n");
+			return 1;
+		}
+		printf("Wall velocities controlled for a particle-region shear rate of %e, gain %f\n",
+			hostDat->TargetShearRate, hostDat->ShearControlGain);
+	}
+
+	if (hostDat->ConvergeWindow != 0) {
+		if (hostDat->ConvergeWindow < 2*CONVERGE_BATCHES || hostDat->ConvergeWindow > CONVERGE_MAX_WINDOW
+		||	hostDat->ConvergeWindow%CONVERGE_BATCHES != 0) {
+			printf("Error: convergence_window must be 0 (off) or a multiple of %d from %d to %d.\n",
+				CONVERGE_BATCHES, 2*CONVERGE_BATCHES, CONVERGE_MAX_WINDOW);
+			return 1;
+		}
+		printf("Run stops once the last %d shear rate samples converge to a relative tolerance of %g\n",
+			hostDat->ConvergeWindow, hostDat->ConvergeTolerance);
+	}
+
+	if (hostDat->FieldAverageFreq < 0) {
+		printf("Error: field_average_freq must be 0 (off) or positive.\n");
+		return 1;
+	}
+	else if (hostDat->FieldAverageFreq > 0) {
+		printf("Field statistics accumulated every %d steps from iteration %d\n", hostDat->FieldAverageFreq, hostDat->FieldAverageStart);
+	}
+
+	if (hostDat->SnapshotCodec != SNAPSHOT_RAW && hostDat->SnapshotCodec != SNAPSHOT_ZLIB) {
+		printf("Error: snapshot_codec must be 0 (raw) or 1 (zlib).\n");
+		return 1;
+	}
+	if (hostDat->SnapshotMantissaBits < 1 || hostDat->SnapshotMantissaBits > 23) {
+		printf("Error: snapshot_mantissa_bits must be from 1 to 23 (lossless).\n");
+		return 1;
+	}
+
+	if (hostDat->VideoFormat < VIDEO_XYZ || hostDat->VideoFormat > VIDEO_BINARY_INT16) {
+		printf("Error: video_format must be 0 (xyz text), 1 (binary float32) or 2 (binary int16).\n");
+		return 1;
+	}
+
 	return 0;
 }
 
-void initialize_lattice_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-		cl_float* f_h, cl_float* gpf_h, cl_float* u_h, cl_float* tau_lb_h, cl_int* countPoint)
+// System size, needed before particles are allocated. Sets the number of particles if packing_volume_fraction is given
+void initialize_system_size(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat)
 {
-	printf("%s %s\n", "Initial distribution type ", hostDat->InitialDist);
-
-	int NumNodes = intDat->LatticeSize[0]*intDat->LatticeSize[1]*intDat->LatticeSize[2];
-	
 	// Set system size
 	for (int dim = 0; dim < 3; dim++) {
 		
@@ -127,79 +333,106 @@ void initialize_lattice_fields(host_param_struct* hostDat, int_param_struct* int
 		printf("System size in dimension %d = %d\n", dim, intDat->SystemSize[dim]);
 	}
 
+	if (hostDat->PackingVolFraction > 0.0f) {
+		// Mean particle volume, including the second species
+		float d1 = flpDat->ParticleDiam;
+		float d2 = hostDat->BidisperseDiam;
+		float frac2 = d2 > 0.0f ? hostDat->BidisperseFraction : 0.0f;
+		float meanVol = (M_PI/6.0f)*((1.0f-frac2)*d1*d1*d1 + frac2*d2*d2*d2);
+
+		// Walls along z take away the particle buffer
+		float vol = (float)intDat->SystemSize[0]*intDat->SystemSize[1];
+		vol *= intDat->BoundaryConds[2] == BC_PERIODIC ? intDat->SystemSize[2] : intDat->SystemSize[2] - 2.0f*flpDat->ParticleZBuffer;
+
+		intDat->NumParticles = (int)(hostDat->PackingVolFraction*vol/meanVol + 0.5f);
+		printf("Volume fraction %f requires %d particles\n", hostDat->PackingVolFraction, intDat->NumParticles);
+	}
+}
+
+// Initial lattice fields of numMembers members, built by the initialize_lattice_fields kernel on the device holding them
+cl_int initialize_lattice_fields(host_param_struct* hostDat, int_param_struct* intDat, cl_command_queue queue, cl_kernel kernel,
+	cl_mem* fields, cl_mem intDat_cl, cl_mem flpDat_cl, int numMembers)
+{
+	printf("%s %s\n", "Initial distribution type ", hostDat->InitialDist);
+
+	cl_float4 initVel = {{0.0f, 0.0f, 0.0f, 0.0f}};
 	if (strstr(hostDat->InitialDist, "poiseuille") != NULL) {
 		// Do something
 		perror("poiseuille starting profile not supported yet");
 		exit(0);
 	}
 	else if (strstr(hostDat->InitialDist, "constant") != NULL) {
-		//
-		float vel[3];
-		float f_eq[19];
-		vel[0] = hostDat->InitialVel[0];
-		vel[1] = hostDat->InitialVel[1];
-		vel[2] = hostDat->InitialVel[2];
-
-		printf("Initializing f with constant velocity = %e %e %e\n", vel[0], vel[1], vel[2]);
+		initVel.x = hostDat->InitialVel[0];
+		initVel.y = hostDat->InitialVel[1];
+		initVel.z = hostDat->InitialVel[2];
 
-		equilibrium_distribution_D3Q19(1.0, vel, f_eq);
-
-		// Use propagation-optimized data layouts
-		for(int i_n=0; i_n<NumNodes; i_n++) {
+		printf("Initializing f with constant velocity = %e %e %e\n", initVel.x, initVel.y, initVel.z);
+	}
+	// Zero is default
 
-			for(int i_f=0; i_f<19; i_f++) {
-				f_h[i_n + i_f*NumNodes] = f_eq[i_f];
-			}
-			u_h[i_n               ] = hostDat->InitialVel[0];
-			u_h[i_n +     NumNodes] = hostDat->InitialVel[1];
-			u_h[i_n +   2*NumNodes] = hostDat->InitialVel[2];
-		}
+	// fA, fB, u, gpf, tau_lb, countPoint, then the second parts of fA, fB, gpf (NULL unless split)
+	size_t memSize = sizeof(cl_mem);
+	cl_int err = CL_SUCCESS;
+	for (int i = 0; i < 6; i++) {
+		err |= clSetKernelArg(kernel, i, memSize, &fields[i]);
+	}
+	err |= clSetKernelArg(kernel, 6, memSize, &intDat_cl);
+	err |= clSetKernelArg(kernel, 7, memSize, &flpDat_cl);
+	err |= clSetKernelArg(kernel, 8, sizeof(cl_float4), &initVel);
+	for (int i = 6; i < 9; i++) {
+		err |= clSetKernelArg(kernel, i+3, memSize, &fields[i]);
 	}
-	else // Zero is default
-	{
-		float vel[3] = {0.0, 0.0, 0.0};
-		float f_eq[19];
-		equilibrium_distribution_D3Q19(1.0, vel, f_eq);
 
-		// Use propagation-optimized data layouts
-		for(int i_n=0; i_n<NumNodes; i_n++) {
+	size_t init_work_size[3] = {intDat->LatticeSize[0], intDat->LatticeSize[1], intDat->LatticeSize[2]*numMembers};
+	err |= clEnqueueNDRangeKernel(queue, kernel, 3, NULL, init_work_size, NULL, 0, NULL, NULL);
 
-			for(int i_f=0; i_f<19; i_f++) {
-				f_h[i_n + i_f*NumNodes] = f_eq[i_f];
-			}
-			u_h[i_n               ] = 0.0f;
-			u_h[i_n +     NumNodes] = 0.0f;
-			u_h[i_n +   2*NumNodes] = 0.0f;
-		}
-	}
+	return err;
+}
+
+// Per-particle diameter, mass, moment of inertia (point area is set in sphere_discretization)
+void initialize_particle_properties(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps)
+{
+	int np = intDat->NumParticles;
+	int numBidisperse = 0;
+	hostDat->MaxParticleDiam = flpDat->ParticleDiam;
 
-	// Other fields
-	for(int i_n=0; i_n<NumNodes; i_n++) {
+	for (int p = 0; p < np; p++) {
 
-		tau_lb_h[i_n] = flpDat->NewtonianTau;
-		countPoint[i_n] = 0;
+		float d = flpDat->ParticleDiam;
 
-		for (int p = 0; p < intDat->MaxSurfPointsPerNode; p++) {
-			gpf_h[i_n + NumNodes*(3*p)    ] = 0.0f;
-			gpf_h[i_n + NumNodes*(3*p + 1)] = 0.0f;
-			gpf_h[i_n + NumNodes*(3*p + 2)] = 0.0f;
+		// Second species spread evenly through the particle indices
+		if (hostDat->BidisperseDiam > 0.0f
+		&&	(int)((p+1)*hostDat->BidisperseFraction) > (int)(p*hostDat->BidisperseFraction)) {
+			d = hostDat->BidisperseDiam;
+			numBidisperse++;
 		}
+		hostDat->MaxParticleDiam = d > hostDat->MaxParticleDiam ? d : hostDat->MaxParticleDiam;
+
+		float mass = (4.0f/3.0f)*M_PI*hostDat->ParticleDensity*pow(d,3);
+		// 2*m*r^2/5;
+		float momInertia = 0.1f*mass*d*d;
+
+		parProps[p] = (cl_float4){{d, mass, momInertia, 0.0f}};
 	}
 
+	if (numBidisperse > 0) {
+		printf("Bidisperse suspension: %d particles of diameter %f, %d of diameter %f\n",
+			np-numBidisperse, flpDat->ParticleDiam, numBidisperse, hostDat->BidisperseDiam);
+	}
+	if (np > 0) {
+		printf("Particle 0: mass = %f, moment of inertia = %f\n", parProps[0].y, parProps[0].z);
+	}
 }
 
-void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-	cl_float4* parKinematics, cl_float4* parForce, cl_float4* parFluidForce)
+// Returns 1 if the particles could not be placed
+int initialize_particle_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps, cl_float4* parKinematics, cl_float4* parForce, cl_float4* parFluidForce)
 {
 	printf("\nThere are %d particles.\n",intDat->NumParticles);
 
-	flpDat->ParticleMass = (4.0f/3.0f)*M_PI*hostDat->ParticleDensity*pow(flpDat->ParticleDiam,3);
-	// 2*m*r^2/5;
-	flpDat->ParticleMomInertia = 0.1f*flpDat->ParticleMass*flpDat->ParticleDiam*flpDat->ParticleDiam;
-	printf("Mass = %f, moment of inertia = %f\n", flpDat->ParticleMass, flpDat->ParticleMomInertia);
-
 	printf("\nNumber of particle force arrays needed = %d, (%d points, max %d per work group).\n\n",
-		intDat->WorkGroupsPerParticle, intDat->PointsPerParticle, intDat->PointsPerWorkGroup);
+		intDat->TotalWorkGroups, intDat->TotalSurfPoints, intDat->PointsPerWorkGroup);
 
 	int np = intDat->NumParticles;
 
@@ -213,7 +446,7 @@ void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* in
 			perror("Error: InitialVel called without particles");
 		}
 
-		if (0.5*flpDat->ParticleDiam > pb) {
+		if (0.5*hostDat->MaxParticleDiam > pb) {
 			perror("Error: Particles begin overlapping walls");
 		}
 
@@ -271,9 +504,17 @@ void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* in
 
 		for(int p = 0; p < np; p++) {
 			int parPlaced = 0;
+			int attempts = 0;
 			
 			while (parPlaced == 0) {
 				
+				if (attempts++ == hostDat->PackingMaxAttempts) {
+					printf("Error: could not place particle %d of %d without overlap after %d attempts.\n",
+						p, np, hostDat->PackingMaxAttempts);
+					printf("Reduce random_particle_shift or num_particles, or use initial_particle_distribution 4\n");
+					return 1;
+				}
+				
 				cl_float px = pb + sp[0]*(p/(n*m)) + hostDat->RandParticleShift*(2*rand()/(float)RAND_MAX - 1);
 				cl_float py = pb + sp[1]*((p/m)%n) + hostDat->RandParticleShift*(2*rand()/(float)RAND_MAX - 1);
 				cl_float pz = pb + flpDat->ParticleZBuffer + sp[2]*(p%m) + hostDat->RandParticleShift*(2*rand()/(float)RAND_MAX - 1);
@@ -288,8 +529,9 @@ void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* in
 					cl_float rijZ = parKinematics[p2].z - testPos.z;
 					
 					cl_float sepSq = rijX*rijX +  rijY*rijY +  rijZ*rijZ;
+					cl_float contact = 0.5f*(parProps[p].x + parProps[p2].x);
 					
-					if (sepSq < flpDat->ParticleDiam*flpDat->ParticleDiam) {
+					if (sepSq < contact*contact) {
 						safePos = 0;
 					}
 				}
@@ -319,6 +561,11 @@ void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* in
 		printf("Placing single particle at position %f %f %f\n", px, py, pz);
 
 	}
+	else if (hostDat->InitialParticleDistribution == 4) {
+		if (random_sequential_packing(hostDat, intDat, flpDat, parProps, parKinematics)) {
+			return 1;
+		}
+	}
 	else {
 		perror("Error: initial_particle_distribution option not a known value\n");
 	}
@@ -332,27 +579,266 @@ void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* in
 
 		parForce[p     ] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}};
 		parForce[p + np] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}};
+	}
+
+	// Force then torque for every surface point work group
+	for (int fa = 0; fa < 2*intDat->TotalWorkGroups; fa++) {
+		parFluidForce[fa] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}};
+	}
+
+	return 0;
+}
+
+// Random sequential addition, with overlap checks against a cell grid of width >= largest diameter.
+// Optional compression (in the spirit of Lubachevsky-Stillinger): particles are placed at a reduced size, then
+// grown back to full size in small steps, with overlaps relaxed by pushing particles apart after each step
+int random_sequential_packing(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps, cl_float4* parKinematics)
+{
+	int np = intDat->NumParticles;
+	float dMax = hostDat->MaxParticleDiam;
+
+	packing_grid_struct grid;
+	int totalCells = 1;
+
+	for (int dim = 0; dim < 3; dim++) {
+		grid.Periodic[dim] = intDat->BoundaryConds[dim] == BC_PERIODIC;
+
+		// Keep centres clear of walls; z uses the wall repulsion buffer
+		float buffer = dim == 2 ? flpDat->ParticleZBuffer : hostDat->ParticleBuffer;
+		buffer = buffer > 0.5f*dMax ? buffer : 0.5f*dMax;
+
+		grid.Lo[dim] = grid.Periodic[dim] ? 0.0f : buffer;
+		grid.Len[dim] = grid.Periodic[dim] ? intDat->SystemSize[dim] : intDat->SystemSize[dim] - 2.0f*buffer;
+
+		if (grid.Len[dim] <= 0.0f) {
+			printf("Error: no space for particles along axis %d\n", dim);
+			return 1;
+		}
+
+		grid.NumCells[dim] = (int)(grid.Len[dim]/dMax);
+		grid.NumCells[dim] = grid.NumCells[dim] < 1 ? 1 : grid.NumCells[dim];
+		grid.CellWidth[dim] = grid.Len[dim]/grid.NumCells[dim];
+		totalCells *= grid.NumCells[dim];
+	}
+	printf("Packing %d particles with a %d x %d x %d cell grid\n", np, grid.NumCells[0], grid.NumCells[1], grid.NumCells[2]);
+
+	grid.CellHead = (cl_int*)malloc(totalCells*sizeof(cl_int));
+	grid.NextInCell = (cl_int*)malloc(np*sizeof(cl_int));
+	grid.ParCell = (cl_int*)malloc(np*sizeof(cl_int));
+	int error = grid.CellHead == NULL || grid.NextInCell == NULL || grid.ParCell == NULL;
+	if (error) {
+		printf("Error: could not allocate the packing cell grid\n");
+	}
+	for (int c = 0; c < totalCells && !error; c++) {
+		grid.CellHead[c] = -1;
+	}
+
+	float scale = hostDat->PackingCompression > 0 ? PACKING_INITIAL_SCALE : 1.0f;
+
+	// Random sequential addition
+	for (int p = 0; p < np && !error; p++) {
+		int attempts = 0;
+		int parPlaced = 0;
+
+		while (parPlaced == 0) {
+
+			if (attempts++ == hostDat->PackingMaxAttempts) {
+				printf("Error: random sequential addition placed %d of %d particles, %d attempts for the next.\n",
+					p, np, hostDat->PackingMaxAttempts);
+				printf("Reduce num_particles/packing_volume_fraction, or use packing_compression_sweeps\n");
+				error = 1;
+				break;
+			}
+
+			cl_float4 testPos;
+			testPos.x = grid.Lo[0] + grid.Len[0]*(rand()/((float)RAND_MAX + 1.0f));
+			testPos.y = grid.Lo[1] + grid.Len[1]*(rand()/((float)RAND_MAX + 1.0f));
+			testPos.z = grid.Lo[2] + grid.Len[2]*(rand()/((float)RAND_MAX + 1.0f));
+			testPos.w = 0.0f;
+
+			if (!packing_overlap(&grid, parProps, parKinematics, p, testPos, scale, NULL)) {
+				parKinematics[p     ] = testPos;
+				parKinematics[p + np] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}};
+				packing_insert(&grid, p, testPos);
+				parPlaced = 1;
+			}
+		}
+	}
+
+	// Compression: grow when free of overlaps, otherwise push overlapping particles apart
+	int sweep = 0;
+	int numOverlaps = 0;
 
-		for (int fa = 0; fa < intDat->WorkGroupsPerParticle; fa++) {
-			parFluidForce[p + np*(2*fa)    ] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}}; // Force
-			parFluidForce[p + np*(2*fa + 1)] = (cl_float4){{0.0f, 0.0f, 0.0f, 0.0f}}; // Torque
+	while (!error && (scale < 1.0f || numOverlaps > 0) && sweep < hostDat->PackingCompression) {
+		sweep++;
+
+		if (numOverlaps == 0) {
+			scale = scale + PACKING_GROWTH < 1.0f ? scale + PACKING_GROWTH : 1.0f;
+		}
+
+		numOverlaps = 0;
+		for (int p = 0; p < np; p++) {
+			float push[3] = {0.0f, 0.0f, 0.0f};
+			packing_remove(&grid, p);
+
+			if (packing_overlap(&grid, parProps, parKinematics, p, parKinematics[p], scale, push)) {
+				numOverlaps++;
+
+				float x[3] = {parKinematics[p].x + push[0], parKinematics[p].y + push[1], parKinematics[p].z + push[2]};
+				for (int dim = 0; dim < 3; dim++) {
+					if (grid.Periodic[dim]) {
+						x[dim] = fmod(x[dim] + grid.Len[dim], grid.Len[dim]);
+					}
+					else {
+						x[dim] = x[dim] < grid.Lo[dim] ? grid.Lo[dim] : x[dim];
+						x[dim] = x[dim] > grid.Lo[dim] + grid.Len[dim] ? grid.Lo[dim] + grid.Len[dim] : x[dim];
+					}
+				}
+				parKinematics[p] = (cl_float4){{x[0], x[1], x[2], 0.0f}};
+			}
+			packing_insert(&grid, p, parKinematics[p]);
+		}
+	}
+
+	if (!error && (scale < 1.0f || numOverlaps > 0)) {
+		printf("Error: packing compression reached %f of the full particle size after %d sweeps.\n", scale, sweep);
+		printf("Increase packing_compression_sweeps or reduce num_particles/packing_volume_fraction\n");
+		error = 1;
+	}
+	else if (!error && sweep > 0) {
+		printf("Packing compression finished after %d sweeps\n", sweep);
+	}
+
+	free(grid.CellHead);
+	free(grid.NextInCell);
+	free(grid.ParCell);
+	return error;
+}
+
+int packing_cell(packing_grid_struct* grid, cl_float4 pos)
+{
+	float x[3] = {pos.x, pos.y, pos.z};
+	int c[3];
+
+	for (int dim = 0; dim < 3; dim++) {
+		c[dim] = (int)((x[dim] - grid->Lo[dim])/grid->CellWidth[dim]);
+		c[dim] = c[dim] < 0 ? 0 : c[dim];
+		c[dim] = c[dim] >= grid->NumCells[dim] ? grid->NumCells[dim]-1 : c[dim];
+	}
+
+	return c[0] + grid->NumCells[0]*(c[1] + grid->NumCells[1]*c[2]);
+}
+
+// Returns 1 if a particle at pos overlaps any particle in the grid (other than p), with diameters multiplied by
+// scale. If push is given, half of each overlap is added to it, directed away from the other particle
+int packing_overlap(packing_grid_struct* grid, cl_float4* parProps, cl_float4* parKinematics, int p, cl_float4 pos,
+	float scale, float* push)
+{
+	float x[3] = {pos.x, pos.y, pos.z};
+	int c[3], cLo[3], cHi[3];
+	int overlap = 0;
+
+	int cell = packing_cell(grid, pos);
+	c[0] = cell%grid->NumCells[0];
+	c[1] = (cell/grid->NumCells[0])%grid->NumCells[1];
+	c[2] = cell/(grid->NumCells[0]*grid->NumCells[1]);
+
+	// Neighbouring cells, every cell if fewer than 3 along an axis
+	for (int dim = 0; dim < 3; dim++) {
+		if (grid->NumCells[dim] < 3) {
+			cLo[dim] = 0;
+			cHi[dim] = grid->NumCells[dim]-1;
+		}
+		else if (grid->Periodic[dim]) {
+			cLo[dim] = c[dim]-1;
+			cHi[dim] = c[dim]+1;
+		}
+		else {
+			cLo[dim] = c[dim] > 0 ? c[dim]-1 : 0;
+			cHi[dim] = c[dim] < grid->NumCells[dim]-1 ? c[dim]+1 : c[dim];
+		}
+	}
+
+	for (int i = cLo[0]; i <= cHi[0]; i++) {
+		for (int j = cLo[1]; j <= cHi[1]; j++) {
+			for (int k = cLo[2]; k <= cHi[2]; k++) {
+
+				int ci = (i + grid->NumCells[0])%grid->NumCells[0];
+				int cj = (j + grid->NumCells[1])%grid->NumCells[1];
+				int ck = (k + grid->NumCells[2])%grid->NumCells[2];
+
+				for (int q = grid->CellHead[ci + grid->NumCells[0]*(cj + grid->NumCells[1]*ck)]; q >= 0; q = grid->NextInCell[q]) {
+
+					if (q == p) {
+						continue;
+					}
+
+					float xq[3] = {parKinematics[q].x, parKinematics[q].y, parKinematics[q].z};
+					float dx[3];
+					float sepSq = 0.0f;
+					for (int dim = 0; dim < 3; dim++) {
+						dx[dim] = x[dim] - xq[dim];
+						if (grid->Periodic[dim] && fabs(dx[dim]) > 0.5f*grid->Len[dim]) {
+							dx[dim] -= dx[dim] > 0.0f ? grid->Len[dim] : -grid->Len[dim];
+						}
+						sepSq += dx[dim]*dx[dim];
+					}
+
+					float contact = scale*0.5f*(parProps[p].x + parProps[q].x);
+					if (sepSq < contact*contact) {
+						overlap = 1;
+
+						if (push != NULL) {
+							float sep = sqrt(sepSq) > 1E-6f ? sqrt(sepSq) : 1E-6f;
+							for (int dim = 0; dim < 3; dim++) {
+								push[dim] += 0.5f*(PACKING_PUSH_MARGIN*contact - sep)*dx[dim]/sep;
+							}
+						}
+					}
+				}
+			}
 		}
 	}
 
+	return overlap;
+}
+
+void packing_insert(packing_grid_struct* grid, int p, cl_float4 pos)
+{
+	int cell = packing_cell(grid, pos);
+	grid->ParCell[p] = cell;
+	grid->NextInCell[p] = grid->CellHead[cell];
+	grid->CellHead[cell] = p;
+}
+
+void packing_remove(packing_grid_struct* grid, int p)
+{
+	int* link = &(grid->CellHead[grid->ParCell[p]]);
+	while (*link != p) {
+		link = &(grid->NextInCell[*link]);
+	}
+	*link = grid->NextInCell[p];
 }
 
-void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+// Zones are the same for every ensemble member (flpDat has one per member), the particle, thread and zone
+// lists are in one block per member, indexed with the member's own particle numbers.
+// Returns 1 if a particle lies outside the zones
+int initialize_particle_zones(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
 	cl_float4* parKinematics, cl_int* parsZone, cl_int** zoneMembers, cl_int** numParInZone, cl_int* threadMembers, cl_int* numParInThread,
 	cl_int** zoneNeighDat)
 {
 	// Calculate estimate of max particle relative speed
 	float vMax = 0.05f; // Guess
-	for (int i = 0; i < 3; i++) {
-		vMax = vMax < fabsf(flpDat->VelUpper[i]) ? fabsf(flpDat->VelUpper[i]) : vMax;
-		vMax = vMax < fabsf(flpDat->VelLower[i]) ? fabsf(flpDat->VelLower[i]) : vMax;
-		float nu = (flpDat->NewtonianTau-0.5f)/3.0f;
-		float vMaxNewt = flpDat->ConstBodyForce[i]*(intDat->SystemSize[i])*(intDat->SystemSize[i])/(12.0f*nu);
-		vMax = vMax < vMaxNewt ? vMaxNewt : vMax;
+	for (int m = 0; m < intDat->EnsembleSize; m++) {
+		flp_param_struct* member = &flpDat[m];
+		for (int i = 0; i < 3; i++) {
+			vMax = vMax < fabsf(member->VelUpper[i]) ? fabsf(member->VelUpper[i]) : vMax;
+			vMax = vMax < fabsf(member->VelLower[i]) ? fabsf(member->VelLower[i]) : vMax;
+			float nu = (member->NewtonianTau-0.5f)/3.0f;
+			float vMaxNewt = member->ConstBodyForce[i]*(intDat->SystemSize[i])*(intDat->SystemSize[i])/(12.0f*nu);
+			vMax = vMax < vMaxNewt ? vMaxNewt : vMax;
+		}
 	}
 	printf("\nEstimated max particle velocity = %f\n", vMax);
 	if (intDat->ViscosityModel != 0) {
@@ -360,7 +846,7 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 	}
 
 	// Compute neighbor zone width
-	float dMax = flpDat->ParticleDiam; // Monodisperse for now
+	float dMax = hostDat->MaxParticleDiam;
 	float minZoneWidth = 2*(vMax*hostDat->RebuildFreq) + dMax;
 	printf("\nMinimum particle neighbor zone width = %f\n", minZoneWidth);
 
@@ -372,6 +858,9 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 		flpDat->ZoneWidth[i] = w/(float)intDat->NumZones[i];
 		printf("Number of particle zones in dimension %d = %d\n", i, intDat->NumZones[i]);
 	}
+	for (int m = 1; m < intDat->EnsembleSize; m++) {
+		memcpy(flpDat[m].ZoneWidth, flpDat->ZoneWidth, sizeof(flpDat->ZoneWidth));
+	}
 	printf("\nActual particle neighbor zone width = %f x %f x %f\n", flpDat->ZoneWidth[0], flpDat->ZoneWidth[1], flpDat->ZoneWidth[2]);
 
 	// Assign particles to threads and zones
@@ -380,14 +869,27 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 
 	printf("Total number of zones = %d\n", totalNumZones);
 
-	*zoneMembers = (cl_int*)malloc(totalNumZones*intDat->NumParticles*sizeof(cl_int));
-	*numParInZone = (cl_int*)calloc(totalNumZones, sizeof(cl_int));
-	*zoneNeighDat = (cl_int*)calloc(28*totalNumZones, sizeof(cl_int));
+	int numMembers = intDat->EnsembleSize;
+	*zoneMembers = (cl_int*)malloc(numMembers*totalNumZones*intDat->NumParticles*sizeof(cl_int));
+	*numParInZone = (cl_int*)calloc(numMembers*totalNumZones, sizeof(cl_int));
+	// With Lees-Edwards, zones on the z boundaries neighbour every zone along x of the sliding image
+	intDat->ZoneNeighStride = 28;
+	if (intDat->LeesEdwards && 10 + 6*intDat->NumZones[0] > intDat->ZoneNeighStride) {
+		intDat->ZoneNeighStride = 10 + 6*intDat->NumZones[0];
+	}
+	int stride = intDat->ZoneNeighStride;
+
+	*zoneNeighDat = (cl_int*)calloc(stride*totalNumZones, sizeof(cl_int));
+
+	for (int i_p = 0; i_p < numMembers*intDat->NumParticles; i_p++) {
 
-	for (int p = 0; p < intDat->NumParticles; p++) {
+		// Particle p of member m, which has its own threads and zone lists
+		int m = i_p/intDat->NumParticles;
+		int p = i_p - m*intDat->NumParticles;
+		int memberZones = m*totalNumZones;
 
 		// Particles always belong to their initial thread
-		int thread = (int)(numParThreads*p)/intDat->NumParticles;
+		int thread = m*numParThreads + (int)(numParThreads*p)/intDat->NumParticles;
 		int np = numParInThread[thread]++;
 		threadMembers[thread*intDat->NumParticles + np] = p;
 		//printf("Particle %d belongs to thread %d\n", p, thread);
@@ -396,20 +898,20 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 		//printf("Particle %d has position ", p);
 		//printf("%f %f %f\n", parKinematics[p].x, parKinematics[p].y, parKinematics[p].z);
 
-		int zoneIDx = (int)(parKinematics[p].x/flpDat->ZoneWidth[0]);
-		int zoneIDy = (int)(parKinematics[p].y/flpDat->ZoneWidth[1]);
-		int zoneIDz = (int)(parKinematics[p].z/flpDat->ZoneWidth[2]);
+		int zoneIDx = (int)(parKinematics[4*m*intDat->NumParticles + p].x/flpDat->ZoneWidth[0]);
+		int zoneIDy = (int)(parKinematics[4*m*intDat->NumParticles + p].y/flpDat->ZoneWidth[1]);
+		int zoneIDz = (int)(parKinematics[4*m*intDat->NumParticles + p].z/flpDat->ZoneWidth[2]);
 		int zoneID = zoneIDx + intDat->NumZones[0]*(zoneIDy + intDat->NumZones[1]*zoneIDz);
 		
-		if (zoneID >= totalNumZones) {
-			perror("\nError: Particle out of bounds at zone initialization\n\n");
-			exit(0);
+		if (zoneID < 0 || zoneID >= totalNumZones) {
+			printf("Error: particle %d of member %d out of bounds at zone initialization\n", p, m);
+			return 1;
 		}
 
-		parsZone[p] = zoneID;
+		parsZone[i_p] = zoneID;
 		//printf("Particle %d is %d'th particle of zone %d (%d,%d,%d).\n", p, (*numParInZone)[zoneID], zoneID, zoneIDx, zoneIDy, zoneIDz);
 		
-		(*zoneMembers)[zoneID*intDat->NumParticles + (*numParInZone)[zoneID]++] = p;
+		(*zoneMembers)[(memberZones + zoneID)*intDat->NumParticles + (*numParInZone)[memberZones + zoneID]++] = p;
 
 	}
 
@@ -421,7 +923,7 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 			for (int i = 0; i < intDat->NumZones[0]; i++) {
 
 				int zoneID = i + intDat->NumZones[0]*(j + intDat->NumZones[1]*k);
-				(*zoneNeighDat)[28*zoneID] = 0;
+				(*zoneNeighDat)[stride*zoneID] = 0;
 
 				int lm = -1; int lp = 1; int mm = -1; int mp = 1; int nm = -1; int np = 1;
 
@@ -434,10 +936,15 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 				if (intDat->BoundaryConds[2] == 1 && k == intDat->NumZones[2]-1) {np = 0;}
 
 				for (int n = nm; n <= np; n++) {
+
+					// Across a Lees-Edwards boundary the image is offset along x by a changing amount
+					int crossLE = intDat->LeesEdwards && (k+n < 0 || k+n >= intDat->NumZones[2]);
+					int lStart = crossLE ? -i : lm;
+					int lEnd = crossLE ? intDat->NumZones[0]-1-i : lp;
 					//
 					for (int m = mm; m <= mp; m++) {
 						//
-						for (int l = lm; l <= lp; l++) {
+						for (int l = lStart; l <= lEnd; l++) {
 
 							// Shifted to neighbor location
 							int ls = i+l; int ms = j+m; int ns = k+n;
@@ -447,10 +954,10 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 							int mw = ms < 0 ? intDat->NumZones[1]-1 : ms%intDat->NumZones[1];
 							int nw = ns < 0 ? intDat->NumZones[2]-1 : ns%intDat->NumZones[2];
 
-							int neighID = lw + intDat->NumZones[0]*(mw + intDat->NumZones[2]*(nw));
+							int neighID = lw + intDat->NumZones[0]*(mw + intDat->NumZones[1]*(nw));
 
-							int numNeighs = ++((*zoneNeighDat)[zoneID*28]);
-							(*zoneNeighDat)[zoneID*28 + numNeighs] = neighID; 
+							int numNeighs = ++((*zoneNeighDat)[zoneID*stride]);
+							(*zoneNeighDat)[zoneID*stride + numNeighs] = neighID; 
 							
 							//printf("Zone %d (%d,%d,%d) has neighbor %d (%d,%d,%d)\n", zoneID,i,j,k, neighID,lw,mw,nw);
 							//printf("and num neighbors is %d\n", numNeighs);
@@ -460,10 +967,24 @@ void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* int
 			}
 		}
 	}
+
+	return 0;
+}
+
+// Build options for GPU_program.cl on a device. Lattice indices are 64-bit only where one buffer
+// can hold more than 2^31 floats, plan_device_memory keeps every buffer within that.
+void lattice_build_options(cl_device_id device, char* options, size_t size)
+{
+	cl_ulong maxAlloc = 0;
+	clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+	int index64 = maxAlloc/sizeof(cl_float) > INT_MAX;
+	snprintf(options, size, "-DLATTICE_BRICK=%d%s", LATTICE_BRICK, index64 ? " -DLATTICE_INDEX_64" : "");
+	if (index64) {
+		printf("64-bit lattice indices for device buffers of up to %llu MiB\n", (unsigned long long)(maxAlloc >> 20));
+	}
 }
 
-int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_context* contextPtr, cl_device_id* devices,
-	cl_program* programCPU, cl_program* programGPU)
+int create_LB_kernels(kernel_struct* kernelDat, cl_context* contextPtr, cl_device_id* devices, cl_program* programCPU, cl_program* programGPU)
 {
 	printf("Creating LB kernels\n");
 	char* programSourceCPU = NULL;
@@ -482,7 +1003,9 @@ int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_con
 		NULL, &error);
 	error_check(error, "clCreateProgramWithSource GPU", 1);
 
-	clBuildProgram(*programGPU, 1, &devices[1], NULL, NULL, &error);
+	char buildOptions[WORD_STRING_SIZE];
+	lattice_build_options(devices[1], buildOptions, WORD_STRING_SIZE);
+	clBuildProgram(*programGPU, 1, &devices[1], buildOptions, NULL, &error);
 	error_check(error, "clBuildProgram GPU", 1);
 	
 
@@ -520,6 +1043,30 @@ int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_con
 	if (error_check(error, "clCreateKernel reset_particle_fluid_forces", 1))
 		print_program_build_log(programGPU, &devices[1]);
 
+	kernelDat->plane_average_velocity = clCreateKernel(*programGPU, "plane_average_velocity", &error);
+	if (error_check(error, "clCreateKernel plane_average_velocity", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
+	kernelDat->gather_fluid_output = clCreateKernel(*programGPU, "gather_fluid_output", &error);
+	if (error_check(error, "clCreateKernel gather_fluid_output", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
+	kernelDat->accumulate_field_statistics = clCreateKernel(*programGPU, "accumulate_field_statistics", &error);
+	if (error_check(error, "clCreateKernel accumulate_field_statistics", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
+	kernelDat->profile_shear_rates = clCreateKernel(*programGPU, "profile_shear_rates", &error);
+	if (error_check(error, "clCreateKernel profile_shear_rates", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
+	kernelDat->initialize_lattice_fields = clCreateKernel(*programGPU, "initialize_lattice_fields", &error);
+	if (error_check(error, "clCreateKernel initialize_lattice_fields", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
+	kernelDat->spread_particle_forces_slab = clCreateKernel(*programGPU, "spread_particle_forces_slab", &error);
+	if (error_check(error, "clCreateKernel spread_particle_forces_slab", 1))
+		print_program_build_log(programGPU, &devices[1]);
+
 	// CPU
 	kernelDat->particle_dynamics = clCreateKernel(*programCPU, "particle_dynamics", &error);
 	if (error_check(error, "clCreateKernel particle_dynamics", 1))
@@ -529,10 +1076,27 @@ int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_con
 	if (error_check(error, "clCreateKernel particle_particle_forces", 1))
 		print_program_build_log(programCPU, &devices[0]);
 
+	kernelDat->particle_substep_kick_drift = clCreateKernel(*programCPU, "particle_substep_kick_drift", &error);
+	if (error_check(error, "clCreateKernel particle_substep_kick_drift", 1))
+		print_program_build_log(programCPU, &devices[0]);
+
+	kernelDat->particle_substep_kick = clCreateKernel(*programCPU, "particle_substep_kick", &error);
+	if (error_check(error, "clCreateKernel particle_substep_kick", 1))
+		print_program_build_log(programCPU, &devices[0]);
+
 	kernelDat->update_particle_zones = clCreateKernel(*programCPU, "update_particle_zones", &error);
 	if (error_check(error, "clCreateKernel update_particle_zones", 1))
 		print_program_build_log(programCPU, &devices[0]);
 
+	//clReleaseProgram(programCPU);
+	//clReleaseProgram(programGPU);
+
+	return 0;
+}
+
+// Surface points per work group of the particle-fluid force kernel, which depends on the particle sizes
+void particle_work_group_size(host_param_struct* hostDat, int_param_struct* intDat, kernel_struct* kernelDat, cl_device_id* devices)
+{
 	size_t actualWorkGrpSize;
 	clGetKernelWorkGroupInfo(kernelDat->particle_fluid_forces_linear_stencil, devices[1],
 		CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &actualWorkGrpSize, NULL);
@@ -545,21 +1109,24 @@ int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_con
 	}
 	printf("Max work group size of fluid-particle kernel = %d.\n", workSize);
 
-	intDat->PointsPerWorkGroup = workSize > intDat->PointsPerParticle ? intDat->PointsPerParticle : workSize;
-	
-	intDat->WorkGroupsPerParticle = (cl_int)ceil(intDat->PointsPerParticle/intDat->PointsPerWorkGroup);
-	
-	//clReleaseProgram(programCPU);
-	//clReleaseProgram(programGPU);
-
-	return 0;
+	// Work groups must not straddle two particles, so no bigger than the smallest particle
+	while (workSize > 1 && workSize > hostDat->MinPointsPerParticle) {
+		workSize /= 2;
+	}
+	intDat->PointsPerWorkGroup = workSize;
 }
 
-void sphere_discretization(int_param_struct* intDat, flp_param_struct* flpDat, cl_float4** spherePoints)
+// Number of surface points for a particle. From the partition files, power of 2 with num points > surface area
+// in lattice units. When generated, any number of points, at surface_point_density per unit area
+int surface_points_for_diameter(host_param_struct* hostDat, float diam)
 {
-	// Calculated surface area
-	float d = flpDat->ParticleDiam;
-	float area = M_PI*d*d;
+	float area = M_PI*diam*diam;
+
+	if (hostDat->SurfPointGenerator) {
+		int numGenerated = (int)ceil(hostDat->SurfPointDensity*area);
+		return numGenerated < SPHERE_MIN_POINTS ? SPHERE_MIN_POINTS : numGenerated;
+	}
+
 	int numPoints = 1;
 	int power2 = (int)ceil(log2(area));
 
@@ -570,17 +1137,15 @@ void sphere_discretization(int_param_struct* intDat, flp_param_struct* flpDat, c
 	numPoints = numPoints < 128 ? 128 : numPoints;
 	numPoints = numPoints > 1024 ? 1024 : numPoints;
 
-	printf("Number of surface points per particle = %d.\n", numPoints);
-	*spherePoints = (cl_float4*)malloc(numPoints*sizeof(cl_float4));
-	intDat->PointsPerParticle = numPoints;
-	intDat->TotalSurfPoints = numPoints*intDat->NumParticles;
-	flpDat->PointArea = area/(float)numPoints;
-	printf("Surface area per point = %f.\n", flpDat->PointArea);
+	return numPoints;
+}
 
-	// Take discretization with num nodes > surface area in lattice units
-	char sphereFilename[128];
+// Read unit sphere points (not scaled by particle radius), returns 1 if the file is missing or malformed
+int read_sphere_partition(const char* resourceDir, int numPoints, cl_float4* spherePoints)
+{
+	char sphereFilename[2*WORD_STRING_SIZE];
 	char sphereFolder[] = "unit_sphere_partitions/";
-	sprintf(sphereFilename, "%s%s%d%s", sphereFolder, "unit_sphere_partition_", numPoints, ".txt");
+	snprintf(sphereFilename, sizeof(sphereFilename), "%s%s%s%d%s", resourceDir, sphereFolder, "unit_sphere_partition_", numPoints, ".txt");
 	printf("Reading sphere discretization from %s\n", sphereFilename);
 
 	FILE* fs;
@@ -588,53 +1153,274 @@ void sphere_discretization(int_param_struct* intDat, flp_param_struct* flpDat, c
 	if (fs == NULL) {
 		printf("%s not opened\n", sphereFilename);
 	    perror("Failed opening sphere discretization file !");
+		return 1;
 	}
 
 	float px, py, pz;
 
 	for(int n=0; n<numPoints; n++) {
-		fscanf(fs, "%f,%f,%f\n", &px, &py, &pz);
+		int numRead = fscanf(fs, "%f,%f,%f\n", &px, &py, &pz);
 		float lenSq = px*px + py*py + pz*pz;
-		if ( !(lenSq < 1.01 && lenSq > 0.99) ) {
-			perror("\nError: malformed coordinates read in sphere discretization\n\n");
-			exit(0);
-		}
-		px *= 0.5f*flpDat->ParticleDiam; // Scale points (from unit sphere) by particle radius
-		py *= 0.5f*flpDat->ParticleDiam;
-		pz *= 0.5f*flpDat->ParticleDiam;
-		(*spherePoints)[n] = (cl_float4){{px, py, pz, 0.0f}};
+		if (numRead != 3 || !(lenSq < 1.01 && lenSq > 0.99) ) {
+			printf("Error: malformed coordinates read in sphere discretization %s\n", sphereFilename);
+			fclose(fs);
+			return 1;
+		}
+		spherePoints[n] = (cl_float4){{px, py, pz, 0.0f}};
 		//printf("Sphere point %d read %f,%f,%f\n", n, px, py, pz);
 	}
 
 	fclose(fs);
+	return 0;
 }
 
-int process_input_line(char* fLine, input_data_struct* inputDefaults, int inputDefaultSize)
+// Equal-area spiral points on the unit sphere (generalised Fibonacci lattice). Each point sits at the
+// centre of a band of equal area in z, rotated by the golden angle from the previous point
+void generate_sphere_points(int numPoints, cl_float4* spherePoints)
 {
-	for (int l=0; l<inputDefaultSize; l++)
-	{
-		// Search for match
-		char* searchPtr = strstr(fLine, (inputDefaults+l)->keyword);
+	printf("Generating %d sphere points\n", numPoints);
 
-		if (searchPtr)
-		{
-			//printf("%s %s\n", "Found input file line ", (inputDefaults+l)->keyword);
+	double goldenAngle = M_PI*(3.0 - sqrt(5.0));
 
-			// Cast as appropriate data types
-			if ((inputDefaults+l)->dataType == TYPE_INT)
-			{
-				cl_int valueInt;
-				sscanf(fLine, "%*s %d", &valueInt);
-				memcpy( (inputDefaults+l)->varPtr, &valueInt, sizeof(cl_int));
-			}
-			else if ((inputDefaults+l)->dataType == TYPE_FLOAT)
-			{
-				cl_float valueFloat;
-				sscanf(fLine, "%*s %f", &valueFloat);
-				memcpy( (inputDefaults+l)->varPtr, &valueFloat, sizeof(cl_float));
-			}
-			else if ((inputDefaults+l)->dataType == TYPE_INT_3VEC)
-			{
+	for (int n = 0; n < numPoints; n++) {
+		double z = 1.0 - (2.0*n + 1.0)/(double)numPoints;
+		double rxy = sqrt(1.0 - z*z);
+		double phi = goldenAngle*n;
+
+		spherePoints[n] = (cl_float4){{(cl_float)(rxy*cos(phi)), (cl_float)(rxy*sin(phi)), (cl_float)z, 0.0f}};
+	}
+}
+
+// Binary cache of generated points: magic, number of points, then x,y,z for each point
+// Returns 1 if the cache exists and is valid
+int read_sphere_points_cache(const char* resourceDir, int numPoints, cl_float4* spherePoints)
+{
+	char cacheFilename[2*WORD_STRING_SIZE];
+	snprintf(cacheFilename, sizeof(cacheFilename), "%s%s%d%s", resourceDir, "unit_sphere_partitions/unit_sphere_points_", numPoints, ".bin");
+
+	size_t cacheSize = 2*sizeof(cl_int) + 3*numPoints*sizeof(cl_float);
+	cl_int* cacheDat = NULL;
+
+#ifndef _WIN32
+	int fd = open(cacheFilename, O_RDONLY);
+	if (fd < 0) {
+		return 0;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size != cacheSize) {
+		close(fd);
+		return 0;
+	}
+	void* mapped = mmap(NULL, cacheSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		return 0;
+	}
+	cacheDat = (cl_int*)mapped;
+#else
+	FILE* fc = fopen(cacheFilename, "rb");
+	if (fc == NULL) {
+		return 0;
+	}
+	cacheDat = (cl_int*)malloc(cacheSize);
+	size_t numRead = fread(cacheDat, 1, cacheSize, fc);
+	fclose(fc);
+	if (numRead != cacheSize) {
+		free(cacheDat);
+		return 0;
+	}
+#endif
+
+	int valid = (cacheDat[0] == SPHERE_CACHE_MAGIC && cacheDat[1] == numPoints);
+
+	if (valid) {
+		printf("Reading sphere points from %s\n", cacheFilename);
+		cl_float* xyz = (cl_float*)(cacheDat + 2);
+		for (int n = 0; n < numPoints; n++) {
+			spherePoints[n] = (cl_float4){{xyz[3*n], xyz[3*n+1], xyz[3*n+2], 0.0f}};
+		}
+	}
+
+#ifndef _WIN32
+	munmap(cacheDat, cacheSize);
+#else
+	free(cacheDat);
+#endif
+
+	return valid;
+}
+
+// Written to a temporary file first, so a concurrent run never reads a partly written cache
+void write_sphere_points_cache(const char* resourceDir, int numPoints, cl_float4* spherePoints)
+{
+	char cacheFilename[2*WORD_STRING_SIZE];
+	snprintf(cacheFilename, sizeof(cacheFilename), "%s%s%d%s", resourceDir, "unit_sphere_partitions/unit_sphere_points_", numPoints, ".bin");
+	char tempName[2*WORD_STRING_SIZE+4];
+	snprintf(tempName, sizeof(tempName), "%s.tmp", cacheFilename);
+
+	FILE* fc = fopen(tempName, "wb");
+	if (fc == NULL) {
+		printf("Warning: could not write sphere point cache %s\n", cacheFilename);
+		return;
+	}
+
+	cl_int header[2] = {SPHERE_CACHE_MAGIC, numPoints};
+	int error = fwrite(header, sizeof(cl_int), 2, fc) != 2;
+
+	for (int n = 0; n < numPoints && !error; n++) {
+		cl_float xyz[3] = {spherePoints[n].x, spherePoints[n].y, spherePoints[n].z};
+		error |= fwrite(xyz, sizeof(cl_float), 3, fc) != 3;
+	}
+	error |= fclose(fc) != 0;
+
+#ifdef _WIN32
+	if (!error) {
+		remove(cacheFilename); // rename does not replace on Windows
+	}
+#endif
+	if (error || rename(tempName, cacheFilename) != 0) {
+		printf("Warning: could not write sphere point cache %s\n", cacheFilename);
+		remove(tempName);
+	}
+}
+
+// Choose a point set for each particle, with each distinct set read once
+// parSphereSet: offset into spherePoints, then number of points, for each particle.
+// Returns 1 if a point set could not be read
+int sphere_discretization(host_param_struct* hostDat, int_param_struct* intDat, cl_float4* parProps,
+	cl_float4** spherePoints, cl_int* parSphereSet)
+{
+	int np = intDat->NumParticles;
+
+	int setSize[SPHERE_MAX_SETS];
+	int setOffset[SPHERE_MAX_SETS];
+	int numSets = 0;
+
+	hostDat->NumSpherePoints = 0;
+	hostDat->MinPointsPerParticle = 0;
+	*spherePoints = NULL;
+
+	for (int p = 0; p < np; p++) {
+
+		float d = parProps[p].x;
+		int numPoints = surface_points_for_diameter(hostDat, d);
+
+		// Look for a set already read
+		int set = 0;
+		while (set < numSets && setSize[set] != numPoints) {
+			set++;
+		}
+
+		if (set == numSets) {
+			if (numSets == SPHERE_MAX_SETS) {
+				printf("Error: more than %d distinct sphere discretizations needed\n", SPHERE_MAX_SETS);
+				return 1;
+			}
+			setSize[set] = numPoints;
+			setOffset[set] = hostDat->NumSpherePoints;
+			numSets++;
+
+			hostDat->NumSpherePoints += numPoints;
+			cl_float4* grown = (cl_float4*)realloc(*spherePoints, hostDat->NumSpherePoints*sizeof(cl_float4));
+			if (grown == NULL) {
+				printf("Error: could not allocate %d sphere points\n", hostDat->NumSpherePoints);
+				return 1;
+			}
+			*spherePoints = grown;
+			if (!hostDat->SurfPointGenerator) {
+				if (read_sphere_partition(hostDat->ResourceDir, numPoints, *spherePoints + setOffset[set])) {
+					return 1;
+				}
+			}
+			else if (!read_sphere_points_cache(hostDat->ResourceDir, numPoints, *spherePoints + setOffset[set])) {
+				generate_sphere_points(numPoints, *spherePoints + setOffset[set]);
+				write_sphere_points_cache(hostDat->ResourceDir, numPoints, *spherePoints + setOffset[set]);
+			}
+
+			printf("Number of surface points for diameter %f = %d.\n", d, numPoints);
+		}
+
+		parSphereSet[p] = setOffset[set];
+		parSphereSet[p + np] = numPoints;
+
+		if (hostDat->MinPointsPerParticle == 0 || numPoints < hostDat->MinPointsPerParticle) {
+			hostDat->MinPointsPerParticle = numPoints;
+		}
+
+		// Surface area per point
+		parProps[p].w = M_PI*d*d/(float)numPoints;
+	}
+
+	if (np > 0) {
+		printf("Surface area per point (particle 0) = %f.\n", parProps[0].w);
+	}
+
+	return 0;
+}
+
+// CSR layout of surface points: each particle's points start at parSurfOffset[p], padded to a whole
+// number of work groups. surfPointMap holds the particle (-1 for padding), then the sphere point, of each point
+void create_surface_point_layout(int_param_struct* intDat, cl_int* parSphereSet,
+	cl_int** parSurfOffset, cl_int** surfPointMap)
+{
+	int np = intDat->NumParticles;
+	int wg = intDat->PointsPerWorkGroup;
+
+	*parSurfOffset = (cl_int*)malloc((np+1)*sizeof(cl_int));
+
+	(*parSurfOffset)[0] = 0;
+	for (int p = 0; p < np; p++) {
+		int numPadded = wg*(1 + (parSphereSet[p + np]-1)/wg);
+		(*parSurfOffset)[p+1] = (*parSurfOffset)[p] + numPadded;
+	}
+
+	int totalPoints = (*parSurfOffset)[np];
+	intDat->TotalSurfPoints = totalPoints;
+	intDat->TotalWorkGroups = totalPoints/wg;
+
+	*surfPointMap = (cl_int*)malloc((totalPoints > 0 ? 2*totalPoints : 1)*sizeof(cl_int));
+
+	for (int p = 0; p < np; p++) {
+		for (int i = (*parSurfOffset)[p]; i < (*parSurfOffset)[p+1]; i++) {
+
+			int n = i - (*parSurfOffset)[p];
+			int isPoint = n < parSphereSet[p + np];
+
+			(*surfPointMap)[i              ] = isPoint ? p : -1;
+			(*surfPointMap)[i + totalPoints] = isPoint ? parSphereSet[p] + n : 0;
+		}
+	}
+
+	printf("Total surface points = %d (including padding), in %d work groups.\n",
+		totalPoints, intDat->TotalWorkGroups);
+}
+
+int process_input_line(char* fLine, input_data_struct* inputDefaults, int inputDefaultSize)
+{
+	for (int l=0; l<inputDefaultSize; l++)
+	{
+		// Search for match
+		char* searchPtr = strstr(fLine, (inputDefaults+l)->keyword);
+
+		if (searchPtr)
+		{
+			//printf("%s %s\n", "Found input file line ", (inputDefaults+l)->keyword);
+
+			// Cast as appropriate data types
+			if ((inputDefaults+l)->dataType == TYPE_INT)
+			{
+				cl_int valueInt;
+				sscanf(fLine, "%*s %d", &valueInt);
+				memcpy( (inputDefaults+l)->varPtr, &valueInt, sizeof(cl_int));
+			}
+			else if ((inputDefaults+l)->dataType == TYPE_FLOAT)
+			{
+				cl_float valueFloat;
+				sscanf(fLine, "%*s %f", &valueFloat);
+				memcpy( (inputDefaults+l)->varPtr, &valueFloat, sizeof(cl_float));
+			}
+			else if ((inputDefaults+l)->dataType == TYPE_INT_3VEC)
+			{
 				cl_int value3VecInt[3];
 				sscanf(fLine, "%*s %d %d %d", value3VecInt, value3VecInt+1, value3VecInt+2);
 				memcpy( (inputDefaults+l)->varPtr, value3VecInt, sizeof(cl_float)*3);
@@ -667,114 +1453,270 @@ int process_input_line(char* fLine, input_data_struct* inputDefaults, int inputD
 	return 0;
 }
 
-void compute_shear_stress(output_data_struct* outDat, host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-	cl_float* u_h, cl_float* tau_lb_h, int frame)
+// Uses a plane-averaged velocity profile from the plane_average_velocity and profile_shear_rates kernels
+// Row 0 (buffer layer) holds the wall shear rate and the shear rate in the particle region
+// Returns 1 if the shear rate controller changed the wall velocities
+int compute_shear_stress(output_data_struct* outDat, host_param_struct* hostDat, int_param_struct* intDat,
+	flp_param_struct* flpDat, cl_float* uProfile, int frame, int member)
 {
-	// Write fluid
-	int n_x = intDat->LatticeSize[0];
-	int n_y = intDat->LatticeSize[1];
 	int n_z = intDat->LatticeSize[2];
-	int n_L = n_x*n_y*n_z;
-
-	FILE* fPtr;
-	fPtr = fopen ("velocity_profile_z.txt","w");
 
-	int gradBuffer = 1; // Additional buffer to add before starting finite-difference derivatives
+	char fileName[WORD_STRING_SIZE];
+	ensemble_file_name(fileName, WORD_STRING_SIZE, "velocity_profile_z", "txt", intDat, member);
 
-	cl_float n_xy = (cl_float)(n_x-2)*(n_y-2);
-
-	cl_float* uMeanX = calloc(n_z, sizeof(cl_float));
-	cl_float dudzMean = 0.0;
-	
-	// Forwards difference from lower and upper boundary
-	//cl_float dudzL = 0.0f;
-	//cl_float dudzU = 0.0f;
-	float dz = 4.0f;
+	FILE* fPtr;
+	fPtr = fopen (fileName,"w");
 
 	for(int i_z=1; i_z < n_z-1; i_z++) {
+		fprintf(fPtr, "%8.6f %8.6f %8.6f\n", uProfile[3*i_z], uProfile[3*i_z + 1], uProfile[3*i_z + 2]);
+	}
 
-		cl_float uMean[3] = {0.0f, 0.0f, 0.0f};
-		//
-		for(int i_x=1; i_x < n_x-1; i_x++) {
-			for(int i_y=1; i_y < n_y-1; i_y++) {
+	cl_float dudzMean = uProfile[0];
+	cl_float actualShearRate = uProfile[1];
 
-				int i_1D = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*i_z);
-				
-				uMean[0] += u_h[i_1D];
-				uMean[1] += u_h[i_1D + n_L];
-				uMean[2] += u_h[i_1D + 2*n_L];
+	fclose(fPtr);
 
-				if (i_z == (1+dz+gradBuffer)) {
-					//
-					int i_1D_fd = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*(i_z-dz));
-					dudzMean += (u_h[i_1D]-u_h[i_1D_fd])/dz;
-				}
-				else if (i_z == (n_z-2-gradBuffer)) {
-					//
-					int i_1D_fd = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*(i_z-dz));
-					dudzMean += (u_h[i_1D]-u_h[i_1D_fd])/dz;
-				}
-			}
-		}
-		uMean[0] /= n_xy; uMeanX[i_z] = uMean[0];
-		uMean[1] /= n_xy;
-		uMean[2] /= n_xy;
-		
-		fprintf(fPtr, "%8.6f %8.6f %8.6f\n", uMean[0], uMean[1], uMean[2]);
+	int wallsChanged = intDat->MaintainShear ? control_shear_rate(hostDat, flpDat, actualShearRate) : 0;
 
+	// With the convergence monitor or shear rate controller on, profiles are taken from the
+	// start of the run, but the running averages still only cover the last quarter
+	if (hostDat->ConvergeWindow > 0) {
+		update_convergence(outDat, hostDat, dudzMean, actualShearRate, frame);
 	}
-	
-	dudzMean /= (2.0*n_xy); // 2.0 because derivative at top and bottom wall were added
-	
+	if (frame <= 3*intDat->MaxIterations/4) {
+		return wallsChanged;
+	}
+
 	// Output counter (for averaging)
 	int count = ++(outDat->ShearStressCount);
-	
-	// Average of upper and lower shear
-	//cl_float dudz = 0.5f*(dudzU + dudzL);
-	
-			
+
 	outDat->ShearStressAvg = (outDat->ShearStressAvg*(count-1) + dudzMean)/count;
+	if (intDat->EnsembleSize > 1) {
+		printf("Member %d: ", member);
+	}
 	printf("Shear rate at wall = %e\n", outDat->ShearStressAvg);
-			
-	int intBuffer = (int)(flpDat->ParticleZBuffer + 1E-8) + (int)(flpDat->ParticleDiam/2); // 
-	int zbL = 1+intBuffer;
-	int zbU = (int)(n_z-2 - intBuffer);
-	
-	cl_float actualShearRate = (uMeanX[zbU] - uMeanX[zbL])/(zbU-zbL);
-	//actualShearRate = abs(actualShearRate);
-		
+
 	outDat->ActualShearRate = (outDat->ActualShearRate*(count-1) + actualShearRate)/count;
+	if (intDat->EnsembleSize > 1) {
+		printf("Member %d: ", member);
+	}
 	printf("Shear rate in particle region = %e\n", outDat->ActualShearRate);
-	
-	fclose(fPtr);
+
+	return wallsChanged;
+}
+
+// Integral control of the particle-region shear rate: both wall velocities are scaled by
+// 1 + gain*(relative error) after each sample, limited per update and in wall speed
+int control_shear_rate(host_param_struct* hostDat, flp_param_struct* flpDat, cl_float parRate)
+{
+	cl_float target = hostDat->TargetShearRate;
+	cl_float scale = 1.0f + hostDat->ShearControlGain*(target - parRate)/target;
+	scale = fminf(fmaxf(scale, 1.0f/SHEAR_CONTROL_MAX_STEP), SHEAR_CONTROL_MAX_STEP);
+
+	cl_float wallSpeed = 0.0f;
+	for (int d = 0; d < 3; d++) {
+		wallSpeed = fmaxf(wallSpeed, fmaxf(fabsf(flpDat->VelUpper[d]), fabsf(flpDat->VelLower[d])));
+	}
+	if (wallSpeed*scale > SHEAR_CONTROL_MAX_VELOCITY) {
+		scale = SHEAR_CONTROL_MAX_VELOCITY/wallSpeed;
+		printf("Warning: wall velocities held at the controller limit of %f\n", SHEAR_CONTROL_MAX_VELOCITY);
+	}
+	if (scale == 1.0f) {
+		return 0;
+	}
+
+	for (int d = 0; d < 3; d++) {
+		flpDat->VelUpper[d] *= scale;
+		flpDat->VelLower[d] *= scale;
+	}
+	printf("Shear rate in particle region %e, target %e: wall velocity x %f -> upper %f, lower %f\n",
+		parRate, target, scale, flpDat->VelUpper[0], flpDat->VelLower[0]);
+
+	return 1;
+}
+
+// Update only the wall velocities (VelUpper, VelLower are adjacent) in the device flpDat
+cl_int write_wall_velocities(cl_command_queue queue, cl_mem flpDat_cl, flp_param_struct* flpDat)
+{
+	size_t offset = offsetof(flp_param_struct, VelUpper);
+	size_t size = offsetof(flp_param_struct, VelLower) + sizeof(flpDat->VelLower) - offset;
+
+	return clEnqueueWriteBuffer(queue, flpDat_cl, CL_TRUE, offset, size, (char*)flpDat + offset, 0, NULL, NULL);
+}
+
+// Converged when, for both shear rates over the window, the standard error (from batch means,
+// as successive samples are correlated) and the drift between the window halves are both
+// within the tolerance, relative to the window mean
+void update_convergence(output_data_struct* outDat, host_param_struct* hostDat, cl_float wallRate, cl_float parRate, int frame)
+{
+	if (outDat->ConvergedFrame > 0) {
+		return;
+	}
+
+	int window = hostDat->ConvergeWindow;
+	int i_new = outDat->NumShearSamples%window;
+	outDat->RecentShear[0][i_new] = wallRate;
+	outDat->RecentShear[1][i_new] = parRate;
+	outDat->NumShearSamples++;
+
+	if (outDat->NumShearSamples < window) {
+		return;
+	}
+
+	int i_oldest = outDat->NumShearSamples%window;
+	int batchSize = window/CONVERGE_BATCHES;
+	int converged = 1;
+	float mean[2], stdErr[2];
+
+	for (int k = 0; k < 2; k++) {
+		double batchMean[CONVERGE_BATCHES];
+		double sum = 0.0;
+		for (int b = 0; b < CONVERGE_BATCHES; b++) {
+			batchMean[b] = 0.0;
+			for (int j = b*batchSize; j < (b+1)*batchSize; j++) {
+				batchMean[b] += outDat->RecentShear[k][(i_oldest + j)%window];
+			}
+			batchMean[b] /= batchSize;
+			sum += batchMean[b];
+		}
+		double m = sum/CONVERGE_BATCHES;
+
+		double var = 0.0, firstHalf = 0.0, secondHalf = 0.0;
+		for (int b = 0; b < CONVERGE_BATCHES; b++) {
+			var += (batchMean[b] - m)*(batchMean[b] - m);
+			if (b < CONVERGE_BATCHES/2) {
+				firstHalf += batchMean[b];
+			}
+			else {
+				secondHalf += batchMean[b];
+			}
+		}
+		double se = sqrt(var/(CONVERGE_BATCHES-1)/CONVERGE_BATCHES);
+		double drift = fabs(firstHalf - secondHalf)/(CONVERGE_BATCHES/2);
+		double tol = hostDat->ConvergeTolerance*fabs(m);
+
+		mean[k] = (float)m;
+		stdErr[k] = (float)se;
+		converged &= se <= tol && drift <= tol;
+	}
+
+	if (converged) {
+		outDat->ConvergedFrame = frame;
+		for (int k = 0; k < 2; k++) {
+			outDat->ConvergedMean[k] = mean[k];
+			outDat->ConvergedStdErr[k] = stdErr[k];
+		}
+	}
+}
+
+// Number of fluid nodes in the subsampled output (every fluid_ouput_spacing'th interior node)
+int fluid_output_count(host_param_struct* hostDat, int_param_struct* intDat)
+{
+	int n_s = hostDat->FluidOutputSpacing;
+	return (1+(intDat->LatticeSize[0]-3)/n_s)*(1+(intDat->LatticeSize[1]-3)/n_s)*(1+(intDat->LatticeSize[2]-3)/n_s);
+}
+
+// Per-member output files of an ensemble run get a _m<member> suffix
+void ensemble_file_name(char* name, size_t size, const char* base, const char* ext, int_param_struct* intDat, int member)
+{
+	if (intDat->EnsembleSize > 1) {
+		snprintf(name, size, "%s_m%d.%s", base, member, ext);
+	}
+	else {
+		snprintf(name, size, "%s.%s", base, ext);
+	}
+}
+
+// Parameters of each ensemble member start from the input file values. Lines of ensemble_file
+// override them per member, as "<member> <keyword> <values>", for the keywords below.
+// particle_seed seeds rand() for the member's initial particle positions, 1+member by default
+// (member 0 then places them as an unseeded run does)
+int read_ensemble_members(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* members, cl_int* parSeeds)
+{
+	for (int m = 0; m < intDat->EnsembleSize; m++) {
+		members[m] = members[0];
+		parSeeds[m] = 1+m;
+	}
+	if (strcmp(hostDat->EnsembleFile, "none") == 0) {
+		return 0;
+	}
+
+	FILE* ifp = fopen(hostDat->EnsembleFile, "r");
+	if (ifp == NULL) {
+		perror(hostDat->EnsembleFile);
+		return 1;
+	}
+
+	flp_param_struct memberDat;
+	cl_int memberSeed;
+	input_data_struct memberInputs[] = {
+		{"constant_body_force", TYPE_FLOAT_3VEC, &(memberDat.ConstBodyForce), ""},
+		{"newtonian_tau", TYPE_FLOAT, &(memberDat.NewtonianTau), ""},
+		{"viscosity_params", TYPE_FLOAT_4VEC, &(memberDat.ViscosityParams), ""},
+		{"velocity_bc_upper", TYPE_FLOAT_3VEC, &(memberDat.VelUpper), ""},
+		{"velocity_bc_lower", TYPE_FLOAT_3VEC, &(memberDat.VelLower), ""},
+		{"particle_seed", TYPE_INT, &memberSeed, ""}
+	};
+	int memberInputSize = sizeof(memberInputs)/sizeof(memberInputs[0]);
+
+	char fLine[128];
+	while(fgets(fLine, sizeof(fLine), ifp)!=NULL) {
+		int m, lineStart;
+		if (sscanf(fLine, "%d %n", &m, &lineStart) != 1) {
+			continue;
+		}
+		if (m < 0 || m >= intDat->EnsembleSize) {
+			printf("Warning: %s names member %d, ensemble_size is %d\n", hostDat->EnsembleFile, m, intDat->EnsembleSize);
+			continue;
+		}
+		memberDat = members[m];
+		memberSeed = parSeeds[m];
+		process_input_line(fLine + lineStart, memberInputs, memberInputSize);
+		members[m] = memberDat;
+		parSeeds[m] = memberSeed;
+	}
+	fclose(ifp);
+
+	for (int m = 0; m < intDat->EnsembleSize; m++) {
+		printf("Member %d: tau %f, velocity_bc_upper %f %f %f, velocity_bc_lower %f %f %f\n", m, members[m].NewtonianTau,
+			members[m].VelUpper[0], members[m].VelUpper[1], members[m].VelUpper[2],
+			members[m].VelLower[0], members[m].VelLower[1], members[m].VelLower[2]);
+	}
+
+	return 0;
 }
 
-void continuous_output(host_param_struct* hostDat, int_param_struct* intDat, cl_float* u_h, cl_float4* parKin, FILE* vidPtr, int frame)
+// Fluid columns from gather_fluid_output: u_x, u_y, u_z (then |vorticity| if output_vorticity)
+void continuous_output(host_param_struct* hostDat, int_param_struct* intDat, cl_float* fluidCols, cl_float4* parKin, FILE* vidPtr, int frame)
 {
 	// Write fluid
 	int n_x = intDat->LatticeSize[0];
 	int n_y = intDat->LatticeSize[1];
 	int n_z = intDat->LatticeSize[2];
 	int n_s = hostDat->FluidOutputSpacing; // for float division
-	int n_L = n_x*n_y*n_z;
 
-	int n_fluid = (int)(1+(n_x-3)/n_s)*(1+(n_y-3)/n_s)*(1+(n_z-3)/n_s);
+	int n_fluid = fluid_output_count(hostDat, intDat);
 	int n_par = intDat->NumParticles;
 
 	fprintf(vidPtr, "%d\n", n_fluid+n_par);
 	fprintf(vidPtr, "D3Q19_output, frame %d\n", frame);
 
+	int i_f = 0;
 	for(int i_x=1; i_x < n_x-1; i_x += n_s) {
 		for(int i_y=1; i_y < n_y-1; i_y += n_s) {
 			for(int i_z=1; i_z < n_z-1; i_z += n_s) {
 
-				int i_1D = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*i_z);
-
 				// Index, then velocity
 				fprintf(vidPtr, "1 "); // Fluid nodes type 1
 				fprintf(vidPtr, "%d %d %d ", i_x-1, i_y-1, i_z-1);
-				fprintf(vidPtr, "%8.6f %8.6f %8.6f\n", u_h[i_1D],  u_h[i_1D + n_L],  u_h[i_1D + 2*n_L]);
-
+				if (hostDat->OutputVorticity) {
+					fprintf(vidPtr, "%8.6f %8.6f %8.6f %8.6f\n", fluidCols[i_f], fluidCols[i_f + n_fluid], fluidCols[i_f + 2*n_fluid],
+						fluidCols[i_f + 3*n_fluid]);
+				}
+				else {
+					fprintf(vidPtr, "%8.6f %8.6f %8.6f\n", fluidCols[i_f], fluidCols[i_f + n_fluid], fluidCols[i_f + 2*n_fluid]);
+				}
+				i_f++;
 			}
 		}
 	}
@@ -785,63 +1727,617 @@ void continuous_output(host_param_struct* hostDat, int_param_struct* intDat, cl_
 		// Index, then velocity
 		fprintf(vidPtr, "2 "); // Particles type 2
 		fprintf(vidPtr, "%.2f %.2f %.2f ", parKin[p].x, parKin[p].y, parKin[p].z);
-		fprintf(vidPtr, "%8.6f %8.6f %8.6f\n", parKin[p+n_par].x, parKin[p+n_par].y, parKin[p+n_par].z);
-
+		if (hostDat->OutputVorticity) {
+			fprintf(vidPtr, "%8.6f %8.6f %8.6f %8.6f\n", parKin[p+n_par].x, parKin[p+n_par].y, parKin[p+n_par].z, 0.0f);
+		}
+		else {
+			fprintf(vidPtr, "%8.6f %8.6f %8.6f\n", parKin[p+n_par].x, parKin[p+n_par].y, parKin[p+n_par].z);
+		}
 	}
 
 }
 
-int write_lattice_field(cl_float* field, int_param_struct* intDat)
+// Returns 1, with nothing left open, if the file, its buffers or the writer thread could not be set up
+int trajectory_writer_open(trajectory_writer_struct* writer, host_param_struct* hostDat, int_param_struct* intDat,
+	const char* fileName, int resumeFrame)
 {
-	FILE* fPtr;
-	fPtr = fopen ("velocity_field_final.txt","w");
+	trajectory_header_struct* header = &(writer->Header);
+	header->Magic = TRAJ_MAGIC;
+	header->Version = TRAJ_VERSION;
+	header->LatticeSize[0] = intDat->LatticeSize[0];
+	header->LatticeSize[1] = intDat->LatticeSize[1];
+	header->LatticeSize[2] = intDat->LatticeSize[2];
+	header->OutputSpacing = hostDat->FluidOutputSpacing;
+	header->NumFluid = fluid_output_count(hostDat, intDat);
+	header->FluidColumns = hostDat->OutputVorticity ? 4 : 3;
+	header->NumParticles = intDat->NumParticles;
+	header->FluidEncoding = hostDat->VideoFormat == VIDEO_BINARY_INT16 ? TRAJ_INT16 : TRAJ_FLOAT32;
+
+	if (resumeFrame == 0 || trajectory_resume(writer, fileName, resumeFrame)) {
+		writer->fPtr = fopen(fileName, "wb");
+		if (writer->fPtr == NULL) {
+			perror(fileName);
+			return 1;
+		}
+		fwrite(header, sizeof(trajectory_header_struct), 1, writer->fPtr);
+	}
 
-	int n_C = intDat->LatticeSize[0]*intDat->LatticeSize[1]*intDat->LatticeSize[2];
+	size_t frameSize = (header->FluidColumns*header->NumFluid + 6*header->NumParticles)*sizeof(cl_float);
+	writer->Frames[0] = (cl_float*)malloc(frameSize);
+	writer->Frames[1] = (cl_float*)malloc(frameSize);
+	writer->Packed = (cl_short*)malloc(header->FluidColumns*header->NumFluid*sizeof(cl_short));
+	if (writer->Frames[0] == NULL || writer->Frames[1] == NULL || writer->Packed == NULL) {
+		printf("Error: could not allocate trajectory frame buffers\n");
+		fclose(writer->fPtr);
+		free(writer->Frames[0]);
+		free(writer->Frames[1]);
+		free(writer->Packed);
+		return 1;
+	}
 
-	for(int i_x=1; i_x < intDat->LatticeSize[0]-1; i_x++) {
-		for(int i_y=1; i_y < intDat->LatticeSize[1]-1; i_y++) {
-			for(int i_z=1; i_z < intDat->LatticeSize[2]-1; i_z++) {
+	writer->Full[0] = 0;
+	writer->Full[1] = 0;
+	writer->Next = 0;
+	writer->Stop = 0;
+
+	pthread_mutex_init(&(writer->Lock), NULL);
+	pthread_cond_init(&(writer->Cond), NULL);
+	if (pthread_create(&(writer->Thread), NULL, trajectory_writer_thread, writer) != 0) {
+		printf("Error: could not start trajectory writer thread\n");
+		pthread_mutex_destroy(&(writer->Lock));
+		pthread_cond_destroy(&(writer->Cond));
+		fclose(writer->fPtr);
+		free(writer->Frames[0]);
+		free(writer->Frames[1]);
+		free(writer->Packed);
+		return 1;
+	}
 
-				int i_1D = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*i_z);
+	return 0;
+}
 
-				// Index, then velocity
-				fprintf(fPtr, "%d %d %d ", i_x, i_y, i_z);
-				fprintf(fPtr, "%9.7f %9.7f %9.7f\n", field[i_1D],  field[i_1D + n_C],  field[i_1D + 2*n_C]);
+// Continue an existing trajectory after a restart: frames after resumeFrame (written after the
+// checkpoint, before the run stopped) and any partial frame are cut off. Returns 1 if a new file is needed.
+int trajectory_resume(trajectory_writer_struct* writer, const char* fileName, int resumeFrame)
+{
+	writer->fPtr = fopen(fileName, "r+b");
+	if (writer->fPtr == NULL) {
+		return 1;
+	}
 
-			}
-		}
+	trajectory_header_struct header;
+	if (fread(&header, sizeof(header), 1, writer->fPtr) != 1
+	||	memcmp(&header, &(writer->Header), sizeof(header)) != 0) {
+		printf("Warning: %s does not match this run, starting a new trajectory\n", fileName);
+		fclose(writer->fPtr);
+		return 1;
 	}
-	fclose(fPtr);
 
-	FILE* fPtr2;
-	fPtr2 = fopen ("matlab_postproc/velocity_field_centerline.txt","w");
+	size_t fluidValSize = header.FluidEncoding == TRAJ_INT16 ? sizeof(cl_short) : sizeof(cl_float);
+	long long frameData = header.FluidColumns*header.NumFluid*fluidValSize + 6*header.NumParticles*sizeof(cl_float);
+
+	file_seek(writer->fPtr, 0, SEEK_END);
+	long long fileEnd = file_tell(writer->fPtr);
+	long long keepBytes = sizeof(header);
+	int numFrames = 0;
+
+	trajectory_frame_struct frameHead;
+	file_seek(writer->fPtr, keepBytes, SEEK_SET);
+	while (fread(&frameHead, sizeof(frameHead), 1, writer->fPtr) == 1 && frameHead.Frame <= resumeFrame
+	&&	keepBytes + (long long)sizeof(frameHead) + frameData <= fileEnd) {
+		keepBytes += sizeof(frameHead) + frameData;
+		file_seek(writer->fPtr, keepBytes, SEEK_SET);
+		numFrames++;
+	}
 
-	int i_y = (int)floor((float)intDat->LatticeSize[1]/2.0f);
+	fflush(writer->fPtr);
+#ifdef _WIN32
+	_chsize_s(_fileno(writer->fPtr), keepBytes);
+#else
+	if (ftruncate(fileno(writer->fPtr), keepBytes) != 0) {
+		perror(fileName);
+	}
+#endif
+	file_seek(writer->fPtr, keepBytes, SEEK_SET);
+	printf("Resuming %s after %d frames\n", fileName, numFrames);
 
-	for(int i_x=1; i_x < intDat->LatticeSize[0]-1; i_x++) {
-		for(int i_z=1; i_z < intDat->LatticeSize[2]-1; i_z++) {
+	return 0;
+}
 
-			int i_1D = i_x + intDat->LatticeSize[0]*(i_y + intDat->LatticeSize[1]*i_z);
+// Copy one frame into the next free buffer and hand it to the writer thread
+// Only waits if the writer is still busy with the frame before last
+void trajectory_writer_submit(trajectory_writer_struct* writer, cl_float* fluidCols, cl_float4* parKin, int frame)
+{
+	int n_fluidVals = writer->Header.FluidColumns*writer->Header.NumFluid;
+	int n_par = writer->Header.NumParticles;
 
-			// Index, then velocity
-			fprintf(fPtr2, "%d %d %d ", i_x, i_y, i_z);
-			fprintf(fPtr2, "%9.7f %9.7f %9.7f\n", field[i_1D],  field[i_1D + n_C],  field[i_1D + 2*n_C]);
+	int b = writer->Next;
 
-		}
+	pthread_mutex_lock(&(writer->Lock));
+	while (writer->Full[b]) {
+		pthread_cond_wait(&(writer->Cond), &(writer->Lock));
 	}
-	fclose(fPtr2);
+	pthread_mutex_unlock(&(writer->Lock));
 
-	return 0;
+	// Fluid columns are already packed by gather_fluid_output
+	memcpy(writer->Frames[b], fluidCols, n_fluidVals*sizeof(cl_float));
+
+	cl_float* parCols = writer->Frames[b] + n_fluidVals;
+	for (int p = 0; p < n_par; p++) {
+		parCols[p          ] = parKin[p].x;
+		parCols[p +   n_par] = parKin[p].y;
+		parCols[p + 2*n_par] = parKin[p].z;
+		parCols[p + 3*n_par] = parKin[p+n_par].x;
+		parCols[p + 4*n_par] = parKin[p+n_par].y;
+		parCols[p + 5*n_par] = parKin[p+n_par].z;
+	}
+
+	pthread_mutex_lock(&(writer->Lock));
+	writer->FrameNum[b] = frame;
+	writer->Full[b] = 1;
+	pthread_cond_broadcast(&(writer->Cond));
+	pthread_mutex_unlock(&(writer->Lock));
+
+	writer->Next = 1 - b;
 }
 
-int display_input_params(int_param_struct* intDat, flp_param_struct* flpDat)
+void* trajectory_writer_thread(void* writerPtr)
 {
-	printf("%s %d \n", "ViscosityModel = ", intDat->ViscosityModel);
-	printf("%s %f %f %f \n", "ConstBodyForce = ", flpDat->ConstBodyForce[0],
-	flpDat->ConstBodyForce[1], flpDat->ConstBodyForce[2]);
+	trajectory_writer_struct* writer = (trajectory_writer_struct*)writerPtr;
 
-	return 0;
-}
+	int n_fluid = writer->Header.NumFluid;
+	int n_cols = writer->Header.FluidColumns;
+	int n_par = writer->Header.NumParticles;
+	int b = 0; // Frames are written in the order they were submitted
+
+	while (1) {
+		pthread_mutex_lock(&(writer->Lock));
+		while (!writer->Full[b] && !writer->Stop) {
+			pthread_cond_wait(&(writer->Cond), &(writer->Lock));
+		}
+		if (!writer->Full[b]) {
+			// Stopped with nothing left to write
+			pthread_mutex_unlock(&(writer->Lock));
+			break;
+		}
+		pthread_mutex_unlock(&(writer->Lock));
+
+		cl_float* fluidCols = writer->Frames[b];
+		trajectory_frame_struct frameHead;
+		frameHead.Frame = writer->FrameNum[b];
+
+		if (writer->Header.FluidEncoding == TRAJ_INT16) {
+			// Symmetric quantisation of each column over its largest magnitude in the frame
+			for (int c = 0; c < TRAJ_MAX_FLUID_COLUMNS; c++) {
+				frameHead.FluidScale[c] = 1.0f;
+			}
+			for (int c = 0; c < n_cols; c++) {
+				cl_float* col = fluidCols + c*n_fluid;
+				float colMax = 0.0f;
+				for (int i = 0; i < n_fluid; i++) {
+					colMax = fmaxf(colMax, fabsf(col[i]));
+				}
+				frameHead.FluidScale[c] = colMax > 0.0f ? colMax/32767.0f : 1.0f;
+				for (int i = 0; i < n_fluid; i++) {
+					writer->Packed[i + c*n_fluid] = (cl_short)lrintf(col[i]/frameHead.FluidScale[c]);
+				}
+			}
+			fwrite(&frameHead, sizeof(frameHead), 1, writer->fPtr);
+			fwrite(writer->Packed, sizeof(cl_short), n_cols*n_fluid, writer->fPtr);
+		}
+		else {
+			for (int c = 0; c < TRAJ_MAX_FLUID_COLUMNS; c++) {
+				frameHead.FluidScale[c] = 1.0f;
+			}
+			fwrite(&frameHead, sizeof(frameHead), 1, writer->fPtr);
+			fwrite(fluidCols, sizeof(cl_float), n_cols*n_fluid, writer->fPtr);
+		}
+		fwrite(fluidCols + n_cols*n_fluid, sizeof(cl_float), 6*n_par, writer->fPtr);
+
+		pthread_mutex_lock(&(writer->Lock));
+		writer->Full[b] = 0;
+		pthread_cond_broadcast(&(writer->Cond));
+		pthread_mutex_unlock(&(writer->Lock));
+
+		b = 1 - b;
+	}
+
+	return NULL;
+}
+
+// Flush any queued frames, then stop the writer thread
+void trajectory_writer_close(trajectory_writer_struct* writer)
+{
+	pthread_mutex_lock(&(writer->Lock));
+	writer->Stop = 1;
+	pthread_cond_broadcast(&(writer->Cond));
+	pthread_mutex_unlock(&(writer->Lock));
+
+	pthread_join(writer->Thread, NULL);
+	pthread_mutex_destroy(&(writer->Lock));
+	pthread_cond_destroy(&(writer->Cond));
+
+	fclose(writer->fPtr);
+	free(writer->Frames[0]);
+	free(writer->Frames[1]);
+	free(writer->Packed);
+}
+
+// Returns 1, with no sections left allocated, if the host copies do not fit
+int checkpoint_writer_init(checkpoint_writer_struct* ckpt, int_param_struct* intDat, int keep, size_t* sectionSizes)
+{
+	memset(&(ckpt->Header), 0, sizeof(checkpoint_header_struct));
+	memcpy(ckpt->Header.LatticeSize, intDat->LatticeSize, sizeof(ckpt->Header.LatticeSize));
+	ckpt->Header.LatticeBrick = LATTICE_BRICK;
+	ckpt->Header.NumParticles = intDat->NumParticles;
+	for (int s = 0; s < CHECKPOINT_SECTIONS; s++) {
+		ckpt->Header.SectionSize[s] = sectionSizes[s];
+		ckpt->Sections[s] = malloc(sectionSizes[s]);
+		if (ckpt->Sections[s] == NULL) {
+			printf("Error: could not allocate checkpoint section %d\n", s);
+			for (int i = 0; i < s; i++) {
+				free(ckpt->Sections[i]);
+			}
+			return 1;
+		}
+	}
+	ckpt->Keep = keep > 0 ? keep : 1;
+	ckpt->Count = 0;
+	ckpt->Busy = 0;
+	ckpt->Error = 0;
+	return 0;
+}
+
+// Particle arrays are worked on by the CPU kernels, everything else by the GPU kernels
+cl_command_queue checkpoint_section_queue(int s, cl_command_queue queueGPU, cl_command_queue queueCPU)
+{
+	return (s >= CKPT_PAR_KIN && s <= CKPT_NUM_PAR_IN_THREAD) ? queueCPU : queueGPU;
+}
+
+// Copy the state after this iteration to host, then write it out on the checkpoint thread.
+// Both queues must be finished. Waits only if the previous checkpoint is still being written.
+int checkpoint_save(checkpoint_writer_struct* ckpt, cl_command_queue queueGPU, cl_command_queue queueCPU, cl_mem* sectionBufs,
+	cl_mem* sectionHiBufs, int iteration, double leOffset, output_data_struct* outDat, flp_param_struct* flpDat, cl_int statSamples)
+{
+	checkpoint_writer_wait(ckpt);
+
+	cl_int err_cl = CL_SUCCESS;
+	for (int s = 0; s < CHECKPOINT_SECTIONS; s++) {
+		if (ckpt->Header.SectionSize[s] == 0) {
+			continue; // Particle sections without particles
+		}
+		err_cl |= enqueue_split_transfer(checkpoint_section_queue(s, queueGPU, queueCPU), sectionBufs[s], sectionHiBufs[s], 0,
+			CL_FALSE, ckpt->Header.SectionSize[s], ckpt->Sections[s]);
+	}
+	clFinish(queueGPU);
+	clFinish(queueCPU);
+	error_check(err_cl, "clEnqueueReadBuffer checkpoint", 1);
+
+	checkpoint_header_struct* header = &(ckpt->Header);
+	header->Magic = CHECKPOINT_MAGIC;
+	header->Version = CHECKPOINT_VERSION;
+	header->Iteration = iteration;
+	header->StatSamples = statSamples;
+	header->LEOffset = leOffset;
+	header->OutDat = *outDat;
+	memcpy(header->VelUpper, flpDat->VelUpper, sizeof(header->VelUpper));
+	memcpy(header->VelLower, flpDat->VelLower, sizeof(header->VelLower));
+
+	snprintf(ckpt->FileName, CHECKPOINT_NAME_SIZE, "checkpoint_%d.bin", ckpt->Count%ckpt->Keep);
+	ckpt->Count++;
+
+	ckpt->Busy = 1;
+	if (pthread_create(&(ckpt->Thread), NULL, checkpoint_writer_thread, ckpt) != 0) {
+		printf("Error: could not start checkpoint writer thread\n");
+		ckpt->Busy = 0;
+		return 1;
+	}
+	return 0;
+}
+
+// Written to a temporary file first, so the file being replaced stays valid if the run dies mid-write
+void* checkpoint_writer_thread(void* ckptPtr)
+{
+	checkpoint_writer_struct* ckpt = (checkpoint_writer_struct*)ckptPtr;
+
+	char tempName[CHECKPOINT_NAME_SIZE+4];
+	snprintf(tempName, sizeof(tempName), "%s.tmp", ckpt->FileName);
+
+	FILE* fPtr = fopen(tempName, "wb");
+	if (fPtr == NULL) {
+		perror(tempName);
+		ckpt->Error = 1;
+		return NULL;
+	}
+
+	int error = fwrite(&(ckpt->Header), sizeof(checkpoint_header_struct), 1, fPtr) != 1;
+	for (int s = 0; s < CHECKPOINT_SECTIONS; s++) {
+		error |= fwrite(ckpt->Sections[s], 1, ckpt->Header.SectionSize[s], fPtr) != ckpt->Header.SectionSize[s];
+	}
+	error |= fclose(fPtr) != 0;
+
+#ifdef _WIN32
+	remove(ckpt->FileName); // rename does not replace on Windows
+#endif
+	if (error || rename(tempName, ckpt->FileName) != 0) {
+		printf("Error: could not write checkpoint %s\n", ckpt->FileName);
+		ckpt->Error = 1;
+	}
+
+	return NULL;
+}
+
+void checkpoint_writer_wait(checkpoint_writer_struct* ckpt)
+{
+	if (ckpt->Busy) {
+		pthread_join(ckpt->Thread, NULL);
+		ckpt->Busy = 0;
+		if (!ckpt->Error) {
+			printf("Checkpoint at iteration %d written to %s\n", ckpt->Header.Iteration, ckpt->FileName);
+		}
+		ckpt->Error = 0;
+	}
+}
+
+void checkpoint_writer_close(checkpoint_writer_struct* ckpt)
+{
+	checkpoint_writer_wait(ckpt);
+	for (int s = 0; s < CHECKPOINT_SECTIONS; s++) {
+		free(ckpt->Sections[s]);
+	}
+}
+
+// Newest complete checkpoint in the rotation, 0 if there is none
+int checkpoint_latest(int keep, char* fileName)
+{
+	int latest = 0;
+	for (int k = 0; k < keep; k++) {
+		char name[CHECKPOINT_NAME_SIZE];
+		snprintf(name, CHECKPOINT_NAME_SIZE, "checkpoint_%d.bin", k);
+
+		FILE* fPtr = fopen(name, "rb");
+		if (fPtr == NULL) {
+			continue;
+		}
+		checkpoint_header_struct header;
+		if (fread(&header, sizeof(header), 1, fPtr) == 1 && header.Magic == CHECKPOINT_MAGIC
+		&&	header.Version == CHECKPOINT_VERSION && header.Iteration > latest) {
+			latest = header.Iteration;
+			strcpy(fileName, name);
+		}
+		fclose(fPtr);
+	}
+	return latest;
+}
+
+// Load a checkpoint into the device buffers, split fields into both of their parts. With fullState 0 (warm start)
+// only the fluid and particle state is taken, output accumulators and field statistics start again.
+int checkpoint_restore(checkpoint_writer_struct* ckpt, const char* fileName, cl_command_queue queueGPU, cl_command_queue queueCPU,
+	cl_mem* sectionBufs, cl_mem* sectionHiBufs, int fullState)
+{
+	FILE* fPtr = fopen(fileName, "rb");
+	if (fPtr == NULL) {
+		perror(fileName);
+		return 1;
+	}
+
+	checkpoint_header_struct header;
+	if (fread(&header, sizeof(header), 1, fPtr) != 1
+	||	header.Magic != CHECKPOINT_MAGIC || header.Version != CHECKPOINT_VERSION) {
+		printf("Error: %s is not a checkpoint\n", fileName);
+		fclose(fPtr);
+		return 1;
+	}
+
+	if (header.LatticeBrick != LATTICE_BRICK) {
+		printf("Error: checkpoint %s has lattice bricks of %d, this build uses %d\n", fileName, header.LatticeBrick, LATTICE_BRICK);
+		fclose(fPtr);
+		return 1;
+	}
+
+	// Same byte counts do not mean the same layout, e.g. a transposed lattice
+	if (memcmp(header.LatticeSize, ckpt->Header.LatticeSize, sizeof(header.LatticeSize)) != 0
+	||	header.NumParticles != ckpt->Header.NumParticles) {
+		printf("Error: checkpoint %s has a %dx%dx%d lattice and %d particles, this run has %dx%dx%d and %d\n", fileName,
+			header.LatticeSize[0], header.LatticeSize[1], header.LatticeSize[2], header.NumParticles,
+			ckpt->Header.LatticeSize[0], ckpt->Header.LatticeSize[1], ckpt->Header.LatticeSize[2], ckpt->Header.NumParticles);
+		fclose(fPtr);
+		return 1;
+	}
+
+	int numSections = fullState ? CHECKPOINT_SECTIONS : CKPT_STAT_MEAN;
+	for (int s = 0; s < numSections; s++) {
+		if (header.SectionSize[s] != ckpt->Header.SectionSize[s]) {
+			printf("Error: checkpoint %s section %d has %llu bytes, this run needs %llu\n", fileName, s,
+				(unsigned long long)header.SectionSize[s], (unsigned long long)ckpt->Header.SectionSize[s]);
+			fclose(fPtr);
+			return 1;
+		}
+	}
+
+	cl_int err_cl = CL_SUCCESS;
+	for (int s = 0; s < numSections; s++) {
+		if (fread(ckpt->Sections[s], 1, header.SectionSize[s], fPtr) != header.SectionSize[s]) {
+			printf("Error: checkpoint %s is truncated\n", fileName);
+			fclose(fPtr);
+			return 1;
+		}
+		if (header.SectionSize[s] > 0) {
+			err_cl |= enqueue_split_transfer(checkpoint_section_queue(s, queueGPU, queueCPU), sectionBufs[s], sectionHiBufs[s], 1,
+				CL_TRUE, header.SectionSize[s], ckpt->Sections[s]);
+		}
+	}
+	fclose(fPtr);
+	error_check(err_cl, "clEnqueueWriteBuffer checkpoint", 1);
+
+	// Keep the sizes this run needs, take the rest from the file
+	memcpy(header.SectionSize, ckpt->Header.SectionSize, sizeof(header.SectionSize));
+	ckpt->Header = header;
+
+	return 0;
+}
+
+// Check (or wait for) the readback of an output snapshot
+int output_snapshot_ready(output_snapshot_struct* snap, int wait)
+{
+	for (int i = 0; i < SNAPSHOT_EVENTS; i++) {
+		if (snap->Ready[i] == NULL) {
+			continue;
+		}
+		if (wait) {
+			error_check(clWaitForEvents(1, &(snap->Ready[i])), "clWaitForEvents snapshot", 1);
+			continue;
+		}
+		cl_int status;
+		clGetEventInfo(snap->Ready[i], CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+		if (status < 0) {
+			error_check(status, "Snapshot readback", 1);
+		}
+		if (status != CL_COMPLETE) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Returns 1 if the wall velocities changed
+int process_output_snapshot(output_snapshot_struct* snap, host_param_struct* hostDat, int_param_struct* intDat,
+	flp_param_struct* flpDat, output_data_struct* outDat, trajectory_writer_struct* trajWriter, FILE* vidPtr)
+{
+	int wallsChanged = 0;
+	int n_z = intDat->LatticeSize[2];
+
+	if (snap->Video) {
+		if (hostDat->VideoFormat == VIDEO_XYZ) {
+			continuous_output(hostDat, intDat, snap->fluid_h, snap->parKin_h, vidPtr, snap->Frame);
+		}
+		else {
+			trajectory_writer_submit(trajWriter, snap->fluid_h, snap->parKin_h, snap->Frame);
+		}
+	}
+	// Profile rows hold one profile per ensemble member
+	int n_m = intDat->EnsembleSize;
+	for (int r = 0; r < snap->NumProfiles; r++) {
+		for (int m = 0; m < n_m; m++) {
+			wallsChanged |= compute_shear_stress(&outDat[m], hostDat, intDat, &flpDat[m], snap->profile_h + (r*n_m + m)*3*n_z,
+				snap->ProfileFrames[r], m);
+		}
+	}
+
+	for (int i = 0; i < SNAPSHOT_EVENTS; i++) {
+		if (snap->Ready[i] != NULL) {
+			clReleaseEvent(snap->Ready[i]);
+			snap->Ready[i] = NULL;
+		}
+	}
+
+	return wallsChanged;
+}
+
+// Means and variances from accumulate_field_statistics, interior nodes only
+void write_field_statistics(host_param_struct* hostDat, int_param_struct* intDat, cl_float* statMean, cl_float* statM2,
+	int numSamples)
+{
+	int n_x = intDat->LatticeSize[0];
+	int n_y = intDat->LatticeSize[1];
+	int n_z = intDat->LatticeSize[2];
+	size_t n_C = lattice_nodes(intDat->LatticeSize);
+	size_t n_interior = (size_t)(n_x-2)*(n_y-2)*(n_z-2);
+
+	FILE* fPtr = fopen("field_statistics.bin", "wb");
+	if (fPtr == NULL) {
+		perror("field_statistics.bin");
+		return;
+	}
+
+	field_statistics_header_struct header;
+	header.Magic = STATS_MAGIC;
+	header.LatticeSize[0] = n_x;
+	header.LatticeSize[1] = n_y;
+	header.LatticeSize[2] = n_z;
+	header.NumFields = NUM_STAT_FIELDS;
+	header.NumSamples = numSamples;
+	header.StartIteration = hostDat->FieldAverageStart;
+	header.SampleFreq = hostDat->FieldAverageFreq;
+	fwrite(&header, sizeof(header), 1, fPtr);
+
+	cl_float* fieldOut = (cl_float*)malloc(n_interior*sizeof(cl_float));
+
+	for (int moment = 0; moment < 2; moment++) {
+		for (int field = 0; field < NUM_STAT_FIELDS; field++) {
+
+			size_t i_out = 0;
+			for(int i_z=1; i_z < n_z-1; i_z++) {
+				for(int i_y=1; i_y < n_y-1; i_y++) {
+					for(int i_x=1; i_x < n_x-1; i_x++) {
+
+						size_t i_s = lattice_node(i_x, i_y, i_z, intDat->LatticeSize) + field*n_C;
+						if (moment == 0) {
+							fieldOut[i_out++] = statMean[i_s];
+						}
+						else {
+							fieldOut[i_out++] = numSamples > 1 ? statM2[i_s]/(numSamples-1) : 0.0f;
+						}
+					}
+				}
+			}
+			fwrite(fieldOut, sizeof(cl_float), n_interior, fPtr);
+		}
+	}
+
+	free(fieldOut);
+	fclose(fPtr);
+	printf("Field statistics from %d samples written to field_statistics.bin\n", numSamples);
+}
+
+// Full velocity field as a chunked binary snapshot (field_snapshot.h), centreline plane as text
+int write_lattice_field(host_param_struct* hostDat, cl_float* field, int_param_struct* intDat, int frame, int member)
+{
+	char snapName[WORD_STRING_SIZE], centerlineName[WORD_STRING_SIZE];
+	ensemble_file_name(snapName, WORD_STRING_SIZE, "velocity_field_final", "snap", intDat, member);
+	ensemble_file_name(centerlineName, WORD_STRING_SIZE, "matlab_postproc/velocity_field_centerline", "txt", intDat, member);
+
+	size_t n_C = lattice_nodes(intDat->LatticeSize);
+
+	field_snapshot_options_struct snapOpts;
+	snapOpts.Codec = hostDat->SnapshotCodec;
+	snapOpts.MantissaBits = hostDat->SnapshotMantissaBits;
+	snapOpts.SlabPlanes = hostDat->SnapshotSlabPlanes;
+	snapOpts.NumThreads = hostDat->SnapshotThreads;
+
+	if (field_snapshot_write(snapName, "u", field, 3, intDat->LatticeSize, frame, &snapOpts)) {
+		return 1;
+	}
+
+	FILE* fPtr2;
+	fPtr2 = fopen (centerlineName,"w");
+
+	int i_y = (int)floor((float)intDat->LatticeSize[1]/2.0f);
+
+	for(int i_x=1; i_x < intDat->LatticeSize[0]-1; i_x++) {
+		for(int i_z=1; i_z < intDat->LatticeSize[2]-1; i_z++) {
+
+			size_t i_1D = lattice_node(i_x, i_y, i_z, intDat->LatticeSize);
+
+			// Index, then velocity
+			fprintf(fPtr2, "%d %d %d ", i_x, i_y, i_z);
+			fprintf(fPtr2, "%9.7f %9.7f %9.7f\n", field[i_1D],  field[i_1D + n_C],  field[i_1D + 2*n_C]);
+
+		}
+	}
+	fclose(fPtr2);
+
+	return 0;
+}
+
+int display_input_params(int_param_struct* intDat, flp_param_struct* flpDat)
+{
+	printf("%s %d \n", "ViscosityModel = ", intDat->ViscosityModel);
+	printf("%s %f %f %f \n", "ConstBodyForce = ", flpDat->ConstBodyForce[0],
+	flpDat->ConstBodyForce[1], flpDat->ConstBodyForce[2]);
+
+	return 0;
+}
 
 // Function to lookup the OpenCL platform, and determine the CPU and GPU device to use
 void analyse_platform(cl_device_id* devices, host_param_struct* hostDat)
@@ -883,91 +2379,642 @@ void analyse_platform(cl_device_id* devices, host_param_struct* hostDat)
 	devicePtrCPU = (cl_device_id*)malloc(numCPUs*sizeof(cl_device_id));
 	error |= clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_CPU, numCPUs, devicePtrCPU, NULL);
 
-	// GPUs
-	error |= clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, &numGPUs);
-	error_check(error, "clGetDeviceIDs", 1);
-	if (error != CL_SUCCESS) {
-		exit(EXIT_FAILURE);
-	} else if(numGPUs == 0) {
-		printf("Error: No GPU found \n\n");
-		exit(EXIT_FAILURE);
+	// GPUs
+	error |= clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, 0, NULL, &numGPUs);
+	error_check(error, "clGetDeviceIDs", 1);
+	if (error != CL_SUCCESS) {
+		exit(EXIT_FAILURE);
+	} else if(numGPUs == 0) {
+		printf("Error: No GPU found \n\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cl_device_id *devicePtrGPU = NULL;
+	devicePtrGPU = (cl_device_id*)malloc(numGPUs*sizeof(cl_device_id));
+	error = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, numGPUs, devicePtrGPU, NULL);
+
+	// Print CPU information
+	for(int i=0; i < (int)numCPUs; i++)
+	{
+		char buf_name[1024];
+		cl_uint buf_cu, buf_freq;
+		cl_ulong buf_mem;
+
+		printf("CPU info, num. %i\n", i);
+		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_NAME, sizeof(buf_name), buf_name, NULL);
+		printf("DEVICE_NAME = %s\n", buf_name);
+		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(buf_cu), &buf_cu, NULL);
+		printf("DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)buf_cu);
+		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_freq), &buf_freq, NULL);
+		printf("DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_freq);
+		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_mem), &buf_mem, NULL);
+		printf("DEVICE_GLOBAL_MEM_SIZE = %lu\n", (unsigned long)buf_mem);
+
+		size_t buf_wi_size[3];
+		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(buf_wi_size), &buf_wi_size, NULL);
+		printf("CL_DEVICE_MAX_WORK_ITEM_SIZES = %lu %lu %lu \n\n", (unsigned long)buf_wi_size[0],
+			(unsigned long)buf_wi_size[1], (unsigned long)buf_wi_size[2]);
+	}
+
+	// Print GPU information
+	cl_uint* numCompUnits = (cl_uint*)calloc(numGPUs, sizeof(cl_uint));
+	for(int i=0; i < (int)numGPUs; i++)
+	{
+		char buf_name[1024];
+		cl_uint buf_freq;
+		cl_ulong buf_mem;
+
+		printf("GPU info, num. %i\n", i);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_NAME, sizeof(buf_name), buf_name, NULL);
+		printf("DEVICE_NAME = %s\n", buf_name);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), numCompUnits+i, NULL);
+		printf("DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)numCompUnits[i]);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_freq), &buf_freq, NULL);
+		printf("DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_freq);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_mem), &buf_mem, NULL);
+		printf("DEVICE_GLOBAL_MEM_SIZE = %lu\n", (unsigned long)buf_mem);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(buf_mem), &buf_mem, NULL);
+		printf("CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE = %lu\n", (unsigned long)buf_mem);
+
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_WORK_ITEM_SIZES, 3*sizeof(size_t), &hostDat->WorkItemSizes, NULL);
+		printf("CL_DEVICE_MAX_WORK_ITEM_SIZES = %lu %lu %lu \n", (unsigned long)hostDat->WorkItemSizes[0],
+			(unsigned long)hostDat->WorkItemSizes[1], (unsigned long)hostDat->WorkItemSizes[2]);
+		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &hostDat->MaxWorkGroupSize, NULL);
+		printf("CL_DEVICE_MAX_WORK_GROUP_SIZE = %lu \n\n", (unsigned long)hostDat->MaxWorkGroupSize);
+	}
+
+	// Choose GPU with most compute units
+	cl_uint chosenOne = 0;
+	cl_uint chosenUnits = numCompUnits[0];
+	for(int i=0; i < (int)numGPUs; i++) {
+		if (numCompUnits[i] > chosenUnits) {
+			chosenOne = i;
+			chosenUnits = numCompUnits[i];
+		}
+	}
+	printf("Choosing device %lu with %lu compute units\n\n", (unsigned long)(chosenOne), (unsigned long)(chosenUnits));
+
+	// Deal with case where there is no GPU...
+
+	// Use default devices for now
+	devices[0] = devicePtrCPU[0];
+	devices[1] = devicePtrGPU[chosenOne];
+
+	free(platforms);
+	free(platformName);
+	free(devicePtrCPU);
+	free(devicePtrGPU);
+}
+
+// Devices, context, queues and programs, shared by every simulation the process runs
+void setup_sim_device(sim_device_struct* dev)
+{
+	host_param_struct platformDat;
+	analyse_platform(dev->Devices, &platformDat);
+	memcpy(dev->WorkItemSizes, platformDat.WorkItemSizes, sizeof(dev->WorkItemSizes));
+	dev->MaxWorkGroupSize = platformDat.MaxWorkGroupSize;
+	print_host_topology(dev);
+
+	cl_int error;
+
+	// CPU device fissioned by NUMA node, one of its sub-devices kept, and the host thread driving it on the same node.
+	// Sub-devices are assumed to come in the order of the system's node numbers
+	dev->RootCPU = dev->Devices[0];
+	if (dev->CpuNumaNode >= 0) {
+		cl_device_partition_property props[3] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+		cl_uint numSubDevices = 0;
+		error = clCreateSubDevices(dev->RootCPU, props, 0, NULL, &numSubDevices);
+		if (error != CL_SUCCESS || (cl_uint)dev->CpuNumaNode >= numSubDevices) {
+			printf("Error: CPU device has no NUMA node %d to run on (%u nodes).\n", dev->CpuNumaNode, numSubDevices);
+			exit(EXIT_FAILURE);
+		}
+		cl_device_id* subDevices = (cl_device_id*)malloc(numSubDevices*sizeof(cl_device_id));
+		error = clCreateSubDevices(dev->RootCPU, props, numSubDevices, subDevices, NULL);
+		error_check(error, "clCreateSubDevices", 1);
+		for (cl_uint i = 0; i < numSubDevices; i++) {
+			if (i != (cl_uint)dev->CpuNumaNode) {
+				clReleaseDevice(subDevices[i]);
+			}
+		}
+		dev->Devices[0] = subDevices[dev->CpuNumaNode];
+		free(subDevices);
+
+		cl_uint computeUnits = 0;
+		clGetDeviceInfo(dev->Devices[0], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+		printf("CPU device confined to NUMA node %d, %u compute units\n", dev->CpuNumaNode, computeUnits);
+		pin_thread_to_node(dev->CpuNumaNode);
+	}
+	dev->Context = clCreateContext(NULL, 2, dev->Devices, NULL, NULL, &error);
+	error_check(error, "clCreateContext", 1);
+
+	// Command queues for CPU and GPU, and a separate GPU queue for output readback,
+	// so transfers overlap later timesteps
+#ifdef __APPLE__
+	dev->QueueCPU = clCreateCommandQueue(dev->Context, dev->Devices[0], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+
+	dev->QueueGPU = clCreateCommandQueue(dev->Context, dev->Devices[1], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+
+	dev->QueueRead = clCreateCommandQueue(dev->Context, dev->Devices[1], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+#else
+	dev->QueueCPU = clCreateCommandQueueWithProperties(dev->Context, dev->Devices[0], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+
+	dev->QueueGPU = clCreateCommandQueueWithProperties(dev->Context, dev->Devices[1], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+
+	dev->QueueRead = clCreateCommandQueueWithProperties(dev->Context, dev->Devices[1], 0, &error);
+	error_check(error, "clCreateCommandQueue", 1);
+#endif
+
+	// Build LB kernels
+	create_LB_kernels(&dev->Kernels, &dev->Context, dev->Devices, &dev->ProgramCPU, &dev->ProgramGPU);
+
+	for (int i = 0; i < NUM_CL_MEM; i++) {
+		dev->Pool[i] = NULL;
+		dev->PoolSize[i] = 0;
+		dev->PoolFlags[i] = 0;
+	}
+	dev->ProgramFluidCPU = NULL;
+	dev->BuffersReused = 0;
+	dev->StartupTime = 0.0;
+}
+
+void release_sim_device(sim_device_struct* dev)
+{
+#define X(kernelName) clReleaseKernel(dev->Kernels.kernelName);
+	LIST_OF_KERNELS
+#undef X
+
+	if (dev->ProgramFluidCPU != NULL) {
+		clReleaseKernel(dev->FluidCPU.collide_stream);
+		clReleaseKernel(dev->FluidCPU.boundary_periodic);
+		clReleaseKernel(dev->FluidCPU.boundary_velocity);
+		clReleaseKernel(dev->FluidCPU.initialize_lattice_fields);
+		if (dev->CollideVecCPU != NULL) {
+			clReleaseKernel(dev->CollideVecCPU);
+		}
+		clReleaseProgram(dev->ProgramFluidCPU);
+	}
+
+	printf("Checkpoint: released kernels\n");
+
+	for (int i = 0; i < NUM_CL_MEM; i++) {
+		if (dev->Pool[i] != NULL) {
+			clReleaseMemObject(dev->Pool[i]);
+		}
+	}
+
+	clReleaseProgram(dev->ProgramCPU);
+	clReleaseProgram(dev->ProgramGPU);
+	clReleaseCommandQueue(dev->QueueRead);
+	clReleaseCommandQueue(dev->QueueCPU);
+	clReleaseCommandQueue(dev->QueueGPU);
+	clReleaseContext(dev->Context);
+	if (dev->Devices[0] != dev->RootCPU) {
+		clReleaseDevice(dev->Devices[0]);
+	}
+}
+
+// Device buffer from the pool, created as clCreateBuffer would. A buffer of the same size and flags
+// from an earlier simulation is reused, with the host data written to it for CL_MEM_COPY_HOST_PTR
+cl_mem pool_buffer(sim_device_struct* dev, int slot, cl_mem_flags flags, size_t size, void* hostPtr, cl_int* err)
+{
+	if (dev->Pool[slot] != NULL && dev->PoolSize[slot] == size && dev->PoolFlags[slot] == flags) {
+		*err = CL_SUCCESS;
+		if (flags & CL_MEM_COPY_HOST_PTR) {
+			*err = clEnqueueWriteBuffer(dev->QueueCPU, dev->Pool[slot], CL_TRUE, 0, size, hostPtr, 0, NULL, NULL);
+		}
+		dev->BuffersReused++;
+		return dev->Pool[slot];
+	}
+
+	if (dev->Pool[slot] != NULL) {
+		clReleaseMemObject(dev->Pool[slot]);
+	}
+	dev->Pool[slot] = clCreateBuffer(dev->Context, flags, size, hostPtr, err);
+	dev->PoolSize[slot] = *err == CL_SUCCESS ? size : 0;
+	dev->PoolFlags[slot] = flags;
+	if (*err != CL_SUCCESS) {
+		dev->Pool[slot] = NULL;
+	}
+	return dev->Pool[slot];
+}
+
+// Buffers only the CPU device works on, everything else is counted against the GPU
+int pool_slot_on_cpu(int slot)
+{
+	switch (slot) {
+		case POOL_parForce_cl: case POOL_parsZone_cl: case POOL_zoneMembers_cl: case POOL_numParInZone_cl:
+		case POOL_zoneNeighDat_cl: case POOL_threadMembers_cl: case POOL_numParInThread_cl: case POOL_fluidPinned_cl:
+		case POOL_fA_cpu_cl: case POOL_fB_cpu_cl: case POOL_u_cpu_cl: case POOL_gpf_cpu_cl:
+		case POOL_countPoint_cpu_cl: case POOL_tau_lb_cpu_cl:
+			return 1;
+	}
+	return 0;
+}
+
+// Split a field of numPlanes planes (planes in multiples of planeGroup) over its two pool slots if it
+// is larger than one allocation may be. Returns the planes in the first part, 0 if it cannot fit.
+int plan_field_split(size_t* bufSizes, int slot, int hiSlot, int numPlanes, int planeGroup, cl_ulong maxAlloc)
+{
+	size_t planeSize = bufSizes[slot]/numPlanes;
+	bufSizes[hiSlot] = 0;
+	if (bufSizes[slot] <= maxAlloc) {
+		return numPlanes;
+	}
+	int numGroups = numPlanes/planeGroup;
+	int partPlanes = planeGroup*((numGroups+1)/2);
+	if (numGroups < 2 || partPlanes*planeSize > maxAlloc) {
+		return 0;
+	}
+	bufSizes[hiSlot] = (numPlanes-partPlanes)*planeSize;
+	bufSizes[slot] = partPlanes*planeSize;
+	return partPlanes;
+}
+
+// Check the buffers of a simulation fit the devices before any are created: f and gpf are split in two
+// allocations when larger than the device's maximum, the rest must fit one each, and the totals must fit
+// global memory, with the ring of slab buffers an out-of-core fluid streams through (slabRingSize, else 0).
+// Prints the plan, releases pooled buffers it will not reuse. Returns 1 if the run cannot fit.
+int plan_device_memory(sim_device_struct* dev, int_param_struct* intDat, size_t* bufSizes, int splitLattice, size_t slabRingSize)
+{
+	const char* slotNames[NUM_CL_MEM] = {
+#define X(memName) #memName,
+	LIST_OF_CL_MEM
+#undef X
+	};
+
+	cl_ulong globalMem[2] = {0, 0};
+	cl_ulong maxAlloc[2] = {0, 0};
+	for (int d = 0; d < 2; d++) {
+		clGetDeviceInfo(dev->Devices[d], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMem[d], NULL);
+		clGetDeviceInfo(dev->Devices[d], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAlloc[d], NULL);
+	}
+
+	size_t numNodes = lattice_nodes(intDat->LatticeSize);
+	if (numNodes > INT_MAX) {
+		printf("Error: %llu lattice nodes per member, node indices are limited to %d\n", (unsigned long long)numNodes, INT_MAX);
+		return 1;
+	}
+
+	int fPlanes = 19*intDat->EnsembleSize;
+	int gpfPlanes = 3*intDat->MaxSurfPointsPerNode*intDat->EnsembleSize;
+	intDat->FPartPlanes = plan_field_split(bufSizes, POOL_fA_cl, POOL_fA_hi_cl, fPlanes, 1, maxAlloc[1]);
+	plan_field_split(bufSizes, POOL_fB_cl, POOL_fB_hi_cl, fPlanes, 1, maxAlloc[1]);
+	intDat->GpfPartPlanes = plan_field_split(bufSizes, POOL_gpf_cl, POOL_gpf_hi_cl, gpfPlanes, 3, maxAlloc[1]);
+
+	int error = 0;
+	if (splitLattice && (intDat->FPartPlanes < fPlanes || intDat->GpfPartPlanes < gpfPlanes)) {
+		printf("Error: the lattice is too large for one GPU buffer per field, which cpu_plane_fraction needs\n");
+		error = 1;
+	}
+
+	cl_ulong total[2] = {0, 0};
+	cl_ulong small[2] = {0, 0};
+	printf("\nDevice memory plan (MiB)\n");
+	for (int i = 0; i < NUM_CL_MEM; i++) {
+		int d = pool_slot_on_cpu(i) ? 0 : 1;
+		total[d] += bufSizes[i];
+		if (bufSizes[i] > maxAlloc[d]) {
+			printf("Error: %s needs %llu MiB, the %s device allows %llu MiB per buffer\n", slotNames[i],
+				(unsigned long long)(bufSizes[i] >> 20), d ? "GPU" : "CPU", (unsigned long long)(maxAlloc[d] >> 20));
+			error = 1;
+		}
+		if (bufSizes[i] < (1 << 20)) {
+			small[d] += bufSizes[i];
+		}
+		else {
+			printf("  %-22s %s %10.1f\n", slotNames[i], d ? "GPU" : "CPU", bufSizes[i]/1048576.0);
+		}
+	}
+	if (slabRingSize > 0) {
+		total[1] += slabRingSize;
+		printf("  %-22s %s %10.1f\n", "slab ring", "GPU", slabRingSize/1048576.0);
+	}
+	for (int d = 1; d >= 0; d--) {
+		printf("  %-22s %s %10.1f\n", "others", d ? "GPU" : "CPU", small[d]/1048576.0);
+		printf("  %-22s %s %10.1f of %.1f\n", "total", d ? "GPU" : "CPU", total[d]/1048576.0, globalMem[d]/1048576.0);
+		if (total[d] > globalMem[d]) {
+			printf("Error: lattice and particle buffers do not fit in %s device memory\n", d ? "GPU" : "CPU");
+			error = 1;
+		}
+	}
+	if (intDat->FPartPlanes < fPlanes) {
+		printf("f split after %d of %d planes, gpf after %d of %d\n", intDat->FPartPlanes, fPlanes,
+			intDat->GpfPartPlanes, gpfPlanes);
+	}
+	else if (intDat->GpfPartPlanes < gpfPlanes) {
+		printf("gpf split after %d of %d planes\n", intDat->GpfPartPlanes, gpfPlanes);
+	}
+	printf("\n");
+
+	// Free what an earlier simulation left that this one cannot reuse, before creating anything
+	for (int i = 0; i < NUM_CL_MEM; i++) {
+		if (dev->Pool[i] != NULL && dev->PoolSize[i] != bufSizes[i]) {
+			clReleaseMemObject(dev->Pool[i]);
+			dev->Pool[i] = NULL;
+			dev->PoolSize[i] = 0;
+		}
+	}
+
+	return error;
+}
+
+// Pool buffer for the second part of a split field, NULL (and the pool slot freed) if unsplit
+cl_mem pool_split_buffer(sim_device_struct* dev, int slot, cl_mem_flags flags, size_t size, cl_int* err)
+{
+	*err = CL_SUCCESS;
+	if (size > 0) {
+		return pool_buffer(dev, slot, flags, size, NULL, err);
+	}
+	if (dev->Pool[slot] != NULL) {
+		clReleaseMemObject(dev->Pool[slot]);
+		dev->Pool[slot] = NULL;
+		dev->PoolSize[slot] = 0;
+	}
+	return NULL;
+}
+
+// Read or write a field held in one allocation or two (second not NULL) as one contiguous block
+cl_int enqueue_split_transfer(cl_command_queue queue, cl_mem first, cl_mem second, int toDevice, cl_bool blocking,
+	size_t size, void* data)
+{
+	size_t firstSize = size;
+	if (second != NULL) {
+		clGetMemObjectInfo(first, CL_MEM_SIZE, sizeof(firstSize), &firstSize, NULL);
+	}
+
+	cl_int err;
+	if (toDevice) {
+		err = clEnqueueWriteBuffer(queue, first, blocking, 0, firstSize, data, 0, NULL, NULL);
+		if (second != NULL) {
+			err |= clEnqueueWriteBuffer(queue, second, blocking, 0, size-firstSize, (char*)data + firstSize, 0, NULL, NULL);
+		}
+	}
+	else {
+		err = clEnqueueReadBuffer(queue, first, blocking, 0, firstSize, data, 0, NULL, NULL);
+		if (second != NULL) {
+			err |= clEnqueueReadBuffer(queue, second, blocking, 0, size-firstSize, (char*)data + firstSize, 0, NULL, NULL);
+		}
+	}
+	return err;
+}
+
+// Seconds from an arbitrary start, for timing
+double wall_time(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double)count.QuadPart/(double)freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1E-9*ts.tv_nsec;
+#endif
+}
+
+// CPUs of a NUMA node from sysfs (e.g. "0-15,32-47"). Returns how many, 0 if the node is unknown
+int numa_node_cpus(int node, int* cpus, int maxCpus)
+{
+	int numCpus = 0;
+#ifdef __linux__
+	char fileName[WORD_STRING_SIZE];
+	snprintf(fileName, WORD_STRING_SIZE, "/sys/devices/system/node/node%d/cpulist", node);
+	FILE* fPtr = fopen(fileName, "r");
+	if (fPtr == NULL) {
+		return 0;
+	}
+	int first, last;
+	while (fscanf(fPtr, "%d", &first) == 1) {
+		last = first;
+		int c = fgetc(fPtr);
+		if (c == '-' && fscanf(fPtr, "%d", &last) == 1) {
+			c = fgetc(fPtr);
+		}
+		for (int cpu = first; cpu <= last && numCpus < maxCpus; cpu++) {
+			cpus[numCpus++] = cpu;
+		}
+		if (c != ',') {
+			break;
+		}
+	}
+	fclose(fPtr);
+#endif
+	return numCpus;
+}
+
+// NUMA nodes numbered from 0, 1 where the system does not say
+int numa_node_count(void)
+{
+	int cpu;
+	int numNodes = 0;
+	while (numNodes < MAX_NUMA_NODES && numa_node_cpus(numNodes, &cpu, 1) > 0) {
+		numNodes++;
 	}
+	return numNodes > 0 ? numNodes : 1;
+}
 
-	cl_device_id *devicePtrGPU = NULL;
-	devicePtrGPU = (cl_device_id*)malloc(numGPUs*sizeof(cl_device_id));
-	error = clGetDeviceIDs(platforms[0], CL_DEVICE_TYPE_GPU, numGPUs, devicePtrGPU, NULL);
+// Calling thread restricted to the CPUs of one NUMA node (Linux only), so the pages it first touches are placed there
+void pin_thread_to_node(int node)
+{
+#ifdef __linux__
+	int cpus[CPU_SETSIZE];
+	int numCpus = numa_node_cpus(node, cpus, CPU_SETSIZE);
+	if (numCpus == 0) {
+		return;
+	}
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for (int i = 0; i < numCpus; i++) {
+		CPU_SET(cpus[i], &cpuSet);
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+#endif
+}
 
-	// Print CPU information
-	for(int i=0; i < (int)numCPUs; i++)
-	{
-		char buf_name[1024];
-		cl_uint buf_cu, buf_freq;
-		cl_ulong buf_mem;
+// NUMA nodes, huge page mode and how the CPU device can be partitioned
+void print_host_topology(sim_device_struct* dev)
+{
+	printf("Host topology:\n");
+#ifndef _WIN32
+	printf("  %ld CPUs online\n", sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+#ifdef __linux__
+	int numNodes = numa_node_count();
+	int* cpus = (int*)malloc(CPU_SETSIZE*sizeof(int));
+	for (int node = 0; node < numNodes; node++) {
+		int numCpus = numa_node_cpus(node, cpus, CPU_SETSIZE);
+		printf("  NUMA node %d: %d CPUs, %d to %d\n", node, numCpus, numCpus > 0 ? cpus[0] : -1, numCpus > 0 ? cpus[numCpus-1] : -1);
+	}
+	free(cpus);
 
-		printf("CPU info, num. %i\n", i);
-		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_NAME, sizeof(buf_name), buf_name, NULL);
-		printf("DEVICE_NAME = %s\n", buf_name);
-		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(buf_cu), &buf_cu, NULL);
-		printf("DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)buf_cu);
-		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_freq), &buf_freq, NULL);
-		printf("DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_freq);
-		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_mem), &buf_mem, NULL);
-		printf("DEVICE_GLOBAL_MEM_SIZE = %lu\n", (unsigned long)buf_mem);
+	char thpMode[WORD_STRING_SIZE] = "unknown";
+	FILE* fPtr = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (fPtr != NULL) {
+		if (fgets(thpMode, WORD_STRING_SIZE, fPtr) != NULL) {
+			thpMode[strcspn(thpMode, "\n")] = '\0';
+		}
+		fclose(fPtr);
+	}
+	printf("  Transparent huge pages: %s\n", thpMode);
+#endif
+
+	cl_uint maxSubDevices = 0;
+	cl_device_affinity_domain domains = 0;
+	clGetDeviceInfo(dev->Devices[0], CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(maxSubDevices), &maxSubDevices, NULL);
+	clGetDeviceInfo(dev->Devices[0], CL_DEVICE_PARTITION_AFFINITY_DOMAIN, sizeof(domains), &domains, NULL);
+	printf("  CPU device: up to %u sub-devices, %s by NUMA node\n\n", maxSubDevices,
+		domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA ? "can be partitioned" : "not partitioned");
+}
 
-		size_t buf_wi_size[3];
-		clGetDeviceInfo(devicePtrCPU[i], CL_DEVICE_MAX_WORK_ITEM_SIZES, sizeof(buf_wi_size), &buf_wi_size, NULL);
-		printf("CL_DEVICE_MAX_WORK_ITEM_SIZES = %lu %lu %lu \n\n", (unsigned long)buf_wi_size[0],
-			(unsigned long)buf_wi_size[1], (unsigned long)buf_wi_size[2]);
+// Host lattice array. With hugePages, aligned to the huge page size and marked for transparent huge pages
+void* host_lattice_alloc(size_t size, int hugePages)
+{
+#ifdef _WIN32
+	return malloc(size);
+#else
+	void* ptr = NULL;
+	if (posix_memalign(&ptr, hugePages ? HUGE_PAGE_SIZE : 64, size) != 0) {
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	if (hugePages) {
+		madvise(ptr, size, MADV_HUGEPAGE);
 	}
+#endif
+	return ptr;
+#endif
+}
 
-	// Print GPU information
-	cl_uint* numCompUnits = (cl_uint*)calloc(numGPUs, sizeof(cl_uint));
-	for(int i=0; i < (int)numGPUs; i++)
-	{
-		char buf_name[1024];
-		cl_uint buf_freq;
-		cl_ulong buf_mem;
+// First input deck <name>.txt in the job directory, in name order. Returns 0 if there is none
+int next_server_job(const char* jobDir, char* jobName)
+{
+	int found = 0;
+	jobName[0] = '\0';
+
+#ifdef _WIN32
+	char pattern[2*WORD_STRING_SIZE];
+	snprintf(pattern, sizeof(pattern), "%s/*.txt", jobDir);
+	struct _finddata_t entry;
+	intptr_t handle = _findfirst(pattern, &entry);
+	if (handle == -1) {
+		return 0;
+	}
+	do {
+		const char* name = entry.name;
+#else
+	DIR* dir = opendir(jobDir);
+	if (dir == NULL) {
+		return 0;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		const char* name = entry->d_name;
+#endif
+		size_t len = strlen(name);
+		if (len > 4 && len < WORD_STRING_SIZE && strcmp(name + len-4, ".txt") == 0 && strcmp(name, SERVER_LOG_FILE) != 0) {
+			char stem[WORD_STRING_SIZE];
+			memcpy(stem, name, len-4);
+			stem[len-4] = '\0';
+			if (!found || strcmp(stem, jobName) < 0) {
+				strcpy(jobName, stem);
+				found = 1;
+			}
+		}
+#ifdef _WIN32
+	} while (_findnext(handle, &entry) == 0);
+	_findclose(handle);
+#else
+	}
+	closedir(dir);
+#endif
 
-		printf("GPU info, num. %i\n", i);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_NAME, sizeof(buf_name), buf_name, NULL);
-		printf("DEVICE_NAME = %s\n", buf_name);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), numCompUnits+i, NULL);
-		printf("DEVICE_MAX_COMPUTE_UNITS = %u\n", (unsigned int)numCompUnits[i]);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_CLOCK_FREQUENCY, sizeof(buf_freq), &buf_freq, NULL);
-		printf("DEVICE_MAX_CLOCK_FREQUENCY = %u\n", (unsigned int)buf_freq);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(buf_mem), &buf_mem, NULL);
-		printf("DEVICE_GLOBAL_MEM_SIZE = %lu\n", (unsigned long)buf_mem);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(buf_mem), &buf_mem, NULL);
-		printf("CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE = %lu\n", (unsigned long)buf_mem);
+	return found;
+}
 
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_WORK_ITEM_SIZES, 3*sizeof(size_t), &hostDat->WorkItemSizes, NULL);
-		printf("CL_DEVICE_MAX_WORK_ITEM_SIZES = %lu %lu %lu \n", (unsigned long)hostDat->WorkItemSizes[0],
-			(unsigned long)hostDat->WorkItemSizes[1], (unsigned long)hostDat->WorkItemSizes[2]);
-		clGetDeviceInfo(devicePtrGPU[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &hostDat->MaxWorkGroupSize, NULL);
-		printf("CL_DEVICE_MAX_WORK_GROUP_SIZE = %lu \n\n", (unsigned long)hostDat->MaxWorkGroupSize);
+// Server mode: run the input decks dropped into jobDir, back to back, with devices, programs and
+// buffers kept between them. A job <name>.txt is claimed by moving it to <name>/input_file.txt,
+// and runs with <name>/ as its working directory (relative paths in the deck are relative to it).
+// Each finished job adds a line to jobDir/job_log.txt. Creating jobDir/stop_server stops the server
+int run_job_server(sim_device_struct* dev, const char* jobDir)
+{
+	char serverDir[WORD_STRING_SIZE];
+	if (current_directory(serverDir, WORD_STRING_SIZE-1) == NULL) {
+		perror("Server working directory");
+		return 1;
 	}
+	// Sphere partitions and cache are shared by all jobs
+	char resourceDir[WORD_STRING_SIZE];
+	strcpy(resourceDir, serverDir);
+	strcat(resourceDir, "/");
+
+	char stopName[2*WORD_STRING_SIZE], logName[2*WORD_STRING_SIZE];
+	snprintf(stopName, sizeof(stopName), "%s/%s", jobDir, SERVER_STOP_FILE);
+	snprintf(logName, sizeof(logName), "%s/%s", jobDir, SERVER_LOG_FILE);
+	printf("Job server watching %s, create %s to stop\n", jobDir, stopName);
+
+	int numJobs = 0;
+	while (1) {
+
+		FILE* stopPtr = fopen(stopName, "r");
+		if (stopPtr != NULL) {
+			fclose(stopPtr);
+			remove(stopName);
+			break;
+		}
 
-	// Choose GPU with most compute units
-	cl_uint chosenOne = 0;
-	cl_uint chosenUnits = numCompUnits[0];
-	for(int i=0; i < (int)numGPUs; i++) {
-		if (numCompUnits[i] > chosenUnits) {
-			chosenOne = i;
-			chosenUnits = numCompUnits[i];
+		char jobName[WORD_STRING_SIZE];
+		if (!next_server_job(jobDir, jobName)) {
+			server_sleep(SERVER_POLL_SECONDS);
+			continue;
 		}
-	}
-	printf("Choosing device %lu with %lu compute units\n\n", (unsigned long)(chosenOne), (unsigned long)(chosenUnits));
 
-	// Deal with case where there is no GPU...
+		// Claim the job: if another server got there first the rename fails
+		char deckName[2*WORD_STRING_SIZE], runDir[2*WORD_STRING_SIZE], runDeck[3*WORD_STRING_SIZE];
+		snprintf(deckName, sizeof(deckName), "%s/%s.txt", jobDir, jobName);
+		snprintf(runDir, sizeof(runDir), "%s/%s", jobDir, jobName);
+		snprintf(runDeck, sizeof(runDeck), "%s/input_file.txt", runDir);
+		make_directory(runDir);
+		if (rename(deckName, runDeck) != 0) {
+			perror(deckName);
+			server_sleep(SERVER_POLL_SECONDS);
+			continue;
+		}
 
-	// Use default devices for now
-	devices[0] = devicePtrCPU[0];
-	devices[1] = devicePtrGPU[chosenOne];
+		printf("\n--- Job %s ---------------------------------------------------\n", jobName);
+		double jobStart = wall_time();
+		int status = 1;
+		if (change_directory(runDir) == 0) {
+			make_directory("matlab_postproc");
+			status = run_simulation(dev, resourceDir);
+			if (change_directory(serverDir) != 0) {
+				perror(serverDir);
+				return 1;
+			}
+		}
+		else {
+			perror(runDir);
+		}
+		double jobTime = wall_time() - jobStart;
+		numJobs++;
+
+		printf("Job %s %s: startup %.3f s, %d device buffers reused, total %.3f s\n", jobName,
+			status == 0 ? "finished" : "failed", dev->StartupTime, dev->BuffersReused, jobTime);
+		FILE* logPtr = fopen(logName, "a");
+		if (logPtr != NULL) {
+			fprintf(logPtr, "%s %s startup %.3f reused %d/%d total %.3f\n", jobName, status == 0 ? "finished" : "failed",
+				dev->StartupTime, dev->BuffersReused, NUM_CL_MEM, jobTime);
+			fclose(logPtr);
+		}
+	}
 
-	free(platforms);
-	free(platformName);
-	free(devicePtrCPU);
-	free(devicePtrGPU);
+	printf("Job server stopped after %d jobs\n", numJobs);
+	return 0;
 }
 
 int create_periodic_stream_mapping(int_param_struct* intDat, cl_int** strMapPtr)
@@ -1017,98 +3064,715 @@ int create_periodic_stream_mapping(int_param_struct* intDat, cl_int** strMapPtr)
 		{N_x-b-1,	N_y-b-1,   N_z-b-1}
 	};
 
-	int* tempMapping;
-	tempMapping = (int*)malloc(N_x*N_y*N_z*2*sizeof(int)); // Max possible size
+	// Counted in the first pass, written in the second with thread-coalesced memory layout:
+	// 1D indices of all nodes, then their face/edge/vertex types
+	cl_int* strMap = NULL;
+	int numMapped = 0;
 	int numPeriodicNodes = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			numMapped = numPeriodicNodes;
+			numPeriodicNodes = 0;
+			strMap = (cl_int*)malloc(numMapped*2*sizeof(cl_int));
+		}
+
+		// Faces
+		for (int face=0; face<6; face++){
+			// If face of periodic boundary
+			if (intDat->BoundaryConds[(int)(face/2)] == 0) {
+
+				for (int i=b+1; i<=faceSpec[face][3]; i++) {
+					for (int j=b+1; j<=faceSpec[face][5]; j++) {
+
+						// Coords of this node
+						int r[3];
+						r[faceSpec[face][0]] = faceSpec[face][1]; // The constant coord in plane
+						r[faceSpec[face][2]] = i;
+						r[faceSpec[face][4]] = j;
+						// 1D index of node
+						int i_1D = (int)lattice_node(r[0], r[1], r[2], intDat->LatticeSize);
+
+						if (strMap != NULL) {
+							strMap[numPeriodicNodes] = i_1D; // 1D index of node in f array
+							strMap[numMapped + numPeriodicNodes] = face; // Boundary node type
+						}
+
+						numPeriodicNodes++;
+					}
+				}
+			}
+		}
 
-	// Write:
-	// 1D index, face/edge/vertex type
+		// Edges
+		// Small perf saving possible, because edges of velocity boundaries don't need all unknowns
+		for (int edge=0; edge<12; edge++) {
 
-	// Faces
-	for (int face=0; face<6; face++){
-		// If face of periodic boundary
-		if (intDat->BoundaryConds[(int)(face/2)] == 0) {
+			// If edge of two periodic boundaries
+			if (intDat->BoundaryConds[edgeSpec[edge][0]] == 0
+			||	intDat->BoundaryConds[edgeSpec[edge][2]] == 0) {
 
-			for (int i=b+1; i<=faceSpec[face][3]; i++) {
-				for (int j=b+1; j<=faceSpec[face][5]; j++) {
+				for (int i=b+1; i<=edgeSpec[edge][5]; i++) {
 
 					// Coords of this node
 					int r[3];
-					r[faceSpec[face][0]] = faceSpec[face][1]; // The constant coord in plane
-					r[faceSpec[face][2]] = i;
-					r[faceSpec[face][4]] = j;
+					r[edgeSpec[edge][0]] = edgeSpec[edge][1]; // Constant coords of edge
+					r[edgeSpec[edge][2]] = edgeSpec[edge][3];
+					r[edgeSpec[edge][4]] = i;
+
 					// 1D index of node
-					int i_1D = r[0] + N_x*(r[1] + r[2]*N_y);
+					int i_1D = (int)lattice_node(r[0], r[1], r[2], intDat->LatticeSize);
 
-					tempMapping[numPeriodicNodes*2	  ] = i_1D; // 1D index of node in f array
-					tempMapping[numPeriodicNodes*2 + 1] = face; // Boundary node type
+					if (strMap != NULL) {
+						strMap[numPeriodicNodes] = i_1D; // 1D index of node f array
+						strMap[numMapped + numPeriodicNodes] = 6 + edge; // Boundary node type
+					}
 
 					numPeriodicNodes++;
 				}
 			}
 		}
-	}
 
-	// Edges
-	// Small perf saving possible, because edges of velocity boundaries don't need all unknowns
-	for (int edge=0; edge<12; edge++) {
+		// Verticies (any boundaries periodic)
+		if (intDat->BoundaryConds[0] == 0
+		||	intDat->BoundaryConds[1] == 0
+		||	intDat->BoundaryConds[2] == 0) {
 
-		// If edge of two periodic boundaries
-		if (intDat->BoundaryConds[edgeSpec[edge][0]] == 0
-		||	intDat->BoundaryConds[edgeSpec[edge][2]] == 0) {
-
-			for (int i=b+1; i<=edgeSpec[edge][5]; i++) {
+			for (int vert=0; vert<8; vert++){
 
 				// Coords of this node
 				int r[3];
-				r[edgeSpec[edge][0]] = edgeSpec[edge][1]; // Constant coords of edge
-				r[edgeSpec[edge][2]] = edgeSpec[edge][3];
-				r[edgeSpec[edge][4]] = i;
+				r[0] = vertSpec[vert][0]; // Constant coords of vert
+				r[1] = vertSpec[vert][1];
+				r[2] = vertSpec[vert][2];
 
 				// 1D index of node
-				int i_1D = r[0] + N_x*(r[1] + r[2]*N_y);
+				int i_1D = (int)lattice_node(r[0], r[1], r[2], intDat->LatticeSize);
 
-				tempMapping[numPeriodicNodes*2	  ] = i_1D; // 1D index of node f array
-				tempMapping[numPeriodicNodes*2 + 1] = 6 + edge; // Boundary node type
+				if (strMap != NULL) {
+					strMap[numPeriodicNodes] = i_1D; // 1D index of node in f array
+					strMap[numMapped + numPeriodicNodes] = 18 + vert; // Boundary node type
+				}
 
 				numPeriodicNodes++;
 			}
 		}
 	}
 
-	// Verticies (any boundaries periodic)
-	if (intDat->BoundaryConds[0] == 0
-	||	intDat->BoundaryConds[1] == 0
-	||	intDat->BoundaryConds[2] == 0) {
+	*strMapPtr = strMap;
+	return numPeriodicNodes;
+}
+
+// Image offset is the last argument of each kernel that crosses the Lees-Edwards boundaries
+// Periodic boundary nodes in order of z plane, so each device of a split lattice takes a contiguous range
+void sort_periodic_mapping(int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes)
+{
+	int N_z = intDat->LatticeSize[2];
+
+	cl_int* sorted = (cl_int*)malloc(numPeriodicNodes*2*sizeof(cl_int));
+	int node = 0;
+	for (int i_z = 0; i_z < N_z; i_z++) {
+		for (int i_k = 0; i_k < numPeriodicNodes; i_k++) {
+			if (lattice_node_plane(strMap[i_k], intDat->LatticeSize) == i_z) {
+				sorted[node] = strMap[i_k];
+				sorted[numPeriodicNodes + node] = strMap[numPeriodicNodes + i_k];
+				node++;
+			}
+		}
+	}
+	memcpy(strMap, sorted, numPeriodicNodes*2*sizeof(cl_int));
+	free(sorted);
+}
+
+// Periodic boundary nodes with z below plane, in a sorted mapping
+int periodic_nodes_below(int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes, int plane)
+{
+	int i_k = 0;
+	while (i_k < numPeriodicNodes && lattice_node_plane(strMap[i_k], intDat->LatticeSize) < plane) {
+		i_k++;
+	}
+	return i_k;
+}
+
+// Fluid kernels for the CPU device, built from GPU_program.cl the first time the lattice is split
+int create_cpu_fluid_kernels(sim_device_struct* dev)
+{
+	if (dev->ProgramFluidCPU != NULL) {
+		return 0;
+	}
+	printf("Creating fluid kernels for the CPU device\n");
+
+	char* programSource = NULL;
+	read_program_source(&programSource, "GPU_program.cl");
+
+	cl_int error;
+	dev->ProgramFluidCPU = clCreateProgramWithSource(dev->Context, 1, (const char**)&programSource, NULL, &error);
+	error_check(error, "clCreateProgramWithSource fluid CPU", 1);
+	free(programSource);
+
+	char latticeOptions[WORD_STRING_SIZE];
+	lattice_build_options(dev->Devices[0], latticeOptions, WORD_STRING_SIZE);
+	char buildOptions[2*WORD_STRING_SIZE];
+	snprintf(buildOptions, sizeof(buildOptions), "-DCOLLIDE_VEC_WIDTH=%d %s", COLLIDE_VEC_WIDTH, latticeOptions);
+	error = clBuildProgram(dev->ProgramFluidCPU, 1, &dev->Devices[0], buildOptions, NULL, NULL);
+	if (error_check(error, "clBuildProgram fluid CPU", 1)) {
+		print_program_build_log(&dev->ProgramFluidCPU, &dev->Devices[0]);
+		return 1;
+	}
+
+	dev->FluidCPU.collide_stream = clCreateKernel(dev->ProgramFluidCPU, "collideMRT_stream_D3Q19", &error);
+	error |= error_check(error, "clCreateKernel collideMRT_stream_D3Q19 CPU", 1);
+
+	dev->FluidCPU.boundary_periodic = clCreateKernel(dev->ProgramFluidCPU, "boundary_periodic", &error);
+	error |= error_check(error, "clCreateKernel boundary_periodic CPU", 1);
+
+	dev->FluidCPU.boundary_velocity = clCreateKernel(dev->ProgramFluidCPU, "boundary_velocity", &error);
+	error |= error_check(error, "clCreateKernel boundary_velocity CPU", 1);
+
+	dev->FluidCPU.initialize_lattice_fields = clCreateKernel(dev->ProgramFluidCPU, "initialize_lattice_fields", &error);
+	error |= error_check(error, "clCreateKernel initialize_lattice_fields CPU", 1);
+
+	// Vector variant for CPU runtimes, where one node per work item barely vectorises
+	cl_device_type deviceType = 0;
+	clGetDeviceInfo(dev->Devices[0], CL_DEVICE_TYPE, sizeof(deviceType), &deviceType, NULL);
+	dev->CollideVecCPU = NULL;
+	if (deviceType & CL_DEVICE_TYPE_CPU) {
+		dev->CollideVecCPU = clCreateKernel(dev->ProgramFluidCPU, "collideMRT_stream_D3Q19_vec", &error);
+		error |= error_check(error, "clCreateKernel collideMRT_stream_D3Q19_vec CPU", 1);
+	}
+
+	return error != CL_SUCCESS;
+}
+
+// Copy z planes [firstPlane, firstPlane+numPlanes) of some components of a lattice field between buffers
+// used on different devices, through host memory (staging: numComps*numPlanes planes)
+cl_int copy_lattice_planes(cl_command_queue srcQueue, cl_mem src, cl_command_queue dstQueue, cl_mem dst,
+	int_param_struct* intDat, const int* comps, int numComps, int firstPlane, int numPlanes, cl_float* staging)
+{
+	size_t n_xy = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1];
+	size_t N_C = n_xy*intDat->LatticeSize[2];
+	size_t numValues = numPlanes*n_xy;
+
+	cl_int err = CL_SUCCESS;
+	for (int c = 0; c < numComps; c++) {
+		size_t offset = (comps[c]*N_C + firstPlane*n_xy)*sizeof(cl_float);
+		err |= clEnqueueReadBuffer(srcQueue, src, c == numComps-1, offset, numValues*sizeof(cl_float), staging + c*numValues,
+			0, NULL, NULL);
+	}
+	for (int c = 0; c < numComps; c++) {
+		size_t offset = (comps[c]*N_C + firstPlane*n_xy)*sizeof(cl_float);
+		err |= clEnqueueWriteBuffer(dstQueue, dst, c == numComps-1, offset, numValues*sizeof(cl_float), staging + c*numValues,
+			0, NULL, NULL);
+	}
+	return err;
+}
+
+// Event callback: time from enqueueing to completion of one device's collide_stream
+void CL_CALLBACK record_split_time(cl_event event, cl_int status, void* data)
+{
+	(void)event;
+	(void)status;
+	split_timing_struct* timing = ((split_callback_struct*)data)->Timing;
+	int device = ((split_callback_struct*)data)->Device;
+
+	pthread_mutex_lock(&timing->Lock);
+	double elapsed = wall_time() - timing->Start;
+	timing->Elapsed[device] += elapsed;
+	timing->TotalTime[device] += elapsed;
+	timing->Steps[device]++;
+	pthread_mutex_unlock(&timing->Lock);
+}
+
+// First CPU plane for the next steps, so both devices take the same time at their measured rates.
+// Moves at most SPLIT_MAX_MOVE planes, and leaves each device at least one
+int balance_split_plane(int_param_struct* intDat, int splitPlane, split_timing_struct* timing)
+{
+	pthread_mutex_lock(&timing->Lock);
+	double gpuTime = timing->Steps[0] > 0 ? timing->Elapsed[0]/timing->Steps[0] : 0.0;
+	double cpuTime = timing->Steps[1] > 0 ? timing->Elapsed[1]/timing->Steps[1] : 0.0;
+	timing->Elapsed[0] = timing->Elapsed[1] = 0.0;
+	timing->Steps[0] = timing->Steps[1] = 0;
+	pthread_mutex_unlock(&timing->Lock);
+
+	if (gpuTime <= 0.0 || cpuTime <= 0.0) {
+		return splitPlane;
+	}
+
+	int n_planes = intDat->LatticeSize[2]-2;
+	int cpuPlanes = n_planes+1 - splitPlane;
+	double gpuRate = (n_planes-cpuPlanes)/gpuTime;
+	double cpuRate = cpuPlanes/cpuTime;
+
+	int target = (int)(n_planes*cpuRate/(gpuRate + cpuRate) + 0.5);
+	target = target > cpuPlanes+SPLIT_MAX_MOVE ? cpuPlanes+SPLIT_MAX_MOVE : target;
+	target = target < cpuPlanes-SPLIT_MAX_MOVE ? cpuPlanes-SPLIT_MAX_MOVE : target;
+	target = target < 1 ? 1 : (target > n_planes-1 ? n_planes-1 : target);
+
+	return n_planes+1 - target;
+}
+
+// Slab thickness for temporal blocking: the planes every step of a sweep is working on at once
+// (about numSteps+1 slabs of f in and out, and u) fit in the device's global memory cache
+int temporal_block_slab_planes(int_param_struct* intDat, cl_device_id device, int numSteps)
+{
+	cl_ulong cacheSize = 0;
+	clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_CACHE_SIZE, sizeof(cacheSize), &cacheSize, NULL);
+
+	int n_planes = intDat->LatticeSize[2]-2;
+	size_t planeBytes = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1]*(2*19 + 3)*sizeof(cl_float);
+	int slabPlanes = (int)(cacheSize/((numSteps+1)*planeBytes));
+
+	return slabPlanes < 1 ? 1 : (slabPlanes > n_planes ? n_planes : slabPlanes);
+}
+
+// numSteps steps from step t of the whole lattice on one device, as a wavefront over z slabs:
+// slab s is taken through step t+l right after slab s+1 went through step t+l-1, while both are in cache.
+// Periodic and velocity boundaries of a slab follow once the slab above it has streamed into it.
+// The particle forcing in gpf is read by every step and held fixed over the block
+cl_int enqueue_temporal_block(cl_command_queue queue, kernel_struct* fluid, cl_kernel collide, size_t collideWidth,
+	cl_mem fA, cl_mem fB, int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes, int t, int numSteps, int slabPlanes)
+{
+	int n_planes = intDat->LatticeSize[2]-2;
+	int numSlabs = (n_planes + slabPlanes-1)/slabPlanes;
+	size_t memSize = sizeof(cl_mem);
+
+	size_t collide_offset[3] = {1, 1, 1};
+	size_t collide_size[3] = {collideWidth, intDat->LatticeSize[1]-2, 0};
+	size_t velBC_offset[3] = {1, 1, 1};
+	size_t velBC_size[3] = {intDat->LatticeSize[0]-2, intDat->LatticeSize[1]-2, 1};
+
+	cl_int err = CL_SUCCESS;
+	for (int p = 0; p < numSlabs+numSteps; p++) {
+		for (int l = 0; l < numSteps && l <= p; l++) {
+			int s = p - l;
+			cl_mem fCollide = (t+l)%2 == 0 ? fA : fB;
+			cl_mem fStream = (t+l)%2 == 0 ? fB : fA;
+
+			if (s < numSlabs) {
+				int firstPlane = 1 + s*slabPlanes;
+				collide_offset[2] = firstPlane;
+				collide_size[2] = n_planes+1-firstPlane < slabPlanes ? n_planes+1-firstPlane : slabPlanes;
+				err |= clSetKernelArg(collide, 0, memSize, &fCollide);
+				err |= clSetKernelArg(collide, 1, memSize, &fStream);
+				err |= clEnqueueNDRangeKernel(queue, collide, 3, collide_offset, collide_size, NULL, 0, NULL, NULL);
+			}
+
+			// Boundaries of the slab below, complete now this slab has streamed into it
+			if (s >= 1 && s-1 < numSlabs) {
+				int b = s-1;
+				size_t firstNode = b == 0 ? 0 : periodic_nodes_below(intDat, strMap, numPeriodicNodes, 1 + b*slabPlanes);
+				size_t endNode = b == numSlabs-1 ? numPeriodicNodes : periodic_nodes_below(intDat, strMap, numPeriodicNodes, 1 + (b+1)*slabPlanes);
+				size_t numNodes = endNode - firstNode;
+				err |= clSetKernelArg(fluid->boundary_periodic, 0, memSize, &fStream);
+				if (numNodes > 0) {
+					err |= clEnqueueNDRangeKernel(queue, fluid->boundary_periodic, 1, &firstNode, &numNodes, NULL, 0, NULL, NULL);
+				}
+
+				if (intDat->BoundaryConds[2] == BC_VELOCITY && !intDat->FuseVelocityBC) {
+					err |= clSetKernelArg(fluid->boundary_velocity, 0, memSize, &fStream);
+					for (int wall = 0; wall < 2; wall++) {
+						if (b == (wall == 0 ? 0 : numSlabs-1)) {
+							velBC_offset[2] = 1 + wall; // Lower or upper wall
+							err |= clEnqueueNDRangeKernel(queue, fluid->boundary_velocity, 3, velBC_offset, velBC_size, NULL, 0, NULL, NULL);
+						}
+					}
+				}
+			}
+		}
+	}
+	return err;
+}
+
+// Device memory of the slab ring an out-of-core fluid streams through
+size_t out_of_core_ring_size(int_param_struct* intDat)
+{
+	int n_planes = intDat->LatticeSize[2]-2;
+	int slabPlanes = intDat->OutOfCorePlanes < n_planes ? intDat->OutOfCorePlanes : n_planes;
+	size_t slabNodes = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1]*(slabPlanes+2);
+
+	// fC, fS, u, gpf, tau and countPoint of a slab, and its int_param_struct
+	size_t slotSize = slabNodes*((2*19 + 3 + 3*intDat->MaxSurfPointsPerNode + 1)*sizeof(cl_float) + sizeof(cl_int))
+		+ sizeof(int_param_struct);
+	return OOC_RING*slotSize;
+}
+
+// Host lattice of an out-of-core fluid, its slabs and their ring of device buffers.
+// With out_of_core_file, f is a shared mapping of that file, unlinked once mapped so it is scratch space
+int out_of_core_init(out_of_core_struct* ooc, sim_device_struct* dev, host_param_struct* hostDat, int_param_struct* intDat)
+{
+	int n_planes = intDat->LatticeSize[2]-2;
+	int slabPlanes = intDat->OutOfCorePlanes < n_planes ? intDat->OutOfCorePlanes : n_planes;
+	size_t n_xy = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1];
+	size_t numNodes = n_xy*intDat->LatticeSize[2];
+
+	memset(ooc, 0, sizeof(out_of_core_struct));
+	ooc->NumSlabs = (n_planes + slabPlanes-1)/slabPlanes;
+	ooc->HostSize = 2*19*numNodes*sizeof(cl_float);
+
+	if (strcmp(hostDat->OutOfCoreFile, "none") == 0) {
+		ooc->f_h[0] = (cl_float*)host_lattice_alloc(ooc->HostSize, hostDat->HugePages);
+		if (ooc->f_h[0] == NULL) {
+			printf("Error: could not allocate %.1f GB of host memory for the fluid\n", 1E-9*ooc->HostSize);
+			return 1;
+		}
+	}
+	else {
+#ifdef _WIN32
+		printf("Error: out_of_core_file is not supported on Windows\n");
+		return 1;
+#else
+		int fd = open(hostDat->OutOfCoreFile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || ftruncate(fd, ooc->HostSize) != 0) {
+			perror(hostDat->OutOfCoreFile);
+			if (fd >= 0) {
+				close(fd);
+			}
+			return 1;
+		}
+		void* map = mmap(NULL, ooc->HostSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		unlink(hostDat->OutOfCoreFile);
+		if (map == MAP_FAILED) {
+			perror(hostDat->OutOfCoreFile);
+			return 1;
+		}
+		ooc->f_h[0] = (cl_float*)map;
+		ooc->Mapped = 1;
+#endif
+	}
+	ooc->f_h[1] = ooc->f_h[0] + 19*numNodes;
+
+	// Periodic x and y boundaries within a slab. Periodic z is taken by the downloads, which wrap the
+	// populations streamed through the z faces round to the far end of the host lattice
+	int_param_struct mapDat = *intDat;
+	mapDat.LatticeSize[2] = slabPlanes+2;
+	mapDat.BoundaryConds[2] = BC_VELOCITY;
+	ooc->NumPeriodicNodes = create_periodic_stream_mapping(&mapDat, &ooc->StrMap);
+
+	// Edges and vertices on a slab's z faces are then only x or y boundary nodes
+	const int xyType[26] = {0,1,2,3,4,5, 6,7,0,0,10,11,1,1,2,2,3,3, 6,6,7,7,10,10,11,11};
+	for (int i_k = 0; i_k < ooc->NumPeriodicNodes; i_k++) {
+		ooc->StrMap[ooc->NumPeriodicNodes + i_k] = xyType[ooc->StrMap[ooc->NumPeriodicNodes + i_k]];
+	}
+	sort_periodic_mapping(&mapDat, ooc->StrMap, ooc->NumPeriodicNodes);
+
+	ooc->SlabDat = (int_param_struct*)malloc(ooc->NumSlabs*sizeof(int_param_struct));
+	for (int s = 0; s < ooc->NumSlabs; s++) {
+		int_param_struct* slabDat = &ooc->SlabDat[s];
+		*slabDat = *intDat;
+		int numPlanes = n_planes - s*slabPlanes < slabPlanes ? n_planes - s*slabPlanes : slabPlanes;
+		slabDat->LatticeSize[2] = numPlanes+2;
+		slabDat->SlabOrigin = s*slabPlanes;
+		slabDat->WholeLatticeZ = intDat->LatticeSize[2];
+		slabDat->FPartPlanes = 19;
+		slabDat->GpfPartPlanes = 3*intDat->MaxSurfPointsPerNode;
+		slabDat->EnsembleSize = 1;
+		slabDat->NumPeriodicNodes = ooc->NumPeriodicNodes;
+	}
+
+	// Uploads and downloads on queues of their own, to overlap the slab being computed
+	cl_int err = CL_SUCCESS;
+	cl_int error;
+#ifdef __APPLE__
+	ooc->QueueUp = clCreateCommandQueue(dev->Context, dev->Devices[1], 0, &error);
+	err |= error;
+	ooc->QueueDown = clCreateCommandQueue(dev->Context, dev->Devices[1], 0, &error);
+	err |= error;
+#else
+	ooc->QueueUp = clCreateCommandQueueWithProperties(dev->Context, dev->Devices[1], 0, &error);
+	err |= error;
+	ooc->QueueDown = clCreateCommandQueueWithProperties(dev->Context, dev->Devices[1], 0, &error);
+	err |= error;
+#endif
+
+	size_t slabNodes = n_xy*(slabPlanes+2);
+	size_t floatSize = slabNodes*sizeof(cl_float);
+	for (int r = 0; r < OOC_RING; r++) {
+		ooc->fC[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, 19*floatSize, NULL, &error);
+		err |= error;
+		ooc->fS[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, 19*floatSize, NULL, &error);
+		err |= error;
+		ooc->u[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, 3*floatSize, NULL, &error);
+		err |= error;
+		ooc->gpf[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, 3*intDat->MaxSurfPointsPerNode*floatSize, NULL, &error);
+		err |= error;
+		ooc->tau[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, floatSize, NULL, &error);
+		err |= error;
+		ooc->countPoint[r] = clCreateBuffer(dev->Context, CL_MEM_READ_WRITE, slabNodes*sizeof(cl_int), NULL, &error);
+		err |= error;
+		ooc->SlabDat_cl[r] = clCreateBuffer(dev->Context, CL_MEM_READ_ONLY, sizeof(int_param_struct), NULL, &error);
+		err |= error;
+	}
+	size_t smDataSize = (ooc->NumPeriodicNodes > 0 ? ooc->NumPeriodicNodes : 1)*2*sizeof(cl_int);
+	ooc->StrMap_cl = clCreateBuffer(dev->Context, CL_MEM_READ_ONLY, smDataSize, NULL, &error);
+	err |= error;
+	if (ooc->NumPeriodicNodes > 0) {
+		err |= clEnqueueWriteBuffer(ooc->QueueUp, ooc->StrMap_cl, CL_TRUE, 0, smDataSize, ooc->StrMap, 0, NULL, NULL);
+	}
+
+	// What was created is released by out_of_core_release
+	if (err != CL_SUCCESS) {
+		printf("Error: could not create the out-of-core queues and slab ring (%d)\n", err);
+		return 1;
+	}
+
+	printf("Out-of-core fluid: %d slabs of %d planes, %.1f GB of populations in %s\n", ooc->NumSlabs, slabPlanes,
+		1E-9*ooc->HostSize, ooc->Mapped ? "a mapped file" : "host memory");
+
+	return 0;
+}
+
+// Initial state: the ring slots are initialized as slab lattices, the first slot's populations are copied
+// over the host lattice and its u and tau over the device-resident fields (all initial fields are uniform)
+cl_int out_of_core_fill(out_of_core_struct* ooc, host_param_struct* hostDat, cl_command_queue queue, cl_kernel init,
+	cl_mem flpDat_cl, cl_mem u_cl, cl_mem tau_cl)
+{
+	int_param_struct* slabDat = &ooc->SlabDat[0];
+	size_t n_xy = (size_t)slabDat->LatticeSize[0]*slabDat->LatticeSize[1];
+	size_t slab_C = n_xy*slabDat->LatticeSize[2];
+	int N_z = slabDat->WholeLatticeZ;
+	size_t N_C = n_xy*N_z;
+
+	cl_int err = CL_SUCCESS;
+	for (int r = 0; r < OOC_RING; r++) {
+		err |= clEnqueueWriteBuffer(queue, ooc->SlabDat_cl[r], CL_TRUE, 0, sizeof(int_param_struct), slabDat, 0, NULL, NULL);
+		cl_mem fields[9] = {ooc->fC[r], ooc->fS[r], ooc->u[r], ooc->gpf[r], ooc->tau[r], ooc->countPoint[r], NULL, NULL, NULL};
+		err |= initialize_lattice_fields(hostDat, slabDat, queue, init, fields, ooc->SlabDat_cl[r], flpDat_cl, 1);
+	}
+
+	for (int firstPlane = 0; firstPlane < N_z; firstPlane += slabDat->LatticeSize[2]) {
+		int numPlanes = N_z - firstPlane < slabDat->LatticeSize[2] ? N_z - firstPlane : slabDat->LatticeSize[2];
+		size_t planesSize = numPlanes*n_xy*sizeof(cl_float);
+		for (int q = 0; q < 19; q++) {
+			err |= clEnqueueReadBuffer(queue, ooc->fC[0], CL_FALSE, q*slab_C*sizeof(cl_float), planesSize,
+				ooc->f_h[0] + q*N_C + firstPlane*n_xy, 0, NULL, NULL);
+		}
+		for (int c = 0; c < 3; c++) {
+			err |= clEnqueueCopyBuffer(queue, ooc->u[0], u_cl, c*slab_C*sizeof(cl_float),
+				(c*N_C + firstPlane*n_xy)*sizeof(cl_float), planesSize, 0, NULL, NULL);
+		}
+		err |= clEnqueueCopyBuffer(queue, ooc->tau[0], tau_cl, 0, firstPlane*n_xy*sizeof(cl_float), planesSize, 0, NULL, NULL);
+	}
+	err |= clFinish(queue);
+
+	memcpy(ooc->f_h[1], ooc->f_h[0], ooc->HostSize/2);
+	return err;
+}
+
+// Download numPlanes planes of population q from a slab (from slabPlane) to the host lattice (from hostPlane).
+// With wrap (periodic z), what was streamed into the buffer plane below goes to the top interior plane
+// and the buffer plane above to the bottom one, as boundary_periodic would take them
+cl_int out_of_core_read_planes(cl_command_queue queue, cl_mem slab, size_t slab_C, int slabPlane, cl_float* f_h,
+	int_param_struct* intDat, int q, int hostPlane, int numPlanes, int wrap)
+{
+	int n_planes = intDat->LatticeSize[2]-2;
+	size_t n_xy = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1];
+	size_t N_C = n_xy*intDat->LatticeSize[2];
+
+	cl_int err = CL_SUCCESS;
+	int run = 1;
+	for (int k = 0; k < numPlanes; k += run) {
+		int plane = hostPlane + k;
+		run = 1;
+		if (wrap && plane == 0) {
+			plane = n_planes;
+		}
+		else if (wrap && plane == n_planes+1) {
+			plane = 1;
+		}
+		else {
+			while (k+run < numPlanes && !(wrap && plane+run == n_planes+1)) {
+				run++;
+			}
+		}
+		err |= clEnqueueReadBuffer(queue, slab, CL_FALSE, (q*slab_C + (slabPlane+k)*n_xy)*sizeof(cl_float),
+			run*n_xy*sizeof(cl_float), f_h + q*N_C + plane*n_xy, 0, NULL, NULL);
+	}
+	return err;
+}
 
-		for (int vert=0; vert<8; vert++){
+// Step t of an out-of-core fluid. Each slab, its interior planes and a halo plane either side, goes through
+// a ring slot: uploaded on QueueUp, periodic x and y boundaries, particle forces spread onto it, collide_stream
+// and u and tau copied back on queue, then downloaded on QueueDown. Each population is downloaded from the
+// planes it was streamed into, so the halos carry what crossed into the neighbouring slabs.
+// Slots are reused once their last collide_stream and download are done, so transfers overlap computing
+cl_int out_of_core_sweep(out_of_core_struct* ooc, kernel_struct* kernelDat, cl_command_queue queue, int_param_struct* intDat,
+	cl_mem flpDat_cl, cl_mem u_cl, cl_mem tau_cl, cl_mem pointForce_cl, size_t numSurfPoints, int t)
+{
+	cl_float* f_c = ooc->f_h[t%2];
+	cl_float* f_s = ooc->f_h[(t+1)%2];
+	size_t n_xy = (size_t)intDat->LatticeSize[0]*intDat->LatticeSize[1];
+	size_t N_C = n_xy*intDat->LatticeSize[2];
+	size_t fSize = sizeof(cl_float);
+	size_t memSize = sizeof(cl_mem);
+	int wrap = intDat->BoundaryConds[2] == BC_PERIODIC;
+	cl_mem noBuffer = NULL;
+	cl_float noOffset = 0.0f;
+
+	cl_int err = CL_SUCCESS;
+	for (int s = 0; s < ooc->NumSlabs; s++) {
+		int r = s%OOC_RING;
+		int_param_struct* slabDat = &ooc->SlabDat[s];
+		int numPlanes = slabDat->LatticeSize[2]-2;
+		int hostPlane = 1 + slabDat->SlabOrigin; // Host plane of the slab's plane 1
+		size_t slab_C = n_xy*slabDat->LatticeSize[2];
+		size_t planesSize = numPlanes*n_xy*fSize;
+
+		// Upload, once the slot's last collide_stream (or the last sweep) is done
+		cl_event uploaded;
+		cl_event* slotFree = s < OOC_RING ? &ooc->SweepDone : &ooc->Computed[r];
+		if (*slotFree != NULL) {
+			err |= clEnqueueBarrierWithWaitList(ooc->QueueUp, 1, slotFree, NULL);
+		}
+		err |= clEnqueueWriteBuffer(ooc->QueueUp, ooc->SlabDat_cl[r], CL_FALSE, 0, sizeof(int_param_struct), slabDat, 0, NULL, NULL);
+		for (int q = 0; q < 19; q++) {
+			err |= clEnqueueWriteBuffer(ooc->QueueUp, ooc->fC[r], CL_FALSE, (q*slab_C + n_xy)*fSize, planesSize,
+				f_c + q*N_C + hostPlane*n_xy, 0, NULL, NULL);
+		}
+		err |= clEnqueueMarkerWithWaitList(ooc->QueueUp, 0, NULL, &uploaded);
+		clFlush(ooc->QueueUp);
+
+		// Compute, once uploaded and the slot's last download in this sweep is done (the upload follows the last sweep's)
+		cl_event computeWait[2] = {uploaded, ooc->Downloaded[r]};
+		err |= clEnqueueBarrierWithWaitList(queue, s < OOC_RING ? 1 : 2, computeWait, NULL);
+		clReleaseEvent(uploaded);
+		err |= clEnqueueCopyBuffer(queue, tau_cl, ooc->tau[r], hostPlane*n_xy*fSize, n_xy*fSize, planesSize, 0, NULL, NULL);
+
+		size_t periodic_work_size = periodic_nodes_below(slabDat, ooc->StrMap, ooc->NumPeriodicNodes, numPlanes+1);
+		if (periodic_work_size > 0) {
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 0, memSize, &ooc->fC[r]);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 1, memSize, &ooc->SlabDat_cl[r]);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 2, memSize, &ooc->StrMap_cl);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 3, memSize, &flpDat_cl);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 4, memSize, &ooc->u[r]);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 5, sizeof(cl_float), &noOffset);
+			err |= clSetKernelArg(kernelDat->boundary_periodic, 6, memSize, &noBuffer);
+			err |= clEnqueueNDRangeKernel(queue, kernelDat->boundary_periodic, 1, NULL, &periodic_work_size, NULL, 0, NULL, NULL);
+		}
 
-			// Coords of this node
-			int r[3];
-			r[0] = vertSpec[vert][0]; // Constant coords of vert
-			r[1] = vertSpec[vert][1];
-			r[2] = vertSpec[vert][2];
+		// Forces of the surface points whose stencils reach this slab, halo planes included
+		if (intDat->NumParticles > 0) {
+			size_t gpf_offset[3] = {1, 1, 0};
+			size_t gpf_size[3] = {intDat->LatticeSize[0]-2, intDat->LatticeSize[1]-2, numPlanes+2};
+			err |= clSetKernelArg(kernelDat->reset_particle_fluid_forces, 0, memSize, &ooc->SlabDat_cl[r]);
+			err |= clSetKernelArg(kernelDat->reset_particle_fluid_forces, 1, memSize, &flpDat_cl);
+			err |= clSetKernelArg(kernelDat->reset_particle_fluid_forces, 2, memSize, &ooc->gpf[r]);
+			err |= clSetKernelArg(kernelDat->reset_particle_fluid_forces, 3, memSize, &noBuffer);
+			err |= clEnqueueNDRangeKernel(queue, kernelDat->reset_particle_fluid_forces, 3, gpf_offset, gpf_size, NULL, 0, NULL, NULL);
+
+			err |= clSetKernelArg(kernelDat->spread_particle_forces_slab, 0, memSize, &ooc->SlabDat_cl[r]);
+			err |= clSetKernelArg(kernelDat->spread_particle_forces_slab, 1, memSize, &flpDat_cl);
+			err |= clSetKernelArg(kernelDat->spread_particle_forces_slab, 2, memSize, &ooc->gpf[r]);
+			err |= clSetKernelArg(kernelDat->spread_particle_forces_slab, 3, memSize, &ooc->countPoint[r]);
+			err |= clSetKernelArg(kernelDat->spread_particle_forces_slab, 4, memSize, &pointForce_cl);
+			err |= clEnqueueNDRangeKernel(queue, kernelDat->spread_particle_forces_slab, 1, NULL, &numSurfPoints, NULL, 0, NULL, NULL);
+
+			err |= clSetKernelArg(kernelDat->sum_particle_fluid_forces, 0, memSize, &ooc->SlabDat_cl[r]);
+			err |= clSetKernelArg(kernelDat->sum_particle_fluid_forces, 1, memSize, &flpDat_cl);
+			err |= clSetKernelArg(kernelDat->sum_particle_fluid_forces, 2, memSize, &ooc->gpf[r]);
+			err |= clSetKernelArg(kernelDat->sum_particle_fluid_forces, 3, memSize, &noBuffer);
+			err |= clEnqueueNDRangeKernel(queue, kernelDat->sum_particle_fluid_forces, 3, gpf_offset, gpf_size, NULL, 0, NULL, NULL);
+		}
 
-			// 1D index of node
-			int i_1D = r[0] + N_x*(r[1] + r[2]*N_y);
+		size_t collide_offset[3] = {1, 1, 1};
+		size_t collide_size[3] = {intDat->LatticeSize[0]-2, intDat->LatticeSize[1]-2, numPlanes};
+		cl_mem collideArgs[11] = {ooc->fC[r], ooc->fS[r], ooc->gpf[r], ooc->u[r], ooc->tau[r], ooc->countPoint[r],
+			ooc->SlabDat_cl[r], flpDat_cl, NULL, NULL, NULL};
+		for (int i = 0; i < 11; i++) {
+			err |= clSetKernelArg(kernelDat->collide_stream, i, memSize, &collideArgs[i]);
+		}
+		err |= clEnqueueNDRangeKernel(queue, kernelDat->collide_stream, 3, collide_offset, collide_size, NULL, 0, NULL, NULL);
 
-			tempMapping[numPeriodicNodes*2	  ] = i_1D; // 1D index of node in f array
-			tempMapping[numPeriodicNodes*2 + 1] = 18 + vert; // Boundary node type
+		// u and tau back to the device-resident fields the particle and output kernels read
+		for (int c = 0; c < 3; c++) {
+			err |= clEnqueueCopyBuffer(queue, ooc->u[r], u_cl, (c*slab_C + n_xy)*fSize, (c*N_C + hostPlane*n_xy)*fSize,
+				planesSize, 0, NULL, NULL);
+		}
+		err |= clEnqueueCopyBuffer(queue, ooc->tau[r], tau_cl, n_xy*fSize, hostPlane*n_xy*fSize, planesSize, 0, NULL, NULL);
 
-			numPeriodicNodes++;
+		if (ooc->Computed[r] != NULL) {
+			clReleaseEvent(ooc->Computed[r]);
 		}
+		err |= clEnqueueMarkerWithWaitList(queue, 0, NULL, &ooc->Computed[r]);
+		clFlush(queue);
+
+		// Download, each population from the planes it was streamed into
+		err |= clEnqueueBarrierWithWaitList(ooc->QueueDown, 1, &ooc->Computed[r], NULL);
+		for (int q = 0; q < 19; q++) {
+			int c_z = intDat->BasisVel[q][2];
+			err |= out_of_core_read_planes(ooc->QueueDown, ooc->fS[r], slab_C, 1+c_z, f_s, intDat, q, hostPlane+c_z, numPlanes, wrap);
+		}
+		if (ooc->Downloaded[r] != NULL) {
+			clReleaseEvent(ooc->Downloaded[r]);
+		}
+		err |= clEnqueueMarkerWithWaitList(ooc->QueueDown, 0, NULL, &ooc->Downloaded[r]);
+		clFlush(ooc->QueueDown);
 	}
 
-	// Copy to mapping array with thread-coalesced memory layout
-	*strMapPtr = (cl_int*)malloc(numPeriodicNodes*2*sizeof(cl_int));
-	for (int node=0; node<numPeriodicNodes; node++) {
-		(*strMapPtr)[					node] = tempMapping[node*2	  ]; // 1D index
-		(*strMapPtr)[numPeriodicNodes + node] = tempMapping[node*2 + 1]; // Boundary node type
+	// The next sweep reads what this one wrote, once the last download (and so every one) is done
+	if (ooc->SweepDone != NULL) {
+		clReleaseEvent(ooc->SweepDone);
 	}
+	ooc->SweepDone = ooc->Downloaded[(ooc->NumSlabs-1)%OOC_RING];
+	clRetainEvent(ooc->SweepDone);
 
-	free(tempMapping);
+	return err;
+}
 
-	return numPeriodicNodes;
+void out_of_core_release(out_of_core_struct* ooc)
+{
+	if (ooc->f_h[0] == NULL) {
+		return;
+	}
+	clFinish(ooc->QueueUp);
+	clFinish(ooc->QueueDown);
+
+	for (int r = 0; r < OOC_RING; r++) {
+		cl_mem slotBufs[7] = {ooc->fC[r], ooc->fS[r], ooc->u[r], ooc->gpf[r], ooc->tau[r], ooc->countPoint[r], ooc->SlabDat_cl[r]};
+		for (int i = 0; i < 7; i++) {
+			clReleaseMemObject(slotBufs[i]);
+		}
+		if (ooc->Computed[r] != NULL) {
+			clReleaseEvent(ooc->Computed[r]);
+		}
+		if (ooc->Downloaded[r] != NULL) {
+			clReleaseEvent(ooc->Downloaded[r]);
+		}
+	}
+	if (ooc->SweepDone != NULL) {
+		clReleaseEvent(ooc->SweepDone);
+	}
+	clReleaseMemObject(ooc->StrMap_cl);
+	clReleaseCommandQueue(ooc->QueueUp);
+	clReleaseCommandQueue(ooc->QueueDown);
+	free(ooc->SlabDat);
+	free(ooc->StrMap);
+
+#ifndef _WIN32
+	if (ooc->Mapped) {
+		munmap(ooc->f_h[0], ooc->HostSize);
+	}
+	else {
+		free(ooc->f_h[0]);
+	}
+#else
+	free(ooc->f_h[0]);
+#endif
+	ooc->f_h[0] = NULL;
+}
+
+cl_int set_lees_edwards_offset(kernel_struct* kernelDat, cl_float leOffset)
+{
+	size_t argSize = sizeof(cl_float);
+	cl_int err_cl = CL_SUCCESS;
+
+	err_cl |= clSetKernelArg(kernelDat->boundary_periodic, 5, argSize, &leOffset);
+	err_cl |= clSetKernelArg(kernelDat->particle_fluid_forces_linear_stencil, 11, argSize, &leOffset);
+	err_cl |= clSetKernelArg(kernelDat->particle_particle_forces, 11, argSize, &leOffset);
+	err_cl |= clSetKernelArg(kernelDat->particle_dynamics, 9, argSize, &leOffset);
+	err_cl |= clSetKernelArg(kernelDat->particle_substep_kick_drift, 10, argSize, &leOffset);
+	err_cl |= clSetKernelArg(kernelDat->particle_substep_kick, 10, argSize, &leOffset);
+
+	return err_cl;
 }
 
 int equilibrium_distribution_D3Q19(float rho, float* vel, float* f_eq)
@@ -1,8 +1,27 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE // Thread affinity
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <math.h>
-
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <direct.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
@@ -11,6 +30,8 @@
 #endif
 
 #include "struct_header_host.h"
+#include "trajectory_format.h"
+#include "lattice_layout.h"
 
 #define TYPE_INT 0
 #define TYPE_FLOAT 1
@@ -29,11 +50,88 @@
 
 #define WORD_STRING_SIZE 128
 
+#define VIDEO_XYZ 0
+#define VIDEO_BINARY 1
+#define VIDEO_BINARY_INT16 2
+
+#define OUTPUT_SNAPSHOTS 2 // Output steps that can be in flight while the simulation continues
+#define SNAPSHOT_EVENTS 3
+#define NUM_STAT_FIELDS 7 // u_x, u_y, u_z, tau, force density x, y, z (as in GPU_program.cl)
+#define STATS_MAGIC 0x54415453 // "STAT"
+
+#define CHECKPOINT_MAGIC 0x504B4843 // "CHKP"
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_NAME_SIZE 64
+// Checkpoint sections, in file order
+#define CKPT_F 0 // The f buffer the next collide_stream reads
+#define CKPT_U 1
+#define CKPT_GPF 2
+#define CKPT_TAU 3
+#define CKPT_PAR_KIN 4 // Particle sections up to CKPT_NUM_PAR_IN_THREAD are on the CPU queue
+#define CKPT_PAR_FORCE 5
+#define CKPT_PAR_FLUID_FORCE 6
+#define CKPT_PARS_ZONE 7
+#define CKPT_ZONE_MEMBERS 8
+#define CKPT_NUM_PAR_IN_ZONE 9
+#define CKPT_THREAD_MEMBERS 10
+#define CKPT_NUM_PAR_IN_THREAD 11
+#define CKPT_STAT_MEAN 12
+#define CKPT_STAT_M2 13
+#define CHECKPOINT_SECTIONS 14
+
+#define SHEAR_CONTROL_MAX_STEP 1.5f // Largest change of the wall velocities in one controller update (factor)
+#define SHEAR_CONTROL_MAX_VELOCITY 0.3f // Wall speed cap for the controller (lattice units), keeps Ma = u/c_s near 0.5, below the compressibility limit
+
+#define CONVERGE_MAX_WINDOW 256 // Shear rate samples kept for the convergence monitor
+#define CONVERGE_BATCHES 8 // Batch means for the standard error of correlated samples
+
+#define SERVER_POLL_SECONDS 1 // Job directory polling interval
+#define SERVER_STOP_FILE "stop_server" // Created in the job directory to stop the server
+#define SERVER_LOG_FILE "job_log.txt"
+
+#define SPLIT_MAX_MOVE 4 // Most z planes moved between the devices in one rebalance
+#define COLLIDE_VEC_WIDTH 8 // Nodes along x per work item of the vector collide_stream on CPU devices
+
+#define HUGE_PAGE_SIZE (2*1024*1024) // Alignment of host lattice arrays for transparent huge pages
+#define MAX_NUMA_NODES 64
+
+#define PROFILE_WORK_SIZE 64 // Work group per plane for the velocity profile (power of 2)
+
+#define SPHERE_MAX_SETS 16
+#define SPHERE_CACHE_MAGIC 0x53505431 // "SPT1"
+#define SPHERE_MIN_POINTS 32
+
+#define PACKING_INITIAL_SCALE 0.8f
+#define PACKING_GROWTH 0.01f
+#define PACKING_PUSH_MARGIN 1.01f // Push slightly past contact, so overlaps clear in finite precision
+
 
 #ifndef M_PI
 	#define M_PI 3.14159265358979323846
 #endif
 
+// Large file offsets (trajectories, checkpoints)
+#ifdef _WIN32
+	#define file_seek _fseeki64
+	#define file_tell _ftelli64
+#else
+	#define file_seek fseeko
+	#define file_tell ftello
+#endif
+
+// Directories, for server mode
+#ifdef _WIN32
+	#define make_directory(name) _mkdir(name)
+	#define change_directory _chdir
+	#define current_directory _getcwd
+	#define server_sleep(seconds) Sleep(1000*(seconds))
+#else
+	#define make_directory(name) mkdir(name, 0755)
+	#define change_directory chdir
+	#define current_directory getcwd
+	#define server_sleep(seconds) sleep(seconds)
+#endif
+
 // X-macros
 #define LIST_OF_KERNELS \
 	X(collide_stream) \
@@ -44,7 +142,15 @@
 	X(reset_particle_fluid_forces) \
 	X(particle_dynamics) \
 	X(particle_particle_forces) \
-	X(update_particle_zones)
+	X(particle_substep_kick_drift) \
+	X(particle_substep_kick) \
+	X(plane_average_velocity) \
+	X(profile_shear_rates) \
+	X(gather_fluid_output) \
+	X(accumulate_field_statistics) \
+	X(update_particle_zones) \
+	X(initialize_lattice_fields) \
+	X(spread_particle_forces_slab)
 
 
 #define LIST_OF_CL_MEM \
@@ -61,19 +167,47 @@
 	X(parFluidForce_cl) \
 	X(parFluidForceSum_cl) \
 	X(spherePoints_cl) \
+	X(parProps_cl) \
+	X(parSurfOffset_cl) \
+	X(surfPointMap_cl) \
 	X(strMap_cl) \
 	X(parsZone_cl) \
 	X(zoneMembers_cl) \
 	X(numParInZone_cl) \
 	X(zoneNeighDat_cl) \
 	X(threadMembers_cl) \
-	X(numParInThread_cl) 
+	X(numParInThread_cl) \
+	X(fluidStage_cl) \
+	X(fluidPinned_cl) \
+	X(uProfile_cl) \
+	X(statMean_cl) \
+	X(statM2_cl) \
+	X(fA_cpu_cl) \
+	X(fB_cpu_cl) \
+	X(u_cpu_cl) \
+	X(gpf_cpu_cl) \
+	X(countPoint_cpu_cl) \
+	X(tau_lb_cpu_cl) \
+	X(fA_hi_cl) \
+	X(fB_hi_cl) \
+	X(gpf_hi_cl) \
+	X(pointForce_cl)
+
+// Buffer pool slots, in LIST_OF_CL_MEM order
+enum {
+#define X(memName) POOL_##memName,
+	LIST_OF_CL_MEM
+#undef X
+	NUM_CL_MEM
+};
 
 
 // Struct to contain information not accessed from within kernels
 typedef struct {
 
 	cl_int ConsolePrintFreq;
+	char ResourceDir[WORD_STRING_SIZE]; // Prefix for unit_sphere_partitions/, set by the job server
+	char EnsembleFile[WORD_STRING_SIZE];
 	char InitialDist[WORD_STRING_SIZE];
 	cl_float InitialVel[3];
 	cl_int InitialParticleDistribution;
@@ -85,13 +219,60 @@ typedef struct {
 	size_t MaxWorkGroupSize;
 	cl_int RebuildFreq;
 	cl_int VideoFreq;
+	cl_int VideoFormat;
+	cl_int OutputVorticity;
 	cl_int FluidOutputSpacing;
-	cl_int TangentialVelBC[3];
 	cl_int ShearStressFreq;
+	cl_int ShearProfileHistory;
+	cl_int ConvergeWindow;
+	cl_float TargetShearRate;
+	cl_float ShearControlGain;
+	cl_float ConvergeTolerance;
+	cl_int FieldAverageStart;
+	cl_int FieldAverageFreq;
+	cl_float CpuPlaneFraction;
+	cl_int SplitBalanceFreq;
+	cl_int CpuCollideVector;
+	cl_int HugePages;
+	cl_int TemporalBlockSteps;
+	cl_int TemporalBlockPlanes;
+	char OutOfCoreFile[WORD_STRING_SIZE];
+	cl_int SnapshotCodec;
+	cl_int SnapshotMantissaBits;
+	cl_int SnapshotSlabPlanes;
+	cl_int SnapshotThreads;
+	cl_int CheckpointFreq;
+	cl_int CheckpointKeep;
+	char RestartFile[WORD_STRING_SIZE];
+	cl_int RestartResetTime;
 	cl_float RandParticleShift;
+	cl_float BidisperseDiam;
+	cl_float BidisperseFraction;
+	cl_float MaxParticleDiam;
+	cl_int MinPointsPerParticle;
+	cl_int NumSpherePoints;
+	cl_int SurfPointGenerator;
+	cl_float SurfPointDensity;
+	cl_int ParticleSubsteps;
+	cl_float PackingVolFraction;
+	cl_int PackingCompression;
+	cl_int PackingMaxAttempts;
 
 } host_param_struct;
 
+// Cell grid for overlap checks when packing particles
+typedef struct {
+	cl_int NumCells[3];
+	cl_float CellWidth[3];
+	cl_float Lo[3];  // Region available to particle centres
+	cl_float Len[3];
+	cl_int Periodic[3];
+	cl_int* CellHead;    // First particle in each cell, -1 if empty
+	cl_int* NextInCell;  // Linked list through particles
+	cl_int* ParCell;
+
+} packing_grid_struct;
+
 
 typedef struct {
 #define X(kernelName) cl_kernel kernelName;
@@ -100,6 +281,85 @@ typedef struct {
 } kernel_struct;
 
 
+// OpenCL objects that outlive a simulation: set up once, then reused by every job in server mode
+typedef struct {
+
+	cl_device_id Devices[2]; // One CPU, one GPU
+	cl_device_id RootCPU;    // Devices[0] is a sub-device of it when pinned to a NUMA node
+	cl_int CpuNumaNode;      // -1 for the whole CPU device
+	cl_context Context;
+	cl_command_queue QueueCPU;
+	cl_command_queue QueueGPU;
+	cl_command_queue QueueRead; // Output readback
+	cl_program ProgramCPU;
+	cl_program ProgramGPU;
+	kernel_struct Kernels;
+	cl_program ProgramFluidCPU; // GPU_program.cl built for the CPU device, when the lattice is split
+	kernel_struct FluidCPU;     // Only collide_stream, boundary_periodic, boundary_velocity and initialize_lattice_fields
+	cl_kernel CollideVecCPU;    // collideMRT_stream_D3Q19_vec, NULL unless Devices[0] is a CPU type device
+	size_t WorkItemSizes[3];
+	size_t MaxWorkGroupSize;
+	// Device buffers, reallocated only when their size or flags change
+	cl_mem Pool[NUM_CL_MEM];
+	size_t PoolSize[NUM_CL_MEM];
+	cl_mem_flags PoolFlags[NUM_CL_MEM];
+	cl_int BuffersReused;  // In the latest simulation
+	double StartupTime;    // Latest simulation, from reading its input to the first time step
+
+} sim_device_struct;
+
+
+// Per-step collide_stream times of the two devices when the lattice is split, from event callbacks
+typedef struct {
+
+	double Start;          // Both collide_stream kernels enqueued
+	double Elapsed[2];     // Summed over steps, GPU then CPU
+	cl_int Steps[2];
+	double TotalTime[2];   // Whole run, for the update rates
+	pthread_mutex_t Lock;
+
+} split_timing_struct;
+
+// Event callback data, one per device
+typedef struct {
+
+	split_timing_struct* Timing;
+	int Device;            // 0 GPU, 1 CPU
+
+} split_callback_struct;
+
+
+// Out-of-core fluid (out_of_core_planes): f for the whole lattice in host memory or a mapped file, passed through
+// the GPU in z slabs each step by a ring of slab buffers (see out_of_core_sweep). u and tau stay on the device
+#define OOC_RING 2
+
+typedef struct {
+
+	int NumSlabs;
+	cl_float* f_h[2];          // fA, fB
+	size_t HostSize;           // Bytes of both
+	int Mapped;                // f_h is a file mapping rather than host_lattice_alloc memory
+	int_param_struct* SlabDat; // Per slab, its lattice: SlabPlanes+2 planes or fewer, from SlabOrigin
+	cl_int* StrMap;            // Periodic x and y nodes of a slab, sorted by plane, z left to the slab exchange
+	cl_int NumPeriodicNodes;
+	cl_command_queue QueueUp;
+	cl_command_queue QueueDown;
+	// Ring slots, each laid out as a full slab lattice
+	cl_mem fC[OOC_RING];
+	cl_mem fS[OOC_RING];
+	cl_mem u[OOC_RING];
+	cl_mem gpf[OOC_RING];
+	cl_mem tau[OOC_RING];
+	cl_mem countPoint[OOC_RING];
+	cl_mem SlabDat_cl[OOC_RING];
+	cl_mem StrMap_cl;
+	cl_event Computed[OOC_RING];   // Last collide_stream in each slot, before its fC is refilled
+	cl_event Downloaded[OOC_RING]; // Last download from each slot, before its fS is written again
+	cl_event SweepDone;            // Last download of the latest sweep, before the next reads the host lattice
+
+} out_of_core_struct;
+
+
 typedef struct {
 
 	char keyword[WORD_STRING_SIZE];
@@ -110,17 +370,104 @@ typedef struct {
 } input_data_struct;
 
 
+// Header of field_statistics.bin, followed by the means then the (unbiased) variances,
+// each NUM_STAT_FIELDS float32 fields over the interior nodes with i_x varying fastest
+typedef struct {
+
+	cl_int Magic;
+	cl_int LatticeSize[3]; // Including buffer layer
+	cl_int NumFields;
+	cl_int NumSamples;
+	cl_int StartIteration;
+	cl_int SampleFreq;
+
+} field_statistics_header_struct;
+
+
+// Binary trajectory writer thread, fed from two host frame buffers
+typedef struct {
+
+	FILE* fPtr;
+	trajectory_header_struct Header;
+	cl_float* Frames[2];  // Fluid columns then particle x, v columns
+	cl_short* Packed;     // int16 fluid columns, used by the writer thread only
+	cl_int FrameNum[2];
+	cl_int Full[2];
+	cl_int Next;          // Buffer the main thread fills next
+	cl_int Stop;
+	pthread_t Thread;
+	pthread_mutex_t Lock;
+	pthread_cond_t Cond;
+
+} trajectory_writer_struct;
+
+
+// Output step copied to device staging memory, then read back without blocking
+typedef struct {
+
+	cl_float* fluid_h;    // Gathered fluid columns, pinned host memory
+	cl_float4* parKin_h;
+	cl_float* profile_h;  // Velocity profile history, n_z*3 floats per row
+	cl_int* ProfileFrames;
+	cl_event Ready[SNAPSHOT_EVENTS]; // Fluid (GPU read queue), particle (CPU queue) and profile (GPU queue) reads
+	cl_int Frame;
+	cl_int Video;
+	cl_int NumProfiles;
+
+} output_snapshot_struct;
+
+
 typedef struct {
 
 	int ShearStressCount;
 	float ShearStressAvg;
 	float ActualShearRate;
 
+	// Convergence monitor, over the latest ConvergeWindow samples of the wall and particle-region shear rates
+	int NumShearSamples;
+	float RecentShear[2][CONVERGE_MAX_WINDOW]; // Ring buffers
+	int ConvergedFrame;   // 0 until converged
+	float ConvergedMean[2];
+	float ConvergedStdErr[2];
+
 } output_data_struct;
 
 
-//int simulation_main(host_param_struct* hostDat, cl_device_id* devices, cl_command_queue* CPU_QueuePtr, cl_command_queue* GPU_QueuePtr,
-//	cl_context* contextPtr, cl_program* programCPU, cl_program* programGPU);
+// Checkpoint file: this header, then each section in order, SectionSize bytes each
+typedef struct {
+
+	cl_int Magic;
+	cl_int Version;
+	cl_int Iteration;
+	cl_int LatticeSize[3];
+	cl_int LatticeBrick;  // Node order of the lattice sections (LATTICE_BRICK)
+	cl_int NumParticles;
+	cl_int StatSamples;
+	double LEOffset;      // Lees-Edwards image offset at Iteration
+	output_data_struct OutDat;
+	cl_float VelUpper[3]; // Wall velocities, which the shear rate controller changes
+	cl_float VelLower[3];
+	cl_ulong SectionSize[CHECKPOINT_SECTIONS];
+
+} checkpoint_header_struct;
+
+
+// Device state is copied to host at the checkpoint step, then written (and rotated) by a thread
+typedef struct {
+
+	checkpoint_header_struct Header;
+	void* Sections[CHECKPOINT_SECTIONS];
+	char FileName[CHECKPOINT_NAME_SIZE];
+	cl_int Keep;          // Files in the rotation
+	cl_int Count;         // Checkpoints taken
+	cl_int Busy;
+	cl_int Error;
+	pthread_t Thread;
+
+} checkpoint_writer_struct;
+
+
+int run_simulation(sim_device_struct* dev, const char* resourceDir);
 	
 void particle_dynamics(int_param_struct* intDat, cl_float4* parKinematics_h, cl_float4* parForces_h);
 
@@ -128,13 +475,30 @@ int initialize_data(int_param_struct* intParams, flp_param_struct* floatParams,
 
 int parameter_checking(int_param_struct* intDat, flp_param_struct* flpDat, host_param_struct* hostDat);
 
-void initialize_lattice_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-	cl_float* f_h, cl_float* gpf_h, cl_float* u_h, cl_float* tau_lb_h, cl_int* countPoint);
+void initialize_system_size(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat);
+
+cl_int initialize_lattice_fields(host_param_struct* hostDat, int_param_struct* intDat, cl_command_queue queue, cl_kernel kernel,
+	cl_mem* fields, cl_mem intDat_cl, cl_mem flpDat_cl, int numMembers);
+
+void initialize_particle_properties(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps);
 
-void initialize_particle_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-	cl_float4* parKinematics, cl_float4* parForce, cl_float4* parFluidForce);
+int initialize_particle_fields(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps, cl_float4* parKinematics, cl_float4* parForce, cl_float4* parFluidForce);
 
-void initialize_particle_zones(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat, cl_float4* parKinematics, 
+int random_sequential_packing(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
+	cl_float4* parProps, cl_float4* parKinematics);
+
+int packing_cell(packing_grid_struct* grid, cl_float4 pos);
+
+int packing_overlap(packing_grid_struct* grid, cl_float4* parProps, cl_float4* parKinematics, int p, cl_float4 pos,
+	float scale, float* push);
+
+void packing_insert(packing_grid_struct* grid, int p, cl_float4 pos);
+
+void packing_remove(packing_grid_struct* grid, int p);
+
+int initialize_particle_zones(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat, cl_float4* parKinematics, 
 	cl_int* parsZone, cl_int** zoneMembers, cl_int** numParInZone, cl_int* threadMembers, cl_int* numParInThread, cl_int** zoneNeighDat);
 
 int equilibrium_distribution_D3Q19(float rho, float* vel, float* f_eq);
@@ -143,19 +507,88 @@ float compute_tau(int viscosityModel, float srtII, cl_float NewtonianTau, cl_flo
 
 int process_input_line(char* fLine, input_data_struct* inputDefaults, int inputDefaultSize);
 
-void sphere_discretization(int_param_struct* intDat, flp_param_struct* flpDat, cl_float4** spherePoints);
+int surface_points_for_diameter(host_param_struct* hostDat, float diam);
 
-int create_periodic_stream_mapping(int_param_struct* intDat, cl_int** strMapPtr);
-
-int write_lattice_field(cl_float* u_h, int_param_struct* intDat);
+int read_sphere_partition(const char* resourceDir, int numPoints, cl_float4* spherePoints);
+void generate_sphere_points(int numPoints, cl_float4* spherePoints);
+int read_sphere_points_cache(const char* resourceDir, int numPoints, cl_float4* spherePoints);
+void write_sphere_points_cache(const char* resourceDir, int numPoints, cl_float4* spherePoints);
 
-void continuous_output(host_param_struct* hostDat, int_param_struct* intDat, cl_float* u_h, cl_float4* parKin, FILE* vidPtr, int frame);
+int sphere_discretization(host_param_struct* hostDat, int_param_struct* intDat, cl_float4* parProps,
+	cl_float4** spherePoints, cl_int* parSphereSet);
 
-void compute_shear_stress(output_data_struct* outDat, host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* flpDat,
-	cl_float* u_h, cl_float* tau_lb_h, int frame);
+void create_surface_point_layout(int_param_struct* intDat, cl_int* parSphereSet,
+	cl_int** parSurfOffset, cl_int** surfPointMap);
 
-int create_LB_kernels(int_param_struct* intDat, kernel_struct* kernelDat, cl_context* contextPtr, cl_device_id* devices,
-	cl_program* programCPU, cl_program* programGPU);
+int create_periodic_stream_mapping(int_param_struct* intDat, cl_int** strMapPtr);
+void sort_periodic_mapping(int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes);
+int periodic_nodes_below(int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes, int plane);
+
+int create_cpu_fluid_kernels(sim_device_struct* dev);
+cl_int copy_lattice_planes(cl_command_queue srcQueue, cl_mem src, cl_command_queue dstQueue, cl_mem dst,
+	int_param_struct* intDat, const int* comps, int numComps, int firstPlane, int numPlanes, cl_float* staging);
+void CL_CALLBACK record_split_time(cl_event event, cl_int status, void* data);
+int balance_split_plane(int_param_struct* intDat, int splitPlane, split_timing_struct* timing);
+int temporal_block_slab_planes(int_param_struct* intDat, cl_device_id device, int numSteps);
+cl_int enqueue_temporal_block(cl_command_queue queue, kernel_struct* fluid, cl_kernel collide, size_t collideWidth,
+	cl_mem fA, cl_mem fB, int_param_struct* intDat, cl_int* strMap, int numPeriodicNodes, int t, int numSteps, int slabPlanes);
+
+size_t out_of_core_ring_size(int_param_struct* intDat);
+int out_of_core_init(out_of_core_struct* ooc, sim_device_struct* dev, host_param_struct* hostDat, int_param_struct* intDat);
+cl_int out_of_core_fill(out_of_core_struct* ooc, host_param_struct* hostDat, cl_command_queue queue, cl_kernel init,
+	cl_mem flpDat_cl, cl_mem u_cl, cl_mem tau_cl);
+cl_int out_of_core_read_planes(cl_command_queue queue, cl_mem slab, size_t slab_C, int slabPlane, cl_float* f_h,
+	int_param_struct* intDat, int q, int hostPlane, int numPlanes, int wrap);
+cl_int out_of_core_sweep(out_of_core_struct* ooc, kernel_struct* kernelDat, cl_command_queue queue, int_param_struct* intDat,
+	cl_mem flpDat_cl, cl_mem u_cl, cl_mem tau_cl, cl_mem pointForce_cl, size_t numSurfPoints, int t);
+void out_of_core_release(out_of_core_struct* ooc);
+
+cl_int set_lees_edwards_offset(kernel_struct* kernelDat, cl_float leOffset);
+
+int write_lattice_field(host_param_struct* hostDat, cl_float* u_h, int_param_struct* intDat, int frame, int member);
+
+void write_field_statistics(host_param_struct* hostDat, int_param_struct* intDat, cl_float* statMean, cl_float* statM2,
+	int numSamples);
+
+int fluid_output_count(host_param_struct* hostDat, int_param_struct* intDat);
+
+void ensemble_file_name(char* name, size_t size, const char* base, const char* ext, int_param_struct* intDat, int member);
+int read_ensemble_members(host_param_struct* hostDat, int_param_struct* intDat, flp_param_struct* members, cl_int* parSeeds);
+
+void continuous_output(host_param_struct* hostDat, int_param_struct* intDat, cl_float* fluidCols, cl_float4* parKin, FILE* vidPtr, int frame);
+
+int trajectory_writer_open(trajectory_writer_struct* writer, host_param_struct* hostDat, int_param_struct* intDat,
+	const char* fileName, int resumeFrame);
+int trajectory_resume(trajectory_writer_struct* writer, const char* fileName, int resumeFrame);
+void trajectory_writer_submit(trajectory_writer_struct* writer, cl_float* fluidCols, cl_float4* parKin, int frame);
+void* trajectory_writer_thread(void* writerPtr);
+void trajectory_writer_close(trajectory_writer_struct* writer);
+
+int checkpoint_writer_init(checkpoint_writer_struct* ckpt, int_param_struct* intDat, int keep, size_t* sectionSizes);
+int checkpoint_save(checkpoint_writer_struct* ckpt, cl_command_queue queueGPU, cl_command_queue queueCPU, cl_mem* sectionBufs,
+	cl_mem* sectionHiBufs, int iteration, double leOffset, output_data_struct* outDat, flp_param_struct* flpDat, cl_int statSamples);
+void* checkpoint_writer_thread(void* ckptPtr);
+void checkpoint_writer_wait(checkpoint_writer_struct* ckpt);
+void checkpoint_writer_close(checkpoint_writer_struct* ckpt);
+int checkpoint_latest(int keep, char* fileName);
+int checkpoint_restore(checkpoint_writer_struct* ckpt, const char* fileName, cl_command_queue queueGPU, cl_command_queue queueCPU,
+	cl_mem* sectionBufs, cl_mem* sectionHiBufs, int fullState);
+
+int output_snapshot_ready(output_snapshot_struct* snap, int wait);
+int process_output_snapshot(output_snapshot_struct* snap, host_param_struct* hostDat, int_param_struct* intDat,
+	flp_param_struct* flpDat, output_data_struct* outDat, trajectory_writer_struct* trajWriter, FILE* vidPtr);
+
+int compute_shear_stress(output_data_struct* outDat, host_param_struct* hostDat, int_param_struct* intDat,
+	flp_param_struct* flpDat, cl_float* uProfile, int frame, int member);
+
+int control_shear_rate(host_param_struct* hostDat, flp_param_struct* flpDat, cl_float parRate);
+cl_int write_wall_velocities(cl_command_queue queue, cl_mem flpDat_cl, flp_param_struct* flpDat);
+
+void update_convergence(output_data_struct* outDat, host_param_struct* hostDat, cl_float wallRate, cl_float parRate, int frame);
+
+void lattice_build_options(cl_device_id device, char* options, size_t size);
+int create_LB_kernels(kernel_struct* kernelDat, cl_context* contextPtr, cl_device_id* devices, cl_program* programCPU, cl_program* programGPU);
+void particle_work_group_size(host_param_struct* hostDat, int_param_struct* intDat, kernel_struct* kernelDat, cl_device_id* devices);
 
 int display_input_params(int_param_struct* intParams, flp_param_struct* floatParams);
 
@@ -163,6 +596,26 @@ int print_program_build_log(cl_program* program, cl_device_id* device);
 
 void analyse_platform(cl_device_id* devices, host_param_struct* hostDat);
 
+void setup_sim_device(sim_device_struct* dev);
+int numa_node_cpus(int node, int* cpus, int maxCpus);
+int numa_node_count(void);
+void pin_thread_to_node(int node);
+void print_host_topology(sim_device_struct* dev);
+void* host_lattice_alloc(size_t size, int hugePages);
+void release_sim_device(sim_device_struct* dev);
+cl_mem pool_buffer(sim_device_struct* dev, int slot, cl_mem_flags flags, size_t size, void* hostPtr, cl_int* err);
+int pool_slot_on_cpu(int slot);
+int plan_field_split(size_t* bufSizes, int slot, int hiSlot, int numPlanes, int planeGroup, cl_ulong maxAlloc);
+int plan_device_memory(sim_device_struct* dev, int_param_struct* intDat, size_t* bufSizes, int splitLattice,
+	size_t slabRingSize);
+cl_mem pool_split_buffer(sim_device_struct* dev, int slot, cl_mem_flags flags, size_t size, cl_int* err);
+cl_int enqueue_split_transfer(cl_command_queue queue, cl_mem first, cl_mem second, int toDevice, cl_bool blocking,
+	size_t size, void* data);
+
+double wall_time(void);
+int next_server_job(const char* jobDir, char* jobName);
+int run_job_server(sim_device_struct* dev, const char* jobDir);
+
 int error_check(cl_int err, char* clFunc, int print);
 
 void read_program_source(char** programSource, const char* programName);
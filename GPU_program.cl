@@ -6,11 +6,24 @@
 #define MIN_TAU 0.505
 #define SRT_EPS 1E-8
 #define VEL_BC_RHO
+#ifndef COLLIDE_VEC_WIDTH
+#define COLLIDE_VEC_WIDTH 8 // Nodes per work item in collideMRT_stream_D3Q19_vec, 8 or 16 (set by the host)
+#endif
+#ifdef LATTICE_INDEX_64
+typedef long lattice_index; // Set by the host when one buffer can hold more than 2^31 floats
+#else
+typedef int lattice_index;
+#endif
+#ifndef LATTICE_BRICK
+#define LATTICE_BRICK 1 // Edge of the cubic bricks lattice nodes are stored in (set by the host, see lattice_node)
+#endif
 //#define VEL_OUTLET_EQ
 //#define VEL_BC_MOM_CORR
 
 //#include "struct_header_device.h"
 
+#define NUM_STAT_FIELDS 7 // u_x, u_y, u_z, tau, force density x, y, z
+
 #define VISC_NEWTONIAN 1
 #define VISC_POWER_LAW 2
 #define VISC_HB 3
@@ -27,7 +40,18 @@ typedef struct {
 	
 	int BufferSize[3];
 	int BoundaryConds[3];
+	int TangentialVelBC[3];
+	int FuseVelocityBC;
+	int LeesEdwards;
+	int EnsembleSize;
+	int NumPeriodicNodes; // Per ensemble member
+	int FPartPlanes; // Planes (component x member) of f in the first allocation, see field_plane
+	int GpfPartPlanes; // Same for gpf, a multiple of 3
+	int OutOfCorePlanes; // Interior z planes per slab when f is held on the host, 0 if on the device
+	int SlabOrigin; // Whole-lattice z of plane 0 of an out-of-core slab, else 0
+	int WholeLatticeZ; // LatticeSize[2] of the whole lattice, which a slab's is not
 	int NumZones[3];
+	int ZoneNeighStride;
 
 	int MaintainShear;
 	int ViscosityModel;
@@ -38,10 +62,9 @@ typedef struct {
 	int MaxSurfPointsPerNode;
 	int InterpOrderIBM;
 
-	int PointsPerParticle;
 	int PointsPerWorkGroup;
 	int TotalSurfPoints;
-	int WorkGroupsPerParticle;
+	int TotalWorkGroups;
 
 } int_param_struct;
 
@@ -53,6 +76,7 @@ typedef struct {
 	float EqWeights[19];
 	float VelUpper[3];
 	float VelLower[3];
+	float LEVelocity;
 	// Viscosity
 	float NewtonianTau;
 	float ViscosityParams[4];
@@ -61,9 +85,6 @@ typedef struct {
 
 	// Particle
 	float ParticleDiam;
-	float ParticleMass;
-	float PointArea;
-	float ParticleMomInertia;
 	float ParForceParams[2];
 	float ParticleZBuffer;
 
@@ -74,9 +95,18 @@ typedef struct {
 
 void equilibirum_distribution_D3Q19(float* f_eq, float rho, float u_x, float u_y, float u_z);
 void stream_locations(int n_x, int n_y, int n_z, int i_x, int i_y, int i_z, int* ind);
+int lattice_node(int i_x, int i_y, int i_z, int N_x, int N_y);
+lattice_index lattice_nodes(int N_x, int N_y, int N_z);
+void lattice_coords(int i_1D, int N_x, int N_y, int* r);
+__global float* field_plane(__global float* part0, __global float* part1, int plane, int partPlanes, lattice_index N_C);
 void guo_body_force_term(float u_x, float u_y, float u_z,
 	float g_x, float g_y, float g_z, float* fGuo);
 float compute_tau(int viscosityModel, float srtII, float NewtonianTau, __global float* nonNewtonianParams);
+void surface_point_stencil(float4 r_pp, float leOffset, __global int_param_struct* intDat, __global flp_param_struct* flpDat,
+	int nodes[8][3], float weights[8], float* duUp);
+void collide_stream_node(__global float* f_c, __global float* f_s, __global float* f_c_hi, __global float* f_s_hi,
+	int firstPlane, __global float* gpf, __global float* u, __global float* tau_lb, __global int* countPointWrite,
+	__global int_param_struct* intDat, __global flp_param_struct* flpDat, int i_x, int i_y, int i_z);
 
 __kernel void particle_fluid_forces_linear_stencil(
 	__global int_param_struct* intDat,
@@ -87,7 +117,12 @@ __kernel void particle_fluid_forces_linear_stencil(
 	__global float4* parFluidForce,
 	__global float4* parFluidForceSum,
 	__global float4* spherePoints,
-	__global int* countPoint)
+	__global int* countPoint,
+	__global float4* parProps,
+	__global int* surfPointMap,
+	float leOffset,
+	__global float* gpf_hi,
+	__global float4* pointForce) // Out-of-core: force and stencil position of each point, spread slab by slab
 {
 	int globalID = get_global_id(0); // 1D kernel execution
 	int globalSize = get_global_size(0);
@@ -108,126 +143,137 @@ __kernel void particle_fluid_forces_linear_stencil(
 
 	int np = intDat->NumParticles;
 
-	// Get particle ID for this node
-	int parID = globalID/intDat->PointsPerParticle; // Requires same number of nodes for each particle
-	int pointID = globalID%intDat->PointsPerParticle;
-
-	//printf("parID, pointID %d  %d\n", parID, pointID);
-
 	// Get lattice size info, for reading and writing velocity and force
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
 	int N_z = intDat->LatticeSize[2];
-	int N_C = N_x*N_y*N_z; // Total nodes
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z); // Total nodes
+
+	// Ensemble members each take TotalSurfPoints work items, with their own particles and fluid
+	int memberPoints = intDat->TotalSurfPoints;
+	int member = globalID/memberPoints;
+	int memberPoint = globalID - member*memberPoints;
+	int gpfPlanes = 3*intDat->MaxSurfPointsPerNode;
+	flpDat += member;
+	parKin += 4*member*np;
+	parFluidForce += 2*member*intDat->TotalWorkGroups;
+	u += member*3*N_C;
+	countPoint += member*N_C;
+	groupID -= member*intDat->TotalWorkGroups;
+	numGroups = intDat->TotalWorkGroups;
+
+	// Get particle ID for this node, -1 for padding at the end of a particle's work groups
+	int parID = surfPointMap[memberPoint];
+	int pointID = surfPointMap[memberPoint + memberPoints]; // Index into spherePoints
 
-	// Get particle kinetmatic data for this node
-	float4 xPar = parKin[parID]; // Position
-	float4 vPar = parKin[parID + np]; // Velocity
-	float4 angVel = parKin[parID + 3*np]; // Angular velocity
+	//printf("parID, pointID %d  %d\n", parID, pointID);
 
-	//if (localID==0) printf("point = %d, xp = %f %f %f (%f)\n", pointID, xPar.x, xPar.y, xPar.z, xPar.w);
-	//printf("point = %d, vp = %f %f %f (%f)\n", pointID, vp.x, vp.y, vp.z, vp.w);
-	//printf("point = %d, angVel = %f %f %f (%f)\n", pointID, angVel.x, angVel.y, angVel.z, angVel.w);
+	float4 vuForce = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+	float4 vuTorque = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+	float4 stencilPos = (float4){0.0f, 0.0f, 0.0f, 0.0f}; // .w 0 for padding
 
-	// Lookup original position of this point relative to particle center
-	float4 r_0 = spherePoints[pointID];
-	//printf("point = %d,r0 = %f %f %f (%f)\n", pointID, r0.x, r0.y, r0.z, r0.w);
+	if (parID >= 0) {
 
-	// Apply rotation matrix (shouldn't be needed for spherical particles)
-	//float4 r2 = (float4){0.0, 0.0, 0.0, 0.0};
-	//r2 = e1*r.x + e2*r.y + e3*r.z;
+		// Get particle kinetmatic data for this node
+		float4 xPar = parKin[parID]; // Position
+		float4 vPar = parKin[parID + np]; // Velocity
+		float4 angVel = parKin[parID + 3*np]; // Angular velocity
 
-	// Absolute position of point
-	float4 r_p = xPar + r_0;
+		//if (localID==0) printf("point = %d, xp = %f %f %f (%f)\n", pointID, xPar.x, xPar.y, xPar.z, xPar.w);
+		//printf("point = %d, vp = %f %f %f (%f)\n", pointID, vp.x, vp.y, vp.z, vp.w);
+		//printf("point = %d, angVel = %f %f %f (%f)\n", pointID, angVel.x, angVel.y, angVel.z, angVel.w);
 
-	// Adjust for PBCs
-	float4 r_pp = fmod((r_p+sysSize),sysSize);
+		float4 props = parProps[parID]; // Diameter, mass, moment of inertia, area per point
 
-	//printf("point = %d, r_p = %f %f %f (%f)\n", pointID, r_p.x, r_p.y, r_p.z, r_p.w);
-	//printf("point = %d, r_pp = %f %f %f (%f)\n", pointID, r_pp.x, r_pp.y, r_pp.z, r_pp.w);
+		// Lookup original position of this point relative to particle center, scaled by radius
+		float4 r_0 = 0.5f*props.x*spherePoints[pointID];
+		//printf("point = %d,r0 = %f %f %f (%f)\n", pointID, r0.x, r0.y, r0.z, r0.w);
 
-	// Location of corner closest to origin in f array
-	int flX = (int)floor(r_pp.x);
-	int flY = (int)floor(r_pp.y);
-	int flZ = (int)floor(r_pp.z);
-	
-	int x_i0 = flX + intDat->BufferSize[0];
-	int y_i0 = flY + intDat->BufferSize[1];
-	int z_i0 = flZ + intDat->BufferSize[2];
-	//printf("point = %d, r_floor = %d %d %d\n", pointID, x_i0, y_i0, z_i0);
+		// Apply rotation matrix (shouldn't be needed for spherical particles)
+		//float4 r2 = (float4){0.0, 0.0, 0.0, 0.0};
+		//r2 = e1*r.x + e2*r.y + e3*r.z;
 
-	// Shift taking into account pbcs
-	int xs = (x_i0 == N_x-2) ? -(N_x-3) : 1; // -(N_x-3) is edge case, where neighbor is across pbc
-	int ys = (y_i0 == N_y-2) ? -(N_y-3) : 1;
-	int zs = (z_i0 == N_z-2) ? -(N_z-3) : 1;
-	
-	int shift[8][3] = {{0,0,0}, {xs,0,0}, {0,ys,0}, {0,0,zs}, {xs,ys,0}, {xs,0,zs}, {0,ys,zs}, {xs,ys,zs}};
-	
-	float wx = 1.0f - (r_pp.x - flX);
-	float wy = 1.0f - (r_pp.y - flY);
-	float wz = 1.0f - (r_pp.z - flZ);
-	
-	float weights[8];
-	weights[0] = wx*wy*wz;
-	weights[1] = (1.0f-wx)*wy*wz;
-	weights[2] = wx*(1.0f-wy)*wz;
-	weights[3] = wx*wy*(1.0f-wz);
-	weights[4] = (1.0f-wx)*(1.0f-wy)*wz;
-	weights[5] = (1.0f-wx)*wy*(1.0f-wz);
-	weights[6] = wx*(1.0f-wy)*(1.0f-wz);
-	weights[7] = (1.0f-wx)*(1.0f-wy)*(1.0f-wz);
-		
-	float4 u_pp = (float4){0.0f, 0.0f, 0.0f, 0.0f};
-
-	//float sumW = 0.0;
-	for(int n = 0; n < 8; n++) {
-		//
-		int x_n = x_i0 + shift[n][0];
-		int y_n = y_i0 + shift[n][1];
-		int z_n = z_i0 + shift[n][2];
-		int i_1D = x_n + N_x*(y_n + N_y*z_n);
-		//printf("shift[%d][0:2] = %d %d %d\n", n, shift[n][0], shift[n][1], shift[n][2]);
-
-		//sumW += weights[n];
-		// Interpolate velocity
-		u_pp.x += weights[n]*u[i_1D        ];
-		u_pp.y += weights[n]*u[i_1D +   N_C];
-		u_pp.z += weights[n]*u[i_1D + 2*N_C];
-	}
-	//printf("weight sum: %f\n", sumW);
+		// Absolute position of point
+		float4 r_p = xPar + r_0;
+
+		// Lees-Edwards: a point beyond a z face is moved into the box through the sliding image
+		if (intDat->LeesEdwards) {
+			float crossZ = floor(r_p.z/sysSize.z);
+			r_p.x = fmod(r_p.x - crossZ*leOffset + 2.0f*sysSize.x, sysSize.x);
+			vPar.x -= crossZ*flpDat->LEVelocity;
+		}
+
+		// Adjust for PBCs
+		float4 r_pp = fmod((r_p+sysSize),sysSize);
+
+		//printf("point = %d, r_p = %f %f %f (%f)\n", pointID, r_p.x, r_p.y, r_p.z, r_p.w);
+		//printf("point = %d, r_pp = %f %f %f (%f)\n", pointID, r_pp.x, r_pp.y, r_pp.z, r_pp.w);
+
+		// Trilinear stencil: 8 nodes around the point
+		int nodes[8][3];
+		float weights[8];
+		float duUp;
+		surface_point_stencil(r_pp, leOffset, intDat, flpDat, nodes, weights, &duUp);
+
+		float4 u_pp = (float4){0.0f, 0.0f, 0.0f, 0.0f};
 
-	// Calculate velocity of node
-	float4 v_pp = vPar + cross(angVel,r_0); // Order is important
+		//float sumW = 0.0;
+		for(int n = 0; n < 8; n++) {
+			//
+			int i_1D = lattice_node(nodes[n][0], nodes[n][1], nodes[n][2], N_x, N_y);
 
-	// Conmpute force on particle = (u-v)*dA
-	float4 vuForce = (u_pp - v_pp)*flpDat->PointArea;
-	float4 vuTorque = cross(r_0,vuForce);
+			//sumW += weights[n];
+			// Interpolate velocity
+			u_pp.x += weights[n]*u[i_1D        ];
+			u_pp.y += weights[n]*u[i_1D +   N_C];
+			u_pp.z += weights[n]*u[i_1D + 2*N_C];
+		}
+		//printf("weight sum: %f\n", sumW);
+
+		// Upper layer velocity seen from this image
+		u_pp.x += duUp;
+
+		// Calculate velocity of node
+		float4 v_pp = vPar + cross(angVel,r_0); // Order is important
+
+		// Conmpute force on particle = (u-v)*dA
+		vuForce = (u_pp - v_pp)*props.w;
+		vuTorque = cross(r_0,vuForce);
 
-	//printf("point = %d, u_pp = %f %f %f (%f)\n", pointID, u_pp.x, u_pp.y, u_pp.z, u_pp.w);
-	//printf("point = %d, v_pp = %f %f %f (%f)\n", pointID, v_pp.x, v_pp.y, v_pp.z, v_pp.w);
+		//printf("point = %d, u_pp = %f %f %f (%f)\n", pointID, u_pp.x, u_pp.y, u_pp.z, u_pp.w);
+		//printf("point = %d, v_pp = %f %f %f (%f)\n", pointID, v_pp.x, v_pp.y, v_pp.z, v_pp.w);
 
-	// Distribute force to 8 nodes
-	for(int n = 0; n < 8; n++) {
-		//
-		int x_n = x_i0 + shift[n][0];
-		int y_n = y_i0 + shift[n][1];
-		int z_n = z_i0 + shift[n][2];
-		int i_1D = x_n + N_x*(y_n + N_y*z_n);
+		// Out-of-core fluid: spread_particle_forces_slab distributes it to each slab as it passes through
+		if (intDat->OutOfCorePlanes > 0) {
+			stencilPos = r_pp;
+			stencilPos.w = 1.0f;
+		}
+
+		// Distribute force to 8 nodes
+		for(int n = 0; n < 8 && intDat->OutOfCorePlanes == 0; n++) {
+			//
+			int i_1D = lattice_node(nodes[n][0], nodes[n][1], nodes[n][2], N_x, N_y);
 
-		int writeCount = atomic_inc(countPoint+i_1D); // The p'th time a surface point writes to this node
-		int j = writeCount%intDat->MaxSurfPointsPerNode;
+			int writeCount = atomic_inc(countPoint+i_1D); // The p'th time a surface point writes to this node
+			int j = writeCount%intDat->MaxSurfPointsPerNode;
 
-		//printf("i_1D, write count: %d %d\n", i_1D, j);
+			//printf("i_1D, write count: %d %d\n", i_1D, j);
 
-		gpf[i_1D + N_C*(3*j    )] -= weights[n]*vuForce.x;
-		gpf[i_1D + N_C*(3*j + 1)] -= weights[n]*vuForce.y;
-		gpf[i_1D + N_C*(3*j + 2)] -= weights[n]*vuForce.z;
+			__global float* g_j = field_plane(gpf, gpf_hi, member*gpfPlanes + 3*j, intDat->GpfPartPlanes, N_C);
+			g_j[i_1D        ] -= weights[n]*vuForce.x;
+			g_j[i_1D + N_C*1] -= weights[n]*vuForce.y;
+			g_j[i_1D + N_C*2] -= weights[n]*vuForce.z;
 
-		//if (x_n == 13 && y_n == 13) printf("i_1D, write g = %d: %f, %f, %f\n", i_1D, gpf[i_1D + N_C*(3*j)    ], gpf[i_1D + N_C*(3*j + 1)], gpf[i_1D + N_C*(3*j + 2)]);
+			//if (x_n == 13 && y_n == 13) printf("i_1D, write g = %d: %f, %f, %f\n", i_1D, g_j[i_1D], g_j[i_1D + N_C*1], g_j[i_1D + N_C*2]);
+		}
 	}
 
 	parFluidForceSum[globalID] = vuForce;
 	parFluidForceSum[globalID + globalSize] = vuTorque;
+	if (intDat->OutOfCorePlanes > 0) {
+		pointForce[globalID] = vuForce;
+		pointForce[globalID + globalSize] = stencilPos;
+	}
 
 	// Sum force and torque over all the threads in this work group
 	barrier(CLK_LOCAL_MEM_FENCE);
@@ -255,10 +301,118 @@ __kernel void particle_fluid_forces_linear_stencil(
 	}
 }
 
+// Trilinear stencil of a surface point at r_pp, inside the periodic box: its 8 nodes (whole-lattice coordinates)
+// and weights. With Lees-Edwards the layer above the top plane is the bottom of the image above, which is
+// offset by leOffset and moves with LEVelocity, so it has its own x stencil and adds duUp to the interpolated u_x
+void surface_point_stencil(float4 r_pp, float leOffset, __global int_param_struct* intDat, __global flp_param_struct* flpDat,
+	int nodes[8][3], float weights[8], float* duUp)
+{
+	int N_x = intDat->LatticeSize[0];
+	int N_y = intDat->LatticeSize[1];
+	int N_z = intDat->WholeLatticeZ;
+	float sysSizeX = (float)intDat->SystemSize[0];
+
+	// Location of corner closest to origin in f array
+	int flX = (int)floor(r_pp.x);
+	int flY = (int)floor(r_pp.y);
+	int flZ = (int)floor(r_pp.z);
+
+	int x_i0 = flX + intDat->BufferSize[0];
+	int y_i0 = flY + intDat->BufferSize[1];
+	int z_i0 = flZ + intDat->BufferSize[2];
+	//printf("point = %d, r_floor = %d %d %d\n", pointID, x_i0, y_i0, z_i0);
+
+	// Shift taking into account pbcs
+	int xs = (x_i0 == N_x-2) ? -(N_x-3) : 1; // -(N_x-3) is edge case, where neighbor is across pbc
+	int ys = (y_i0 == N_y-2) ? -(N_y-3) : 1;
+	int zs = (z_i0 == N_z-2) ? -(N_z-3) : 1;
+
+	float wx = 1.0f - (r_pp.x - flX);
+	float wy = 1.0f - (r_pp.y - flY);
+	float wz = 1.0f - (r_pp.z - flZ);
+
+	int dxUp = 0;
+	int xsUp = xs;
+	float wxUp = wx;
+	*duUp = 0.0f;
+	if (intDat->LeesEdwards && z_i0 == N_z-2) {
+		float xUp = fmod(r_pp.x - leOffset + sysSizeX, sysSizeX);
+		int flXUp = (int)floor(xUp);
+		dxUp = flXUp - flX;
+		xsUp = (flXUp + intDat->BufferSize[0] == N_x-2) ? -(N_x-3) : 1;
+		wxUp = 1.0f - (xUp - flXUp);
+		*duUp = (1.0f-wz)*flpDat->LEVelocity;
+	}
+
+	int shift[8][3] = {{0,0,0}, {xs,0,0}, {0,ys,0}, {dxUp,0,zs}, {xs,ys,0}, {dxUp+xsUp,0,zs}, {dxUp,ys,zs}, {dxUp+xsUp,ys,zs}};
+	for (int n = 0; n < 8; n++) {
+		nodes[n][0] = x_i0 + shift[n][0];
+		nodes[n][1] = y_i0 + shift[n][1];
+		nodes[n][2] = z_i0 + shift[n][2];
+	}
+
+	weights[0] = wx*wy*wz;
+	weights[1] = (1.0f-wx)*wy*wz;
+	weights[2] = wx*(1.0f-wy)*wz;
+	weights[3] = wxUp*wy*(1.0f-wz);
+	weights[4] = (1.0f-wx)*(1.0f-wy)*wz;
+	weights[5] = (1.0f-wxUp)*wy*(1.0f-wz);
+	weights[6] = wxUp*(1.0f-wy)*(1.0f-wz);
+	weights[7] = (1.0f-wxUp)*(1.0f-wy)*(1.0f-wz);
+}
+
+// Out-of-core fluid: spread the surface point forces from particle_fluid_forces_linear_stencil onto the
+// nodes of one slab (slabDat), from its plane 0 to LatticeSize[2]-1, the halo planes included
+__kernel void spread_particle_forces_slab(
+	__global int_param_struct* slabDat,
+	__global flp_param_struct* flpDat,
+	__global float* gpf,
+	__global int* countPoint,
+	__global float4* pointForce)
+{
+	int globalID = get_global_id(0);
+	int globalSize = get_global_size(0);
+
+	float4 r_pp = pointForce[globalID + globalSize];
+	if (r_pp.w == 0.0f) {
+		return;
+	}
+	float4 vuForce = pointForce[globalID];
+
+	int N_x = slabDat->LatticeSize[0];
+	int N_y = slabDat->LatticeSize[1];
+	int N_z = slabDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+
+	// No Lees-Edwards out of core
+	int nodes[8][3];
+	float weights[8];
+	float duUp;
+	surface_point_stencil(r_pp, 0.0f, slabDat, flpDat, nodes, weights, &duUp);
+
+	for (int n = 0; n < 8; n++) {
+		int z_n = nodes[n][2] - slabDat->SlabOrigin;
+		if (z_n < 0 || z_n >= N_z) {
+			continue;
+		}
+		int i_1D = lattice_node(nodes[n][0], nodes[n][1], z_n, N_x, N_y);
+
+		int writeCount = atomic_inc(countPoint+i_1D);
+		int j = writeCount%slabDat->MaxSurfPointsPerNode;
+
+		__global float* g_j = gpf + 3*j*N_C;
+		g_j[i_1D        ] -= weights[n]*vuForce.x;
+		g_j[i_1D + N_C*1] -= weights[n]*vuForce.y;
+		g_j[i_1D + N_C*2] -= weights[n]*vuForce.z;
+	}
+}
+
+// Sum and reset take the member from i_z/N_z, so z covers the buffer layer, N_z*members planes from 0
 __kernel void sum_particle_fluid_forces(
 	__global int_param_struct* intDat,
 	__global flp_param_struct* flpDat, // maybe not needed
-	__global float* gpf)
+	__global float* gpf,
+	__global float* gpf_hi) // Slots from GpfPartPlanes/3 on, if split
 {
 
 	int i_x = get_global_id(0);
@@ -268,23 +422,32 @@ __kernel void sum_particle_fluid_forces(
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
 	int N_z = intDat->LatticeSize[2];
-	int N_C = N_x*N_y*N_z;
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+
+	int member = i_z/N_z;
+	i_z -= member*N_z;
+	int gpfPlanes = 3*intDat->MaxSurfPointsPerNode;
 
 	// 1D index
-	int i_1D = i_x + N_x*(i_y + N_y*i_z);
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
+
+	// A split never divides a slot
+	__global float* g_0 = field_plane(gpf, gpf_hi, member*gpfPlanes, intDat->GpfPartPlanes, N_C);
 
 	for (int j = 1; j < intDat->MaxSurfPointsPerNode; j++) {
 
-		gpf[i_1D        ] += gpf[i_1D + N_C*(3*j    )]; // Write to j=0 part of array
-		gpf[i_1D + N_C*1] += gpf[i_1D + N_C*(3*j + 1)];
-		gpf[i_1D + N_C*2] += gpf[i_1D + N_C*(3*j + 2)];
+		__global float* g_j = field_plane(gpf, gpf_hi, member*gpfPlanes + 3*j, intDat->GpfPartPlanes, N_C);
+
+		g_0[i_1D        ] += g_j[i_1D        ]; // Write to j=0 part of array
+		g_0[i_1D + N_C*1] += g_j[i_1D + N_C*1];
+		g_0[i_1D + N_C*2] += g_j[i_1D + N_C*2];
 
 		//if (i_x == 13 && i_y == 13) printf("i_1D, j, +=g, %d, %d, %f, %f, %f\n", i_1D, j,
-		//	gpf[i_1D + N_C*(3*j    )], gpf[i_1D + N_C*(3*j + 1)], gpf[i_1D + N_C*(3*j + 2)]);
+		//	g_j[i_1D        ], g_j[i_1D + N_C*1], g_j[i_1D + N_C*2]);
 
-		gpf[i_1D + N_C*(3*j    )] = 0.0f;
-		gpf[i_1D + N_C*(3*j + 1)] = 0.0f;
-		gpf[i_1D + N_C*(3*j + 2)] = 0.0f;
+		g_j[i_1D        ] = 0.0f;
+		g_j[i_1D + N_C*1] = 0.0f;
+		g_j[i_1D + N_C*2] = 0.0f;
 	}
 }
 
@@ -292,7 +455,8 @@ __kernel void sum_particle_fluid_forces(
 __kernel void reset_particle_fluid_forces(
 	__global int_param_struct* intDat,
 	__global flp_param_struct* flpDat, // maybe not needed
-	__global float* gpf)
+	__global float* gpf,
+	__global float* gpf_hi)
 {
 
 	int i_x = get_global_id(0);
@@ -302,10 +466,14 @@ __kernel void reset_particle_fluid_forces(
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
 	int N_z = intDat->LatticeSize[2];
-	int N_C = N_x*N_y*N_z;
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+
+	int member = i_z/N_z;
+	i_z -= member*N_z;
+	gpf = field_plane(gpf, gpf_hi, member*3*intDat->MaxSurfPointsPerNode, intDat->GpfPartPlanes, N_C);
 
 	// 1D index
-	int i_1D = i_x + N_x*(i_y + N_y*i_z);
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
 
 	gpf[i_1D        ] = 0.0f;
 	gpf[i_1D + N_C*1] = 0.0f;
@@ -313,6 +481,171 @@ __kernel void reset_particle_fluid_forces(
 }
 
 
+// Zou-He velocity boundary for wall i_w (-x,+x, -y,+y, -z,+z numbered 0 to 5),
+// applied to the 19 populations of one node held in private memory.
+// Indices of the 5 reconstructed unknowns are returned in un.
+void zou_he_velocity_D3Q19(
+	float* f,
+	int* un,
+	int i_w,
+	int calcRho,
+	__global flp_param_struct* flpDat)
+{
+	int i_lu = i_w%2;         //  0 or 1 for lower or upper wall
+	int i_lu_pm = i_lu*2 - 1; // -1 or 1 for lower or upper wall
+
+	// Tabulated velocity boundary condition
+	// 5 unknowns and 14 knowns in a symmetric order (see thesis)
+	int tabUn[6][5] = {
+		{1, 7, 8, 9,10}, // x- wall
+		{2,11,12,13,14}, // x+ wall
+		{3, 7,11,15,16}, // y- wall
+		{4, 8,12,17,18}, // y+ wall
+		{5, 9,13,15,17}, // z- wall
+		{6,10,14,16,18}	 // z+ wall
+	};
+
+	int tabKn[6][14] = {
+		{0, 3, 4, 5, 6,15,16,17,18, 2,11,12,13,14},
+		{0, 3, 4, 5, 6,15,16,17,18, 1, 7, 8, 9,10},
+		{0, 1, 2, 5, 6, 9,10,13,14, 4, 8,12,17,18},
+		{0, 1, 2, 5, 6, 9,10,13,14, 3, 7,11,15,16},
+		{0, 1, 2, 3, 4, 7, 8,11,12, 6,10,14,16,18},
+		{0, 1, 2, 3, 4, 7, 8,11,12, 5, 9,13,15,17}
+	};
+
+	int tabAxes[6][3] = {
+		//n a1 a2
+		{0, 1, 2},
+		{0, 1, 2},
+		{1, 0, 2},
+		{1, 0, 2},
+		{2, 0, 1},
+		{2, 0, 1},
+	};
+
+	// Gather 14 knowns
+	float f_k[14];
+	for (int i_k=0; i_k<14; i_k++) {
+		f_k[i_k] = f[tabKn[i_w][i_k]];
+	}
+
+	// Read in velocities
+	float u_w[6];
+	u_w[0] = flpDat->VelLower[0]; // Only really need 3 of these
+	u_w[1] = flpDat->VelLower[1];
+	u_w[2] = flpDat->VelLower[2];
+	u_w[3] = flpDat->VelUpper[0];
+	u_w[4] = flpDat->VelUpper[1];
+	u_w[5] = flpDat->VelUpper[2];
+
+	float u[3]; // Velocity for this node
+	u[0] = u_w[i_lu*3	 ]; // i_lu =  0 or 1 for lower or upper wall
+	u[1] = u_w[i_lu*3 + 1];
+	u[2] = u_w[i_lu*3 + 2];
+
+	float u_n = -i_lu_pm*u[tabAxes[i_w][0]]; // Inwards normal fluid velocity
+	float u_a1 = u[tabAxes[i_w][1]]; // Tangential velocity axis 1
+	float u_a2 = u[tabAxes[i_w][2]]; // Tangential velocity axis 2
+
+	// Calculate rho
+	float rho;
+
+	// Shouldn't be any performance loss from if statement if all threads doing the same thing
+	if (calcRho) {
+		rho = (f_k[0]+f_k[1]+f_k[2]+f_k[3]+f_k[4]+f_k[5]+f_k[6]+f_k[7]+f_k[8]
+			+ 2*(f_k[9]+f_k[10]+f_k[11]+f_k[12]+f_k[13]))/(1.0f-u_n);
+	}
+	else {
+		// Calculate inward normal vel with rho = 1
+		rho = 1.0f;
+		u_n = 1 - (f_k[0]+f_k[1]+f_k[2]+f_k[3]+f_k[4]+f_k[5]+f_k[6]+f_k[7]+f_k[8]
+			+ 2*(f_k[9]+f_k[10]+f_k[11]+f_k[12]+f_k[13]))/rho;
+	}
+
+#ifdef VEL_BC_MOM_CORR
+	// Calculate 'tranverse momentum correction'
+	float N_a1 = 0.5f*(f_k[1]+f_k[5]+f_k[6] -f_k[2]-f_k[7]-f_k[8]) - rho*u_a1/3.0f;
+	float N_a2 = 0.5f*(f_k[3]+f_k[5]+f_k[7] -f_k[4]-f_k[6]-f_k[8]) - rho*u_a2/3.0f;
+#else
+	float N_a1 = 0.0;
+	float N_a2 = 0.0;
+#endif
+
+	for (int i_u=0; i_u<5; i_u++) {
+		un[i_u] = tabUn[i_w][i_u];
+	}
+
+	// Calculate unknown normal to wall
+	f[un[0]] = f_k[9] + rho*u_n/3.0f;
+
+	// Other four unknowns
+	f[un[1]] = f_k[11] + rho*(u_n + u_a1)/6.0f - N_a1;
+	f[un[2]] = f_k[10] + rho*(u_n - u_a1)/6.0f + N_a1;
+	f[un[3]] = f_k[13] + rho*(u_n + u_a2)/6.0f - N_a2;
+	f[un[4]] = f_k[12] + rho*(u_n - u_a2)/6.0f + N_a2;
+/*
+#ifdef VEL_OUTLET_EQ
+	if (i_lu == 1) {
+		float f_eq[19];
+		equilibirum_distribution_D3Q19(f_eq, rho, u[0], u[1], u[2]);
+		f[un[1]] = f_eq[un[1]];
+		f[un[2]] = f_eq[un[2]];
+		f[un[3]] = f_eq[un[3]];
+		f[un[4]] = f_eq[un[4]];
+	}
+#endif */
+}
+
+// Velocity boundaries completed in registers at the start of collide_stream
+// (FuseVelocityBC), in the same order as the separate boundary_velocity launches:
+// the wall pair first, then any tangential boundaries. calcRho = 0 for both,
+// as set for those launches in sim_main.c
+void fused_velocity_boundaries(
+	float* f,
+	int i_x, int i_y, int i_z,
+	__global int_param_struct* intDat,
+	__global flp_param_struct* flpDat)
+{
+	// Planes of an out-of-core slab are numbered from its SlabOrigin in the whole lattice
+	int i_3[3] = {i_x, i_y, i_z + intDat->SlabOrigin};
+	int un[5];
+
+	int wallAxis = -1;
+	for (int dim = 0; dim < 3; dim++) {
+		if (intDat->BoundaryConds[dim] == 1) {
+			wallAxis = dim;
+		}
+	}
+	if (wallAxis < 0) {
+		return;
+	}
+
+	for (int pass = -1; pass < 3; pass++) {
+		int axis = pass < 0 ? wallAxis : pass;
+		if (pass >= 0 && intDat->TangentialVelBC[axis] != 1) {
+			continue;
+		}
+
+		int N_a = axis == 2 ? intDat->WholeLatticeZ : intDat->LatticeSize[axis];
+		if (i_3[axis] == 1) {
+			zou_he_velocity_D3Q19(f, un, axis*2, 0, flpDat);
+		}
+		else if (i_3[axis] == N_a-2) {
+			zou_he_velocity_D3Q19(f, un, axis*2 + 1, 0, flpDat);
+		}
+	}
+}
+
+// Ensemble members are stacked along the z work dimension, memberPlanes work items each,
+// and each has its own slice of every field. Returns the member, i_z made local to it
+int ensemble_member(int* i_z, int memberPlanes)
+{
+	int member = (*i_z-1)/memberPlanes;
+	*i_z -= member*memberPlanes;
+	return member;
+}
+
 __kernel void collideMRT_stream_D3Q19(
 	__global float* f_c,
 	__global float* f_s,
@@ -321,7 +654,10 @@ __kernel void collideMRT_stream_D3Q19(
 	__global float* tau_lb,
 	__global int* countPointWrite,
 	__global int_param_struct* intDat,
-	__global flp_param_struct* flpDat) // Params could be const or local if supported
+	__global flp_param_struct* flpDat, // Params could be const or local if supported
+	__global float* f_c_hi, // Second allocations of split fields (see field_plane), else unused
+	__global float* f_s_hi,
+	__global float* gpf_hi)
 {
 	//printf(">> collideMRT_stream_D3Q19 <<");
 
@@ -330,22 +666,56 @@ __kernel void collideMRT_stream_D3Q19(
 	int i_y = get_global_id(1);
 	int i_z = get_global_id(2);
 
+	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(intDat->LatticeSize[0], intDat->LatticeSize[1], N_z);
+
+	int member = ensemble_member(&i_z, N_z-2);
+
+	int gpfPlanes = 3*intDat->MaxSurfPointsPerNode;
+	collide_stream_node(f_c, f_s, f_c_hi, f_s_hi, member*19, field_plane(gpf, gpf_hi, member*gpfPlanes, intDat->GpfPartPlanes, N_C),
+		u + member*3*N_C, tau_lb + member*N_C, countPointWrite + member*N_C, intDat, flpDat + member, i_x, i_y, i_z);
+}
+
+// MRT collision and push of one node. f planes of its ensemble member start at firstPlane,
+// other fields are already offset to the member.
+void collide_stream_node(
+	__global float* f_c,
+	__global float* f_s,
+	__global float* f_c_hi,
+	__global float* f_s_hi,
+	int firstPlane,
+	__global float* gpf,
+	__global float* u,
+	__global float* tau_lb,
+	__global int* countPointWrite,
+	__global int_param_struct* intDat,
+	__global flp_param_struct* flpDat,
+	int i_x, int i_y, int i_z)
+{
 	// Convention: upper-case N for total lattice array size (including buffer)
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
 	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z); // Total nodes
 
 	// 1D index
-	int i_1D = i_x + N_x*(i_y + N_y*i_z);
-	int N_C = N_x*N_y*N_z; // Total nodes
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
 
 	// Read in f (from f_c) for this cell
 	float f[19];
 
 	// Read f_c from __global to private memory (should be coalesced memory access)
+	for (int i = 0; i < 19; i++) {
+		f[i] = field_plane(f_c, f_c_hi, firstPlane+i, intDat->FPartPlanes, N_C)[i_1D];
+	}
+
+	// Unknowns left at velocity boundary nodes by the previous stream
+	if (intDat->FuseVelocityBC) {
+		fused_velocity_boundaries(f, i_x, i_y, i_z, intDat, flpDat);
+	}
+
 	float rho = 0.0f;
 	for (int i = 0; i < 19; i++) {
-		f[i] = f_c[i_1D + i*N_C];
 		rho += f[i];
 	}
 
@@ -365,7 +735,7 @@ __kernel void collideMRT_stream_D3Q19(
 		for(int sy = -1; sy <= 1; sy++) {
 			for(int sz = -1; sz <= 1; sz++) {
 
-				int i_S = (i_x+sx) + N_x*((i_y+sy) + N_y*(i_z+sz));
+				int i_S = lattice_node(i_x+sx, i_y+sy, i_z+sz, N_x, N_y);
 				float w_s = sten[sx+1]*sten[sy+1]*sten[sz+1]; //64.0f;
 				//wSum += w_s;
 
@@ -618,27 +988,315 @@ __kernel void collideMRT_stream_D3Q19(
 
 	// Propagate to f_s (not taking into account boundary conditions)
 	for (int i=0; i<19; i++) {
-		f_s[streamIndex[i]] = f[i] + msmn[i] + fg[i] - 0.5f*msmg[i]; // fg contains non-relaxed part of full Guo term
+		field_plane(f_s, f_s_hi, firstPlane+i, intDat->FPartPlanes, N_C)[streamIndex[i]] = f[i] + msmn[i] + fg[i] - 0.5f*msmg[i]; // fg contains non-relaxed part of full Guo term
 		//printf("i, f, msmn, fg, 0.5f*msmg; %d %f %f %f %f \n", i, f[i], msmn[i], fg[i], 0.5f*msmg[i]);
 	}
 }
+// CPU devices: collide_stream over a run of COLLIDE_VEC_WIDTH nodes along x per work item, one vector
+// lane per node, as one node per work item with large private arrays barely vectorises there.
+// The x global size is the number of runs. Runs cut short by the lattice edge, or touching a fused
+// velocity boundary, are done node by node with collide_stream_node. Runs are contiguous only in
+// plain x-fastest order (LATTICE_BRICK 1), which the split lattice needs
+#if COLLIDE_VEC_WIDTH == 16
+	typedef float16 floatv;
+	typedef int16 intv;
+	#define vloadv vload16
+	#define vstorev vstore16
+#else
+	typedef float8 floatv;
+	typedef int8 intv;
+	#define vloadv vload8
+	#define vstorev vstore8
+#endif
 
-__kernel void boundary_periodic(__global float* f_s,
+void equilibrium_D3Q19_vec(floatv* f_eq, floatv rho, floatv u_x, floatv u_y, floatv u_z);
+void guo_body_force_term_vec(floatv u_x, floatv u_y, floatv u_z,
+	floatv g_x, floatv g_y, floatv g_z, floatv* fGuo);
+void mrt_moments_vec(floatv* d, floatv* m);
+void mrt_inverse_vec(floatv* sm, floatv* out);
+
+__kernel void collideMRT_stream_D3Q19_vec(
+	__global float* f_c,
+	__global float* f_s,
+	__global float* gpf,
+	__global float* u,
+	__global float* tau_lb,
+	__global int* countPointWrite,
 	__global int_param_struct* intDat,
-	__global int* streamMapping)
+	__global flp_param_struct* flpDat,
+	__global float* f_c_hi,
+	__global float* f_s_hi,
+	__global float* gpf_hi)
 {
-	int i_k = get_global_id(0);
-	int N_BC = get_global_size(0); // Total number of periodic boundary nodes
+	int i_run = get_global_id(0); // From 1, with the same global_work_offset as collide_stream
+	int i_y = get_global_id(1);
+	int i_z = get_global_id(2);
 
-	int i_1D = streamMapping[i_k];
-	int typeBC = streamMapping[i_k + N_BC];
+	int N_x = intDat->LatticeSize[0];
+	int N_y = intDat->LatticeSize[1];
+	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+
+	int member = ensemble_member(&i_z, N_z-2);
+	int firstPlane = member*19;
+	gpf = field_plane(gpf, gpf_hi, member*3*intDat->MaxSurfPointsPerNode, intDat->GpfPartPlanes, N_C);
+	u += member*3*N_C;
+	tau_lb += member*N_C;
+	countPointWrite += member*N_C;
+	flpDat += member;
+
+	int x0 = 1 + (i_run-1)*COLLIDE_VEC_WIDTH;
+	int x1 = x0 + COLLIDE_VEC_WIDTH-1;
+	int atBoundary = x0 == 1 || x1 >= N_x-2 || i_y == 1 || i_y == N_y-2 || i_z == 1 || i_z == N_z-2;
+
+	if (x1 > N_x-2 || (intDat->FuseVelocityBC && atBoundary)) {
+		for (int i_x = x0; i_x <= x1 && i_x <= N_x-2; i_x++) {
+			collide_stream_node(f_c, f_s, f_c_hi, f_s_hi, firstPlane, gpf, u, tau_lb, countPointWrite, intDat, flpDat, i_x, i_y, i_z);
+		}
+		return;
+	}
 
-	// Uppercase N to denote total lattice size (including buffer layer)
-	int N[3];
-	N[0] = intDat->LatticeSize[0];
-	N[1] = intDat->LatticeSize[1];
+	int i_1D = lattice_node(x0, i_y, i_z, N_x, N_y);
+
+	floatv f[19];
+	for (int i = 0; i < 19; i++) {
+		f[i] = vloadv(0, field_plane(f_c, f_c_hi, firstPlane+i, intDat->FPartPlanes, N_C) + i_1D);
+	}
+
+	floatv rho = f[0];
+	for (int i = 1; i < 19; i++) {
+		rho += f[i];
+	}
+
+	floatv g_x = (floatv)(flpDat->ConstBodyForce[0]);
+	floatv g_y = (floatv)(flpDat->ConstBodyForce[1]);
+	floatv g_z = (floatv)(flpDat->ConstBodyForce[2]);
+
+#ifdef USE_VARIABLE_BODY_FORCE
+	float sten[3] = {0.25, 0.5, 0.25};
+
+	for(int sx = -1; sx <= 1; sx++) {
+		for(int sy = -1; sy <= 1; sy++) {
+			for(int sz = -1; sz <= 1; sz++) {
+				int i_S = lattice_node(x0+sx, i_y+sy, i_z+sz, N_x, N_y);
+				float w_s = sten[sx+1]*sten[sy+1]*sten[sz+1];
+
+				g_x += w_s*vloadv(0, gpf + i_S        );
+				g_y += w_s*vloadv(0, gpf + i_S + N_C*1);
+				g_z += w_s*vloadv(0, gpf + i_S + N_C*2);
+			}
+		}
+	}
+
+	vstorev((intv)(0), 0, countPointWrite + i_1D);
+#endif
+
+	// Velocity with the Guo body force contribution, as collide_stream_node
+	floatv u_x = (f[1]-f[2]+f[7]+f[8] +f[9] +f[10]-f[11]-f[12]-f[13]-f[14] + 0.5f*g_x)/rho;
+	floatv u_y = (f[3]-f[4]+f[7]-f[8] +f[11]-f[12]+f[15]+f[16]-f[17]-f[18] + 0.5f*g_y)/rho;
+	floatv u_z = (f[5]-f[6]+f[9]-f[10]+f[13]-f[14]+f[15]-f[16]+f[17]-f[18] + 0.5f*g_z)/rho;
+
+	vstorev(u_x, 0, u + i_1D);
+	vstorev(u_y, 0, u + i_1D + N_C);
+	vstorev(u_z, 0, u + i_1D + 2*N_C);
+
+	// M^-1 S M is linear, so the non-equilibrium part and the relaxed half of the Guo term
+	// are relaxed together: f + fg + M^-1 S M (f_eq - f - fg/2)
+	floatv fg[19], d[19], m[19], sm[19], msm[19];
+	equilibrium_D3Q19_vec(d, rho, u_x, u_y, u_z);
+	guo_body_force_term_vec(u_x, u_y, u_z, g_x, g_y, g_z, fg);
+	for (int i = 0; i < 19; i++) {
+		d[i] += -f[i] - 0.5f*fg[i];
+	}
+	mrt_moments_vec(d, m);
+	m[0] = (floatv)(0.0f); // s[0] = 0
+
+	float s[19] = {0.0, 1.19f, 1.40f, 1.0f, 1.20f, 1.0f, 1.20f, 1.0f, 1.0f, 1.0f, 1.0f, 1.20f, 1.40f, 1.40f, 1.0f, 1.0f, 1.98f, 1.98f, 1.98f};
+	for (int i = 0; i < 19; i++) {
+		sm[i] = s[i]*m[i];
+	}
+
+#ifdef USE_CONSTANT_VISCOSITY
+	floatv sTau = (floatv)(1.0f/flpDat->NewtonianTau);
+#else
+	// Shear rate from the relaxation with tau of the previous time step, then tau per node
+	floatv sTau = 1.0f/vloadv(0, tau_lb + i_1D);
+	sm[8] = sTau*m[8]; sm[9] = sTau*m[9]; sm[10] = sTau*m[10];
+	sm[14] = sTau*m[14]; sm[15] = sTau*m[15];
+	mrt_inverse_vec(sm, msm);
+
+	floatv ssum[19];
+	for(int i = 0; i < 19; i++) {
+		ssum[i] = msm[i] + fg[i];
+	}
+
+	floatv scc_xx = ssum[1] +ssum[2] +ssum[7] +ssum[8] +ssum[9] +ssum[10] +ssum[11] +ssum[12] +ssum[13] +ssum[14] - 2*u_x*g_x;
+	floatv scc_yy = ssum[3] +ssum[4] +ssum[7] +ssum[8] +ssum[11] +ssum[12] +ssum[15] +ssum[16] +ssum[17] +ssum[18] - 2*u_y*g_y;
+	floatv scc_zz = ssum[5] +ssum[6] +ssum[9] +ssum[10] +ssum[13] +ssum[14] +ssum[15] +ssum[16] +ssum[17] +ssum[18] - 2*u_z*g_z;
+	floatv scc_xy = ssum[7] -ssum[8] -ssum[11] +ssum[12] - (u_x*g_y + u_y*g_x);
+	floatv scc_xz = ssum[9] -ssum[10] -ssum[13] +ssum[14] - (u_x*g_z + u_z*g_x);
+	floatv scc_yz = ssum[15] -ssum[16] -ssum[17] +ssum[18] - (u_y*g_z + u_z*g_y);
+
+	floatv srtII = scc_xx*scc_xx + scc_yy*scc_yy + scc_zz*scc_zz + 2.0f*(scc_xy*scc_xy + scc_xz*scc_xz + scc_yz*scc_yz);
+	srtII = sqrt(srtII)*2.1213203f/rho;
+
+	float srtLane[COLLIDE_VEC_WIDTH], tauLane[COLLIDE_VEC_WIDTH];
+	vstorev(srtII, 0, srtLane);
+	for (int l = 0; l < COLLIDE_VEC_WIDTH; l++) {
+		tauLane[l] = compute_tau(intDat->ViscosityModel, srtLane[l], flpDat->NewtonianTau, &(flpDat->ViscosityParams[0]));
+	}
+	floatv tau = vloadv(0, tauLane);
+	vstorev(tau, 0, tau_lb + i_1D);
+	sTau = 1.0f/tau;
+#endif
+
+	// Rates 1/tau for the same moments as collide_stream_node
+	sm[8] = sTau*m[8]; sm[9] = sTau*m[9]; sm[10] = sTau*m[10];
+	sm[14] = sTau*m[14]; sm[15] = sTau*m[15];
+	mrt_inverse_vec(sm, msm);
+
+	int streamIndex[19];
+	stream_locations(N_x, N_y, N_z, x0, i_y, i_z, streamIndex);
+
+	for (int i = 0; i < 19; i++) {
+		vstorev(f[i] + fg[i] + msm[i], 0, field_plane(f_s, f_s_hi, firstPlane+i, intDat->FPartPlanes, N_C) + streamIndex[i]);
+	}
+}
+
+void equilibrium_D3Q19_vec(floatv* f_eq, floatv rho, floatv u_x, floatv u_y, floatv u_z)
+{
+	floatv u_sq = u_x*u_x + u_y*u_y + u_z*u_z;
+
+	f_eq[0] = (rho/3.0f)*(1.0f - 1.5f*u_sq);
+
+	// could remove factor of 1.5
+	f_eq[1]	 = (rho/18.0f)*(1.0f + 3.0f*u_x + 4.5f*u_x*u_x - 1.5f*u_sq);
+	f_eq[2]	 = (rho/18.0f)*(1.0f - 3.0f*u_x + 4.5f*u_x*u_x - 1.5f*u_sq);
+	f_eq[3]	 = (rho/18.0f)*(1.0f + 3.0f*u_y + 4.5f*u_y*u_y - 1.5f*u_sq);
+	f_eq[4]	 = (rho/18.0f)*(1.0f - 3.0f*u_y + 4.5f*u_y*u_y - 1.5f*u_sq);
+	f_eq[5]	 = (rho/18.0f)*(1.0f + 3.0f*u_z + 4.5f*u_z*u_z - 1.5f*u_sq);
+	f_eq[6]	 = (rho/18.0f)*(1.0f - 3.0f*u_z + 4.5f*u_z*u_z - 1.5f*u_sq);
+
+	f_eq[7]	 = (rho/36.0f)*(1.0f + 3.0f*(u_x+u_y) + 4.5f*(u_x+u_y)*(u_x+u_y) - 1.5f*u_sq);
+	f_eq[8]	 = (rho/36.0f)*(1.0f + 3.0f*(u_x-u_y) + 4.5f*(u_x-u_y)*(u_x-u_y) - 1.5f*u_sq);
+	f_eq[9]	 = (rho/36.0f)*(1.0f + 3.0f*(u_x+u_z) + 4.5f*(u_x+u_z)*(u_x+u_z) - 1.5f*u_sq);
+	f_eq[10] = (rho/36.0f)*(1.0f + 3.0f*(u_x-u_z) + 4.5f*(u_x-u_z)*(u_x-u_z) - 1.5f*u_sq);
+
+	f_eq[11] = (rho/36.0f)*(1.0f + 3.0f*(-u_x+u_y) + 4.5f*(-u_x+u_y)*(-u_x+u_y) - 1.5f*u_sq);
+	f_eq[12] = (rho/36.0f)*(1.0f + 3.0f*(-u_x-u_y) + 4.5f*(-u_x-u_y)*(-u_x-u_y) - 1.5f*u_sq);
+	f_eq[13] = (rho/36.0f)*(1.0f + 3.0f*(-u_x+u_z) + 4.5f*(-u_x+u_z)*(-u_x+u_z) - 1.5f*u_sq);
+	f_eq[14] = (rho/36.0f)*(1.0f + 3.0f*(-u_x-u_z) + 4.5f*(-u_x-u_z)*(-u_x-u_z) - 1.5f*u_sq);
+
+	f_eq[15] = (rho/36.0f)*(1.0f + 3.0f*(u_y+u_z) + 4.5f*(u_y+u_z)*(u_y+u_z) - 1.5f*u_sq);
+	f_eq[16] = (rho/36.0f)*(1.0f + 3.0f*(u_y-u_z) + 4.5f*(u_y-u_z)*(u_y-u_z) - 1.5f*u_sq);
+	f_eq[17] = (rho/36.0f)*(1.0f + 3.0f*(-u_y+u_z) + 4.5f*(-u_y+u_z)*(-u_y+u_z) - 1.5f*u_sq);
+	f_eq[18] = (rho/36.0f)*(1.0f + 3.0f*(-u_y-u_z) + 4.5f*(-u_y-u_z)*(-u_y-u_z) - 1.5f*u_sq);
+}
+
+void guo_body_force_term_vec(floatv u_x, floatv u_y, floatv u_z,
+	floatv g_x, floatv g_y, floatv g_z, floatv* fGuo)
+{
+	floatv uDg = u_x*g_x + u_y*g_y + u_z*g_z;
+
+	fGuo[0 ] = -uDg;
+	fGuo[1 ] = ( g_x - uDg + 3.0f*u_x*g_x )/6.0f; // Factor of 3 cancelled
+	fGuo[2 ] = (-g_x - uDg + 3.0f*u_x*g_x )/6.0f;
+	fGuo[3 ] = ( g_y - uDg + 3.0f*u_y*g_y )/6.0f;
+	fGuo[4 ] = (-g_y - uDg + 3.0f*u_y*g_y )/6.0f;
+	fGuo[5 ] = ( g_z - uDg + 3.0f*u_z*g_z )/6.0f;
+	fGuo[6 ] = (-g_z - uDg + 3.0f*u_z*g_z )/6.0f;
+
+	fGuo[7 ] = ( g_x+g_y - uDg + 3.0f*( u_x+u_y)*( g_x+g_y) )/12.0f;
+	fGuo[8 ] = ( g_x-g_y - uDg + 3.0f*( u_x-u_y)*( g_x-g_y) )/12.0f;
+	fGuo[9 ] = ( g_x+g_z - uDg + 3.0f*( u_x+u_z)*( g_x+g_z) )/12.0f;
+	fGuo[10] = ( g_x-g_z - uDg + 3.0f*( u_x-u_z)*( g_x-g_z) )/12.0f;
+
+	fGuo[11] = (-g_x+g_y - uDg + 3.0f*(-u_x+u_y)*(-g_x+g_y) )/12.0f;
+	fGuo[12] = (-g_x-g_y - uDg + 3.0f*(-u_x-u_y)*(-g_x-g_y) )/12.0f; // could simplify further
+	fGuo[13] = (-g_x+g_z - uDg + 3.0f*(-u_x+u_z)*(-g_x+g_z) )/12.0f;
+	fGuo[14] = (-g_x-g_z - uDg + 3.0f*(-u_x-u_z)*(-g_x-g_z) )/12.0f;
+
+	fGuo[15] = ( g_y+g_z - uDg + 3.0f*( u_y+u_z)*( g_y+g_z) )/12.0f;
+	fGuo[16] = ( g_y-g_z - uDg + 3.0f*( u_y-u_z)*( g_y-g_z) )/12.0f;
+	fGuo[17] = (-g_y+g_z - uDg + 3.0f*(-u_y+u_z)*(-g_y+g_z) )/12.0f;
+	fGuo[18] = (-g_y-g_z - uDg + 3.0f*(-u_y-u_z)*(-g_y-g_z) )/12.0f;
+}
+
+// MRT moments, rows of M as in collide_stream_node
+void mrt_moments_vec(floatv* d, floatv* m)
+{
+	m[1] = -30.0f*d[0] -11.0f*d[1] -11.0f*d[2] -11.0f*d[3] -11.0f*d[4] -11.0f*d[5] -11.0f*d[6] +8.0f*d[7] +8.0f*d[8] +8.0f*d[9] +8.0f*d[10] +8.0f*d[11] +8.0f*d[12] +8.0f*d[13] +8.0f*d[14] +8.0f*d[15] +8.0f*d[16] +8.0f*d[17] +8.0f*d[18];
+	m[2] = 12.0f*d[0] -4.0f*d[1] -4.0f*d[2] -4.0f*d[3] -4.0f*d[4] -4.0f*d[5] -4.0f*d[6] +d[7] +d[8] +d[9] +d[10] +d[11] +d[12] +d[13] +d[14] +d[15] +d[16] +d[17] +d[18];
+	m[3] = +d[1] -d[2] +d[7] +d[8] +d[9] +d[10] -d[11] -d[12] -d[13] -d[14];
+	m[4] = -4.0f*d[1] +4.0f*d[2] +d[7] +d[8] +d[9] +d[10] -d[11] -d[12] -d[13] -d[14];
+	m[5] = +d[3] -d[4] +d[7] -d[8] +d[11] -d[12] +d[15] +d[16] -d[17] -d[18];
+	m[6] = -4.0f*d[3] +4.0f*d[4] +d[7] -d[8] +d[11] -d[12] +d[15] +d[16] -d[17] -d[18];
+	m[7] = +d[5] -d[6] +d[9] -d[10] +d[13] -d[14] +d[15] -d[16] +d[17] -d[18];
+	m[8] = -4.0f*d[5] +4.0f*d[6] +d[9] -d[10] +d[13] -d[14] +d[15] -d[16] +d[17] -d[18];
+	m[9] = +2.0f*d[1] +2.0f*d[2] -d[3] -d[4] -d[5] -d[6] +d[7] +d[8] +d[9] +d[10] +d[11] +d[12] +d[13] +d[14] -2.0f*d[15] -2.0f*d[16] -2.0f*d[17] -2.0f*d[18];
+	m[10] = -4.0f*d[1] -4.0f*d[2] +2.0f*d[3] +2.0f*d[4] +2.0f*d[5] +2.0f*d[6] +d[7] +d[8] +d[9] +d[10] +d[11] +d[12] +d[13] +d[14] -2.0f*d[15] -2.0f*d[16] -2.0f*d[17] -2.0f*d[18];
+	m[11] = +d[3] +d[4] -d[5] -d[6] +d[7] +d[8] -d[9] -d[10] +d[11] +d[12] -d[13] -d[14];
+	m[12] = -2.0f*d[3] -2.0f*d[4] +2.0f*d[5] +2.0f*d[6] +d[7] +d[8] -d[9] -d[10] +d[11] +d[12] -d[13] -d[14];
+	m[13] = +d[7] -d[8] -d[11] +d[12];
+	m[14] = +d[15] -d[16] -d[17] +d[18];
+	m[15] = +d[9] -d[10] -d[13] +d[14];
+	m[16] = +d[7] +d[8] -d[9] -d[10] -d[11] -d[12] +d[13] +d[14];
+	m[17] = -d[7] +d[8] -d[11] +d[12] +d[15] +d[16] -d[17] -d[18];
+	m[18] = +d[9] -d[10] +d[13] -d[14] -d[15] +d[16] -d[17] +d[18];
+}
+
+// Back from relaxed moments, M^-1
+void mrt_inverse_vec(floatv* sm, floatv* out)
+{
+	out[0] = 5.2631579E-2f*sm[0] -1.2531328E-2f*sm[1] +4.7619048E-2f*sm[2];
+	out[1] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] +1.0E-1f*sm[3] -1.0E-1f*sm[4] +5.5555556E-2f*sm[9] -5.5555556E-2f*sm[10];
+	out[2] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] -1.0E-1f*sm[3] +1.0E-1f*sm[4] +5.5555556E-2f*sm[9] -5.5555556E-2f*sm[10];
+	out[3] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] +1.0E-1f*sm[5] -1.0E-1f*sm[6] -2.7777778E-2f*sm[9] +2.7777778E-2f*sm[10] +8.3333333E-2f*sm[11] -8.3333333E-2f*sm[12];
+	out[4] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] -1.0E-1f*sm[5] +1.0E-1f*sm[6] -2.7777778E-2f*sm[9] +2.7777778E-2f*sm[10] +8.3333333E-2f*sm[11] -8.3333333E-2f*sm[12];
+	out[5] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] +1.0E-1f*sm[7] -1.0E-1f*sm[8] -2.7777778E-2f*sm[9] +2.7777778E-2f*sm[10] -8.3333333E-2f*sm[11] +8.3333333E-2f*sm[12];
+	out[6] = 5.2631579E-2f*sm[0] -4.5948204E-3f*sm[1] -1.5873016E-2f*sm[2] -1.0E-1f*sm[7] +1.0E-1f*sm[8] -2.7777778E-2f*sm[9] +2.7777778E-2f*sm[10] -8.3333333E-2f*sm[11] +8.3333333E-2f*sm[12];
+	out[7] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[3] +2.5E-2f*sm[4] +1.0E-1f*sm[5] +2.5E-2f*sm[6] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] +8.3333333E-2f*sm[11] +4.1666667E-2f*sm[12] +2.5E-1f*sm[13] +1.25E-1f*sm[16] -1.25E-1f*sm[17];
+	out[8] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[3] +2.5E-2f*sm[4] -1.0E-1f*sm[5] -2.5E-2f*sm[6] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] +8.3333333E-2f*sm[11] +4.1666667E-2f*sm[12] -2.5E-1f*sm[13] +1.25E-1f*sm[16] +1.25E-1f*sm[17];
+	out[9] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[3] +2.5E-2f*sm[4] +1.0E-1f*sm[7] +2.5E-2f*sm[8] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] -8.3333333E-2f*sm[11] -4.1666667E-2f*sm[12] +2.5E-1f*sm[15] -1.25E-1f*sm[16] +1.25E-1f*sm[18];
+	out[10] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[3] +2.5E-2f*sm[4] -1.0E-1f*sm[7] -2.5E-2f*sm[8] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] -8.3333333E-2f*sm[11] -4.1666667E-2f*sm[12] -2.5E-1f*sm[15] -1.25E-1f*sm[16] -1.25E-1f*sm[18];
+	out[11] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[3] -2.5E-2f*sm[4] +1.0E-1f*sm[5] +2.5E-2f*sm[6] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] +8.3333333E-2f*sm[11] +4.1666667E-2f*sm[12] -2.5E-1f*sm[13] -1.25E-1f*sm[16] -1.25E-1f*sm[17];
+	out[12] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[3] -2.5E-2f*sm[4] -1.0E-1f*sm[5] -2.5E-2f*sm[6] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] +8.3333333E-2f*sm[11] +4.1666667E-2f*sm[12] +2.5E-1f*sm[13] -1.25E-1f*sm[16] +1.25E-1f*sm[17];
+	out[13] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[3] -2.5E-2f*sm[4] +1.0E-1f*sm[7] +2.5E-2f*sm[8] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] -8.3333333E-2f*sm[11] -4.1666667E-2f*sm[12] -2.5E-1f*sm[15] +1.25E-1f*sm[16] +1.25E-1f*sm[18];
+	out[14] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[3] -2.5E-2f*sm[4] -1.0E-1f*sm[7] -2.5E-2f*sm[8] +2.7777778E-2f*sm[9] +1.3888889E-2f*sm[10] -8.3333333E-2f*sm[11] -4.1666667E-2f*sm[12] +2.5E-1f*sm[15] +1.25E-1f*sm[16] -1.25E-1f*sm[18];
+	out[15] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[5] +2.5E-2f*sm[6] +1.0E-1f*sm[7] +2.5E-2f*sm[8] -5.5555556E-2f*sm[9] -2.7777778E-2f*sm[10] +2.5E-1f*sm[14] +1.25E-1f*sm[17] -1.25E-1f*sm[18];
+	out[16] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] +1.0E-1f*sm[5] +2.5E-2f*sm[6] -1.0E-1f*sm[7] -2.5E-2f*sm[8] -5.5555556E-2f*sm[9] -2.7777778E-2f*sm[10] -2.5E-1f*sm[14] +1.25E-1f*sm[17] +1.25E-1f*sm[18];
+	out[17] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[5] -2.5E-2f*sm[6] +1.0E-1f*sm[7] +2.5E-2f*sm[8] -5.5555556E-2f*sm[9] -2.7777778E-2f*sm[10] -2.5E-1f*sm[14] -1.25E-1f*sm[17] -1.25E-1f*sm[18];
+	out[18] = 5.2631579E-2f*sm[0] +3.3416876E-3f*sm[1] +3.9682540E-3f*sm[2] -1.0E-1f*sm[5] -2.5E-2f*sm[6] -1.0E-1f*sm[7] -2.5E-2f*sm[8] -5.5555556E-2f*sm[9] -2.7777778E-2f*sm[10] +2.5E-1f*sm[14] -1.25E-1f*sm[17] +1.25E-1f*sm[18];
+}
+
+
+__kernel void boundary_periodic(__global float* f_s,
+	__global int_param_struct* intDat,
+	__global int* streamMapping,
+	__global flp_param_struct* flpDat,
+	__global float* u,
+	float leOffset,
+	__global float* f_s_hi)
+{
+	int i_k = get_global_id(0);
+	int N_BC = intDat->NumPeriodicNodes; // Total number of periodic boundary nodes (per member)
+
+	// Uppercase N to denote total lattice size (including buffer layer)
+	int N[3];
+	N[0] = intDat->LatticeSize[0];
+	N[1] = intDat->LatticeSize[1];
 	N[2] = intDat->LatticeSize[2];
-	int N_C = N[0]*N[1]*N[2];
+	lattice_index N_C = lattice_nodes(N[0], N[1], N[2]);
+
+	// All members share the stream mapping
+	int member = i_k/N_BC;
+	i_k -= member*N_BC;
+	int firstPlane = member*19;
+	u += member*3*N_C;
+	flpDat += member;
+
+	int i_1D = streamMapping[i_k];
+	int typeBC = streamMapping[i_k + N_BC];
 
 	// D3Q19 version
 
@@ -710,10 +1368,17 @@ __kernel void boundary_periodic(__global float* f_s,
 
 	int numUnknowns = unknowns[typeBC][0];
 
+	// Lees-Edwards: +1 on the lower z face (image above is offset by +leOffset, moving with +LEVelocity),
+	// -1 on the upper z face, 0 otherwise
+	int sideLE = intDat->LeesEdwards ? inwardNormals[typeBC][2] : 0;
+	int r[3];
+	lattice_coords(i_1D, N[0], N[1], r);
+
 	// Loop over unknowns
-	for (int u=0; u<numUnknowns; u++)
+	for (int i_u=0; i_u<numUnknowns; i_u++)
 	{
-		int i_f = unknowns[typeBC][u+1];
+		int i_f = unknowns[typeBC][i_u+1];
+		__global float* f_p = field_plane(f_s, f_s_hi, firstPlane+i_f, intDat->FPartPlanes, N_C);
 
 		int offset[3];
 		// If component of c and inward normals are both non-zero and have same direction,
@@ -727,10 +1392,50 @@ __kernel void boundary_periodic(__global float* f_s,
 		//printf("i_k,typeBC,i,i_f,offset %d,%d,%d,%d %d,%d,%d\n",
 		//i_k, typeBC, i_1D, i_f, offset[0], offset[1], offset[2]);
 
-		int periodic_1D = i_1D + offset[0] + N[0]*(offset[1] + N[1]*offset[2]);
-
-		// Read component i_f from periodic-offset cell, and write to this one
-		f_s[i_f*N_C + i_1D] = f_s[i_f*N_C + periodic_1D];
+		int p_y = r[1] + offset[1];
+		int p_z = r[2] + offset[2];
+		int periodic_1D = lattice_node(r[0] + offset[0], p_y, p_z, N[0], N[1]);
+
+		if (sideLE != 0 && offset[2] != 0) {
+			// Sliding image: interpolate along x in the buffer layer, over the nodes that have been streamed
+			// to for this direction, i.e. x in [1+c_x, N_x-2+c_x]
+			int c_x = intDat->BasisVel[i_f][0];
+			int c_y = intDat->BasisVel[i_f][1];
+			int c_z = intDat->BasisVel[i_f][2];
+			int L_x = N[0]-2;
+
+			float xs = (float)(r[0] - 1 - c_x) + sideLE*leOffset;
+			xs = fmod(fmod(xs, (float)L_x) + L_x, (float)L_x);
+			int x0 = (int)xs;
+			float w1 = xs - x0;
+			int x1 = (x0 + 1)%L_x;
+
+			int src0 = lattice_node(1 + c_x + x0, p_y, p_z, N[0], N[1]);
+			int src1 = lattice_node(1 + c_x + x1, p_y, p_z, N[0], N[1]);
+			float f_i = (1.0f-w1)*f_p[src0] + w1*f_p[src1];
+
+			// Galilean shift of the population into this image's frame, f_eq(u+du) - f_eq(u)
+			// using the velocity of the nodes that streamed into the buffer, and rho ~ 1
+			int u0 = lattice_node(1 + x0, p_y - c_y, p_z - c_z, N[0], N[1]);
+			int u1 = lattice_node(1 + x1, p_y - c_y, p_z - c_z, N[0], N[1]);
+			float u_x = (1.0f-w1)*u[u0        ] + w1*u[u1        ];
+			float u_y = (1.0f-w1)*u[u0 +   N_C] + w1*u[u1 +   N_C];
+			float u_z = (1.0f-w1)*u[u0 + 2*N_C] + w1*u[u1 + 2*N_C];
+			float du = -sideLE*flpDat->LEVelocity;
+
+			float cu = c_x*u_x + c_y*u_y + c_z*u_z;
+			float cuShift = cu + c_x*du;
+			float uSq = u_x*u_x + u_y*u_y + u_z*u_z;
+			float uSqShift = uSq + 2.0f*u_x*du + du*du;
+
+			f_i += flpDat->EqWeights[i_f]*(3.0f*c_x*du + 4.5f*(cuShift*cuShift - cu*cu) - 1.5f*(uSqShift - uSq));
+
+			f_p[i_1D] = f_i;
+		}
+		else {
+			// Read component i_f from periodic-offset cell, and write to this one
+			f_p[i_1D] = f_p[periodic_1D];
+		}
 	}
 }
 
@@ -739,7 +1444,8 @@ __kernel void boundary_velocity(
 	__global int_param_struct* intDat,
 	__global flp_param_struct* flpDat,
 	int wallAxis,
-	int calcRho)
+	int calcRho,
+	__global float* f_s_hi)
 {
 
 	// Get 3D indices
@@ -747,8 +1453,6 @@ __kernel void boundary_velocity(
 	i_3[0] = get_global_id(0); // Using global_work_offset = {1,1,1}
 	i_3[1] = get_global_id(1);
 	i_3[2] = get_global_id(2);
-	int i_lu = get_global_id(wallAxis)-1; //  0 or 1 for lower or upper wall
-	int i_lu_pm = i_lu*2 - 1;             // -1 or 1 for lower or upper wall
 
 	//printf("Vel BC with wallAxis = %d and calcRho = %d\n", wallAxis, calcRho);
 
@@ -756,223 +1460,389 @@ __kernel void boundary_velocity(
 	N[0] = intDat->LatticeSize[0];
 	N[1] = intDat->LatticeSize[1];
 	N[2] = intDat->LatticeSize[2];
-	int N_C = N[0]*N[1]*N[2];
+	lattice_index N_C = lattice_nodes(N[0], N[1], N[2]);
+
+	int member = ensemble_member(&i_3[2], wallAxis == 2 ? 2 : N[2]-2);
+	int firstPlane = member*19;
+	flpDat += member;
+
+	int i_lu = i_3[wallAxis]-1; //  0 or 1 for lower or upper wall
 
 	// Wall index (-x,+x, -y,+y, -z,+z) numbered from 0 to 5
 	int i_w = wallAxis*2 + i_lu; // -1 because of work_offset
 
 	// Eqivalent index for entire lattice (1->1, 2->n-2)
 	i_3[wallAxis] += (i_3[wallAxis]-1)*(N[wallAxis]-4);
-	int i_1D = i_3[0] + N[0]*(i_3[1] + N[1]*i_3[2]);
+	int i_1D = lattice_node(i_3[0], i_3[1], i_3[2], N[0], N[1]);
 
-	// Tabulated velocity boundary condition
-	// 5 unknowns and 14 knowns in a symmetric order (see thesis)
-	int tabUn[6][5] = {
-		{1, 7, 8, 9,10}, // x- wall
-		{2,11,12,13,14}, // x+ wall
-		{3, 7,11,15,16}, // y- wall
-		{4, 8,12,17,18}, // y+ wall
-		{5, 9,13,15,17}, // z- wall
-		{6,10,14,16,18}	 // z+ wall
-	};
+	float f[19];
+	for (int i=0; i<19; i++) {
+		f[i] = field_plane(f_s, f_s_hi, firstPlane+i, intDat->FPartPlanes, N_C)[i_1D];
+	}
 
-	int tabKn[6][14] = {
-		{0, 3, 4, 5, 6,15,16,17,18, 2,11,12,13,14},
-		{0, 3, 4, 5, 6,15,16,17,18, 1, 7, 8, 9,10},
-		{0, 1, 2, 5, 6, 9,10,13,14, 4, 8,12,17,18},
-		{0, 1, 2, 5, 6, 9,10,13,14, 3, 7,11,15,16},
-		{0, 1, 2, 3, 4, 7, 8,11,12, 6,10,14,16,18},
-		{0, 1, 2, 3, 4, 7, 8,11,12, 5, 9,13,15,17}
-	};
+	int un[5];
+	zou_he_velocity_D3Q19(f, un, i_w, calcRho, flpDat);
 
-	int tabAxes[6][3] = {
-		//n a1 a2
-		{0, 1, 2},
-		{0, 1, 2},
-		{1, 0, 2},
-		{1, 0, 2},
-		{2, 0, 1},
-		{2, 0, 1},
-	};
+	// Write the 5 unknowns back to f_s for this node
+	for (int i_u=0; i_u<5; i_u++) {
+		field_plane(f_s, f_s_hi, firstPlane+un[i_u], intDat->FPartPlanes, N_C)[i_1D] = f[un[i_u]];
+	}
+}
 
-	// Read in 14 knowns
-	float f_k[14];
-	for (int i_k=0; i_k<14; i_k++) {
-		f_k[i_k] = f_s[i_1D + tabKn[i_w][i_k]*N_C];
+// Running mean and sum of squared deviations (Welford) of u, tau_lb and the particle force
+// density, NUM_STAT_FIELDS values per node stored field-major: statMean[i_1D + field*N_C]
+// sampleNum counts from 1; the first sample initialises both accumulators
+__kernel void accumulate_field_statistics(
+	__global float* u,
+	__global float* tau_lb,
+	__global float* gpf,
+	__global float* statMean,
+	__global float* statM2,
+	int sampleNum,
+	__global int_param_struct* intDat)
+{
+	int i_x = get_global_id(0); // Using global_work_offset to take buffer layer into account
+	int i_y = get_global_id(1);
+	int i_z = get_global_id(2);
+
+	int N_x = intDat->LatticeSize[0];
+	int N_y = intDat->LatticeSize[1];
+	int N_z = intDat->LatticeSize[2];
+
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+
+	float x[NUM_STAT_FIELDS];
+	x[0] = u[i_1D        ];
+	x[1] = u[i_1D +   N_C];
+	x[2] = u[i_1D + 2*N_C];
+	x[3] = tau_lb[i_1D];
+	x[4] = gpf[i_1D        ]; // Summed into the j = 0 slots by sum_particle_fluid_forces
+	x[5] = gpf[i_1D +   N_C];
+	x[6] = gpf[i_1D + 2*N_C];
+
+	for (int field = 0; field < NUM_STAT_FIELDS; field++) {
+		lattice_index i_s = i_1D + field*N_C;
+		if (sampleNum == 1) {
+			statMean[i_s] = x[field];
+			statM2[i_s] = 0.0f;
+		}
+		else {
+			float mean = statMean[i_s];
+			float delta = x[field] - mean;
+			mean += delta/sampleNum;
+			statMean[i_s] = mean;
+			statM2[i_s] += delta*(x[field] - mean);
+		}
 	}
+}
 
-	// Read in velocities
-	float u_w[6];
-	u_w[0] = flpDat->VelLower[0]; // Only really need 3 of these
-	u_w[1] = flpDat->VelLower[1];
-	u_w[2] = flpDat->VelLower[2];
-	u_w[3] = flpDat->VelUpper[0];
-	u_w[4] = flpDat->VelUpper[1];
-	u_w[5] = flpDat->VelUpper[2];
+// Initial state: equilibrium at initVel in both f buffers, no forcing, Newtonian tau of the node's member.
+// Covers the buffer layer, global size {N_x, N_y, N_z*members} with no offset
+__kernel void initialize_lattice_fields(
+	__global float* f_A,
+	__global float* f_B,
+	__global float* u,
+	__global float* gpf,
+	__global float* tau_lb,
+	__global int* countPoint,
+	__global int_param_struct* intDat,
+	__global flp_param_struct* flpDat,
+	float4 initVel,
+	__global float* f_A_hi,
+	__global float* f_B_hi,
+	__global float* gpf_hi)
+{
+	int i_x = get_global_id(0);
+	int i_y = get_global_id(1);
+	int i_z = get_global_id(2);
 
-	float u[3]; // Velocity for this node
-	u[0] = u_w[i_lu*3	 ]; // i_lu =  0 or 1 for lower or upper wall
-	u[1] = u_w[i_lu*3 + 1];
-	u[2] = u_w[i_lu*3 + 2];
+	int N_x = intDat->LatticeSize[0];
+	int N_y = intDat->LatticeSize[1];
+	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
 
-	float u_n = -i_lu_pm*u[tabAxes[i_w][0]]; // Inwards normal fluid velocity
-	float u_a1 = u[tabAxes[i_w][1]]; // Tangential velocity axis 1
-	float u_a2 = u[tabAxes[i_w][2]]; // Tangential velocity axis 2
+	int member = i_z/N_z;
+	i_z -= member*N_z;
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
 
-	// Calculate rho
-	float rho;
+	u += member*3*N_C;
+	tau_lb += member*N_C;
+	countPoint += member*N_C;
 
-	// Shouldn't be any performance loss from if statement if all threads doing the same thing
-	if (calcRho) {
-		rho = (f_k[0]+f_k[1]+f_k[2]+f_k[3]+f_k[4]+f_k[5]+f_k[6]+f_k[7]+f_k[8]
-			+ 2*(f_k[9]+f_k[10]+f_k[11]+f_k[12]+f_k[13]))/(1.0f-u_n);
+	float f_eq[19];
+	equilibirum_distribution_D3Q19(f_eq, 1.0f, initVel.x, initVel.y, initVel.z);
+	for (int i = 0; i < 19; i++) {
+		field_plane(f_A, f_A_hi, member*19+i, intDat->FPartPlanes, N_C)[i_1D] = f_eq[i];
+		field_plane(f_B, f_B_hi, member*19+i, intDat->FPartPlanes, N_C)[i_1D] = f_eq[i];
 	}
-	else {
-		// Calculate inward normal vel with rho = 1
-		rho = 1.0f;
-		u_n = 1 - (f_k[0]+f_k[1]+f_k[2]+f_k[3]+f_k[4]+f_k[5]+f_k[6]+f_k[7]+f_k[8]
-			+ 2*(f_k[9]+f_k[10]+f_k[11]+f_k[12]+f_k[13]))/rho;
+
+	u[i_1D        ] = initVel.x;
+	u[i_1D +   N_C] = initVel.y;
+	u[i_1D + 2*N_C] = initVel.z;
+
+	int gpfPlanes = 3*intDat->MaxSurfPointsPerNode;
+	for (int j = 0; j < gpfPlanes; j++) {
+		field_plane(gpf, gpf_hi, member*gpfPlanes+j, intDat->GpfPartPlanes, N_C)[i_1D] = 0.0f;
 	}
+	tau_lb[i_1D] = flpDat[member].NewtonianTau;
+	countPoint[i_1D] = 0;
+}
 
-#ifdef VEL_BC_MOM_CORR
-	// Calculate 'tranverse momentum correction'
-	float N_a1 = 0.5f*(f_k[1]+f_k[5]+f_k[6] -f_k[2]-f_k[7]-f_k[8]) - rho*u_a1/3.0f;
-	float N_a2 = 0.5f*(f_k[3]+f_k[5]+f_k[7] -f_k[4]-f_k[6]-f_k[8]) - rho*u_a2/3.0f;
-#else
-	float N_a1 = 0.0;
-	float N_a2 = 0.0;
-#endif
+// Magnitude of the vorticity at an interior node, central differences of u
+// Periodic axes wrap, walls and Lees-Edwards z faces fall back to one-sided differences
+float vorticity_magnitude(
+	__global float* u,
+	int i_x, int i_y, int i_z,
+	__global int_param_struct* intDat)
+{
+	int N[3];
+	N[0] = intDat->LatticeSize[0];
+	N[1] = intDat->LatticeSize[1];
+	N[2] = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N[0], N[1], N[2]);
 
-	// Calculate unknown normal to wall, write to f_s for this node
-	f_s[i_1D + tabUn[i_w][0]*N_C] = f_k[9] + rho*u_n/3.0f;
+	float du[3][3]; // du[a][b] = d(u_a)/d(x_b)
 
-	// Other four unknowns
-	f_s[i_1D + tabUn[i_w][1]*N_C] = f_k[11] + rho*(u_n + u_a1)/6.0f - N_a1;
-	f_s[i_1D + tabUn[i_w][2]*N_C] = f_k[10] + rho*(u_n - u_a1)/6.0f + N_a1;
-	f_s[i_1D + tabUn[i_w][3]*N_C] = f_k[13] + rho*(u_n + u_a2)/6.0f - N_a2;
-	f_s[i_1D + tabUn[i_w][4]*N_C] = f_k[12] + rho*(u_n - u_a2)/6.0f + N_a2;
-/*
-#ifdef VEL_OUTLET_EQ
-	if (i_lu == 1) {
-		float f_eq[19];
-		equilibirum_distribution_D3Q19(f_eq, rho, u[0], u[1], u[2]);
-		f_s[i_1D + tabUn[i_w][1]*N_C] = f_eq[tabUn[i_w][1]];
-		f_s[i_1D + tabUn[i_w][2]*N_C] = f_eq[tabUn[i_w][2]];
-		f_s[i_1D + tabUn[i_w][3]*N_C] = f_eq[tabUn[i_w][3]];
-		f_s[i_1D + tabUn[i_w][4]*N_C] = f_eq[tabUn[i_w][4]];
+	for (int b = 0; b < 3; b++) {
+		int i_m[3] = {i_x, i_y, i_z};
+		int i_p[3] = {i_x, i_y, i_z};
+		int periodic = intDat->BoundaryConds[b] == 0 && !(b == 2 && intDat->LeesEdwards);
+		float h = 2.0f;
+
+		i_m[b] -= 1;
+		i_p[b] += 1;
+		if (i_m[b] < 1) {
+			if (periodic) { i_m[b] = N[b]-2; } else { i_m[b] += 1; h -= 1.0f; }
+		}
+		if (i_p[b] > N[b]-2) {
+			if (periodic) { i_p[b] = 1; } else { i_p[b] -= 1; h -= 1.0f; }
+		}
+
+		int i_1D_m = lattice_node(i_m[0], i_m[1], i_m[2], N[0], N[1]);
+		int i_1D_p = lattice_node(i_p[0], i_p[1], i_p[2], N[0], N[1]);
+
+		for (int a = 0; a < 3; a++) {
+			du[a][b] = h > 0.0f ? (u[i_1D_p + a*N_C] - u[i_1D_m + a*N_C])/h : 0.0f;
+		}
 	}
-#endif */
+
+	float w_x = du[2][1] - du[1][2];
+	float w_y = du[0][2] - du[2][0];
+	float w_z = du[1][0] - du[0][1];
+
+	return sqrt(w_x*w_x + w_y*w_y + w_z*w_z);
 }
 
-// Outdated kernel
-__kernel void collideSRT_newtonian_stream_D3Q19(
-	__global float* f_c,
-	__global float* f_s,
-	__global float* g,
+// Pack every spacing'th interior node (i_x slowest, i_z fastest, as in the output files) into
+// columns u_x, u_y, u_z (then |vorticity| if withVorticity), starting at gatherOffset
+// One work-item per output node
+__kernel void gather_fluid_output(
 	__global float* u,
-	__global int_param_struct* intDat,
-	__global flp_param_struct* flpDat)
+	__global float* fluidGather,
+	int gatherOffset,
+	int spacing,
+	int withVorticity,
+	__global int_param_struct* intDat)
 {
-	// Get 3D indices
-	int i_x = get_global_id(0); // Using global_work_offset to take buffer layer into account
-	int i_y = get_global_id(1);
-	int i_z = get_global_id(2);
-
-	// Convention: upper-case N for total lattice array size (including buffer)
 	int N_x = intDat->LatticeSize[0];
 	int N_y = intDat->LatticeSize[1];
 	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
 
-	// 1D index
-	int i_1D = i_x + N_x*(i_y + N_y*i_z);
-	int N_C = N_x*N_y*N_z; // Total nodes
+	int n_gx = 1 + (N_x-3)/spacing;
+	int n_gy = 1 + (N_y-3)/spacing;
+	int n_gz = 1 + (N_z-3)/spacing;
+	int n_fluid = n_gx*n_gy*n_gz;
 
-	// Read in f (from f_c) for this cell
-	float f[19];
-
-	// Read f_c from __global to private memory (should be coalesced memory access)
-	float rho = 0.0f;
-	for (int i=0; i<19; i++) {
-		f[i] = f_c[i_1D + i*N_C ];
-		rho += f[i];
+	int i_g = get_global_id(0);
+	if (i_g >= n_fluid) {
+		return;
 	}
 
-#ifdef USE_CONSTANT_BODY_FORCE
-	float g_x = flpDat->ConstBodyForce[0];
-	float g_y = flpDat->ConstBodyForce[1];
-	float g_z = flpDat->ConstBodyForce[2];
-#else
-	float g_x = g[i_1D		  ];
-	float g_y = g[i_1D +   N_C];
-	float g_z = g[i_1D + 2*N_C];
-#endif
-
-	// Compute velocity (J. Stat. Mech. (2010) P01018 convention)
-	// w/ body force contribution (Guo et al. 2002)
-	float u_x = (f[1]-f[2]+f[7]+f[8] +f[9] +f[10]-f[11]-f[12]-f[13]-f[14] + 0.5f*g_x)/rho;
-	float u_y = (f[3]-f[4]+f[7]-f[8] +f[11]-f[12]+f[15]+f[16]-f[17]-f[18] + 0.5f*g_y)/rho;
-	float u_z = (f[5]-f[6]+f[9]-f[10]+f[13]-f[14]+f[15]-f[16]+f[17]-f[18] + 0.5f*g_z)/rho;
+	int i_x = 1 + spacing*(i_g/(n_gy*n_gz));
+	int i_y = 1 + spacing*((i_g/n_gz)%n_gy);
+	int i_z = 1 + spacing*(i_g%n_gz);
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
 
-	// Write to __global *u
-	u[i_1D		  ] = u_x;
-	u[i_1D +   N_C] = u_y;
-	u[i_1D + 2*N_C] = u_z;
+	__global float* cols = fluidGather + gatherOffset;
+	cols[i_g            ] = u[i_1D        ];
+	cols[i_g +   n_fluid] = u[i_1D +   N_C];
+	cols[i_g + 2*n_fluid] = u[i_1D + 2*N_C];
 
-	// Single relaxtion time (BGK) collision
-	float f_eq[19];
-	equilibirum_distribution_D3Q19(f_eq, rho, u_x, u_y, u_z);
+	if (withVorticity) {
+		cols[i_g + 3*n_fluid] = vorticity_magnitude(u, i_x, i_y, i_z, intDat);
+	}
+}
 
-	int streamIndex[19];
-	stream_locations(N_x, N_y, N_z, i_x, i_y, i_z, streamIndex);
+// Mean velocity of each x-y plane, written to row profileRow of the profile history
+// (n_z*3 floats per ensemble member per row)
+// One work group per interior plane, work group size a power of 2
+__kernel void plane_average_velocity(
+	__global float* u,
+	__global float* uProfile,
+	__local float4* planeSum,
+	int profileRow,
+	__global int_param_struct* intDat)
+{
+	int localID = get_local_id(0);
+	int localSize = get_local_size(0);
+	int i_z = get_group_id(0) + 1; // Skip buffer layer
 
-	// Guo, Zheng & Shi body force term (2002)
-	float tau = flpDat->NewtonianTau;
-	float fGuo[19];
-	guo_body_force_term(u_x, u_y, u_z, g_x, g_y, g_z, fGuo);
+	int N_x = intDat->LatticeSize[0];
+	int N_y = intDat->LatticeSize[1];
+	int N_z = intDat->LatticeSize[2];
+	lattice_index N_C = lattice_nodes(N_x, N_y, N_z);
+	int n_xy = (N_x-2)*(N_y-2);
+
+	// Each row holds one profile per ensemble member
+	int member = ensemble_member(&i_z, N_z-2);
+	u += member*3*N_C;
+	uProfile += 3*N_z*(profileRow*intDat->EnsembleSize + member);
+
+	float4 uSum = (float4){0.0f, 0.0f, 0.0f, 0.0f};
+	for (int i_p = localID; i_p < n_xy; i_p += localSize) {
+		int i_x = 1 + i_p%(N_x-2);
+		int i_y = 1 + i_p/(N_x-2);
+		int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
+
+		uSum.x += u[i_1D        ];
+		uSum.y += u[i_1D +   N_C];
+		uSum.z += u[i_1D + 2*N_C];
+	}
+	planeSum[localID] = uSum;
 
-	float pfGuo = (1.0f - 0.5f/tau); // Guo term SRT collision prefactor
+	barrier(CLK_LOCAL_MEM_FENCE);
 
-	//float guoSum = 0.0;
-	for(int i = 0; i < 19; i++) {
-		fGuo[i] *= pfGuo;
-		//guoSum += fGuo[i];
-		//printf("Guo, guosum %d %e %e\n", i, fGuo[i], guoSum);
+	for(int i_s = localSize/2; i_s>0; i_s >>= 1) {
+		if(localID < i_s) {
+			planeSum[localID] += planeSum[localID + i_s];
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
 	}
 
-	// Propagate to f_s (not taking into account boundary conditions)
-	for (int i=0; i<19; i++) {
-		f_s[streamIndex[i]] = f[i] + (f_eq[i]-f[i])/tau + fGuo[i];
+	if (localID == 0) {
+		int i_r = 3*i_z;
+		uProfile[i_r    ] = planeSum[0].x/n_xy;
+		uProfile[i_r + 1] = planeSum[0].y/n_xy;
+		uProfile[i_r + 2] = planeSum[0].z/n_xy;
 	}
+}
+
+// Shear rates from one plane-averaged profile, stored in its unused buffer-layer row (i_z = 0):
+// wall shear rate (mean of the differences over dz from both walls) and the rate between
+// planes zbL and zbU bounding the particle region. One work-item per ensemble member
+__kernel void profile_shear_rates(
+	__global float* uProfile,
+	__global int_param_struct* intDat,
+	int profileRow,
+	int zbL,
+	int zbU)
+{
+	int N_z = intDat->LatticeSize[2];
+	int member = get_global_id(0);
+	__global float* uMean = uProfile + 3*N_z*(profileRow*intDat->EnsembleSize + member);
+
+	int dz = 4;
+	int gradBuffer = 1; // Additional buffer to add before starting finite-difference derivatives
+	int zL = 1 + dz + gradBuffer;
+	int zU = N_z-2 - gradBuffer;
+
+	float dudzL = (uMean[3*zL] - uMean[3*(zL-dz)])/dz;
+	float dudzU = (uMean[3*zU] - uMean[3*(zU-dz)])/dz;
 
+	uMean[0] = 0.5f*(dudzL + dudzU);
+	uMean[1] = (uMean[3*zbU] - uMean[3*zbL])/(zbU-zbL);
+	uMean[2] = 0.0f;
 }
 
 
 // Helper functions
+
+// Destination node of each velocity for a push from (i_x, i_y, i_z)
 void stream_locations(int N_x, int N_y, int N_z, int i_x, int i_y, int i_z, int* index)
 {
-	int i_1D = i_x + N_x*(i_y + N_y*i_z);
+#if LATTICE_BRICK > 1
+	// Neighbours may sit in another brick, map each one
+	const int c[19][3] = {
+		{ 0, 0, 0}, { 1, 0, 0}, {-1, 0, 0}, { 0, 1, 0}, { 0,-1, 0}, { 0, 0, 1}, { 0, 0,-1},
+		{ 1, 1, 0}, { 1,-1, 0}, { 1, 0, 1}, { 1, 0,-1}, {-1, 1, 0}, {-1,-1, 0}, {-1, 0, 1}, {-1, 0,-1},
+		{ 0, 1, 1}, { 0, 1,-1}, { 0,-1, 1}, { 0,-1,-1}
+	};
+	for (int i = 0; i < 19; i++) {
+		index[i] = lattice_node(i_x+c[i][0], i_y+c[i][1], i_z+c[i][2], N_x, N_y);
+	}
+#else
+	int i_1D = lattice_node(i_x, i_y, i_z, N_x, N_y);
 	int N_xy = N_x*N_y;
-	int N_C = N_xy*N_z;
-
-	index[0]  =			 i_1D;
-	index[1]  =	   N_C + i_1D + 1;
-	index[2]  =	 2*N_C + i_1D - 1;
-	index[3]  =	 3*N_C + i_1D	  + N_x;
-	index[4]  =	 4*N_C + i_1D	  - N_x;
-	index[5]  =	 5*N_C + i_1D			+ N_xy;
-	index[6]  =	 6*N_C + i_1D			- N_xy;
-	index[7]  =	 7*N_C + i_1D + 1 + N_x;
-	index[8]  =	 8*N_C + i_1D + 1 - N_x;
-	index[9]  =	 9*N_C + i_1D + 1		+ N_xy;
-	index[10] = 10*N_C + i_1D + 1		- N_xy;
-	index[11] = 11*N_C + i_1D - 1 + N_x;
-	index[12] = 12*N_C + i_1D - 1 - N_x;
-	index[13] = 13*N_C + i_1D - 1		+ N_xy;
-	index[14] = 14*N_C + i_1D - 1		- N_xy;
-	index[15] = 15*N_C + i_1D	  + N_x + N_xy;
-	index[16] = 16*N_C + i_1D	  + N_x - N_xy;
-	index[17] = 17*N_C + i_1D	  - N_x + N_xy;
-	index[18] = 18*N_C + i_1D	  - N_x - N_xy;
+
+	index[0]  = i_1D;
+	index[1]  = i_1D + 1;
+	index[2]  = i_1D - 1;
+	index[3]  = i_1D	  + N_x;
+	index[4]  = i_1D	  - N_x;
+	index[5]  = i_1D			+ N_xy;
+	index[6]  = i_1D			- N_xy;
+	index[7]  = i_1D + 1 + N_x;
+	index[8]  = i_1D + 1 - N_x;
+	index[9]  = i_1D + 1		+ N_xy;
+	index[10] = i_1D + 1		- N_xy;
+	index[11] = i_1D - 1 + N_x;
+	index[12] = i_1D - 1 - N_x;
+	index[13] = i_1D - 1		+ N_xy;
+	index[14] = i_1D - 1		- N_xy;
+	index[15] = i_1D	  + N_x + N_xy;
+	index[16] = i_1D	  + N_x - N_xy;
+	index[17] = i_1D	  - N_x + N_xy;
+	index[18] = i_1D	  - N_x - N_xy;
+#endif
+}
+
+// Storage index of node (i_x, i_y, i_z) in one component of a lattice field, the one mapping used by
+// every kernel (the host mirrors it in lattice_layout.h). Bricks of LATTICE_BRICK^3 nodes are stored
+// one after another, x then y then z, x fastest inside a brick. LATTICE_BRICK 1 is plain x-fastest order.
+int lattice_node(int i_x, int i_y, int i_z, int N_x, int N_y)
+{
+#if LATTICE_BRICK > 1
+	const int B = LATTICE_BRICK;
+	int brick = i_x/B + ((N_x+B-1)/B)*(i_y/B + ((N_y+B-1)/B)*(i_z/B));
+	return brick*B*B*B + i_x%B + B*(i_y%B + B*(i_z%B));
+#else
+	return i_x + N_x*(i_y + N_y*i_z);
+#endif
+}
+
+// Nodes stored per field component, the lattice padded to whole bricks
+lattice_index lattice_nodes(int N_x, int N_y, int N_z)
+{
+	const int B = LATTICE_BRICK;
+	return (lattice_index)((N_x+B-1)/B)*((N_y+B-1)/B)*((N_z+B-1)/B)*B*B*B;
+}
+
+// Coordinates r of the node stored at i_1D
+void lattice_coords(int i_1D, int N_x, int N_y, int* r)
+{
+#if LATTICE_BRICK > 1
+	const int B = LATTICE_BRICK;
+	int n_bx = (N_x+B-1)/B;
+	int n_by = (N_y+B-1)/B;
+	int brick = i_1D/(B*B*B);
+	int i_b = i_1D%(B*B*B);
+	r[0] = B*(brick%n_bx) + i_b%B;
+	r[1] = B*((brick/n_bx)%n_by) + (i_b/B)%B;
+	r[2] = B*(brick/(n_bx*n_by)) + i_b/(B*B);
+#else
+	r[0] = i_1D%N_x;
+	r[1] = (i_1D/N_x)%N_y;
+	r[2] = i_1D/(N_x*N_y);
+#endif
+}
+
+// Start of one plane (a component of a member) of a field held in up to two allocations,
+// the first with partPlanes planes. Unsplit fields have partPlanes >= all planes.
+__global float* field_plane(__global float* part0, __global float* part1, int plane, int partPlanes, lattice_index N_C)
+{
+	return plane < partPlanes ? part0 + plane*N_C : part1 + (plane-partPlanes)*N_C;
 }
 
 void equilibirum_distribution_D3Q19(float* f_eq, float rho, float u_x, float u_y, float u_z)
@@ -0,0 +1,324 @@
+// Chunked, optionally compressed binary snapshots of lattice fields (format in field_snapshot.h)
+// Slabs are packed and compressed in parallel on host threads, then written in order.
+// Also builds on its own with a post-processing tool, e.g. gcc tool.c field_snapshot.c -lz -lpthread
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "field_snapshot.h"
+#include "lattice_layout.h"
+
+#ifdef _WIN32
+	#define snapshot_fseek _fseeki64
+#else
+	#define snapshot_fseek fseeko
+#endif
+
+#define SNAPSHOT_ZLIB_LEVEL 1 // Speed over ratio, most of the gain comes from the byte shuffle
+
+typedef struct {
+
+	float* Field;
+	int NumComponents;
+	int LatticeSize[3];
+	field_snapshot_options_struct* Opts;
+	int FirstPlane;
+	int NumPlanes;
+	unsigned char* Stored;
+	uint64_t StoredSize;
+	int Error;
+	int Started;
+
+} snapshot_chunk_job_struct;
+
+
+// Round to the given number of mantissa bits (nearest), leaving Inf and NaN alone
+float snapshot_round_mantissa(float val, int mantissaBits)
+{
+	uint32_t bits;
+	memcpy(&bits, &val, sizeof(bits));
+
+	int drop = 23 - mantissaBits;
+	if (drop > 0 && (bits & 0x7f800000) != 0x7f800000) {
+		bits = (bits + (1u << (drop-1))) & ~((1u << drop) - 1);
+	}
+	memcpy(&val, &bits, sizeof(bits));
+	return val;
+}
+
+// Gather one slab of interior planes, quantise and compress it
+void* snapshot_pack_chunk(void* jobPtr)
+{
+	snapshot_chunk_job_struct* job = (snapshot_chunk_job_struct*)jobPtr;
+
+	int n_x = job->LatticeSize[0];
+	int n_y = job->LatticeSize[1];
+	size_t n_C = lattice_nodes(job->LatticeSize);
+	size_t numValues = (size_t)job->NumComponents*job->NumPlanes*(n_x-2)*(n_y-2);
+
+	float* values = (float*)malloc(numValues*sizeof(float));
+	if (values == NULL) {
+		job->Error = 1;
+		return NULL;
+	}
+
+	size_t i_v = 0;
+	for (int comp = 0; comp < job->NumComponents; comp++) {
+		for (int i_z = 1+job->FirstPlane; i_z < 1+job->FirstPlane+job->NumPlanes; i_z++) {
+			for (int i_y = 1; i_y < n_y-1; i_y++) {
+				for (int i_x = 1; i_x < n_x-1; i_x++) {
+					size_t i_1D = lattice_node(i_x, i_y, i_z, job->LatticeSize);
+					values[i_v++] = job->Field[i_1D + comp*n_C];
+				}
+			}
+		}
+	}
+
+	if (job->Opts->MantissaBits < 23) {
+		for (i_v = 0; i_v < numValues; i_v++) {
+			values[i_v] = snapshot_round_mantissa(values[i_v], job->Opts->MantissaBits);
+		}
+	}
+
+	if (job->Opts->Codec == SNAPSHOT_RAW) {
+		job->Stored = (unsigned char*)values;
+		job->StoredSize = numValues*sizeof(float);
+		return NULL;
+	}
+
+	// Byte shuffle: all first bytes, then all second bytes... so exponents sit together
+	size_t numBytes = numValues*sizeof(float);
+	unsigned char* shuffled = (unsigned char*)malloc(numBytes);
+	if (shuffled == NULL) {
+		free(values);
+		job->Error = 1;
+		return NULL;
+	}
+	unsigned char* raw = (unsigned char*)values;
+	for (i_v = 0; i_v < numValues; i_v++) {
+		for (int b = 0; b < 4; b++) {
+			shuffled[b*numValues + i_v] = raw[4*i_v + b];
+		}
+	}
+	free(values);
+
+	uLongf storedSize = compressBound(numBytes);
+	job->Stored = (unsigned char*)malloc(storedSize);
+	if (job->Stored == NULL || compress2(job->Stored, &storedSize, shuffled, numBytes, SNAPSHOT_ZLIB_LEVEL) != Z_OK) {
+		job->Error = 1;
+	}
+	job->StoredSize = storedSize;
+	free(shuffled);
+
+	return NULL;
+}
+
+int field_snapshot_write(const char* fileName, const char* name, float* field, int numComponents,
+	const int latticeSize[3], int frame, field_snapshot_options_struct* opts)
+{
+	int n_planes = latticeSize[2]-2;
+	int slabPlanes = opts->SlabPlanes > 0 ? opts->SlabPlanes : n_planes;
+	int numChunks = (n_planes + slabPlanes - 1)/slabPlanes;
+	int numThreads = opts->NumThreads > 0 ? opts->NumThreads : 1;
+
+	FILE* fPtr = fopen(fileName, "wb");
+	if (fPtr == NULL) {
+		perror(fileName);
+		return 1;
+	}
+
+	field_snapshot_header_struct header;
+	memset(&header, 0, sizeof(header));
+	header.Magic = SNAPSHOT_MAGIC;
+	header.Version = SNAPSHOT_VERSION;
+	header.Size[0] = latticeSize[0]-2;
+	header.Size[1] = latticeSize[1]-2;
+	header.Size[2] = n_planes;
+	header.NumComponents = numComponents;
+	header.SlabPlanes = slabPlanes;
+	header.NumChunks = numChunks;
+	header.Codec = opts->Codec;
+	header.MantissaBits = opts->MantissaBits < 23 ? opts->MantissaBits : 23;
+	header.Frame = frame;
+	strncpy(header.Name, name, SNAPSHOT_NAME_SIZE-1);
+
+	field_snapshot_chunk_struct* chunks = (field_snapshot_chunk_struct*)calloc(numChunks, sizeof(field_snapshot_chunk_struct));
+	snapshot_chunk_job_struct* jobs = (snapshot_chunk_job_struct*)calloc(numThreads, sizeof(snapshot_chunk_job_struct));
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	if (chunks == NULL || jobs == NULL || threads == NULL) {
+		printf("Error: could not allocate snapshot chunk index for %s\n", fileName);
+		free(chunks);
+		free(jobs);
+		free(threads);
+		fclose(fPtr);
+		remove(fileName);
+		return 1;
+	}
+
+	// Index is filled in once the stored sizes are known
+	fwrite(&header, sizeof(header), 1, fPtr);
+	fwrite(chunks, sizeof(field_snapshot_chunk_struct), numChunks, fPtr);
+	uint64_t offset = sizeof(header) + numChunks*sizeof(field_snapshot_chunk_struct);
+
+	// A chunk that fails stops the snapshot, the partial file is removed rather than indexed
+	int error = 0;
+	for (int c0 = 0; c0 < numChunks && !error; c0 += numThreads) {
+
+		int batch = numChunks-c0 < numThreads ? numChunks-c0 : numThreads;
+		for (int j = 0; j < batch; j++) {
+			snapshot_chunk_job_struct* job = &jobs[j];
+			job->Field = field;
+			job->NumComponents = numComponents;
+			memcpy(job->LatticeSize, latticeSize, 3*sizeof(int));
+			job->Opts = opts;
+			job->FirstPlane = (c0+j)*slabPlanes;
+			job->NumPlanes = n_planes-job->FirstPlane < slabPlanes ? n_planes-job->FirstPlane : slabPlanes;
+			job->Stored = NULL;
+			job->StoredSize = 0;
+			job->Error = 0;
+			job->Started = pthread_create(&threads[j], NULL, snapshot_pack_chunk, job) == 0;
+			if (!job->Started) {
+				printf("Error: could not start snapshot packing thread\n");
+				job->Error = 1;
+			}
+		}
+
+		for (int j = 0; j < batch; j++) {
+			snapshot_chunk_job_struct* job = &jobs[j];
+			if (job->Started) {
+				pthread_join(threads[j], NULL);
+			}
+			error |= job->Error;
+
+			if (!error) {
+				field_snapshot_chunk_struct* chunk = &chunks[c0+j];
+				chunk->Offset = offset;
+				chunk->StoredSize = job->StoredSize;
+				chunk->FirstPlane = job->FirstPlane;
+				chunk->NumPlanes = job->NumPlanes;
+				error |= fwrite(job->Stored, 1, job->StoredSize, fPtr) != job->StoredSize;
+				offset += job->StoredSize;
+			}
+			free(job->Stored);
+		}
+	}
+
+	if (!error) {
+		snapshot_fseek(fPtr, sizeof(header), SEEK_SET);
+		error |= fwrite(chunks, sizeof(field_snapshot_chunk_struct), numChunks, fPtr) != (size_t)numChunks;
+	}
+	error |= fclose(fPtr) != 0;
+
+	free(chunks);
+	free(jobs);
+	free(threads);
+
+	if (error) {
+		printf("Error: could not write snapshot %s\n", fileName);
+		remove(fileName);
+		return 1;
+	}
+	return 0;
+}
+
+int field_snapshot_open(field_snapshot_reader_struct* reader, const char* fileName)
+{
+	reader->fPtr = fopen(fileName, "rb");
+	reader->Chunks = NULL;
+	if (reader->fPtr == NULL) {
+		perror(fileName);
+		return 1;
+	}
+
+	field_snapshot_header_struct* header = &(reader->Header);
+	if (fread(header, sizeof(field_snapshot_header_struct), 1, reader->fPtr) != 1
+	||	header->Magic != SNAPSHOT_MAGIC || header->Version != SNAPSHOT_VERSION) {
+		printf("Error: %s is not a field snapshot\n", fileName);
+		fclose(reader->fPtr);
+		return 1;
+	}
+
+	if (header->NumChunks <= 0 || header->NumComponents <= 0 || header->Size[0] <= 0 || header->Size[1] <= 0) {
+		printf("Error: %s has an empty or corrupt header\n", fileName);
+		fclose(reader->fPtr);
+		reader->fPtr = NULL;
+		return 1;
+	}
+	reader->Chunks = (field_snapshot_chunk_struct*)malloc(header->NumChunks*sizeof(field_snapshot_chunk_struct));
+	if (reader->Chunks == NULL) {
+		printf("Error: no memory for the %d chunk index entries of %s\n", header->NumChunks, fileName);
+		field_snapshot_close(reader);
+		return 1;
+	}
+	if (fread(reader->Chunks, sizeof(field_snapshot_chunk_struct), header->NumChunks, reader->fPtr) != (size_t)header->NumChunks) {
+		printf("Error: truncated chunk index in %s\n", fileName);
+		field_snapshot_close(reader);
+		return 1;
+	}
+
+	return 0;
+}
+
+// Number of floats in a chunk (components x planes x n_y x n_x)
+size_t field_snapshot_chunk_values(field_snapshot_reader_struct* reader, int chunk)
+{
+	field_snapshot_header_struct* header = &(reader->Header);
+	return (size_t)header->NumComponents*reader->Chunks[chunk].NumPlanes*header->Size[0]*header->Size[1];
+}
+
+int field_snapshot_read_chunk(field_snapshot_reader_struct* reader, int chunk, float* values)
+{
+	if (chunk < 0 || chunk >= reader->Header.NumChunks) {
+		printf("Error: snapshot chunk %d out of range (%d chunks)\n", chunk, reader->Header.NumChunks);
+		return 1;
+	}
+	field_snapshot_chunk_struct* entry = &(reader->Chunks[chunk]);
+	size_t numValues = field_snapshot_chunk_values(reader, chunk);
+	size_t numBytes = numValues*sizeof(float);
+
+	snapshot_fseek(reader->fPtr, entry->Offset, SEEK_SET);
+
+	if (reader->Header.Codec == SNAPSHOT_RAW) {
+		return fread(values, sizeof(float), numValues, reader->fPtr) != numValues;
+	}
+
+	unsigned char* stored = (unsigned char*)malloc(entry->StoredSize);
+	unsigned char* shuffled = (unsigned char*)malloc(numBytes);
+	uLongf rawSize = numBytes;
+	if (stored == NULL || shuffled == NULL) {
+		printf("Error: no memory to read snapshot chunk %d\n", chunk);
+		free(stored);
+		free(shuffled);
+		return 1;
+	}
+
+	int error = fread(stored, 1, entry->StoredSize, reader->fPtr) != entry->StoredSize;
+	if (!error) {
+		error = uncompress(shuffled, &rawSize, stored, entry->StoredSize) != Z_OK || rawSize != numBytes;
+	}
+	if (!error) {
+		unsigned char* raw = (unsigned char*)values;
+		for (size_t i_v = 0; i_v < numValues; i_v++) {
+			for (int b = 0; b < 4; b++) {
+				raw[4*i_v + b] = shuffled[b*numValues + i_v];
+			}
+		}
+	}
+
+	free(stored);
+	free(shuffled);
+	return error;
+}
+
+void field_snapshot_close(field_snapshot_reader_struct* reader)
+{
+	if (reader->fPtr != NULL) {
+		fclose(reader->fPtr);
+		reader->fPtr = NULL;
+	}
+	free(reader->Chunks);
+	reader->Chunks = NULL;
+}
@@ -0,0 +1,74 @@
+// Chunked binary snapshots of lattice fields, written by field_snapshot_write (field_snapshot.c)
+// File: field_snapshot_header_struct, then NumChunks field_snapshot_chunk_struct index entries,
+// then the chunk data. Each chunk is a slab of SlabPlanes z planes of the interior lattice
+// (fewer in the last), all components, component-major with x varying fastest.
+//
+// Reading slab by slab, without loading the whole field:
+//   field_snapshot_reader_struct snap;
+//   field_snapshot_open(&snap, "velocity_field_final.snap");
+//   float* slab = malloc(field_snapshot_chunk_values(&snap, 0)*sizeof(float));
+//   for (int c = 0; c < snap.Header.NumChunks; c++) field_snapshot_read_chunk(&snap, c, slab);
+//   field_snapshot_close(&snap);
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP"
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_RAW 0
+#define SNAPSHOT_ZLIB 1 // Floats byte-shuffled, then deflate
+
+#define SNAPSHOT_NAME_SIZE 32
+
+typedef struct {
+
+	int32_t Magic;
+	int32_t Version;
+	int32_t Size[3];        // Interior nodes
+	int32_t NumComponents;
+	int32_t SlabPlanes;
+	int32_t NumChunks;
+	int32_t Codec;
+	int32_t MantissaBits;   // 23 is lossless, fewer rounds each value to that many mantissa bits
+	int32_t Frame;
+	char Name[SNAPSHOT_NAME_SIZE];
+
+} field_snapshot_header_struct;
+
+typedef struct {
+
+	uint64_t Offset;        // From start of file
+	uint64_t StoredSize;    // Bytes in file
+	int32_t FirstPlane;
+	int32_t NumPlanes;
+
+} field_snapshot_chunk_struct;
+
+typedef struct {
+
+	int Codec;
+	int MantissaBits;
+	int SlabPlanes;
+	int NumThreads;
+
+} field_snapshot_options_struct;
+
+typedef struct {
+
+	FILE* fPtr;
+	field_snapshot_header_struct Header;
+	field_snapshot_chunk_struct* Chunks;
+
+} field_snapshot_reader_struct;
+
+// Writer: field has numComponents arrays of the full lattice (with buffer layer), stride N_C, nodes in
+// lattice_layout.h order
+int field_snapshot_write(const char* fileName, const char* name, float* field, int numComponents,
+	const int latticeSize[3], int frame, field_snapshot_options_struct* opts);
+
+// Reader
+int field_snapshot_open(field_snapshot_reader_struct* reader, const char* fileName);
+size_t field_snapshot_chunk_values(field_snapshot_reader_struct* reader, int chunk);
+int field_snapshot_read_chunk(field_snapshot_reader_struct* reader, int chunk, float* values);
+void field_snapshot_close(field_snapshot_reader_struct* reader);
@@ -0,0 +1,40 @@
+// Storage order of lattice nodes in the host copies of lattice fields, the same mapping as
+// lattice_node in GPU_program.cl (the host passes LATTICE_BRICK to the kernel build).
+// Also used by field_snapshot.c, so snapshot files stay in plain x-fastest order.
+
+#ifndef LATTICE_LAYOUT_H
+#define LATTICE_LAYOUT_H
+
+#include <stddef.h>
+
+#ifndef LATTICE_BRICK
+#define LATTICE_BRICK 1 // Edge of the cubic bricks lattice nodes are stored in, 1 for x-fastest (or build with -DLATTICE_BRICK=4, 8)
+#endif
+
+// Index of node (i_x, i_y, i_z) in one component of a field. Bricks of LATTICE_BRICK^3 nodes are
+// stored one after another, x then y then z, x fastest inside a brick
+static inline size_t lattice_node(int i_x, int i_y, int i_z, const int latticeSize[3])
+{
+	const size_t b = LATTICE_BRICK;
+	size_t n_bx = (latticeSize[0] + b-1)/b;
+	size_t n_by = (latticeSize[1] + b-1)/b;
+	size_t brick = i_x/b + n_bx*(i_y/b + n_by*(i_z/b));
+	return brick*b*b*b + i_x%b + b*(i_y%b + b*(i_z%b));
+}
+
+// Nodes stored per field component, the lattice padded to whole bricks
+static inline size_t lattice_nodes(const int latticeSize[3])
+{
+	const size_t b = LATTICE_BRICK;
+	return ((latticeSize[0] + b-1)/b)*((latticeSize[1] + b-1)/b)*((latticeSize[2] + b-1)/b)*b*b*b;
+}
+
+// z plane of the node stored at i_1D
+static inline int lattice_node_plane(size_t i_1D, const int latticeSize[3])
+{
+	const size_t b = LATTICE_BRICK;
+	size_t n_bxy = ((latticeSize[0] + b-1)/b)*((latticeSize[1] + b-1)/b);
+	return (int)(b*(i_1D/(b*b*b*n_bxy)) + (i_1D%(b*b*b))/(b*b));
+}
+
+#endif
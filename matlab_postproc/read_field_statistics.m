@@ -0,0 +1,24 @@
+function [fieldMean, fieldVar, header] = read_field_statistics(fName)
+% Read time-averaged fields written by write_field_statistics
+% fieldMean, fieldVar: [n_x n_y n_z numFields] over interior nodes,
+% fields u_x, u_y, u_z, tau, force density x, y, z
+
+if nargin < 1
+    fName = 'field_statistics.bin';
+end
+
+fid = fopen(fName, 'r');
+h = fread(fid, 8, 'int32');
+header.LatticeSize = h(2:4)';
+header.NumFields = h(5);
+header.NumSamples = h(6);
+header.StartIteration = h(7);
+header.SampleFreq = h(8);
+
+n = header.LatticeSize - 2;
+numVals = prod(n)*header.NumFields;
+
+fieldMean = reshape(fread(fid, numVals, 'float32'), [n header.NumFields]);
+fieldVar = reshape(fread(fid, numVals, 'float32'), [n header.NumFields]);
+fclose(fid);
+end
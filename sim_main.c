@@ -1,212 +1,494 @@
-int main(int argc, char *argv[])
+// One simulation, from the input_file.txt in the working directory, on devices already set up
+// Returns 0 when finished, 1 if the input was rejected or the job could not be set up
+int run_simulation(sim_device_struct* dev, const char* resourceDir)
 {
+	double startTime = wall_time();
+	dev->BuffersReused = 0;
+	dev->StartupTime = 0.0;
+
 	int_param_struct intDat;
 	flp_param_struct flpDat;
-	kernel_struct kernelDat;
 	host_param_struct hostDat; // Data not accessed by kernels
-	output_data_struct outDat;
-	outDat.ShearStressCount = 0;
-	outDat.ShearStressAvg = 0.0f;
-	outDat.ActualShearRate = 0.0f;
-	
-	printf("Int struct size: %lu\n", (unsigned long)sizeof(intDat));
-	printf("Flp struct size: %lu\n", (unsigned long)sizeof(flpDat));
-
-	cl_device_id deviceArr[2]; // One CPU, one GPU
-	analyse_platform(deviceArr, &hostDat);
-
-	// Create context and queues
-	cl_int error;
-	cl_context contextSim;
-	contextSim = clCreateContext(NULL, 2, deviceArr, NULL, NULL, &error);
-	error_check(error, "clCreateContext", 1);
-	
-	// Create programs
-	cl_program programCPU, programGPU;
+	output_data_struct* outDat; // One per ensemble member
 
-	// Create a command queue for CPU and GPU
-	cl_command_queue queueCPU, queueGPU;
+	cl_device_id* deviceArr = dev->Devices;
+	cl_command_queue queueCPU = dev->QueueCPU;
+	cl_command_queue queueGPU = dev->QueueGPU;
+	cl_command_queue queueRead = dev->QueueRead;
+	kernel_struct kernelDat = dev->Kernels;
 
-#ifdef __APPLE__
-	queueCPU = clCreateCommandQueue(contextSim, deviceArr[0], 0, &error);
-	error_check(error, "clCreateCommandQueue", 1);
-
-	queueGPU = clCreateCommandQueue(contextSim, deviceArr[1], 0, &error);
-	error_check(error, "clCreateCommandQueue", 1);
-#else
-	queueCPU = clCreateCommandQueueWithProperties(contextSim, deviceArr[0], 0, &error);
-	error_check(error, "clCreateCommandQueue", 1);
-
-	queueGPU = clCreateCommandQueueWithProperties(contextSim, deviceArr[1], 0, &error);
-	error_check(error, "clCreateCommandQueue", 1);
-#endif
+	memcpy(hostDat.WorkItemSizes, dev->WorkItemSizes, sizeof(hostDat.WorkItemSizes));
+	hostDat.MaxWorkGroupSize = dev->MaxWorkGroupSize;
+	snprintf(hostDat.ResourceDir, WORD_STRING_SIZE, "%s", resourceDir);
 
 	// Assign data arrays, read input
-	initialize_data(&intDat, &flpDat, &hostDat);
+	if (initialize_data(&intDat, &flpDat, &hostDat)) {
+		return 1;
+	}
 	int paramErrors = parameter_checking(&intDat, &flpDat, &hostDat);
 	if (paramErrors > 0) {
-		exit(EXIT_FAILURE);
+		return 1;
 	}
 
-	// Read sphere surface discretization points
+	initialize_system_size(&hostDat, &intDat, &flpDat);
+
+	// Host memory, files and threads of this job, released at job_cleanup whether it finishes or fails
+	// part way, so a server moves on to its next job (device buffers stay in the pool)
+	int status = 1;
+	cl_float4* parProps_h = NULL;
 	cl_float4* spherePoints = NULL;
-	sphere_discretization(&intDat, &flpDat, &spherePoints);
+	cl_int* parSphereSet_h = NULL;
+	cl_int* parSurfOffset_h = NULL;
+	cl_int* surfPointMap_h = NULL;
+	cl_float4* parKin_h = NULL;
+	cl_float4* parForce_h = NULL;
+	cl_float4* parFluidForce_h = NULL;
+	cl_float4* parFluidForceSum_h = NULL;
+	cl_int* threadMembers_h = NULL;
+	cl_int* numParInThread_h = NULL;
+	cl_int* parsZone_h = NULL;
+	cl_int* zoneMembers_h = NULL; // To be malloc'ed in initialize_particle_zones
+	cl_int* numParInZone_h = NULL;
+	cl_int* zoneNeighDat_h = NULL;
+	flp_param_struct* flpMembers = NULL;
+	cl_int* parSeeds = NULL;
+	cl_int* strMap = NULL;
+	cl_float* splitStaging = NULL;
+	cl_float* fluidPinned_h = NULL;
+	cl_int* profileFrames = NULL;
+	output_snapshot_struct snapshots[OUTPUT_SNAPSHOTS];
+	memset(snapshots, 0, sizeof(snapshots));
+	out_of_core_struct ooc;
+	ooc.f_h[0] = NULL;
+	checkpoint_writer_struct ckpt;
+	int ckptOpen = 0;
+	FILE* vidPtr = NULL;
+	trajectory_writer_struct trajWriter;
+	int trajOpen = 0;
+	split_timing_struct splitTiming = {0};
+	pthread_mutex_init(&splitTiming.Lock, NULL);
+
+	// Ensemble members advance together, each with its own slice of the lattice fields
+	cl_int numMembers = intDat.EnsembleSize;
+	outDat = (output_data_struct*)calloc(numMembers, sizeof(output_data_struct));
+
+	// Particle diameters, masses, moments of inertia
+	parProps_h = (cl_float4*)malloc(intDat.NumParticles*sizeof(cl_float4));
+	initialize_particle_properties(&hostDat, &intDat, &flpDat, parProps_h);
+
+	// Read sphere surface discretization points, for each particle size
+	parSphereSet_h = (cl_int*)malloc(2*intDat.NumParticles*sizeof(cl_int));
+	if (sphere_discretization(&hostDat, &intDat, parProps_h, &spherePoints, parSphereSet_h)) {
+		goto job_cleanup;
+	}
 
-	// Build LB kernels
-	create_LB_kernels(&intDat, &kernelDat, &contextSim, deviceArr, &programCPU, &programGPU);
+	// Work group size of the particle-fluid force kernel (LB kernels are built once, in setup_sim_device)
+	particle_work_group_size(&hostDat, &intDat, &kernelDat, deviceArr);
+
+	// Surface points of all particles, padded to whole work groups
+	create_surface_point_layout(&intDat, parSphereSet_h, &parSurfOffset_h, &surfPointMap_h);
 
 	// Some useful data sizes (cl functions often need size_t*)
-	size_t numNodes = intDat.LatticeSize[0]*intDat.LatticeSize[1]*intDat.LatticeSize[2];
+	size_t numNodes = lattice_nodes(intDat.LatticeSize);
 	//size_t splitKernelSize = 1 + (numNodes-1)/maxKernelSize;
 	//printf("Splitting fluid kernel into %d kernels\n", (int)splitKernelSize);
 	//size_t fluid_kernel_work_size[3];
 	//size_t fluid_kernel_work_offset[3];
 
-	size_t numParThreads = hostDat.DomainDecomp[0]*hostDat.DomainDecomp[1]*hostDat.DomainDecomp[2];
+	size_t numParThreads = hostDat.DomainDecomp[0]*hostDat.DomainDecomp[1]*hostDat.DomainDecomp[2]; // Per ensemble member
 	size_t numSurfPoints = intDat.NumParticles > 0 ? intDat.TotalSurfPoints : 32;
 	size_t pointWorkSize = intDat.PointsPerWorkGroup;
 
-	size_t fDataSize = numNodes*19*sizeof(cl_float);
-	size_t a3DataSize = numNodes*3*sizeof(cl_float);
-	size_t parV4DataSize = intDat.NumParticles*sizeof(cl_float4);  // Vector type implementation
+	size_t numMemberNodes = numMembers*numNodes;
+	size_t fDataSize = numMemberNodes*19*sizeof(cl_float);
+	size_t a3DataSize = numMemberNodes*3*sizeof(cl_float);
+	size_t parV4DataSize = numMembers*intDat.NumParticles*sizeof(cl_float4);  // Vector type implementation, every member's particles
+	size_t pffDataSize = numMembers*(intDat.TotalWorkGroups > 0 ? intDat.TotalWorkGroups : 1)*2*sizeof(cl_float4); // Force and torque per work group
+	size_t spDataSize = (hostDat.NumSpherePoints > 0 ? hostDat.NumSpherePoints : 1)*sizeof(cl_float4);
+	size_t spmDataSize = (intDat.TotalSurfPoints > 0 ? intDat.TotalSurfPoints : 1)*2*sizeof(cl_int);
 	
 	printf("\nnumParThreads = %lu\n", (unsigned long)numParThreads);
 	printf("numSurfPoints = %lu\n", (unsigned long)numSurfPoints);
 	printf("pointWorkSize = %lu\n", (unsigned long)pointWorkSize);
 	printf("numNodes = %lu\n", (unsigned long)numNodes);
 	printf("intDat.NumParticles = %lu\n", (unsigned long)intDat.NumParticles);
-	printf("intDat.WorkGroupsPerParticle = %d\n\n", intDat.WorkGroupsPerParticle);
+	printf("intDat.TotalWorkGroups = %d\n\n", intDat.TotalWorkGroups);
 
 	// --- HOST ARRAYS ---------------------------------------------------------
-	// Lattice fields
-	cl_float* f_h = (cl_float*)malloc(fDataSize);
-	cl_float* u_h = (cl_float*)malloc(a3DataSize);
-	cl_float* gpf_h = (cl_float*)malloc(a3DataSize*intDat.MaxSurfPointsPerNode);
-	cl_int* countPoint_h = (cl_int*)malloc(numNodes*sizeof(cl_int));
-	cl_float* tau_lb_h = (cl_float*)malloc(numNodes*sizeof(cl_float));
-	// Particle arrays
-	cl_float4* parKin_h = (cl_float4*)malloc(parV4DataSize*4); // x, vel, rot (quaternion), ang vel
-	cl_float4* parForce_h = (cl_float4*)malloc(parV4DataSize*2); // Force and torque
-	cl_float4* parFluidForce_h = (cl_float4*)malloc(parV4DataSize*intDat.WorkGroupsPerParticle*2);
-	cl_float4* parFluidForceSum_h = (cl_float4*)calloc(numSurfPoints*2, sizeof(cl_float4)); // Check this
+	// Lattice fields are initialized on their devices, only the final velocity field is read back to the host
+	// Particle arrays, one block per ensemble member (properties and surface points are shared)
+	parKin_h = (cl_float4*)malloc(parV4DataSize*4); // x, vel, rot (quaternion), ang vel
+	parForce_h = (cl_float4*)malloc(parV4DataSize*2); // Force and torque
+	parFluidForce_h = (cl_float4*)malloc(pffDataSize);
+	parFluidForceSum_h = (cl_float4*)calloc(numMembers*numSurfPoints*2, sizeof(cl_float4)); // Check this
 	//
-	cl_int* threadMembers_h = (cl_int*)malloc(numParThreads*intDat.NumParticles*sizeof(cl_int)); 
-	cl_int* numParInThread_h = (cl_int*)calloc(numParThreads, sizeof(cl_int));
+	threadMembers_h = (cl_int*)malloc(numMembers*numParThreads*intDat.NumParticles*sizeof(cl_int)); 
+	numParInThread_h = (cl_int*)calloc(numMembers*numParThreads, sizeof(cl_int));
 	//
-	cl_int* parsZone_h = (cl_int*)malloc(intDat.NumParticles*sizeof(cl_int));
-	cl_int* zoneMembers_h = NULL; // To be malloc'ed in initialize_particle_zones
-	cl_int* numParInZone_h = NULL;
-	cl_int* zoneNeighDat_h = NULL;
+	parsZone_h = (cl_int*)malloc(numMembers*intDat.NumParticles*sizeof(cl_int));
+
+	// Parameters of the other members, whose fields follow member 0's
+	flpMembers = (flp_param_struct*)malloc(numMembers*sizeof(flp_param_struct));
+	parSeeds = (cl_int*)malloc(numMembers*sizeof(cl_int));
+	if (outDat == NULL || parFluidForce_h == NULL || parFluidForceSum_h == NULL || numParInThread_h == NULL
+	||	flpMembers == NULL || parSeeds == NULL
+	||	(intDat.NumParticles > 0 && (parKin_h == NULL || parForce_h == NULL || threadMembers_h == NULL || parsZone_h == NULL))) {
+		printf("Error: could not allocate the host particle arrays\n");
+		goto job_cleanup;
+	}
+	flpMembers[0] = flpDat;
+	if (read_ensemble_members(&hostDat, &intDat, flpMembers, parSeeds)) {
+		goto job_cleanup;
+	}
 
-	// Initialization
-	initialize_lattice_fields(&hostDat, &intDat, &flpDat, f_h, gpf_h, u_h, tau_lb_h, countPoint_h);
-	initialize_particle_fields(&hostDat, &intDat, &flpDat, parKin_h, parForce_h, parFluidForce_h);
-	initialize_particle_zones(&hostDat, &intDat, &flpDat, parKin_h, parsZone_h, &zoneMembers_h, &numParInZone_h, 
-		threadMembers_h, numParInThread_h, &zoneNeighDat_h);
+	// Initialization, each member's particles placed from its own seed
+	for (int m = 0; m < numMembers; m++) {
+		srand(parSeeds[m]);
+		if (initialize_particle_fields(&hostDat, &intDat, &flpMembers[m], parProps_h, parKin_h + 4*m*intDat.NumParticles,
+			parForce_h + 2*m*intDat.NumParticles, parFluidForce_h + 2*m*intDat.TotalWorkGroups)) {
+			goto job_cleanup;
+		}
+	}
+	if (initialize_particle_zones(&hostDat, &intDat, flpMembers, parKin_h, parsZone_h, &zoneMembers_h, &numParInZone_h, 
+		threadMembers_h, numParInThread_h, &zoneNeighDat_h)) {
+		goto job_cleanup;
+	}
 		
 	size_t totalNumZones = intDat.NumZones[0]*intDat.NumZones[1]*intDat.NumZones[2];
 	
 	// Stream mapping for pbcs
-	cl_int* strMap = NULL;
 	cl_int numPeriodicNodes = create_periodic_stream_mapping(&intDat, &strMap);
 	printf("Periodic boundary nodes %d\n", numPeriodicNodes);
 	size_t smDataSize = numPeriodicNodes*2*sizeof(cl_int);
+	intDat.NumPeriodicNodes = numPeriodicNodes;
+
+	// Lattice split in z between the devices: GPU planes [1, splitPlane-1], CPU planes [splitPlane, N_z-2]
+	int splitLattice = hostDat.CpuPlaneFraction > 0.0f;
+	int n_planes = intDat.LatticeSize[2]-2;
+	int splitPlane = n_planes+1;
+	if (splitLattice) {
+		int cpuPlanes = (int)(hostDat.CpuPlaneFraction*n_planes + 0.5f);
+		cpuPlanes = cpuPlanes < 1 ? 1 : (cpuPlanes > n_planes-1 ? n_planes-1 : cpuPlanes);
+		cpuPlanes = hostDat.CpuPlaneFraction >= 1.0f ? n_planes : cpuPlanes;
+		splitPlane = n_planes+1 - cpuPlanes;
+		if (splitPlane == 1) {
+			printf("Whole fluid lattice on the CPU device, GPU for output only\n");
+		}
+		else {
+			printf("GPU z planes 1 to %d, CPU z planes %d to %d\n", splitPlane-1, splitPlane, n_planes);
+		}
+
+		// Each device then takes a contiguous range of the periodic nodes
+		sort_periodic_mapping(&intDat, strMap, numPeriodicNodes);
+		if (create_cpu_fluid_kernels(dev)) {
+			goto job_cleanup;
+		}
+	}
+
+	// Output snapshots: subsampled fluid columns gathered on device, and pinned host memory they are read into
+	size_t numFluidOut = fluid_output_count(&hostDat, &intDat);
+	cl_int fluidOutCols = hostDat.OutputVorticity ? 4 : 3;
+	size_t fluidOutDataSize = numFluidOut*fluidOutCols*sizeof(cl_float);
+
+	// History of plane-averaged velocity profiles, n_z*3 floats per member each, kept on device until flushed
+	size_t profileDataSize = numMembers*intDat.LatticeSize[2]*3*sizeof(cl_float);
+
+	// Running field statistics, only allocated in full when field_average_freq is set
+	int fieldStats = hostDat.FieldAverageFreq > 0;
+	size_t statDataSize = (fieldStats ? numNodes*NUM_STAT_FIELDS : 1)*sizeof(cl_float);
+
+	// Copies of the lattice fields on the CPU device, for its planes of a split lattice (placeholders otherwise)
+	size_t cpuNodes = splitLattice ? numNodes : 1;
+
+	// --- DEVICE MEMORY PLAN ----------------------------------------------------
+	// Every buffer, whole fields in their first slot until plan_device_memory splits them
+	size_t bufSizes[NUM_CL_MEM] = {0};
+	bufSizes[POOL_fA_cl] = fDataSize;
+	bufSizes[POOL_fB_cl] = fDataSize;
+	bufSizes[POOL_u_cl] = a3DataSize;
+	bufSizes[POOL_gpf_cl] = a3DataSize*intDat.MaxSurfPointsPerNode;
+	bufSizes[POOL_countPoint_cl] = numMemberNodes*sizeof(cl_int);
+	bufSizes[POOL_tau_lb_cl] = numMemberNodes*sizeof(cl_float);
+	bufSizes[POOL_fA_cpu_cl] = cpuNodes*19*sizeof(cl_float);
+	bufSizes[POOL_fB_cpu_cl] = cpuNodes*19*sizeof(cl_float);
+	bufSizes[POOL_u_cpu_cl] = cpuNodes*3*sizeof(cl_float);
+	bufSizes[POOL_gpf_cpu_cl] = cpuNodes*3*intDat.MaxSurfPointsPerNode*sizeof(cl_float);
+	bufSizes[POOL_countPoint_cpu_cl] = cpuNodes*sizeof(cl_int);
+	bufSizes[POOL_tau_lb_cpu_cl] = cpuNodes*sizeof(cl_float);
+	bufSizes[POOL_parKin_cl] = parV4DataSize*4;
+	bufSizes[POOL_parForce_cl] = parV4DataSize*2;
+	bufSizes[POOL_parFluidForce_cl] = pffDataSize;
+	bufSizes[POOL_parsZone_cl] = numMembers*intDat.NumParticles*sizeof(cl_int);
+	bufSizes[POOL_zoneMembers_cl] = numMembers*totalNumZones*intDat.NumParticles*sizeof(cl_int);
+	bufSizes[POOL_numParInZone_cl] = numMembers*totalNumZones*sizeof(cl_int);
+	bufSizes[POOL_parFluidForceSum_cl] = numMembers*numSurfPoints*sizeof(cl_float4)*2;
+	bufSizes[POOL_threadMembers_cl] = numMembers*numParThreads*intDat.NumParticles*sizeof(cl_int);
+	bufSizes[POOL_numParInThread_cl] = numMembers*numParThreads*sizeof(cl_int);
+	bufSizes[POOL_parProps_cl] = intDat.NumParticles*sizeof(cl_float4);
+	bufSizes[POOL_parSurfOffset_cl] = (intDat.NumParticles+1)*sizeof(cl_int);
+	bufSizes[POOL_zoneNeighDat_cl] = intDat.ZoneNeighStride*totalNumZones*sizeof(cl_int);
+	bufSizes[POOL_intDat_cl] = sizeof(int_param_struct);
+	bufSizes[POOL_flpDat_cl] = numMembers*sizeof(flp_param_struct);
+	bufSizes[POOL_strMap_cl] = smDataSize;
+	bufSizes[POOL_spherePoints_cl] = spDataSize;
+	bufSizes[POOL_surfPointMap_cl] = spmDataSize;
+	bufSizes[POOL_fluidStage_cl] = OUTPUT_SNAPSHOTS*fluidOutDataSize;
+	bufSizes[POOL_fluidPinned_cl] = OUTPUT_SNAPSHOTS*fluidOutDataSize;
+	bufSizes[POOL_uProfile_cl] = hostDat.ShearProfileHistory*profileDataSize;
+	bufSizes[POOL_statMean_cl] = statDataSize;
+	bufSizes[POOL_statM2_cl] = statDataSize;
+
+	// Out-of-core fluid: f, gpf and countPoint only exist as slabs in the ring (placeholders here),
+	// surface point forces are kept for spreading onto each slab
+	int outOfCore = intDat.OutOfCorePlanes > 0;
+	if (outOfCore) {
+		bufSizes[POOL_fA_cl] = 19*sizeof(cl_float);
+		bufSizes[POOL_fB_cl] = 19*sizeof(cl_float);
+		bufSizes[POOL_gpf_cl] = 3*intDat.MaxSurfPointsPerNode*sizeof(cl_float);
+		bufSizes[POOL_countPoint_cl] = sizeof(cl_int);
+	}
+	bufSizes[POOL_pointForce_cl] = (outOfCore ? numSurfPoints*2 : 1)*sizeof(cl_float4);
+	if (plan_device_memory(dev, &intDat, bufSizes, splitLattice, outOfCore ? out_of_core_ring_size(&intDat) : 0)) {
+		goto job_cleanup;
+	}
 
-	// --- CREATE BUFFERS --------------------------------------------------------
+	// --- CREATE BUFFERS (from the pool) ----------------------------------------
 #define X(memName) cl_mem memName;
 	LIST_OF_CL_MEM
 #undef X
-	// Lattice fields
+	// Lattice fields, f and gpf in two parts when too large for one allocation (see field_plane)
 	cl_int err_cl = CL_SUCCESS;
-	fA_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, fDataSize, NULL, &err_cl);
+	fA_cl = pool_buffer(dev, POOL_fA_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fA_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer fA", 1);
+	fA_hi_cl = pool_split_buffer(dev, POOL_fA_hi_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fA_hi_cl], &err_cl);
+	error_check(err_cl, "clCreateBuffer fA_hi", 1);
 	
-	fB_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, fDataSize, NULL, &err_cl);
+	fB_cl = pool_buffer(dev, POOL_fB_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fB_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer fB", 1);
+	fB_hi_cl = pool_split_buffer(dev, POOL_fB_hi_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fB_hi_cl], &err_cl);
+	error_check(err_cl, "clCreateBuffer fB_hi", 1);
 	
-	u_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, a3DataSize, NULL, &err_cl);
+	u_cl = pool_buffer(dev, POOL_u_cl, CL_MEM_READ_WRITE, bufSizes[POOL_u_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer u_cl", 1);
 	
-	gpf_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, a3DataSize*intDat.MaxSurfPointsPerNode, NULL, &err_cl);
+	gpf_cl = pool_buffer(dev, POOL_gpf_cl, CL_MEM_READ_WRITE, bufSizes[POOL_gpf_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer gpf_cl", 1);
+	gpf_hi_cl = pool_split_buffer(dev, POOL_gpf_hi_cl, CL_MEM_READ_WRITE, bufSizes[POOL_gpf_hi_cl], &err_cl);
+	error_check(err_cl, "clCreateBuffer gpf_hi_cl", 1);
 	
-	countPoint_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, numNodes*sizeof(cl_int), NULL, &err_cl);
+	countPoint_cl = pool_buffer(dev, POOL_countPoint_cl, CL_MEM_READ_WRITE, bufSizes[POOL_countPoint_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer countPoint_cl", 1);
 	
-	tau_lb_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, numNodes*sizeof(cl_float), NULL, &err_cl);
+	tau_lb_cl = pool_buffer(dev, POOL_tau_lb_cl, CL_MEM_READ_WRITE, bufSizes[POOL_tau_lb_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer tau_lb_cl", 1);
 
+	fA_cpu_cl = pool_buffer(dev, POOL_fA_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fA_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer fA_cpu_cl", 1);
+
+	fB_cpu_cl = pool_buffer(dev, POOL_fB_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fB_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer fB_cpu_cl", 1);
+
+	u_cpu_cl = pool_buffer(dev, POOL_u_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_u_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer u_cpu_cl", 1);
+
+	gpf_cpu_cl = pool_buffer(dev, POOL_gpf_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_gpf_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer gpf_cpu_cl", 1);
+
+	countPoint_cpu_cl = pool_buffer(dev, POOL_countPoint_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_countPoint_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer countPoint_cpu_cl", 1);
+
+	tau_lb_cpu_cl = pool_buffer(dev, POOL_tau_lb_cpu_cl, CL_MEM_READ_WRITE, bufSizes[POOL_tau_lb_cpu_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer tau_lb_cpu_cl", 1);
+
 	// Particle arrays (host accessible memory)
-	parKin_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, parV4DataSize*4, parKin_h, &err_cl);
+	parKin_cl = pool_buffer(dev, POOL_parKin_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parKin_cl], parKin_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer parKin_cl", 1);
 	
-	parForce_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, parV4DataSize*2, parForce_h, &err_cl);
+	parForce_cl = pool_buffer(dev, POOL_parForce_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parForce_cl], parForce_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer parForce_cl", 1);
 	
-	parFluidForce_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, parV4DataSize*intDat.WorkGroupsPerParticle*2, parFluidForce_h, &err_cl);
+	parFluidForce_cl = pool_buffer(dev, POOL_parFluidForce_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parFluidForce_cl], parFluidForce_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer parFluidForce_cl", 1);
 	
-	parsZone_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, intDat.NumParticles*sizeof(cl_int), parsZone_h, &err_cl);
+	parsZone_cl = pool_buffer(dev, POOL_parsZone_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parsZone_cl], parsZone_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer parsZone_cl", 1);
 	
-	zoneMembers_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, totalNumZones*intDat.NumParticles*sizeof(cl_int), zoneMembers_h, &err_cl);
+	zoneMembers_cl = pool_buffer(dev, POOL_zoneMembers_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_zoneMembers_cl], zoneMembers_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer zoneMembers_cl", 1);
 	
-	numParInZone_cl = clCreateBuffer(contextSim, 
-		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, totalNumZones*sizeof(cl_int), numParInZone_h, &err_cl);
+	numParInZone_cl = pool_buffer(dev, POOL_numParInZone_cl, 
+		CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_numParInZone_cl], numParInZone_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer numParInZone_cl", 1);
 	
-	parFluidForceSum_cl = clCreateBuffer(contextSim, CL_MEM_READ_WRITE, numSurfPoints*sizeof(cl_float4)*2, NULL, &err_cl);
+	parFluidForceSum_cl = pool_buffer(dev, POOL_parFluidForceSum_cl, CL_MEM_READ_WRITE, bufSizes[POOL_parFluidForceSum_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer parFluidForceSum_cl", 1);
+
+	pointForce_cl = pool_buffer(dev, POOL_pointForce_cl, CL_MEM_READ_WRITE, bufSizes[POOL_pointForce_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer pointForce_cl", 1);
 	
 	// Read-only buffers
-	threadMembers_cl = clCreateBuffer(contextSim,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, numParThreads*intDat.NumParticles*sizeof(cl_int), threadMembers_h, &err_cl);
+	threadMembers_cl = pool_buffer(dev, POOL_threadMembers_cl,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_threadMembers_cl], threadMembers_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer threadMembers_cl", 1);
 	
-	numParInThread_cl = clCreateBuffer(contextSim,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, numParThreads*sizeof(cl_int), numParInThread_h, &err_cl);
+	numParInThread_cl = pool_buffer(dev, POOL_numParInThread_cl,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_numParInThread_cl], numParInThread_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer numParInThread_cl", 1);
 	
-	zoneNeighDat_cl = clCreateBuffer(contextSim,
-		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, 28*totalNumZones*sizeof(cl_int), zoneNeighDat_h, &err_cl);
+	parProps_cl = pool_buffer(dev, POOL_parProps_cl,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parProps_cl], parProps_h, &err_cl);
+	error_check(err_cl, "clCreateBuffer parProps_cl", 1);
+	
+	parSurfOffset_cl = pool_buffer(dev, POOL_parSurfOffset_cl,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_parSurfOffset_cl], parSurfOffset_h, &err_cl);
+	error_check(err_cl, "clCreateBuffer parSurfOffset_cl", 1);
+	
+	zoneNeighDat_cl = pool_buffer(dev, POOL_zoneNeighDat_cl,
+		CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_zoneNeighDat_cl], zoneNeighDat_h, &err_cl);
 	error_check(err_cl, "clCreateBuffer zoneNeighDat_cl", 1);
 	
-	intDat_cl = clCreateBuffer(contextSim, CL_MEM_READ_ONLY, sizeof(int_param_struct), NULL, &err_cl);
+	intDat_cl = pool_buffer(dev, POOL_intDat_cl, CL_MEM_READ_ONLY, bufSizes[POOL_intDat_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer intDat_cl", 1);
 	
-	flpDat_cl = clCreateBuffer(contextSim, CL_MEM_READ_ONLY, sizeof(flp_param_struct), NULL, &err_cl);
+	flpDat_cl = pool_buffer(dev, POOL_flpDat_cl, CL_MEM_READ_ONLY, bufSizes[POOL_flpDat_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer flpDat_cl", 1);
 	
-	strMap_cl = clCreateBuffer(contextSim, CL_MEM_READ_ONLY, smDataSize, NULL, &err_cl);
+	strMap_cl = pool_buffer(dev, POOL_strMap_cl, CL_MEM_READ_ONLY, bufSizes[POOL_strMap_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer strMap_cl", 1);
 	
-	spherePoints_cl = clCreateBuffer(contextSim, CL_MEM_READ_ONLY, intDat.PointsPerParticle*sizeof(cl_float4), NULL, &err_cl);
+	spherePoints_cl = pool_buffer(dev, POOL_spherePoints_cl, CL_MEM_READ_ONLY, bufSizes[POOL_spherePoints_cl], NULL, &err_cl);
 	error_check(err_cl, "clCreateBuffer spherePoints_cl", 1);
+	
+	surfPointMap_cl = pool_buffer(dev, POOL_surfPointMap_cl, CL_MEM_READ_ONLY, bufSizes[POOL_surfPointMap_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer surfPointMap_cl", 1);
+
+	// Output snapshots
+	fluidStage_cl = pool_buffer(dev, POOL_fluidStage_cl, CL_MEM_READ_WRITE, bufSizes[POOL_fluidStage_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer fluidStage_cl", 1);
+
+	fluidPinned_cl = pool_buffer(dev, POOL_fluidPinned_cl, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bufSizes[POOL_fluidPinned_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer fluidPinned_cl", 1);
+
+	fluidPinned_h = (cl_float*)clEnqueueMapBuffer(queueRead, fluidPinned_cl, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+		0, OUTPUT_SNAPSHOTS*fluidOutDataSize, 0, NULL, NULL, &err_cl);
+	error_check(err_cl, "clEnqueueMapBuffer fluidPinned_cl", 1);
+
+	uProfile_cl = pool_buffer(dev, POOL_uProfile_cl, CL_MEM_READ_WRITE, bufSizes[POOL_uProfile_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer uProfile_cl", 1);
+	profileFrames = (cl_int*)malloc(hostDat.ShearProfileHistory*sizeof(cl_int));
+	cl_int profileRows = 0;
+
+	statMean_cl = pool_buffer(dev, POOL_statMean_cl, CL_MEM_READ_WRITE, bufSizes[POOL_statMean_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer statMean_cl", 1);
+	statM2_cl = pool_buffer(dev, POOL_statM2_cl, CL_MEM_READ_WRITE, bufSizes[POOL_statM2_cl], NULL, &err_cl);
+	error_check(err_cl, "clCreateBuffer statM2_cl", 1);
+	cl_int statSamples = 0;
+
+	for (int i = 0; i < OUTPUT_SNAPSHOTS; i++) {
+		snapshots[i].fluid_h = fluidPinned_h + i*fluidOutCols*numFluidOut;
+		snapshots[i].parKin_h = (cl_float4*)malloc(parV4DataSize*4 + sizeof(cl_float4));
+		snapshots[i].profile_h = (cl_float*)malloc(hostDat.ShearProfileHistory*profileDataSize);
+		snapshots[i].ProfileFrames = (cl_int*)malloc(hostDat.ShearProfileHistory*sizeof(cl_int));
+	}
+	int snapHead = 0;  // Oldest snapshot still in flight
+	int snapCount = 0;
 
 	// --- WRITE BUFFERS --------------------------------------------------------		
-	err_cl = clEnqueueWriteBuffer(queueGPU, fA_cl, CL_TRUE, 0, fDataSize, f_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, fB_cl, CL_TRUE, 0, fDataSize, f_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, u_cl, CL_TRUE, 0, a3DataSize, u_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, gpf_cl, CL_TRUE, 0, a3DataSize*intDat.MaxSurfPointsPerNode, gpf_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, countPoint_cl, CL_TRUE, 0, numNodes*sizeof(cl_int), countPoint_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, tau_lb_cl, CL_TRUE, 0, numNodes*sizeof(cl_float), tau_lb_h, 0, NULL, NULL);
-	error_check(err_cl, "clEnqueueWriteBuffer 1", 1);
-	
-	err_cl |= clEnqueueWriteBuffer(queueGPU, parFluidForceSum_cl, CL_TRUE, 0, numSurfPoints*sizeof(cl_float4)*2, parFluidForceSum_h, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, spherePoints_cl, CL_TRUE, 0, intDat.PointsPerParticle*sizeof(cl_float4), spherePoints, 0, NULL, NULL);
+	int usingParticles = intDat.NumParticles > 0 ? 1 : 0;
+	err_cl = clEnqueueWriteBuffer(queueGPU, parFluidForceSum_cl, CL_TRUE, 0, numMembers*numSurfPoints*sizeof(cl_float4)*2, parFluidForceSum_h, 0, NULL, NULL);
+	if (usingParticles) {
+		err_cl |= clEnqueueWriteBuffer(queueGPU, spherePoints_cl, CL_TRUE, 0, spDataSize, spherePoints, 0, NULL, NULL);
+		err_cl |= clEnqueueWriteBuffer(queueGPU, surfPointMap_cl, CL_TRUE, 0, spmDataSize, surfPointMap_h, 0, NULL, NULL);
+	}
 	err_cl |= clEnqueueWriteBuffer(queueGPU, strMap_cl, CL_TRUE, 0, smDataSize, strMap, 0, NULL, NULL);
 	err_cl |= clEnqueueWriteBuffer(queueGPU, intDat_cl, CL_TRUE, 0, sizeof(intDat), &intDat, 0, NULL, NULL);
-	err_cl |= clEnqueueWriteBuffer(queueGPU, flpDat_cl, CL_TRUE, 0, sizeof(flpDat), &flpDat, 0, NULL, NULL);
+	err_cl |= clEnqueueWriteBuffer(queueGPU, flpDat_cl, CL_TRUE, 0, numMembers*sizeof(flp_param_struct), flpMembers, 0, NULL, NULL);
 	error_check(err_cl, "clEnqueueWriteBuffer 2", 1);
 
+	// Lattice fields, on the device holding each copy, or f in host memory for an out-of-core fluid
+	if (outOfCore) {
+		if (out_of_core_init(&ooc, dev, &hostDat, &intDat)) {
+			goto job_cleanup;
+		}
+		err_cl = out_of_core_fill(&ooc, &hostDat, queueGPU, kernelDat.initialize_lattice_fields, flpDat_cl, u_cl, tau_lb_cl);
+	}
+	else {
+		cl_mem gpuFields[9] = {fA_cl, fB_cl, u_cl, gpf_cl, tau_lb_cl, countPoint_cl, fA_hi_cl, fB_hi_cl, gpf_hi_cl};
+		err_cl = initialize_lattice_fields(&hostDat, &intDat, queueGPU, kernelDat.initialize_lattice_fields, gpuFields,
+			intDat_cl, flpDat_cl, numMembers);
+	}
+	if (splitLattice) {
+		cl_mem cpuFields[9] = {fA_cpu_cl, fB_cpu_cl, u_cpu_cl, gpf_cpu_cl, tau_lb_cpu_cl, countPoint_cpu_cl, NULL, NULL, NULL};
+		err_cl |= initialize_lattice_fields(&hostDat, &intDat, queueCPU, dev->FluidCPU.initialize_lattice_fields, cpuFields,
+			intDat_cl, flpDat_cl, 1);
+		clFinish(queueCPU);
+	}
+	clFinish(queueGPU);
+	error_check(err_cl, "initialize_lattice_fields", 1);
+
+	// --- CHECKPOINT / RESTART ------------------------------------------------
+	// In CKPT_* order. The f section is whichever of fA, fB the next collide_stream reads.
+	cl_mem ckptBufs[CHECKPOINT_SECTIONS] = {fA_cl, u_cl, gpf_cl, tau_lb_cl,
+		parKin_cl, parForce_cl, parFluidForce_cl, parsZone_cl, zoneMembers_cl, numParInZone_cl, threadMembers_cl, numParInThread_cl,
+		statMean_cl, statM2_cl};
+	cl_mem ckptHiBufs[CHECKPOINT_SECTIONS] = {fA_hi_cl, NULL, gpf_hi_cl}; // Second parts of split fields
+	size_t ckptSizes[CHECKPOINT_SECTIONS] = {fDataSize, a3DataSize, a3DataSize*intDat.MaxSurfPointsPerNode, numMemberNodes*sizeof(cl_float),
+		parV4DataSize*4, parV4DataSize*2, pffDataSize, bufSizes[POOL_parsZone_cl],
+		bufSizes[POOL_zoneMembers_cl], bufSizes[POOL_numParInZone_cl],
+		bufSizes[POOL_threadMembers_cl], bufSizes[POOL_numParInThread_cl],
+		statDataSize, statDataSize};
+
+	int restarting = strcmp(hostDat.RestartFile, "none") != 0;
+	if (hostDat.CheckpointFreq > 0 || restarting) {
+		if (checkpoint_writer_init(&ckpt, &intDat, hostDat.CheckpointKeep, ckptSizes)) {
+			goto job_cleanup;
+		}
+		ckptOpen = 1;
+	}
+
+	int startIteration = 1;
+	double leOffsetBase = 0.0;
+	if (restarting) {
+		char restartName[WORD_STRING_SIZE];
+		strcpy(restartName, hostDat.RestartFile);
+		if (strcmp(restartName, "latest") == 0 && checkpoint_latest(ckpt.Keep, restartName) == 0) {
+			printf("Error: no checkpoint_<n>.bin to restart from\n");
+			goto job_cleanup;
+		}
+		if (checkpoint_restore(&ckpt, restartName, queueGPU, queueCPU, ckptBufs, ckptHiBufs, !hostDat.RestartResetTime)) {
+			goto job_cleanup;
+		}
+		// Both f buffers hold the saved state, as at initialization
+		err_cl = enqueue_split_transfer(queueGPU, fB_cl, fB_hi_cl, 1, CL_TRUE, fDataSize, ckpt.Sections[CKPT_F]);
+		error_check(err_cl, "clEnqueueWriteBuffer restart", 1);
+
+		if (hostDat.RestartResetTime) {
+			// Warm start from a developed flow: iterations and output start again,
+			// Lees-Edwards images carry on from the saved offset
+			leOffsetBase = ckpt.Header.LEOffset;
+			printf("Warm start from %s (iteration %d)\n", restartName, ckpt.Header.Iteration);
+		}
+		else {
+			startIteration = ckpt.Header.Iteration + 1;
+			outDat[0] = ckpt.Header.OutDat;
+			if (intDat.MaintainShear) {
+				// Continue from the controller's last wall velocities
+				memcpy(flpMembers[0].VelUpper, ckpt.Header.VelUpper, sizeof(flpDat.VelUpper));
+				memcpy(flpMembers[0].VelLower, ckpt.Header.VelLower, sizeof(flpDat.VelLower));
+				err_cl = write_wall_velocities(queueGPU, flpDat_cl, flpMembers);
+				error_check(err_cl, "clEnqueueWriteBuffer wall velocities", 1);
+			}
+			statSamples = ckpt.Header.StatSamples;
+			printf("Restarting from %s at iteration %d\n", restartName, startIteration);
+		}
+	}
+
 	// --- KERNEL RANGE SETTINGS -----------------------------------------------
-	int usingParticles = intDat.NumParticles > 0 ? 1 : 0;
 	// Offset global id by 1, because of buffer layer
 	size_t lattice_work_offset[3] = {1, 1, 1}; // Perf test this
 	size_t global_work_size[3];
@@ -231,12 +513,98 @@ int main(int argc, char *argv[])
 			velBC_work_size[dim] = intDat.LatticeSize[dim] - 2;
 		}
 	}
+	// Ensemble members stacked along z
+	global_work_size[2] *= numMembers;
+	velBC_work_size[2] *= numMembers;
 	if (velBoundary) {
 		char xyz[4] = "XYZ\0";
 		printf("%s %c\n", "Velocity BC applied to walls normal to axis", xyz[wallAxis]);
+		if (intDat.FuseVelocityBC) {
+			printf("Velocity BC fused into collide_stream\n");
+		}
 	}
 
-	size_t periodic_work_size = numPeriodicNodes;
+	size_t periodic_work_size = numMembers*numPeriodicNodes;
+
+	// Particle threads and surface points of every member, and every member's whole lattice (buffer layer
+	// included) for summing and resetting the particle forces on the fluid
+	size_t particle_work_size = numMembers*numParThreads;
+	size_t surface_work_size = numMembers*numSurfPoints;
+	size_t member_work_size[3] = {intDat.LatticeSize[0], intDat.LatticeSize[1], numMembers*intDat.LatticeSize[2]};
+
+	// Split lattice: collide_stream planes, periodic nodes and velocity wall of each device
+	size_t fluid_work_size[3] = {global_work_size[0], global_work_size[1], global_work_size[2]};
+	size_t cpu_work_offset[3] = {1, 1, 1};
+	size_t cpu_work_size[3] = {global_work_size[0], global_work_size[1], 0};
+	size_t cpuVelBC_work_offset[3] = {1, 1, 2}; // Upper wall
+	size_t cpuVelBC_work_size[3] = {velBC_work_size[0], velBC_work_size[1], 1};
+	size_t cpu_periodic_offset = 0;
+	size_t cpu_periodic_work_size = 0;
+	cl_kernel cpuCollide = dev->FluidCPU.collide_stream;
+	if (splitLattice) {
+		// Vector collide_stream on a CPU type device, each work item a run of nodes along x
+		if (hostDat.CpuCollideVector && dev->CollideVecCPU != NULL) {
+			cpuCollide = dev->CollideVecCPU;
+			cpu_work_size[0] = (global_work_size[0] + COLLIDE_VEC_WIDTH-1)/COLLIDE_VEC_WIDTH;
+		}
+		if (cpuCollide == dev->CollideVecCPU) {
+			printf("CPU collide_stream vector variant, %d nodes along x per work item\n", COLLIDE_VEC_WIDTH);
+		}
+		fluid_work_size[2] = splitPlane-1;
+		cpu_work_offset[2] = splitPlane;
+		cpu_work_size[2] = n_planes+1 - splitPlane;
+		periodic_work_size = periodic_nodes_below(&intDat, strMap, numPeriodicNodes, splitPlane);
+		cpu_periodic_offset = periodic_work_size;
+		cpu_periodic_work_size = numPeriodicNodes - periodic_work_size;
+		velBC_work_size[2] = 1;
+	}
+
+	// Host staging for the planes copied between devices, and the timing that balances them
+	size_t stagingPlanes = 3*(n_planes+2) > 19*SPLIT_MAX_MOVE ? 3*(n_planes+2) : 19*SPLIT_MAX_MOVE;
+	size_t n_xy = (size_t)intDat.LatticeSize[0]*intDat.LatticeSize[1];
+	splitStaging = splitLattice ? (cl_float*)malloc(stagingPlanes*n_xy*sizeof(cl_float)) : NULL;
+	double splitNodeSteps[2] = {0.0, 0.0};
+	split_callback_struct splitCallbacks[2] = {{&splitTiming, 0}, {&splitTiming, 1}};
+	const int upComps[5] = {5, 9, 13, 15, 17};
+	const int downComps[5] = {6, 10, 14, 16, 18};
+	const int allComps[19] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
+
+	// Whole lattice on the CPU device: it takes both walls, optionally several steps per sweep of z slabs
+	int cpuOnly = splitLattice && splitPlane == 1;
+	int temporalBlocking = hostDat.TemporalBlockSteps > 1;
+	int blockSlabPlanes = 0;
+	int blockEnd = startIteration-1;
+	size_t blockPlaneBytes = n_xy*(2*19 + 3)*sizeof(cl_float);
+	// The second block's steps are taken one per sweep, the unblocked reference the blocked sweeps after it
+	// are timed against (the first block is left out as warm-up)
+	int referenceStart = startIteration + hostDat.TemporalBlockSteps;
+	int referenceEnd = referenceStart + hostDat.TemporalBlockSteps-1;
+	double sweepTime[2] = {0.0, 0.0};
+	int sweepSteps[2] = {0, 0};
+	if (cpuOnly) {
+		cpuVelBC_work_offset[2] = 1;
+		cpuVelBC_work_size[2] = 2;
+	}
+	if (temporalBlocking) {
+		blockSlabPlanes = hostDat.TemporalBlockPlanes > 0 ? hostDat.TemporalBlockPlanes
+			: temporal_block_slab_planes(&intDat, dev->Devices[0], hostDat.TemporalBlockSteps);
+		blockSlabPlanes = blockSlabPlanes > n_planes ? n_planes : blockSlabPlanes;
+		printf("Temporal blocking: %d steps per sweep over %d-plane z slabs, %.1f MB in flight\n",
+			hostDat.TemporalBlockSteps, blockSlabPlanes, 1E-6*(hostDat.TemporalBlockSteps+1)*blockSlabPlanes*blockPlaneBytes);
+		if (usingParticles) {
+			printf("Particle forcing on the fluid refreshed at the end of each block\n");
+		}
+	}
+
+	// One work group per interior z plane (of each member) for the velocity profile
+	size_t profileWorkGroup = PROFILE_WORK_SIZE;
+	size_t profile_work_size = numMembers*(intDat.LatticeSize[2]-2)*profileWorkGroup;
+	size_t shear_rate_work_size = numMembers;
+
+	// Planes bounding the particle region, for its shear rate
+	cl_int intBuffer = (cl_int)(flpDat.ParticleZBuffer + 1E-8) + (cl_int)(hostDat.MaxParticleDiam/2);
+	cl_int zbL = 1 + intBuffer;
+	cl_int zbU = intDat.LatticeSize[2]-2 - intBuffer;
 
 	// --- FIXED KERNEL ARGS ---------------------------------------------------
 	size_t memSize = sizeof(cl_mem);
@@ -247,14 +615,68 @@ int main(int argc, char *argv[])
 	err_cl |= clSetKernelArg(kernelDat.collide_stream, 5, memSize, &countPoint_cl);
 	err_cl |= clSetKernelArg(kernelDat.collide_stream, 6, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.collide_stream, 7, memSize, &flpDat_cl);
+	err_cl |= clSetKernelArg(kernelDat.collide_stream, 10, memSize, &gpf_hi_cl);
 
 	err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 1, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 2, memSize, &flpDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 3, sizeof(cl_int), &wallAxis);
 	err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 4, sizeof(cl_int), &calcRho);
 
+	err_cl |= clSetKernelArg(kernelDat.plane_average_velocity, 0, memSize, &u_cl);
+	err_cl |= clSetKernelArg(kernelDat.plane_average_velocity, 1, memSize, &uProfile_cl);
+	err_cl |= clSetKernelArg(kernelDat.plane_average_velocity, 2, profileWorkGroup*sizeof(cl_float4), NULL);
+	err_cl |= clSetKernelArg(kernelDat.plane_average_velocity, 4, memSize, &intDat_cl);
+
+	err_cl |= clSetKernelArg(kernelDat.gather_fluid_output, 0, memSize, &u_cl);
+	err_cl |= clSetKernelArg(kernelDat.gather_fluid_output, 1, memSize, &fluidStage_cl);
+	err_cl |= clSetKernelArg(kernelDat.gather_fluid_output, 3, sizeof(cl_int), &hostDat.FluidOutputSpacing);
+	err_cl |= clSetKernelArg(kernelDat.gather_fluid_output, 4, sizeof(cl_int), &hostDat.OutputVorticity);
+	err_cl |= clSetKernelArg(kernelDat.gather_fluid_output, 5, memSize, &intDat_cl);
+
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 0, memSize, &u_cl);
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 1, memSize, &tau_lb_cl);
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 2, memSize, &gpf_cl);
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 3, memSize, &statMean_cl);
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 4, memSize, &statM2_cl);
+	err_cl |= clSetKernelArg(kernelDat.accumulate_field_statistics, 6, memSize, &intDat_cl);
+
+	err_cl |= clSetKernelArg(kernelDat.profile_shear_rates, 0, memSize, &uProfile_cl);
+	err_cl |= clSetKernelArg(kernelDat.profile_shear_rates, 1, memSize, &intDat_cl);
+	err_cl |= clSetKernelArg(kernelDat.profile_shear_rates, 3, sizeof(cl_int), &zbL);
+	err_cl |= clSetKernelArg(kernelDat.profile_shear_rates, 4, sizeof(cl_int), &zbU);
+
 	err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 1, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 2, memSize, &strMap_cl);
+	err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 3, memSize, &flpDat_cl);
+	err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 4, memSize, &u_cl);
+
+	if (splitLattice) {
+		kernel_struct* cpuFluid = &dev->FluidCPU;
+		cl_float noOffset = 0.0f;
+		cl_mem noBuffer = NULL;
+		err_cl |= clSetKernelArg(cpuCollide, 2, memSize, &gpf_cpu_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 3, memSize, &u_cpu_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 4, memSize, &tau_lb_cpu_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 5, memSize, &countPoint_cpu_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 6, memSize, &intDat_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 7, memSize, &flpDat_cl);
+		err_cl |= clSetKernelArg(cpuCollide, 8, memSize, &noBuffer); // Never split with the lattice split
+		err_cl |= clSetKernelArg(cpuCollide, 9, memSize, &noBuffer);
+		err_cl |= clSetKernelArg(cpuCollide, 10, memSize, &noBuffer);
+
+		err_cl |= clSetKernelArg(cpuFluid->boundary_velocity, 1, memSize, &intDat_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_velocity, 2, memSize, &flpDat_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_velocity, 3, sizeof(cl_int), &wallAxis);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_velocity, 4, sizeof(cl_int), &calcRho);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_velocity, 5, memSize, &noBuffer);
+
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 1, memSize, &intDat_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 2, memSize, &strMap_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 3, memSize, &flpDat_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 4, memSize, &u_cpu_cl);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 5, sizeof(cl_float), &noOffset);
+		err_cl |= clSetKernelArg(cpuFluid->boundary_periodic, 6, memSize, &noBuffer);
+	}
 
 	//cl_mem* pfflsMem[] = {&intDat_cl, &gpf_cl, &u_cl}; etc.
 	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 0, memSize, &intDat_cl);
@@ -266,14 +688,20 @@ int main(int argc, char *argv[])
 	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 6, memSize, &parFluidForceSum_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 7, memSize, &spherePoints_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 8, memSize, &countPoint_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 9, memSize, &parProps_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 10, memSize, &surfPointMap_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 12, memSize, &gpf_hi_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_fluid_forces_linear_stencil, 13, memSize, &pointForce_cl);
 
 	err_cl |= clSetKernelArg(kernelDat.sum_particle_fluid_forces, 0, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.sum_particle_fluid_forces, 1, memSize, &flpDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.sum_particle_fluid_forces, 2, memSize, &gpf_cl);
+	err_cl |= clSetKernelArg(kernelDat.sum_particle_fluid_forces, 3, memSize, &gpf_hi_cl);
 
 	err_cl |= clSetKernelArg(kernelDat.reset_particle_fluid_forces, 0, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.reset_particle_fluid_forces, 1, memSize, &flpDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.reset_particle_fluid_forces, 2, memSize, &gpf_cl);
+	err_cl |= clSetKernelArg(kernelDat.reset_particle_fluid_forces, 3, memSize, &gpf_hi_cl);
 
 	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 0, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 1, memSize, &flpDat_cl);
@@ -285,6 +713,7 @@ int main(int argc, char *argv[])
 	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 7, memSize, &numParInThread_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 8, memSize, &zoneMembers_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 9, memSize, &numParInZone_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_particle_forces, 10, memSize, &parProps_cl);
 
 	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 0, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 1, memSize, &flpDat_cl);
@@ -293,6 +722,27 @@ int main(int argc, char *argv[])
 	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 4, memSize, &parFluidForce_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 5, memSize, &threadMembers_cl);
 	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 6, memSize, &numParInThread_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 7, memSize, &parProps_cl);
+	err_cl |= clSetKernelArg(kernelDat.particle_dynamics, 8, memSize, &parSurfOffset_cl);
+
+	cl_float substepDt = 1.0f/(cl_float)hostDat.ParticleSubsteps;
+	cl_kernel substepKernels[2] = {kernelDat.particle_substep_kick_drift, kernelDat.particle_substep_kick};
+	for (int i_k = 0; i_k < 2; i_k++) {
+		err_cl |= clSetKernelArg(substepKernels[i_k], 0, memSize, &intDat_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 1, memSize, &flpDat_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 2, memSize, &parKin_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 3, memSize, &parForce_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 4, memSize, &parFluidForce_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 5, memSize, &threadMembers_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 6, memSize, &numParInThread_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 7, memSize, &parProps_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 8, memSize, &parSurfOffset_cl);
+		err_cl |= clSetKernelArg(substepKernels[i_k], 9, sizeof(cl_float), &substepDt);
+	}
+
+	// Lees-Edwards image offset, updated every step
+	cl_float leOffset = 0.0f;
+	err_cl |= set_lees_edwards_offset(&kernelDat, leOffset);
 
 	err_cl |= clSetKernelArg(kernelDat.update_particle_zones, 0, memSize, &intDat_cl);
 	err_cl |= clSetKernelArg(kernelDat.update_particle_zones, 1, memSize, &flpDat_cl);
@@ -308,11 +758,34 @@ int main(int argc, char *argv[])
 	// ---------------------------------------------------------------------------------
 	// --- MAIN LOOP -------------------------------------------------------------------
 	// ---------------------------------------------------------------------------------
-	FILE* vidPtr;
-	vidPtr = fopen ("xyz_ovito_output.txt","w");
-	printf("%s %d\n", "Starting iteration 1, maximum iterations", intDat.MaxIterations);
+	if (hostDat.VideoFormat == VIDEO_XYZ) {
+		vidPtr = fopen ("xyz_ovito_output.txt", startIteration > 1 ? "a" : "w");
+		if (vidPtr == NULL) {
+			perror("xyz_ovito_output.txt");
+			goto job_cleanup;
+		}
+	}
+	else if (trajectory_writer_open(&trajWriter, &hostDat, &intDat, "trajectory_output.bin", startIteration-1)) {
+		goto job_cleanup;
+	}
+	else {
+		trajOpen = 1;
+	}
+	dev->StartupTime = wall_time() - startTime;
+	printf("Startup %.3f s, %d of %d device buffers reused\n", dev->StartupTime, dev->BuffersReused, NUM_CL_MEM);
+	printf("Starting iteration %d, maximum iterations %d\n", startIteration, intDat.MaxIterations);
+
+	// Sub-stepping needs contact forces at the initial positions for the first half kick
+	int particleSubstepping = usingParticles && hostDat.ParticleSubsteps > 1;
+	if (particleSubstepping) {
+		clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_particle_forces, 1,
+			NULL, &particle_work_size, NULL, 0, NULL, NULL);
+	}
 	
-	for (int t=1; t<=intDat.MaxIterations; t++) {
+	int lastIteration = intDat.MaxIterations;
+	int wallsChanged = 0;
+	double loopStart = wall_time();
+	for (int t=startIteration; t<=intDat.MaxIterations; t++) {
 
 		int toPrint = (t%hostDat.ConsolePrintFreq == 1);
 
@@ -320,21 +793,47 @@ int main(int argc, char *argv[])
 			printf("%s %d\n", "Starting iteration", t);
 		}
 
+		// Lees-Edwards image offset at this step, kept in [0, L_x)
+		if (intDat.LeesEdwards) {
+			double L_x = (double)intDat.SystemSize[0];
+			leOffset = (cl_float)fmod(fmod(leOffsetBase + (double)flpDat.LEVelocity*t, L_x) + L_x, L_x);
+			err_cl = set_lees_edwards_offset(&kernelDat, leOffset);
+			error_check(err_cl, "clSetKernelArg Lees-Edwards", 0);
+		}
+
 		// Switch f buffers
 		if (t%2 == 0) {
 			err_cl  = clSetKernelArg(kernelDat.collide_stream, 0, memSize, &fA_cl);
 			err_cl |= clSetKernelArg(kernelDat.collide_stream, 1, memSize, &fB_cl);
+			err_cl |= clSetKernelArg(kernelDat.collide_stream, 8, memSize, &fA_hi_cl);
+			err_cl |= clSetKernelArg(kernelDat.collide_stream, 9, memSize, &fB_hi_cl);
 			err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 0, memSize, &fB_cl);
+			err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 5, memSize, &fB_hi_cl);
 			err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 0, memSize, &fB_cl);
+			err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 6, memSize, &fB_hi_cl);
 			error_check(err_cl, "clSetKernelArg", 0);
 		}
 		else {
 			err_cl  = clSetKernelArg(kernelDat.collide_stream, 0, memSize, &fB_cl);
 			err_cl |= clSetKernelArg(kernelDat.collide_stream, 1, memSize, &fA_cl);
+			err_cl |= clSetKernelArg(kernelDat.collide_stream, 8, memSize, &fB_hi_cl);
+			err_cl |= clSetKernelArg(kernelDat.collide_stream, 9, memSize, &fA_hi_cl);
 			err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 0, memSize, &fA_cl);
+			err_cl |= clSetKernelArg(kernelDat.boundary_velocity, 5, memSize, &fA_hi_cl);
 			err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 0, memSize, &fA_cl);
+			err_cl |= clSetKernelArg(kernelDat.boundary_periodic, 6, memSize, &fA_hi_cl);
 			error_check(err_cl, "clSetKernelArg", 0);
 		}
+		cl_mem fStreamGPU = t%2 == 0 ? fB_cl : fA_cl;
+		cl_mem fStreamCPU = t%2 == 0 ? fB_cpu_cl : fA_cpu_cl;
+		if (splitLattice) {
+			cl_mem fCollideCPU = t%2 == 0 ? fA_cpu_cl : fB_cpu_cl;
+			err_cl  = clSetKernelArg(cpuCollide, 0, memSize, &fCollideCPU);
+			err_cl |= clSetKernelArg(cpuCollide, 1, memSize, &fStreamCPU);
+			err_cl |= clSetKernelArg(dev->FluidCPU.boundary_velocity, 0, memSize, &fStreamCPU);
+			err_cl |= clSetKernelArg(dev->FluidCPU.boundary_periodic, 0, memSize, &fStreamCPU);
+			error_check(err_cl, "clSetKernelArg CPU fluid", 0);
+		}
 
 		// Kernel: LB collide and stream
 		//for (size_t i_k = 0; i_k < splitKernelSize; i_k++) {
@@ -355,42 +854,139 @@ int main(int argc, char *argv[])
 		//printf("Checkpoint 1 \n\n");
 
 		// Kernel: LB collide and stream
-		clEnqueueNDRangeKernel(queueGPU, kernelDat.collide_stream, 3,
-			lattice_work_offset, global_work_size, NULL, 0, NULL, NULL);
-			
+		if (outOfCore) {
+			// Slab by slab from host memory, with periodic boundaries and the particle forces of the last step
+			err_cl = out_of_core_sweep(&ooc, &kernelDat, queueGPU, &intDat, flpDat_cl, u_cl, tau_lb_cl, pointForce_cl, numSurfPoints, t);
+			error_check(err_cl, "out_of_core_sweep", 1);
+		}
+		else if (temporalBlocking) {
+			// Steps up to blockEnd, with their boundaries, were taken in the last sweep
+			if (t > blockEnd) {
+				int reference = t >= referenceStart && t <= referenceEnd;
+				int numSteps = intDat.MaxIterations+1-t < hostDat.TemporalBlockSteps ? intDat.MaxIterations+1-t : hostDat.TemporalBlockSteps;
+				numSteps = reference ? 1 : numSteps;
+				// Particle forces spread at the end of the last block, held over this one
+				if (usingParticles) {
+					err_cl = copy_lattice_planes(queueGPU, gpf_cl, queueCPU, gpf_cpu_cl, &intDat, allComps, 3, 0, n_planes+2, splitStaging);
+					error_check(err_cl, "copy_lattice_planes gpf", 1);
+				}
+				clFinish(queueCPU);
+				double sweepStart = wall_time();
+				err_cl = enqueue_temporal_block(queueCPU, &dev->FluidCPU, cpuCollide, cpu_work_size[0], fA_cpu_cl, fB_cpu_cl,
+					&intDat, strMap, numPeriodicNodes, t, numSteps, blockSlabPlanes);
+				error_check(err_cl, "enqueue_temporal_block", 1);
+				clFlush(queueCPU);
+				if (t >= referenceStart) {
+					clFinish(queueCPU);
+					sweepTime[!reference] += wall_time() - sweepStart;
+					sweepSteps[!reference] += numSteps;
+				}
+				blockEnd = t + numSteps-1;
+			}
+		}
+		else if (splitLattice) {
+			// Both devices at once, each timed to its completion callback
+			cl_event collideEvents[2];
+			// Particle forces of the last step, spread on the GPU, for the CPU planes and the one below them
+			// that the CPU's force stencil reaches. Here rather than after the sum, so rebalanced planes get theirs
+			if (usingParticles) {
+				err_cl = copy_lattice_planes(queueGPU, gpf_cl, queueCPU, gpf_cpu_cl, &intDat, allComps, 3, splitPlane-1, n_planes+3-splitPlane, splitStaging);
+				error_check(err_cl, "copy_lattice_planes gpf", 1);
+			}
+			pthread_mutex_lock(&splitTiming.Lock);
+			splitTiming.Start = wall_time();
+			pthread_mutex_unlock(&splitTiming.Lock);
+
+			if (!cpuOnly) {
+				clEnqueueNDRangeKernel(queueGPU, kernelDat.collide_stream, 3,
+					lattice_work_offset, fluid_work_size, NULL, 0, NULL, &collideEvents[0]);
+			}
+			clEnqueueNDRangeKernel(queueCPU, cpuCollide, 3,
+				cpu_work_offset, cpu_work_size, NULL, 0, NULL, &collideEvents[1]);
+			splitNodeSteps[0] += (double)fluid_work_size[0]*fluid_work_size[1]*fluid_work_size[2];
+			splitNodeSteps[1] += (double)global_work_size[0]*cpu_work_size[1]*cpu_work_size[2];
+			for (int i = cpuOnly; i < 2; i++) {
+				clSetEventCallback(collideEvents[i], CL_COMPLETE, record_split_time, &splitCallbacks[i]);
+				clReleaseEvent(collideEvents[i]);
+			}
+			clFlush(queueGPU);
+			clFlush(queueCPU);
+
+			// Populations streamed across the split: up into the CPU's first plane, down into the GPU's last
+			if (!cpuOnly) {
+				err_cl  = copy_lattice_planes(queueGPU, fStreamGPU, queueCPU, fStreamCPU, &intDat, upComps, 5, splitPlane, 1, splitStaging);
+				err_cl |= copy_lattice_planes(queueCPU, fStreamCPU, queueGPU, fStreamGPU, &intDat, downComps, 5, splitPlane-1, 1, splitStaging);
+				error_check(err_cl, "copy_lattice_planes halo", 1);
+			}
+		}
+		else {
+			clEnqueueNDRangeKernel(queueGPU, kernelDat.collide_stream, 3,
+				lattice_work_offset, global_work_size, NULL, 0, NULL, NULL);
+		}
+
 
 		// Kernel: Particle update
-		if (usingParticles) {
+		if (particleSubstepping) {
+			// Fluid force held constant, contact forces updated every sub-step
+			for (int k = 0; k < hostDat.ParticleSubsteps; k++) {
+				clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_substep_kick_drift, 1,
+					NULL, &particle_work_size, NULL, 0, NULL, NULL);
+				clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_particle_forces, 1,
+					NULL, &particle_work_size, NULL, 0, NULL, NULL);
+				clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_substep_kick, 1,
+					NULL, &particle_work_size, NULL, 0, NULL, NULL);
+			}
+		}
+		else if (usingParticles) {
 			clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_dynamics, 1,
-				NULL, &numParThreads, NULL, 0, NULL, NULL);
+				NULL, &particle_work_size, NULL, 0, NULL, NULL);
+		}
+
+		// A blocked fluid's velocity is only current at the end of its block, where the forcing is refreshed
+		int forcingStep = usingParticles && (!temporalBlocking || t == blockEnd);
+
+		if (forcingStep && !outOfCore) {
 
 			//clFinish(queueCPU);
 
 			// Kernel: Reset particle-fluid force array
 			clEnqueueNDRangeKernel(queueGPU, kernelDat.reset_particle_fluid_forces, 3,
-				lattice_work_offset, global_work_size, NULL, 0, NULL, NULL);
+				NULL, member_work_size, NULL, 0, NULL, NULL);
 		}
 		
 		//printf("Checkpoint 2 \n\n");
 
 		// Kernel: Periodic stream
-		clEnqueueNDRangeKernel(queueGPU, kernelDat.boundary_periodic, 1,
-			NULL, &periodic_work_size, NULL, 0, NULL, NULL);
+		if (!cpuOnly && !outOfCore) {
+			clEnqueueNDRangeKernel(queueGPU, kernelDat.boundary_periodic, 1,
+				NULL, &periodic_work_size, NULL, 0, NULL, NULL);
+		}
+		if (splitLattice && !temporalBlocking) {
+			clEnqueueNDRangeKernel(queueCPU, dev->FluidCPU.boundary_periodic, 1,
+				&cpu_periodic_offset, &cpu_periodic_work_size, NULL, 0, NULL, NULL);
+		}
 		
 		//printf("Checkpoint 3 \n\n");
 
-		// Kernel: LB velocity boundary
-		if (velBoundary) {
-			clEnqueueNDRangeKernel(queueGPU, kernelDat.boundary_velocity, 3,
-				lattice_work_offset, velBC_work_size, NULL, 0, NULL, NULL);
+		// Kernel: LB velocity boundary (otherwise completed in the next collide_stream)
+		if (velBoundary && !intDat.FuseVelocityBC) {
+			if (!cpuOnly) {
+				clEnqueueNDRangeKernel(queueGPU, kernelDat.boundary_velocity, 3,
+					lattice_work_offset, velBC_work_size, NULL, 0, NULL, NULL);
+			}
+			if (splitLattice && !temporalBlocking) {
+				clEnqueueNDRangeKernel(queueCPU, dev->FluidCPU.boundary_velocity, 3,
+					cpuVelBC_work_offset, cpuVelBC_work_size, NULL, 0, NULL, NULL);
+			}
 
 			// Additional tangential velocity boundaries (experimental)
 			for (int i = 0; i < 3; i++) {
-				if (hostDat.TangentialVelBC[i] == 1) {
+				if (intDat.TangentialVelBC[i] == 1) {
 					//printf("Applying tangential velocity bounary on axis %d\n", i);
 					tanBC_work_size[i] = 2;
 					tanBC_work_size[(i+1)%3] = intDat.LatticeSize[(i+1)%3]-2;
 					tanBC_work_size[(i+2)%3] = intDat.LatticeSize[(i+2)%3]-2;
+					tanBC_work_size[2] *= numMembers;
 					tanAxis = i;
 
 					clSetKernelArg(kernelDat.boundary_velocity, 3, sizeof(cl_int), &tanAxis);
@@ -408,19 +1004,30 @@ int main(int argc, char *argv[])
 		//printf("Checkpoint 4 \n\n");
 
 		// Kernel: Particle-fluid forces
-		if (usingParticles) {
+		if (forcingStep) {
+			if (splitLattice) {
+				// The CPU planes of u for the interpolation, and the write counts its collide cleared
+				err_cl  = copy_lattice_planes(queueCPU, u_cpu_cl, queueGPU, u_cl, &intDat, allComps, 3, splitPlane, n_planes+1-splitPlane, splitStaging);
+				err_cl |= copy_lattice_planes(queueCPU, countPoint_cpu_cl, queueGPU, countPoint_cl, &intDat, allComps, 1, splitPlane, n_planes+1-splitPlane, splitStaging);
+				error_check(err_cl, "copy_lattice_planes u", 1);
+			}
 			clEnqueueNDRangeKernel(queueGPU, kernelDat.particle_fluid_forces_linear_stencil, 1,
-				NULL, &numSurfPoints, &pointWorkSize, 0, NULL, NULL);
+				NULL, &surface_work_size, &pointWorkSize, 0, NULL, NULL);
 
 			//clFinish(queueGPU);
 
-			// Kernel: Sum particle-fluid forces (acting on fluid)
-			clEnqueueNDRangeKernel(queueGPU, kernelDat.sum_particle_fluid_forces, 3,
-				lattice_work_offset, global_work_size, NULL, 0, NULL, NULL);
+			// Kernel: Sum particle-fluid forces (acting on fluid), out of core once spread onto each slab
+			if (!outOfCore) {
+				clEnqueueNDRangeKernel(queueGPU, kernelDat.sum_particle_fluid_forces, 3,
+					NULL, member_work_size, NULL, 0, NULL, NULL);
+			}
+
+		}
 
-			// Kernel: Particle-particle forces
+		// Kernel: Particle-particle forces (already current when sub-stepping)
+		if (usingParticles && !particleSubstepping) {
 			clEnqueueNDRangeKernel(queueCPU, kernelDat.particle_particle_forces, 1,
-				NULL, &numParThreads, NULL, 0, NULL, NULL);
+				NULL, &particle_work_size, NULL, 0, NULL, NULL);
 		}
 		
 		//printf("Checkpoint 5 \n\n");
@@ -428,42 +1035,186 @@ int main(int argc, char *argv[])
 		// Rebuild neighbour lists every intDat.RebuildFreq
 		if (usingParticles && t%hostDat.RebuildFreq == 0) {
 			
-			numParInZone_h = (cl_int*)clEnqueueMapBuffer(queueCPU, 
-				numParInZone_cl, CL_TRUE, CL_MAP_WRITE, 0, totalNumZones*sizeof(cl_int), 0, NULL, NULL, &err_cl);
+			cl_int* numParInZoneMap = (cl_int*)clEnqueueMapBuffer(queueCPU, 
+				numParInZone_cl, CL_TRUE, CL_MAP_WRITE, 0, numMembers*totalNumZones*sizeof(cl_int), 0, NULL, NULL, &err_cl);
 			error_check(err_cl, "clEnqueueMapBuffer", 0);
 			
-			for (int i = 0; i < totalNumZones; i++) {
+			for (int i = 0; i < (int)(numMembers*totalNumZones); i++) {
 				// Count is reset here because zones don't belong to threads
 				// May impact performance if large num of zones
-				numParInZone_h[i] = 0;
+				numParInZoneMap[i] = 0;
 			}
-			clEnqueueUnmapMemObject(queueCPU, numParInZone_cl, numParInZone_h, 0, NULL, NULL);
+			clEnqueueUnmapMemObject(queueCPU, numParInZone_cl, numParInZoneMap, 0, NULL, NULL);
 			clFinish(queueCPU);
 			clEnqueueNDRangeKernel(queueCPU, kernelDat.update_particle_zones, 1,
-				NULL, &numParThreads, NULL, 0, NULL, NULL);
+				NULL, &particle_work_size, NULL, 0, NULL, NULL);
 			
 		}
 
+		// Host output for snapshots whose readback has finished, oldest first,
+		// while this step's kernels run
+		while (snapCount > 0 && output_snapshot_ready(&snapshots[snapHead], 0)) {
+			wallsChanged |= process_output_snapshot(&snapshots[snapHead], &hostDat, &intDat, flpMembers, outDat, &trajWriter, vidPtr);
+			snapHead = (snapHead+1)%OUTPUT_SNAPSHOTS;
+			snapCount--;
+		}
+
 		clFinish(queueGPU);
 		//printf("Checkpoint 6 \n\n");
 
+		// Time-averaged fields, on device until the end of the run
+		if (fieldStats && t >= hostDat.FieldAverageStart && (t-hostDat.FieldAverageStart)%hostDat.FieldAverageFreq == 0) {
+			statSamples++;
+			clSetKernelArg(kernelDat.accumulate_field_statistics, 5, sizeof(cl_int), &statSamples);
+			clEnqueueNDRangeKernel(queueGPU, kernelDat.accumulate_field_statistics, 3,
+				lattice_work_offset, global_work_size, NULL, 0, NULL, NULL);
+		}
+
 		// Produce video output and/or analysis
-		if (t%hostDat.VideoFreq == 0) {
-			err_cl = clEnqueueReadBuffer(queueGPU, u_cl, CL_TRUE, 0, a3DataSize, u_h, 0, NULL, NULL);
-			err_cl = clEnqueueReadBuffer(queueCPU, parKin_cl, CL_TRUE, 0, parV4DataSize*4, parKin_h, 0, NULL, NULL);
-			error_check(err_cl, "clEnqueueReadBuffer Video", 0);
+		int videoStep = numMembers == 1 && t%hostDat.VideoFreq == 0;
+		int profileFlush = 0;
+		int profileStep = (hostDat.ConvergeWindow > 0 || intDat.MaintainShear || t > 3*intDat.MaxIterations/4) && t%hostDat.ShearStressFreq == 0;
+		if (splitLattice && !usingParticles && (videoStep || profileStep)) {
+			// The CPU planes of u into the GPU copy, which the output kernels read (every step with particles)
+			err_cl = copy_lattice_planes(queueCPU, u_cpu_cl, queueGPU, u_cl, &intDat, allComps, 3, splitPlane, n_planes+1-splitPlane, splitStaging);
+			error_check(err_cl, "copy_lattice_planes u", 1);
+		}
+		if (profileStep) {
+			// Plane-averaged profile and shear rates, into the next row of the history on device
+			clSetKernelArg(kernelDat.plane_average_velocity, 3, sizeof(cl_int), &profileRows);
+			clSetKernelArg(kernelDat.profile_shear_rates, 2, sizeof(cl_int), &profileRows);
+			clEnqueueNDRangeKernel(queueGPU, kernelDat.plane_average_velocity, 1,
+				NULL, &profile_work_size, &profileWorkGroup, 0, NULL, NULL);
+			clEnqueueNDRangeKernel(queueGPU, kernelDat.profile_shear_rates, 1,
+				NULL, &shear_rate_work_size, NULL, 0, NULL, NULL);
+			profileFrames[profileRows++] = t;
+			profileFlush = profileRows == hostDat.ShearProfileHistory;
+		}
+		if (videoStep || profileFlush) {
+			if (snapCount == OUTPUT_SNAPSHOTS) {
+				output_snapshot_ready(&snapshots[snapHead], 1);
+				wallsChanged |= process_output_snapshot(&snapshots[snapHead], &hostDat, &intDat, flpMembers, outDat, &trajWriter, vidPtr);
+				snapHead = (snapHead+1)%OUTPUT_SNAPSHOTS;
+				snapCount--;
+			}
+			int slot = (snapHead+snapCount)%OUTPUT_SNAPSHOTS;
+			output_snapshot_struct* snap = &snapshots[slot];
+			snap->Frame = t;
+			snap->Video = videoStep;
+			snap->NumProfiles = 0;
+			err_cl = CL_SUCCESS;
+
+			if (videoStep) {
+				// Gather is ordered before the next step on queueGPU, the read overlaps it
+				cl_event stageEvent;
+				cl_int gatherOffset = slot*fluidOutCols*numFluidOut;
+				clSetKernelArg(kernelDat.gather_fluid_output, 2, sizeof(cl_int), &gatherOffset);
+				err_cl |= clEnqueueNDRangeKernel(queueGPU, kernelDat.gather_fluid_output, 1,
+					NULL, &numFluidOut, NULL, 0, NULL, &stageEvent);
+				clFlush(queueGPU);
+				err_cl |= clEnqueueReadBuffer(queueRead, fluidStage_cl, CL_FALSE, slot*fluidOutDataSize, fluidOutDataSize, snap->fluid_h,
+					1, &stageEvent, &snap->Ready[0]);
+				clFlush(queueRead);
+				clReleaseEvent(stageEvent);
+
+				if (usingParticles) {
+					err_cl |= clEnqueueReadBuffer(queueCPU, parKin_cl, CL_FALSE, 0, parV4DataSize*4, snap->parKin_h,
+						0, NULL, &snap->Ready[1]);
+				}
+			}
+			if (profileFlush) {
+				// Small enough to read in order on queueGPU, so the history rows can be reused straight away
+				err_cl |= clEnqueueReadBuffer(queueGPU, uProfile_cl, CL_FALSE, 0, profileRows*profileDataSize, snap->profile_h,
+					0, NULL, &snap->Ready[2]);
+				memcpy(snap->ProfileFrames, profileFrames, profileRows*sizeof(cl_int));
+				snap->NumProfiles = profileRows;
+				profileRows = 0;
+			}
+			error_check(err_cl, "clEnqueueReadBuffer snapshot", 1);
+			snapCount++;
+		}
+
+		// Checkpoint, after completing this step's output so the saved accumulators are current
+		if (hostDat.CheckpointFreq > 0 && t%hostDat.CheckpointFreq == 0) {
+			while (snapCount > 0) {
+				output_snapshot_ready(&snapshots[snapHead], 1);
+				wallsChanged |= process_output_snapshot(&snapshots[snapHead], &hostDat, &intDat, flpMembers, outDat, &trajWriter, vidPtr);
+				snapHead = (snapHead+1)%OUTPUT_SNAPSHOTS;
+				snapCount--;
+			}
+			if (profileRows > 0) {
+				err_cl = clEnqueueReadBuffer(queueGPU, uProfile_cl, CL_TRUE, 0, profileRows*profileDataSize, snapshots[0].profile_h,
+					0, NULL, NULL);
+				error_check(err_cl, "clEnqueueReadBuffer uProfile_cl", 1);
+				for (int r = 0; r < profileRows; r++) {
+					wallsChanged |= compute_shear_stress(outDat, &hostDat, &intDat, flpMembers,
+						snapshots[0].profile_h + r*3*intDat.LatticeSize[2], profileFrames[r], 0);
+				}
+				profileRows = 0;
+			}
+			clFinish(queueGPU);
+			clFinish(queueCPU);
+
+			ckptBufs[CKPT_F] = t%2 == 0 ? fB_cl : fA_cl;
+			ckptHiBufs[CKPT_F] = t%2 == 0 ? fB_hi_cl : fA_hi_cl;
+			checkpoint_save(&ckpt, queueGPU, queueCPU, ckptBufs, ckptHiBufs, t, leOffset, outDat, flpMembers, statSamples);
+		}
 
-			clFinish(queueGPU); 
+		// New wall velocities from the shear rate controller, for the next step
+		// (particle kernels on the CPU device also read flpDat, so they are finished first)
+		if (wallsChanged) {
 			clFinish(queueCPU);
-			continuous_output(&hostDat, &intDat, u_h, parKin_h, vidPtr, t);
+			err_cl = write_wall_velocities(queueGPU, flpDat_cl, flpMembers);
+			error_check(err_cl, "clEnqueueWriteBuffer wall velocities", 1);
+			wallsChanged = 0;
 		}
-		if (t > 3*intDat.MaxIterations/4 && t%hostDat.ShearStressFreq == 0) {
-			err_cl = clEnqueueReadBuffer(queueGPU, u_cl, CL_TRUE, 0, a3DataSize, u_h, 0, NULL, NULL);
-			err_cl = clEnqueueReadBuffer(queueGPU, tau_lb_cl, CL_TRUE, 0, numNodes*sizeof(cl_float), tau_lb_h, 0, NULL, NULL);
-			error_check(err_cl, "clEnqueueReadBuffer Shear stress", 1);
+
+		// Rebalance the split so both devices take as long, from the measured collide_stream times.
+		// Planes changing device take their current populations, tau and u with them
+		if (splitLattice && !cpuOnly && hostDat.SplitBalanceFreq > 0 && t%hostDat.SplitBalanceFreq == 0) {
 			clFinish(queueGPU);
-			compute_shear_stress(&outDat, &hostDat, &intDat, &flpDat, u_h, tau_lb_h, t);
+			clFinish(queueCPU);
+			int newPlane = balance_split_plane(&intDat, splitPlane, &splitTiming);
+			if (newPlane != splitPlane) {
+				int first = newPlane < splitPlane ? newPlane : splitPlane;
+				int moved = abs(newPlane - splitPlane);
+				cl_command_queue srcQueue = newPlane < splitPlane ? queueGPU : queueCPU;
+				cl_command_queue dstQueue = newPlane < splitPlane ? queueCPU : queueGPU;
+				cl_mem srcF = newPlane < splitPlane ? fStreamGPU : fStreamCPU;
+				cl_mem dstF = newPlane < splitPlane ? fStreamCPU : fStreamGPU;
+				cl_mem srcU = newPlane < splitPlane ? u_cl : u_cpu_cl;
+				cl_mem dstU = newPlane < splitPlane ? u_cpu_cl : u_cl;
+				cl_mem srcTau = newPlane < splitPlane ? tau_lb_cl : tau_lb_cpu_cl;
+				cl_mem dstTau = newPlane < splitPlane ? tau_lb_cpu_cl : tau_lb_cl;
+
+				err_cl  = copy_lattice_planes(srcQueue, srcF, dstQueue, dstF, &intDat, allComps, 19, first, moved, splitStaging);
+				err_cl |= copy_lattice_planes(srcQueue, srcU, dstQueue, dstU, &intDat, allComps, 3, first, moved, splitStaging);
+				err_cl |= copy_lattice_planes(srcQueue, srcTau, dstQueue, dstTau, &intDat, allComps, 1, first, moved, splitStaging);
+				error_check(err_cl, "copy_lattice_planes rebalance", 1);
+
+				splitPlane = newPlane;
+				fluid_work_size[2] = splitPlane-1;
+				cpu_work_offset[2] = splitPlane;
+				cpu_work_size[2] = n_planes+1 - splitPlane;
+				periodic_work_size = periodic_nodes_below(&intDat, strMap, numPeriodicNodes, splitPlane);
+				cpu_periodic_offset = periodic_work_size;
+				cpu_periodic_work_size = numPeriodicNodes - periodic_work_size;
+				if (toPrint) {
+					printf("Split moved to z plane %d\n", splitPlane);
+				}
+			}
+		}
 
+		// Shear rates converged (seen when their profile was processed, up to two output steps back),
+		// for every ensemble member. A blocked fluid stops at the end of its sweep
+		int converged = !temporalBlocking || t >= blockEnd;
+		for (int m = 0; m < numMembers; m++) {
+			converged &= outDat[m].ConvergedFrame > 0;
+		}
+		if (converged) {
+			lastIteration = t;
+			printf("Shear rates converged, stopping at iteration %d\n", t);
+			break;
 		}
 		
 		//printf("Checkpoint 7 \n\n");
@@ -471,57 +1222,204 @@ int main(int argc, char *argv[])
 	} 
 	clFinish(queueGPU); 
 	clFinish(queueCPU); 
+
+	// Fluid update rate, million lattice updates per second, and of each device's collide_stream when split
+	double loopTime = wall_time() - loopStart;
+	double numUpdates = (double)global_work_size[0]*global_work_size[1]*global_work_size[2]*(lastIteration - startIteration + 1);
+	printf("Simulation loop %.3f s, %.2f MLUPS\n", loopTime, loopTime > 0.0 ? 1E-6*numUpdates/loopTime : 0.0);
+	if (splitLattice && !temporalBlocking) {
+		for (int i = cpuOnly; i < 2; i++) {
+			printf("%s collide_stream %.2f MLUPS\n", i == 0 ? "GPU" : "CPU",
+				splitTiming.TotalTime[i] > 0.0 ? 1E-6*splitNodeSteps[i]/splitTiming.TotalTime[i] : 0.0);
+		}
+	}
+	// Measured sweep times, with the population traffic each implies (estimated from the planes read and written)
+	if (temporalBlocking && sweepSteps[0] > 0 && sweepSteps[1] > 0) {
+		double stepTime[2] = {sweepTime[0]/sweepSteps[0], sweepTime[1]/sweepSteps[1]};
+		double stepBytes[2] = {(double)n_planes*blockPlaneBytes, (double)n_planes*blockPlaneBytes/hostDat.TemporalBlockSteps};
+		for (int i = 0; i < 2; i++) {
+			printf("%s: %.3f ms per fluid step, about %.1f MB read and written per step, %.2f GB/s\n",
+				i == 0 ? "One step per sweep" : "Temporal blocking", 1E3*stepTime[i], 1E-6*stepBytes[i],
+				stepTime[i] > 0.0 ? 1E-9*stepBytes[i]/stepTime[i] : 0.0);
+		}
+		printf("Temporal blocking speed-up %.2f, with an estimated %d times less population traffic\n",
+			stepTime[1] > 0.0 ? stepTime[0]/stepTime[1] : 0.0, hostDat.TemporalBlockSteps);
+	}
+
+	// Remaining output snapshots
+	while (snapCount > 0) {
+		output_snapshot_ready(&snapshots[snapHead], 1);
+		process_output_snapshot(&snapshots[snapHead], &hostDat, &intDat, flpMembers, outDat, &trajWriter, vidPtr);
+		snapHead = (snapHead+1)%OUTPUT_SNAPSHOTS;
+		snapCount--;
+	}
+
+	// Profiles still held in the history on device
+	if (profileRows > 0) {
+		err_cl = clEnqueueReadBuffer(queueGPU, uProfile_cl, CL_TRUE, 0, profileRows*profileDataSize, snapshots[0].profile_h,
+			0, NULL, NULL);
+		error_check(err_cl, "clEnqueueReadBuffer uProfile_cl", 1);
+		for (int r = 0; r < profileRows; r++) {
+			for (int m = 0; m < numMembers; m++) {
+				compute_shear_stress(&outDat[m], &hostDat, &intDat, &flpMembers[m],
+					snapshots[0].profile_h + (r*numMembers + m)*3*intDat.LatticeSize[2], profileFrames[r], m);
+			}
+		}
+	}
+
+	for (int m = 0; m < numMembers; m++) {
+		if (numMembers > 1 && hostDat.ConvergeWindow > 0) {
+			printf("Member %d: ", m);
+		}
+		if (outDat[m].ConvergedFrame > 0) {
+			printf("Converged at iteration %d over the last %d samples:\n", outDat[m].ConvergedFrame, hostDat.ConvergeWindow);
+			printf("Shear rate at wall = %e +/- %e\n", outDat[m].ConvergedMean[0], outDat[m].ConvergedStdErr[0]);
+			printf("Shear rate in particle region = %e +/- %e\n", outDat[m].ConvergedMean[1], outDat[m].ConvergedStdErr[1]);
+		}
+		else if (hostDat.ConvergeWindow > 0) {
+			printf("Shear rates not converged within %d iterations\n", intDat.MaxIterations);
+		}
+	}
+
 	printf("Checkpoint: end of simulation loop\n");
 
 	// --- COPY DATA TO HOST ---------------------------------------------------
 	// Velocity
-	err_cl = clEnqueueReadBuffer(queueGPU, u_cl, CL_TRUE, 0, a3DataSize, u_h, 0, NULL, NULL);
-	error_check(err_cl, "clEnqueueReadBuffer", 1);
-
-	write_lattice_field(u_h, &intDat);
+	if (splitLattice) {
+		err_cl = copy_lattice_planes(queueCPU, u_cpu_cl, queueGPU, u_cl, &intDat, allComps, 3, splitPlane, n_planes+1-splitPlane, splitStaging);
+		error_check(err_cl, "copy_lattice_planes u", 1);
+		if (!cpuOnly) {
+			printf("Final split: GPU z planes 1 to %d, CPU z planes %d to %d\n", splitPlane-1, splitPlane, n_planes);
+		}
+	}
+	// One member at a time
+	cl_float* u_h = (cl_float*)host_lattice_alloc(3*numNodes*sizeof(cl_float), hostDat.HugePages);
+	for (int m = 0; m < numMembers; m++) {
+		err_cl = clEnqueueReadBuffer(queueGPU, u_cl, CL_TRUE, m*3*numNodes*sizeof(cl_float), 3*numNodes*sizeof(cl_float), u_h,
+			0, NULL, NULL);
+		error_check(err_cl, "clEnqueueReadBuffer", 1);
+		write_lattice_field(&hostDat, u_h, &intDat, lastIteration, m);
+	}
+	free(u_h);
+
+	if (statSamples > 0) {
+		cl_float* statMean_h = (cl_float*)malloc(statDataSize);
+		cl_float* statM2_h = (cl_float*)malloc(statDataSize);
+		err_cl = clEnqueueReadBuffer(queueGPU, statMean_cl, CL_TRUE, 0, statDataSize, statMean_h, 0, NULL, NULL);
+		err_cl |= clEnqueueReadBuffer(queueGPU, statM2_cl, CL_TRUE, 0, statDataSize, statM2_h, 0, NULL, NULL);
+		error_check(err_cl, "clEnqueueReadBuffer field statistics", 1);
+
+		write_field_statistics(&hostDat, &intDat, statMean_h, statM2_h, statSamples);
+		free(statMean_h);
+		free(statM2_h);
+	}
 
 	
 	if (usingParticles) {
 		
-		parFluidForce_h = (cl_float4*)clEnqueueMapBuffer(queueCPU, 
-			parFluidForce_cl, CL_TRUE, CL_MAP_READ, 0, parV4DataSize*intDat.WorkGroupsPerParticle*2, 0, NULL, NULL, &err_cl);
+		cl_float4* parFluidForceMap = (cl_float4*)clEnqueueMapBuffer(queueCPU, 
+			parFluidForce_cl, CL_TRUE, CL_MAP_READ, 0, pffDataSize, 0, NULL, NULL, &err_cl);
 		error_check(err_cl, "clEnqueueMapBuffer", 1);
 		
 		cl_float finalForce[3] = {0.0, 0.0, 0.0};
-		for (int i_fa = 0; i_fa < intDat.WorkGroupsPerParticle; i_fa++) {
-			finalForce[0] += parFluidForce_h[i_fa].x;
-			finalForce[1] += parFluidForce_h[i_fa].y;
-			finalForce[2] += parFluidForce_h[i_fa].z;
-			printf("Final force += %f %f %f\n", parFluidForce_h[i_fa].x, parFluidForce_h[i_fa].y, parFluidForce_h[i_fa].z);
+		for (int i_fa = parSurfOffset_h[0]/intDat.PointsPerWorkGroup; i_fa < parSurfOffset_h[1]/intDat.PointsPerWorkGroup; i_fa++) {
+			finalForce[0] += parFluidForceMap[i_fa].x;
+			finalForce[1] += parFluidForceMap[i_fa].y;
+			finalForce[2] += parFluidForceMap[i_fa].z;
+			printf("Final force += %f %f %f\n", parFluidForceMap[i_fa].x, parFluidForceMap[i_fa].y, parFluidForceMap[i_fa].z);
 		}
 		printf("Final force on particle 1 = %f %f %f\n", finalForce[0], finalForce[1], finalForce[2]);
-		clEnqueueUnmapMemObject(queueCPU, parFluidForce_cl, parFluidForce_h, 0, NULL, NULL);
+		clEnqueueUnmapMemObject(queueCPU, parFluidForce_cl, parFluidForceMap, 0, NULL, NULL);
 	} 
 	clFinish(queueCPU);
 	printf("Checkpoint: end of output\n"); 
+	status = 0;
 
-	// Cleanup
-#define X(kernelName) clReleaseKernel(kernelDat.kernelName);
-	LIST_OF_KERNELS
-#undef X
+job_cleanup:
+	// Also reached when setup fails, with only what was set up by then to release
+	clFinish(queueGPU);
+	clFinish(queueCPU);
+	if (fluidPinned_h != NULL) {
+		clEnqueueUnmapMemObject(queueRead, dev->Pool[POOL_fluidPinned_cl], fluidPinned_h, 0, NULL, NULL);
+	}
+	clFinish(queueRead);
+	out_of_core_release(&ooc);
+	if (ckptOpen) {
+		checkpoint_writer_close(&ckpt);
+	}
+	if (vidPtr != NULL) {
+		fclose(vidPtr);
+	}
+	if (trajOpen) {
+		trajectory_writer_close(&trajWriter);
+	}
+	for (int i = 0; i < OUTPUT_SNAPSHOTS; i++) {
+		free(snapshots[i].parKin_h);
+		free(snapshots[i].profile_h);
+		free(snapshots[i].ProfileFrames);
+	}
+	free(profileFrames);
+
+	// Host arrays (device buffers stay in the pool for the next simulation)
+	free(parKin_h);
+	free(parForce_h);
+	free(parFluidForce_h);
+	free(parFluidForceSum_h);
+	free(threadMembers_h);
+	free(numParInThread_h);
+	free(parsZone_h);
+	free(zoneMembers_h);
+	free(numParInZone_h);
+	free(zoneNeighDat_h);
+	free(parProps_h);
+	free(spherePoints);
+	free(parSphereSet_h);
+	free(parSurfOffset_h);
+	free(surfPointMap_h);
+	free(strMap);
+	free(flpMembers);
+	free(parSeeds);
+	free(outDat);
+	free(splitStaging);
+	pthread_mutex_destroy(&splitTiming.Lock);
+
+	printf("Checkpoint: end of simulation\n");
+	return status;
+}
 
-	printf("Checkpoint: released kernels\n");
+int main(int argc, char *argv[])
+{
+	printf("Int struct size: %lu\n", (unsigned long)sizeof(int_param_struct));
+	printf("Flp struct size: %lu\n", (unsigned long)sizeof(flp_param_struct));
+
+	// Devices, queues and programs, kept for every simulation in server mode
+	double setupStart = wall_time();
+	// Options: --server <job directory>, --cpu-numa-node <node>
+	sim_device_struct dev;
+	dev.CpuNumaNode = -1;
+	const char* jobDir = NULL;
+	for (int i = 1; i < argc-1; i++) {
+		if (strcmp(argv[i], "--server") == 0) {
+			jobDir = argv[++i];
+		}
+		else if (strcmp(argv[i], "--cpu-numa-node") == 0) {
+			dev.CpuNumaNode = atoi(argv[++i]);
+		}
+	}
 
-#define X(memName) clReleaseMemObject(memName);
-	LIST_OF_CL_MEM
-#undef X 
+	setup_sim_device(&dev);
+	printf("Device setup %.3f s\n", wall_time() - setupStart);
 
+	int status;
+	if (jobDir != NULL) {
+		status = run_job_server(&dev, jobDir);
+	}
+	else {
+		status = run_simulation(&dev, "");
+	}
+
+	release_sim_device(&dev);
 	printf("Checkpoint: end of sim_main\n");
-	
-	/* Clean-up
-	clReleaseCommandQueue(queueCPU);
-	clReleaseCommandQueue(queueGPU);
-	clReleaseDevice(deviceArr[0]);
-	clReleaseDevice(deviceArr[1]);
-	clReleaseProgram(programCPU);
-	clReleaseProgram(programGPU);
-
-	clReleaseContext(contextSim); 
-	*/
-	return 0;
+
+	return status == 0 ? 0 : EXIT_FAILURE;
 }
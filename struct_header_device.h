@@ -12,7 +12,18 @@ typedef struct {
 	
 	int BufferSize[3];
 	int BoundaryConds[3];
+	int TangentialVelBC[3];
+	int FuseVelocityBC;
+	int LeesEdwards;
+	int EnsembleSize;
+	int NumPeriodicNodes; // Per ensemble member
+	int FPartPlanes; // Planes (component x member) of f in the first allocation, see field_plane
+	int GpfPartPlanes; // Same for gpf, a multiple of 3
+	int OutOfCorePlanes; // Interior z planes per slab when f is held on the host, 0 if on the device
+	int SlabOrigin; // Whole-lattice z of plane 0 of an out-of-core slab, else 0
+	int WholeLatticeZ; // LatticeSize[2] of the whole lattice, which a slab's is not
 	int NumZones[3];
+	int ZoneNeighStride;
 	
 	int MaintainShear;
 	int ViscosityModel;
@@ -23,10 +34,9 @@ typedef struct {
 	int MaxSurfPointsPerNode;
 	int InterpOrderIBM;
 	
-	int PointsPerParticle;
 	int PointsPerWorkGroup;
 	int TotalSurfPoints;
-	int WorkGroupsPerParticle;
+	int TotalWorkGroups;
 
 } int_param_struct;
 
@@ -38,6 +48,7 @@ typedef struct {
 	float EqWeights[19];
 	float VelUpper[3];
 	float VelLower[3];
+	float LEVelocity;
 	// Viscosity
 	float NewtonianTau;
 	float ViscosityParams[4];
@@ -46,9 +57,6 @@ typedef struct {
 
 	// Particle
 	float ParticleDiam;
-	float ParticleMass;
-	float PointArea;
-	float ParticleMomInertia;
 	float ParForceParams[2];
 	float ParticleZBuffer;
 	
@@ -12,7 +12,18 @@ typedef struct {
 	
 	cl_int BufferSize[3];
 	cl_int BoundaryConds[3];
+	cl_int TangentialVelBC[3];
+	cl_int FuseVelocityBC;
+	cl_int LeesEdwards;
+	cl_int EnsembleSize;
+	cl_int NumPeriodicNodes; // Per ensemble member
+	cl_int FPartPlanes; // Planes (component x member) of f in the first allocation, see field_plane
+	cl_int GpfPartPlanes; // Same for gpf, a multiple of 3
+	cl_int OutOfCorePlanes; // Interior z planes per slab when f is held on the host, 0 if on the device
+	cl_int SlabOrigin; // Whole-lattice z of plane 0 of an out-of-core slab, else 0
+	cl_int WholeLatticeZ; // LatticeSize[2] of the whole lattice, which a slab's is not
 	cl_int NumZones[3];
+	cl_int ZoneNeighStride;
 	
 	cl_int MaintainShear;
 	cl_int ViscosityModel;
@@ -23,10 +34,9 @@ typedef struct {
 	cl_int MaxSurfPointsPerNode;
 	cl_int InterpOrderIBM;
 	
-	cl_int PointsPerParticle;
 	cl_int PointsPerWorkGroup;
 	cl_int TotalSurfPoints;
-	cl_int WorkGroupsPerParticle;
+	cl_int TotalWorkGroups;
 
 } int_param_struct;
 
@@ -38,6 +48,7 @@ typedef struct {
 	cl_float EqWeights[19];
 	cl_float VelUpper[3];
 	cl_float VelLower[3];
+	cl_float LEVelocity;
 	// Viscosity
 	cl_float NewtonianTau;
 	cl_float ViscosityParams[4];
@@ -46,9 +57,6 @@ typedef struct {
 
 	// Particle
 	cl_float ParticleDiam;
-	cl_float ParticleMass;
-	cl_float PointArea;
-	cl_float ParticleMomInertia;
 	cl_float ParForceParams[2];
 	cl_float ParticleZBuffer;
 	
@@ -0,0 +1,38 @@
+// Binary trajectory written for video output (replaces the xyz text video)
+// File: one trajectory_header_struct, then per frame a trajectory_frame_struct followed by
+//   fluid columns ux, uy, uz and, if FluidColumns is 4, |vorticity|, each [NumFluid]
+//   (float32, or int16 times that column's FluidScale)
+//   particle columns x, y, z, vx, vy, vz, each float32[NumParticles]
+// Fluid nodes are implicit: i_x, i_y, i_z from 1 to LatticeSize-2 in steps of OutputSpacing,
+// i_z varying fastest, as in the xyz text output.
+// trajectory_to_xyz.c converts a trajectory back to the OVITO xyz format.
+
+#include <stdint.h>
+
+#define TRAJ_MAGIC 0x4A525454 // "TTRJ"
+#define TRAJ_VERSION 2
+
+#define TRAJ_FLOAT32 0
+#define TRAJ_INT16 1
+
+#define TRAJ_MAX_FLUID_COLUMNS 4
+
+typedef struct {
+
+	int32_t Magic;
+	int32_t Version;
+	int32_t LatticeSize[3];
+	int32_t OutputSpacing;
+	int32_t NumFluid;
+	int32_t FluidColumns;
+	int32_t NumParticles;
+	int32_t FluidEncoding;
+
+} trajectory_header_struct;
+
+typedef struct {
+
+	int32_t Frame;
+	float FluidScale[TRAJ_MAX_FLUID_COLUMNS];
+
+} trajectory_frame_struct;
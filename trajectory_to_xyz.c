@@ -0,0 +1,102 @@
+// Convert a binary trajectory (trajectory_format.h) to the OVITO xyz text format
+// Usage: trajectory_to_xyz.out [trajectory_output.bin] [xyz_ovito_output.txt]
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "trajectory_format.h"
+
+int main(int argc, char* argv[])
+{
+	const char* inName = argc > 1 ? argv[1] : "trajectory_output.bin";
+	const char* outName = argc > 2 ? argv[2] : "xyz_ovito_output.txt";
+
+	FILE* inPtr = fopen(inName, "rb");
+	if (inPtr == NULL) {
+		perror(inName);
+		exit(EXIT_FAILURE);
+	}
+
+	trajectory_header_struct header;
+	if (fread(&header, sizeof(header), 1, inPtr) != 1
+	||	header.Magic != TRAJ_MAGIC || header.Version != TRAJ_VERSION) {
+		printf("Error: %s is not a trajectory file\n", inName);
+		exit(EXIT_FAILURE);
+	}
+
+	FILE* outPtr = fopen(outName, "w");
+	if (outPtr == NULL) {
+		perror(outName);
+		exit(EXIT_FAILURE);
+	}
+
+	int n_x = header.LatticeSize[0];
+	int n_y = header.LatticeSize[1];
+	int n_z = header.LatticeSize[2];
+	int n_s = header.OutputSpacing;
+	int n_fluid = header.NumFluid;
+	int n_cols = header.FluidColumns;
+	int n_par = header.NumParticles;
+
+	size_t fluidValSize = header.FluidEncoding == TRAJ_INT16 ? sizeof(int16_t) : sizeof(float);
+	void* fluidCols = malloc(n_cols*n_fluid*fluidValSize);
+	float* parCols = malloc(6*n_par*sizeof(float) + 1);
+
+	trajectory_frame_struct frameHead;
+	int numFrames = 0;
+
+	while (fread(&frameHead, sizeof(frameHead), 1, inPtr) == 1) {
+
+		if (fread(fluidCols, fluidValSize, n_cols*n_fluid, inPtr) != (size_t)(n_cols*n_fluid)
+		||	fread(parCols, sizeof(float), 6*n_par, inPtr) != (size_t)(6*n_par)) {
+			printf("Warning: truncated frame %d, stopping\n", frameHead.Frame);
+			break;
+		}
+
+		fprintf(outPtr, "%d\n", n_fluid+n_par);
+		fprintf(outPtr, "D3Q19_output, frame %d\n", frameHead.Frame);
+
+		int i_f = 0;
+		for (int i_x = 1; i_x < n_x-1; i_x += n_s) {
+			for (int i_y = 1; i_y < n_y-1; i_y += n_s) {
+				for (int i_z = 1; i_z < n_z-1; i_z += n_s) {
+
+					fprintf(outPtr, "1 %d %d %d", i_x-1, i_y-1, i_z-1);
+					for (int c = 0; c < n_cols; c++) {
+						float val;
+						if (header.FluidEncoding == TRAJ_INT16) {
+							val = frameHead.FluidScale[c]*((int16_t*)fluidCols)[i_f + c*n_fluid];
+						}
+						else {
+							val = ((float*)fluidCols)[i_f + c*n_fluid];
+						}
+						fprintf(outPtr, " %8.6f", val);
+					}
+					fprintf(outPtr, "\n");
+					i_f++;
+				}
+			}
+		}
+
+		for (int p = 0; p < n_par; p++) {
+			fprintf(outPtr, "2 %.2f %.2f %.2f %8.6f %8.6f %8.6f",
+				parCols[p], parCols[p + n_par], parCols[p + 2*n_par],
+				parCols[p + 3*n_par], parCols[p + 4*n_par], parCols[p + 5*n_par]);
+			if (n_cols == 4) {
+				fprintf(outPtr, " %8.6f", 0.0f); // No vorticity for particles
+			}
+			fprintf(outPtr, "\n");
+		}
+
+		numFrames++;
+	}
+
+	printf("Converted %d frames from %s to %s\n", numFrames, inName, outName);
+
+	free(fluidCols);
+	free(parCols);
+	fclose(inPtr);
+	fclose(outPtr);
+
+	return 0;
+}